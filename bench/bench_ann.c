@@ -0,0 +1,184 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+/// Recall versus latency of the np_ann index, compared to the exact search with np_topk.
+/// The vectors are float32 drawn around random cluster centers, the database is in memory.
+///
+/// === Compiling
+///   gcc -O3 bench_ann.c -lsqlite3 -lm -o bench_ann
+///
+/// === Running
+///   ./bench_ann [extension] [rows] [dim] [queries]
+/// The extension defaults to ../blopy.so
+
+#include <sqlite3.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define K 10
+#define CLUSTERS 64
+#define HEADER 128
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static double uniform(void)
+{
+    return (rand() + 0.5) / ((double) RAND_MAX + 1);
+}
+
+static double gaussian(void)
+{
+    return sqrt(-2 * log(uniform())) * cos(2 * M_PI * uniform());
+}
+
+static void check(sqlite3* db, int rc, const char* what)
+{
+    if (rc != SQLITE_OK && rc != SQLITE_ROW && rc != SQLITE_DONE) {
+        fprintf(stderr, "%s: %s\n", what, sqlite3_errmsg(db));
+        exit(1);
+    }
+}
+
+static void exec(sqlite3* db, const char* sql)
+{
+    char* error = NULL;
+    if (sqlite3_exec(db, sql, NULL, NULL, &error) != SQLITE_OK) {
+        fprintf(stderr, "%s: %s\n", sql, error);
+        exit(1);
+    }
+}
+
+/// A '<f4' vector of `dim` elements as a numpy version 1 BLOB, with a HEADER byte header
+static int make_vector(unsigned char* blob, const float* values, int dim)
+{
+    char dict[HEADER];
+    int len = snprintf(dict, sizeof(dict),
+                       "{'descr': '<f4', 'fortran_order': False, 'shape': (%d,), }", dim);
+    memcpy(blob, "\x93NUMPY\x01\x00", 8);
+    blob[8] = HEADER - 10;
+    blob[9] = 0;
+    memcpy(blob + 10, dict, len);
+    memset(blob + 10 + len, ' ', HEADER - 1 - 10 - len);
+    blob[HEADER - 1] = '\n';
+    memcpy(blob + HEADER, values, dim * sizeof(float));
+    return HEADER + dim * sizeof(float);
+}
+
+static void random_vector(float* out, const float* centers, int dim)
+{
+    const float* center = centers + (size_t) (rand() % CLUSTERS) * dim;
+    for (int j = 0; j < dim; j++)
+        out[j] = center[j] + 0.3 * gaussian();
+}
+
+int main(int argc, char** argv)
+{
+    const char* extension = argc > 1 ? argv[1] : "../blopy.so";
+    int rows = argc > 2 ? atoi(argv[2]) : 50000;
+    int dim = argc > 3 ? atoi(argv[3]) : 64;
+    int queries = argc > 4 ? atoi(argv[4]) : 200;
+
+    sqlite3* db;
+    char* error = NULL;
+    if (sqlite3_open(":memory:", &db) != SQLITE_OK)
+        return 1;
+    sqlite3_enable_load_extension(db, 1);
+    if (sqlite3_load_extension(db, extension, NULL, &error) != SQLITE_OK) {
+        fprintf(stderr, "loading %s: %s\n", extension, error);
+        return 1;
+    }
+
+    srand(1);
+    float* centers = malloc((size_t) CLUSTERS * dim * sizeof(float));
+    float* values = malloc(dim * sizeof(float));
+    unsigned char* blob = malloc(HEADER + dim * sizeof(float));
+    for (int i = 0; i < CLUSTERS * dim; i++)
+        centers[i] = gaussian();
+
+    exec(db, "CREATE TABLE t(emb BLOB)");
+    exec(db, "BEGIN");
+    sqlite3_stmt* insert;
+    check(db, sqlite3_prepare_v2(db, "INSERT INTO t(emb) VALUES (?)", -1, &insert, NULL), "insert");
+    for (int i = 0; i < rows; i++) {
+        random_vector(values, centers, dim);
+        sqlite3_bind_blob(insert, 1, blob, make_vector(blob, values, dim), SQLITE_STATIC);
+        check(db, sqlite3_step(insert), "insert");
+        sqlite3_reset(insert);
+    }
+    sqlite3_finalize(insert);
+    exec(db, "COMMIT");
+
+    double start = now();
+    exec(db, "CREATE VIRTUAL TABLE idx USING np_ann(t, emb)");
+    printf("rows %d, dim %d, queries %d, build %.2f s\n\n", rows, dim, queries, now() - start);
+
+    // The exact neighbours of each query
+    unsigned char** query_blobs = malloc(queries * sizeof(*query_blobs));
+    long long* truth = malloc((size_t) queries * K * sizeof(long long));
+    sqlite3_stmt* exact;
+    check(db, sqlite3_prepare_v2(db, "SELECT np_topk(rowid, np_l2(emb, ?1), 10) FROM t",
+                                 -1, &exact, NULL), "exact");
+    int length = HEADER + dim * sizeof(float);
+    start = now();
+    for (int q = 0; q < queries; q++) {
+        random_vector(values, centers, dim);
+        query_blobs[q] = malloc(length);
+        make_vector(query_blobs[q], values, dim);
+        sqlite3_bind_blob(exact, 1, query_blobs[q], length, SQLITE_STATIC);
+        check(db, sqlite3_step(exact), "exact");
+        // The ids are the last K * 8 bytes of the '<i8' result
+        const unsigned char* ids = sqlite3_column_blob(exact, 0);
+        memcpy(truth + (size_t) q * K, ids + sqlite3_column_bytes(exact, 0) - K * sizeof(long long),
+               K * sizeof(long long));
+        sqlite3_reset(exact);
+    }
+    double exact_time = now() - start;
+    sqlite3_finalize(exact);
+
+    printf("%-8s %10s %12s %10s\n", "nprobe", "recall@10", "ms/query", "speedup");
+    printf("%-8s %10.3f %12.3f %10.1f\n", "exact", 1.0, exact_time / queries * 1e3, 1.0);
+
+    sqlite3_stmt* search;
+    check(db, sqlite3_prepare_v2(db, "SELECT rowid FROM idx WHERE vector MATCH ?1 AND k = 10 "
+                                 "AND nprobe = ?2", -1, &search, NULL), "search");
+    static const int nprobes[] = {1, 2, 4, 8, 16, 32, 64};
+    for (size_t p = 0; p < sizeof(nprobes)/sizeof(nprobes[0]); p++) {
+        long found = 0;
+        start = now();
+        for (int q = 0; q < queries; q++) {
+            sqlite3_bind_blob(search, 1, query_blobs[q], length, SQLITE_STATIC);
+            sqlite3_bind_int(search, 2, nprobes[p]);
+            while (sqlite3_step(search) == SQLITE_ROW) {
+                long long id = sqlite3_column_int64(search, 0);
+                for (int i = 0; i < K; i++)
+                    found += truth[(size_t) q * K + i] == id;
+            }
+            sqlite3_reset(search);
+        }
+        double elapsed = now() - start;
+        printf("%-8d %10.3f %12.3f %10.1f\n", nprobes[p], (double) found / queries / K,
+               elapsed / queries * 1e3, exact_time / elapsed);
+    }
+    sqlite3_finalize(search);
+
+    for (int q = 0; q < queries; q++)
+        free(query_blobs[q]);
+    free(query_blobs);
+    free(truth);
+    free(centers);
+    free(values);
+    free(blob);
+    sqlite3_close(db);
+    return 0;
+}
@@ -0,0 +1,82 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+/// Microbenchmark of the numpy header parser and the header cache. No sqlite involved.
+///
+/// === Compiling
+///   gcc -O3 -I.. bench_header.c ../numpy_reader.c -lm -o bench_header
+///
+/// === Running
+///   ./bench_header [iterations]
+
+#include "numpy_reader.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char** argv)
+{
+    long iterations = argc > 1 ? atol(argv[1]) : 5000000;
+
+    static const struct {
+        const char* descr;
+        bool fortran_order;
+        int64_t shape[3];
+        int shape_len;
+    } cases[] = {
+        {"<f8", false, {100000}, 1},
+        {"<i4", true, {512, 384}, 2},
+        {"<c16", false, {8, 16, 32}, 3},
+    };
+    int n_cases = sizeof(cases)/sizeof(cases[0]);
+
+    unsigned char blobs[3][256];
+    int lengths[3];
+    for (int c = 0; c < n_cases; c++) {
+        lengths[c] = write_header(blobs[c], cases[c].descr, cases[c].fortran_order,
+                                  cases[c].shape, cases[c].shape_len);
+    }
+
+    printf("%-8s %-14s %14s %10s\n", "dtype", "mode", "headers/s", "ns/header");
+    for (int c = 0; c < n_cases; c++) {
+        Header_data header_data;
+        long checksum = 0;
+
+        double start = now();
+        for (long i = 0; i < iterations; i++) {
+            read_header(blobs[c], lengths[c], &header_data);
+            checksum += header_data.size;
+        }
+        double parse = now() - start;
+
+        Header_cache* cache = header_cache_new();
+        start = now();
+        for (long i = 0; i < iterations; i++) {
+            int rc;
+            const Header_data* cached = header_cache_get(cache, blobs[c], lengths[c], &rc);
+            checksum += cached->size;
+            header_release((void*) cached);
+        }
+        double hit = now() - start;
+        header_cache_free(cache);
+
+        printf("%-8s %-14s %14.0f %10.1f\n", cases[c].descr, "read_header",
+               iterations / parse, parse / iterations * 1e9);
+        printf("%-8s %-14s %14.0f %10.1f\n", cases[c].descr, "cache",
+               iterations / hit, hit / iterations * 1e9);
+        if (checksum == 42)
+            printf("\n"); // keeps the compiler from dropping the loops
+    }
+
+    return 0;
+}
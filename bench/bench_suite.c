@@ -0,0 +1,399 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+/// Benchmark of all SQL functions of the extension on synthetic tables of numpy BLOBs.
+/// For every dtype, layout (1-d, 2-d C order, 2-d Fortran order) and BLOB size (100 B up to
+/// 100 MB) an in-memory table t(a) is generated and each query of `benchmarks` below runs over
+/// it. The extension is loaded with sqlite3_load_extension, as a user would do it.
+///
+/// malloc, calloc, realloc and free are replaced (glibc only) to count the allocations of
+/// sqlite and the extension while a query runs.
+///
+/// The output is tab separated with a header line, one line per query and table, so two
+/// versions can be compared with e.g. `join` or a spreadsheet. Lines starting with '#' are
+/// comments: the sqlite version and registered functions that have no benchmark yet.
+///
+/// === Compiling
+///   gcc -O3 -I.. bench_suite.c ../numpy_reader.c -lsqlite3 -lm -o bench_suite
+///
+/// === Running
+///   ./bench_suite [-e extension] [-m max_bytes] [-b bytes_per_table] [-r repeat] [-f filter]
+/// The extension defaults to ../blopy.so, max_bytes to 100000000 and the tables hold about
+/// bytes_per_table (default 32000000) bytes, at least one row. Each query runs `repeat`
+/// (default 3) times, the fastest run is reported. With a filter only queries that contain it
+/// are run.
+
+#include "numpy_reader.h"
+#include <sqlite3.h>
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/// The queries, `a` is the numpy column of table `t`. New functions get a line here, the
+/// suite warns about registered functions that none of the queries mentions. A line may hold
+/// several statements
+static const struct {
+    const char* name;
+    const char* sql;
+} benchmarks[] = {
+    {"isnp", "SELECT isnp(a) FROM t"},
+    {"np_ver", "SELECT np_ver(a) FROM t"},
+    {"np_size", "SELECT np_size(a) FROM t"},
+    {"np_desc", "SELECT np_desc(a) FROM t"},
+    {"np", "SELECT np(a) FROM t"},
+    {"np_fmt", "SELECT np(a, '%.3g') FROM t"},
+    {"np_sum", "SELECT np_sum(a) FROM t"},
+    {"np_mean", "SELECT np_mean(a) FROM t"},
+    {"np_min", "SELECT np_min(a) FROM t"},
+    {"np_max", "SELECT np_max(a) FROM t"},
+    {"np_std", "SELECT np_std(a) FROM t"},
+    {"np_sum_axis", "SELECT np_sum(a, 0) FROM t"},
+    {"np_each", "SELECT count(*) FROM t, np_each(t.a)"},
+    {"np_each_range", "SELECT count(*) FROM t, np_each(t.a) WHERE idx BETWEEN 10 AND 19"},
+    {"np_head", "SELECT np_head(a, 10) FROM t"},
+    {"np_tail", "SELECT np_tail(a, 10) FROM t"},
+    {"np_slice", "SELECT np_slice(a, '::2') FROM t"},
+    {"np_head_blob_io", "SELECT np_head('t', 'a', rowid, 10) FROM t"},
+    {"np_slice_blob_io", "SELECT np_slice('t', 'a', rowid, 1, 10) FROM t"},
+    {"np_stack", "SELECT length(np_stack(a)) FROM t"},
+    // The same rows streamed to a file in the working directory, overwritten by every run
+    {"np_export", "SELECT np_export('bench_export.npy', a) FROM t"},
+    {"np_sum_rows", "SELECT length(np_sum_rows(a)) FROM t"},
+    // One array in and one out of the frame per row
+    {"np_mean_rows_window", "SELECT count(*) FROM (SELECT np_mean_rows(a) OVER (ORDER BY rowid "
+                            "ROWS 10 PRECEDING) FROM t)"},
+    {"np_histogram", "SELECT length(np_histogram(a, -1000, 1000, 64)) FROM t"},
+    {"np_quantile", "SELECT np_quantile(a, 0.5) FROM t"},
+    // Stops at the first matching element, the other one at the first that does not match
+    {"np_any", "SELECT np_any(a, '>', 0) FROM t"},
+    {"np_all", "SELECT np_all(a, '<', 0) FROM t"},
+    {"np_count_where", "SELECT np_count_where(a, '>=', 0) FROM t"},
+    {"np_argmax", "SELECT np_argmax(a) FROM t"},
+    {"np_argmin_nd", "SELECT np_argmin(a, 'nd') FROM t"},
+    {"np_add", "SELECT np_add(a, a) FROM t"},
+    {"np_sub", "SELECT np_sub(a, 1) FROM t"},
+    {"np_mul", "SELECT np_mul(a, 2.5) FROM t"},
+    {"np_div", "SELECT np_div(a, 2) FROM t"},
+    {"np_scale", "SELECT np_scale(a, 2, 1) FROM t"},
+    {"np_dot", "SELECT np_dot(a, a) FROM t"},
+    {"np_l2", "SELECT np_l2(a, a) FROM t"},
+    {"np_cosine", "SELECT np_cosine(a, a) FROM t"},
+    {"np_topk", "SELECT np_topk(rowid, np_l2(a, a), 10) FROM t"},
+    {"np_compress", "SELECT np_compress(a) FROM t"},
+    // Includes the compression
+    {"np_decompress", "SELECT np_decompress(np_compress(a)) FROM t"},
+    {"np_sum_compressed", "SELECT np_sum(np_compress(a)) FROM t"},
+    // A copy only for layout F, the others come back unchanged
+    {"np_ascontiguous", "SELECT np_ascontiguous(a) FROM t"},
+    {"np_astype_f4", "SELECT np_astype(a, 'f4') FROM t"},
+    {"np_astype_f2", "SELECT np_astype(a, 'f2') FROM t"},
+    {"np_astype_i2", "SELECT np_astype(a, 'i2', 'saturate,round') FROM t"},
+    // The same with 8 threads for arrays from 1 MiB on, then back to the defaults
+#define THREADS_ON "SELECT np_config('threads', 8), np_config('parallel_threshold', 1 << 20); "
+#define THREADS_OFF "; SELECT np_config('threads', 1), np_config('parallel_threshold', 16 << 20)"
+    {"np_sum_threads", THREADS_ON "SELECT np_sum(a) FROM t" THREADS_OFF},
+    {"np_add_threads", THREADS_ON "SELECT np_add(a, a) FROM t" THREADS_OFF},
+    {"np_astype_threads", THREADS_ON "SELECT np_astype(a, 'f2') FROM t" THREADS_OFF},
+    // What the counters of np_stats cost: compare with np_size, which counts without the time
+#define STATS(level, sql) "SELECT np_config('stats', " #level "); " sql \
+                          "; SELECT np_config('stats', 1)"
+    {"np_size_stats_off", STATS(0, "SELECT np_size(a) FROM t")},
+    {"np_size_stats_time", STATS(2, "SELECT np_size(a) FROM t")},
+    {"np_stats", "SELECT np_stats_reset() FROM t; SELECT count(*) FROM np_stats()"},
+    // Builds the index over all rows and runs one query
+    {"np_ann", "DROP TABLE IF EXISTS t_idx; CREATE VIRTUAL TABLE t_idx USING np_ann(t, a); "
+               "SELECT count(*) FROM t_idx WHERE vector MATCH (SELECT a FROM t) AND k = 10; "
+               "DROP TABLE t_idx"},
+    // The filter np_meta answers from its indexes, once from the headers of the BLOBs, once
+    // building the side table over all rows and querying it
+    {"np_desc_filter", "SELECT count(*) FROM t WHERE np_desc(a) = '<f8' AND np_size(a) > 1000"},
+    {"np_meta", "DROP TABLE IF EXISTS t_meta; CREATE VIRTUAL TABLE t_meta USING np_meta(t, a); "
+                "SELECT count(*) FROM t_meta WHERE dtype = '<f8' AND size > 1000; "
+                "DROP TABLE t_meta"},
+};
+
+static const char* dtypes[] = {"<i4", "<f4", "<f8", "<c16"};
+
+static const long sizes[] = {100, 10000, 1000000, 100000000};
+
+enum Layout { LAYOUT_1D, LAYOUT_C, LAYOUT_F };
+static const char* layout_names[] = {"1d", "C", "F"};
+
+// Allocation counting. The real allocator is glibc's, under its internal names
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void __libc_free(void* ptr);
+
+static long allocations;
+static bool counting;
+
+void* malloc(size_t size)
+{
+    if (counting)
+        __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(size);
+}
+
+void* calloc(size_t n, size_t size)
+{
+    if (counting)
+        __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(n, size);
+}
+
+void* realloc(void* ptr, size_t size)
+{
+    if (counting)
+        __atomic_fetch_add(&allocations, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(ptr, size);
+}
+
+void free(void* ptr)
+{
+    __libc_free(ptr);
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Deterministic data, independent of the C library
+static unsigned long long next_random(unsigned long long* state)
+{
+    *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return *state >> 33;
+}
+
+static void fill(unsigned char* data, const char* descr, long n, unsigned long long* state)
+{
+    for (long i = 0; i < n; i++) {
+        double value = (double) (next_random(state) % 20001) / 100 - 100;
+        if (strcmp(descr, "<i4") == 0)
+            ((int*) data)[i] = (int) (value * 100);
+        else if (strcmp(descr, "<f4") == 0)
+            ((float*) data)[i] = value;
+        else if (strcmp(descr, "<f8") == 0)
+            ((double*) data)[i] = value;
+        else {
+            ((double*) data)[2*i] = value;
+            ((double*) data)[2*i + 1] = -value;
+        }
+    }
+}
+
+static int item_size(const char* descr)
+{
+    return atoi(descr + 2);
+}
+
+/// Creates table t(a) in `db` with BLOBs of about `bytes` bytes (header included)
+/// @Returns the number of rows and the exact BLOB size in `*blob_size`, or -1 on error
+static long make_table(sqlite3* db, const char* descr, enum Layout layout, long bytes,
+                       long bytes_per_table, int64_t* shape, int* shape_len, long* blob_size)
+{
+    long n = (bytes - 64) / item_size(descr);
+    if (n < 1)
+        n = 1;
+    if (layout == LAYOUT_1D) {
+        shape[0] = n;
+        *shape_len = 1;
+    } else {
+        int columns = (int) sqrt((double) n);
+        if (columns < 1)
+            columns = 1;
+        shape[0] = n / columns;
+        shape[1] = columns;
+        *shape_len = 2;
+        n = (long) shape[0] * shape[1];
+    }
+
+    int header_length = write_header(NULL, descr, layout == LAYOUT_F, shape, *shape_len);
+    *blob_size = header_length + n * item_size(descr);
+    unsigned char* blob = malloc(*blob_size);
+    if (blob == NULL)
+        return -1;
+    write_header(blob, descr, layout == LAYOUT_F, shape, *shape_len);
+
+    long rows = bytes_per_table / *blob_size;
+    if (rows < 1)
+        rows = 1;
+    if (rows > 100000)
+        rows = 100000;
+
+    sqlite3_exec(db, "DROP TABLE IF EXISTS t; CREATE TABLE t(a BLOB); BEGIN", 0, 0, 0);
+    sqlite3_stmt* insert;
+    if (sqlite3_prepare_v2(db, "INSERT INTO t(a) VALUES (?)", -1, &insert, NULL) != SQLITE_OK) {
+        free(blob);
+        return -1;
+    }
+    unsigned long long state = 1;
+    for (long row = 0; row < rows; row++) {
+        fill(blob + header_length, descr, n, &state);
+        sqlite3_bind_blob64(insert, 1, blob, *blob_size, SQLITE_STATIC);
+        if (sqlite3_step(insert) != SQLITE_DONE) {
+            rows = -1;
+            break;
+        }
+        sqlite3_reset(insert);
+    }
+    sqlite3_finalize(insert);
+    sqlite3_exec(db, "COMMIT", 0, 0, 0);
+    free(blob);
+    return rows;
+}
+
+/// Runs the statements in `sql` to the end and reads every result, like a client would
+/// @Returns the sqlite result code
+static int run(sqlite3* db, const char* sql)
+{
+    long long checksum = 0;
+    while (*sql != '\0') {
+        sqlite3_stmt* stmt;
+        int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, &sql);
+        if (rc != SQLITE_OK)
+            return rc;
+        if (stmt == NULL) // only whitespace left
+            break;
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            int type = sqlite3_column_type(stmt, 0);
+            if (type == SQLITE_BLOB || type == SQLITE_TEXT)
+                checksum += sqlite3_column_bytes(stmt, 0);
+            else
+                checksum += sqlite3_column_int64(stmt, 0);
+        }
+        sqlite3_finalize(stmt);
+        if (rc != SQLITE_DONE)
+            return rc;
+    }
+    if (checksum == 42)
+        fprintf(stderr, "\n"); // keeps the compiler from dropping the reads
+    return SQLITE_OK;
+}
+
+/// Lists the functions and modules of the extension that no benchmark mentions
+static void report_missing(sqlite3* db)
+{
+    sqlite3_stmt* stmt;
+    const char* sql = "SELECT DISTINCT name FROM pragma_function_list WHERE name GLOB 'np*' "
+                      "OR name = 'isnp' UNION SELECT name FROM pragma_module_list "
+                      "WHERE name GLOB 'np_*' ORDER BY 1";
+    if (sqlite3_prepare_v2(db, sql, -1, &stmt, NULL) != SQLITE_OK)
+        return;
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char* name = (const char*) sqlite3_column_text(stmt, 0);
+        char call[64];
+        snprintf(call, sizeof(call), "%s(", name);
+        bool found = false;
+        for (size_t i = 0; i < sizeof(benchmarks)/sizeof(benchmarks[0]) && !found; i++)
+            found = strstr(benchmarks[i].sql, call) != NULL;
+        if (!found)
+            printf("# not benchmarked: %s\n", name);
+    }
+    sqlite3_finalize(stmt);
+}
+
+int main(int argc, char** argv)
+{
+    const char* extension = "../blopy.so";
+    const char* filter = NULL;
+    long max_bytes = 100000000, bytes_per_table = 32000000;
+    int repeat = 3;
+    for (int i = 1; i + 1 < argc; i += 2) {
+        if (strcmp(argv[i], "-e") == 0)
+            extension = argv[i+1];
+        else if (strcmp(argv[i], "-m") == 0)
+            max_bytes = atol(argv[i+1]);
+        else if (strcmp(argv[i], "-b") == 0)
+            bytes_per_table = atol(argv[i+1]);
+        else if (strcmp(argv[i], "-r") == 0)
+            repeat = atoi(argv[i+1]);
+        else if (strcmp(argv[i], "-f") == 0)
+            filter = argv[i+1];
+        else {
+            fprintf(stderr, "unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+    if (repeat < 1)
+        repeat = 1;
+
+    sqlite3* db;
+    char* error = NULL;
+    if (sqlite3_open(":memory:", &db) != SQLITE_OK)
+        return 1;
+    sqlite3_enable_load_extension(db, 1);
+    if (sqlite3_load_extension(db, extension, NULL, &error) != SQLITE_OK) {
+        fprintf(stderr, "loading %s: %s\n", extension, error);
+        return 1;
+    }
+
+    printf("# sqlite %s, extension %s\n", sqlite3_libversion(), extension);
+    report_missing(db);
+    printf("benchmark\tdtype\tlayout\tshape\tblob_bytes\trows\tseconds\trows_per_s\tbytes_per_s"
+           "\tallocs_per_row\tstatus\n");
+
+    for (size_t s = 0; s < sizeof(sizes)/sizeof(sizes[0]) && sizes[s] <= max_bytes; s++) {
+        for (size_t d = 0; d < sizeof(dtypes)/sizeof(dtypes[0]); d++) {
+            for (int layout = LAYOUT_1D; layout <= LAYOUT_F; layout++) {
+                int64_t shape[2];
+                int shape_len;
+                long blob_size;
+                long rows = make_table(db, dtypes[d], layout, sizes[s], bytes_per_table,
+                                       shape, &shape_len, &blob_size);
+                if (rows < 0) {
+                    fprintf(stderr, "creating the table failed: %s\n", sqlite3_errmsg(db));
+                    return 1;
+                }
+                char shape_text[32];
+                if (shape_len == 1)
+                    snprintf(shape_text, sizeof(shape_text), "%lld", (long long) shape[0]);
+                else
+                    snprintf(shape_text, sizeof(shape_text), "%lldx%lld", (long long) shape[0],
+                             (long long) shape[1]);
+
+                for (size_t b = 0; b < sizeof(benchmarks)/sizeof(benchmarks[0]); b++) {
+                    if (filter != NULL && strstr(benchmarks[b].name, filter) == NULL
+                            && strstr(benchmarks[b].sql, filter) == NULL)
+                        continue;
+                    double best = INFINITY;
+                    long allocs = 0;
+                    int rc = SQLITE_OK;
+                    for (int r = 0; r < repeat && rc == SQLITE_OK; r++) {
+                        allocations = 0;
+                        counting = true;
+                        double start = now();
+                        rc = run(db, benchmarks[b].sql);
+                        double elapsed = now() - start;
+                        counting = false;
+                        allocs = allocations;
+                        if (elapsed < best)
+                            best = elapsed;
+                    }
+
+                    printf("%s\t%s\t%s\t%s\t%ld\t%ld\t", benchmarks[b].name, dtypes[d],
+                           layout_names[layout], shape_text, blob_size, rows);
+                    if (rc != SQLITE_OK) {
+                        // e.g. a dtype the function does not support
+                        printf("\t\t\t\terror: %s\n", sqlite3_errmsg(db));
+                        continue;
+                    }
+                    printf("%.6f\t%.0f\t%.0f\t%.2f\tok\n", best, rows / best,
+                           rows * (double) blob_size / best, (double) allocs / rows);
+                    fflush(stdout);
+                }
+            }
+        }
+    }
+
+    sqlite3_close(db);
+    return 0;
+}
@@ -3,35 +3,403 @@
  * file, You can obtain one at http://mozilla.org/MPL/2.0/.
  **/
 
-#include <sqlite3ext.h> /* Do not use <sqlite3.h>! */
+#include "blopy.h"
 SQLITE_EXTENSION_INIT1
-#include "numpy_reader.h"
+#include "numpy_compress.h"
+#include "numpy_format.h"
+#include "numpy_layout.h"
+#include "numpy_reduce.h"
 
 #include <stdlib.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <string.h>
 
 /// === Loading this extention in sqlite
 ///   .load ./blopy
 
 /// === Compiling
-///   gcc -g -fPIC -shared blopy.c  numpy_reader.c numpy_reader.h -o blopy.so
+///   gcc -g -O3 -fPIC -shared blopy.c blopy_ann.c blopy_arith.c blopy_compress.c
+///       blopy_convert.c blopy_distance.c blopy_each.c blopy_file.c blopy_layout.c
+///       blopy_meta.c blopy_search.c blopy_shadow.c blopy_sketch.c blopy_slice.c blopy_stack.c
+///       blopy_stats.c blopy_window.c numpy_accumulate.c numpy_ann.c numpy_arith.c
+///       numpy_compress.c numpy_convert.c numpy_distance.c numpy_file.c numpy_format.c
+///       numpy_layout.c numpy_parallel.c numpy_reader.c numpy_reduce.c numpy_search.c
+///       numpy_sketch.c -lm -lpthread -o blopy.so
+/// Without -O3 (or at least -O2 -ftree-vectorize) the reduction kernels are not vectorized
 
 // In the final version (1.0) this extention should provide the following sqlite functions
 // * np_header(col) -> header: dtype, fortran_order, shape
 // * np_shape(col) -> shape of stored array
 // * np(col) -> convert BLOB to TEXT. Columns are seperated by '\t' and rows by '\n'
 // * np(col, fmt) -> convert BLOB to TEXT where each value is formated according to `fmt`
-// * np_head(col, num) -> first `num` rows
+// * np_head(col, num) -> first `num` rows as a numpy BLOB
 // * np_head(col, num, fmt) -> first `num` rows where each value is formated according to `fmt`
-// * np_tail(col, num) -> last `num` rows
-//                        TODO (check for positivity)
+// * np_tail(col, num) -> last `num` rows as a numpy BLOB
 // * np_tail(col, num, fmt) -> last `num` rows where each value is formated according to `fmt`
-//                             TODO (check for positivity)
-// Potential further functions could do operations like min and max or mean. Or BLOB-size (without
-// header based on wordsize*size).
+// * np_head(table, column, rowid, num), np_tail(...) -> like above, but only the needed bytes
+//                                                      are read (incremental BLOB I/O)
+// * np_slice(col, spec), np_slice(table, column, rowid, spec) -> numpy style slicing, e.g.
+//                                                               '10:20, ::2'
+// * np_slice(table, column, rowid, start, count) -> `count` rows from `start` on
+// * np_field(col, name) -> the field `name` of an array of records (structured dtype)
+// * np_file(path) -> an .npy file as numpy BLOB, memory mapped without a copy
+// * np_file(path, spec) -> np_slice of an .npy file of any size
+// * np_export(path, col) -> aggregate, writes the arrays of all rows stacked to an .npy file,
+//                           one row at a time
+// * np_export(path, col, offsets_path) -> the same for arrays of different lengths: elements and
+//                                         offsets of the rows in two .npy files
+// * np_npz(path) -> table-valued function, the members (name, shape, dtype, data) of an .npz file
+// * np_stack(col) -> aggregate, stacks the arrays of all rows into one numpy BLOB
+// * np_sum(col), np_mean(col), np_min(col), np_max(col), np_std(col) -> reduction over all elements
+// * np_sum(col, axis), ... -> reduction of a 2-d array along `axis`, returned as a 1-d numpy BLOB
+// * np_sum_rows(col), np_mean_rows(col) -> aggregate and window function, element-wise sum and
+//                                          mean of the arrays of all rows (or of the frame)
+// * np_histogram(col, lo, hi, bins) -> aggregate, counts of the elements of all rows in equal bins
+// * np_quantile(col, q), np_quantile(col, q, k) -> aggregate, quantile(s) of the elements of all
+//                                                 rows from a bounded KLL sketch
+// * np_any(col, op, value), np_all(...), np_count_where(...) -> whether any/all elements compare
+//                                             with `op` ('>', '<', '==', ..., 'isnan') and how many
+// * np_argmax(col), np_argmin(col) -> flat index of the largest/smallest element, with a second
+//                                     argument 'nd' its index per dimension, e.g. '(2, 0)'
+// * np_each(col) -> table-valued function with one row (idx, i, j, value, imag) per element
+// * np_add(a, b), np_sub(a, b), np_mul(a, b), np_div(a, b) -> element-wise with broadcasting,
+//                                                              a and b are BLOBs or numbers
+// * np_scale(col, factor), np_scale(col, factor, offset) -> col * factor + offset
+// * np_dot(a, b), np_l2(a, b), np_cosine(a, b) -> inner product, euclidean and cosine distance
+// * np_topk(id, distance, k) -> aggregate, ids of the k smallest distances as a numpy BLOB
+// * np_ann(table, column, metric, ...) -> virtual table, approximate nearest neighbour index
+// * np_meta(table, column) -> virtual table, dtype, shape, size, ... of every row kept up to date
+//                             and indexed, so filters on them do not read the BLOBs
+// * np_compress(col), np_decompress(col) -> to and from the compressed form of a numpy BLOB,
+//                                           which all other functions read as well
+// * np_ascontiguous(col) -> the array in native byte order and C order, unchanged if it is
+//                           already stored like that
+// * np_astype(col, dtype), np_astype(col, dtype, mode) -> converted to another numeric dtype,
+//                                                        float16 and bfloat16 included
+// * np_config(name), np_config(name, value) -> settings of the connection, e.g. the number of
+//                                             threads for large arrays
+// * np_stats -> virtual table, calls, bytes, header parses, ... of every function so far
+// * np_stats_reset() -> sets the counters of np_stats back to 0
+// Potential further functions could do BLOB-size (without header based on wordsize*size).
 // For currently supported sqlite-functions look into sqlite3_blopy_init
 
+void retain_conn(Blopy_conn* conn)
+{
+    conn->refcount++;
+}
+
+/// Drops a reference to the connection state. The signature fits the destructor callbacks of
+/// sqlite
+void release_conn(void* ptr)
+{
+    Blopy_conn* conn = ptr;
+    if (--conn->refcount == 0) {
+        header_cache_free(conn->cache);
+        pool_free(conn->pool);
+        for (int i = 0; i < 2*BLOPY_SCRATCH; i++)
+            sqlite3_free(conn->scratch[i]);
+        sqlite3_free(conn->stats_memory);
+        sqlite3_free(conn);
+    }
+}
+
+static void destroy_func(void* ptr)
+{
+    Blopy_func* func = ptr;
+    release_conn(func->conn);
+    sqlite3_free(func);
+}
+
+/// A Blopy_func for the function `name`, whose calls are counted for np_stats
+/// @Returns the Blopy_func or NULL if there is no memory
+static Blopy_func* new_func(Blopy_conn* conn, const char* name, int op)
+{
+    Blopy_func* func = sqlite3_malloc(sizeof(*func));
+    if (func == NULL)
+        return NULL;
+    memset(func, 0, sizeof(*func));
+    func->conn = conn;
+    func->op = op;
+    func->stats = stats_entry(conn, name);
+    retain_conn(conn);
+    return func;
+}
+
+/// Registers a scalar function (xFunc) or an aggregate (xStep and xFinal) with a Blopy_func as
+/// user data. `flags` are added to SQLITE_UTF8, typically SQLITE_DETERMINISTIC. sqlite calls
+/// the functions through the counting ones of blopy_stats.c
+int create_function(sqlite3 *db, Blopy_conn* conn, const char* name, int n_arg, int flags, int op,
+                    void (*xFunc)(sqlite3_context*, int, sqlite3_value**),
+                    void (*xStep)(sqlite3_context*, int, sqlite3_value**),
+                    void (*xFinal)(sqlite3_context*))
+{
+    Blopy_func* func = new_func(conn, name, op);
+    if (func == NULL)
+        return SQLITE_NOMEM;
+    func->xFunc = xFunc;
+    func->xStep = xStep;
+    func->xFinal = xFinal;
+    if (func->stats == NULL) {
+        // No room for counters, the functions are called directly
+        return sqlite3_create_function_v2(db, name, n_arg, SQLITE_UTF8 | flags, func,
+                                          xFunc, xStep, xFinal, destroy_func);
+    }
+    return sqlite3_create_function_v2(db, name, n_arg, SQLITE_UTF8 | flags, func,
+                                      xFunc ? stats_func : 0, xStep ? stats_step : 0,
+                                      xFinal ? stats_final : 0, destroy_func);
+}
+
+/// Registers an aggregate window function (xStep, xFinal, xValue and xInverse) with a
+/// Blopy_func as user data, like create_function
+int create_window_function(sqlite3 *db, Blopy_conn* conn, const char* name, int n_arg,
+                           int flags, int op,
+                           void (*xStep)(sqlite3_context*, int, sqlite3_value**),
+                           void (*xFinal)(sqlite3_context*),
+                           void (*xValue)(sqlite3_context*),
+                           void (*xInverse)(sqlite3_context*, int, sqlite3_value**))
+{
+    Blopy_func* func = new_func(conn, name, op);
+    if (func == NULL)
+        return SQLITE_NOMEM;
+    func->xStep = xStep;
+    func->xFinal = xFinal;
+    func->xValue = xValue;
+    func->xInverse = xInverse;
+    if (func->stats == NULL) {
+        return sqlite3_create_window_function(db, name, n_arg, SQLITE_UTF8 | flags, func,
+                                              xStep, xFinal, xValue, xInverse, destroy_func);
+    }
+    return sqlite3_create_window_function(db, name, n_arg, SQLITE_UTF8 | flags, func,
+                                          stats_step, stats_final, stats_value, stats_inverse,
+                                          destroy_func);
+}
+
+/// Registers the virtual table `module` with the connection state as client data. Its calls
+/// are counted for np_stats if its xFilter goes through stats_filter
+int register_module(sqlite3 *db, Blopy_conn* conn, const char* name, const sqlite3_module* module)
+{
+    stats_entry(conn, name);
+    retain_conn(conn);
+    return sqlite3_create_module_v2(db, name, module, conn, release_conn);
+}
+
+/// Returns the parsed header of the numpy BLOB argv[i] or NULL (with an error set on `context`).
+/// The header is first looked up in the sqlite auxdata of the argument, which survives from row
+/// to row as long as the argument does not change (e.g. a bound parameter). Otherwise the
+/// connection wide header cache is asked, which only parses headers it has not seen yet.
+/// The returned header is valid until the function returns
+const Header_data* blob_header(sqlite3_context *context, sqlite3_value **argv, int i)
+{
+    const Header_data* header_data = sqlite3_get_auxdata(context, i);
+    if (header_data != NULL) {
+        stats_header_hit();
+        return header_data;
+    }
+
+    Blopy_func* func = sqlite3_user_data(context);
+    int rc;
+    header_data = header_cache_get(func->conn->cache, sqlite3_value_blob(argv[i]),
+                                   sqlite3_value_bytes(argv[i]), &rc);
+    if (header_data == NULL) {
+        sqlite3_result_error(context, header_error(rc), -1);
+        return NULL;
+    }
+
+    // sqlite now owns our reference. It only drops it right away if it runs out of memory
+    sqlite3_set_auxdata(context, i, (void*) header_data, header_release);
+    header_data = sqlite3_get_auxdata(context, i);
+    if (header_data == NULL)
+        sqlite3_result_error_nomem(context);
+    return header_data;
+}
+
+/// blob_header for the step functions of aggregates: sqlite keeps the auxdata of an aggregate
+/// across rows, so it would hand out the header of the first row for all others. This one goes
+/// to the connection's cache every time.
+/// @Returns a reference the caller has to give back with header_release, or NULL (with an error
+/// set on `context`)
+const Header_data* blob_header_ref(sqlite3_context *context, sqlite3_value **argv, int i)
+{
+    Blopy_func* func = sqlite3_user_data(context);
+    int rc;
+    const Header_data* header_data = header_cache_get(func->conn->cache,
+                                                      sqlite3_value_blob(argv[i]),
+                                                      sqlite3_value_bytes(argv[i]), &rc);
+    if (header_data == NULL)
+        sqlite3_result_error(context, header_error(rc), -1);
+    return header_data;
+}
+
+/// Like blob_header but also checks that the BLOB really contains all the elements the header
+/// promises. Compressed BLOBs are decoded and big-endian ones byte swapped (see blob_payload),
+/// so `*header_data` describes data in native byte order.
+/// @Returns a pointer to the first element or NULL (with an error set on `context`)
+const unsigned char* blob_data(sqlite3_context *context, sqlite3_value **argv, int i,
+                               const Header_data** header_data)
+{
+    *header_data = blob_header(context, argv, i);
+    if (*header_data == NULL)
+        return NULL;
+    return blob_payload(context, argv[i], header_data, i, BLOB_NATIVE);
+}
+
+/// Grows the connection's scratch buffer number `index` to at least `n` bytes
+/// @Returns the buffer or NULL (with an error set on `context`)
+static unsigned char* scratch_get(sqlite3_context *context, Blopy_conn* conn, int index,
+                                  sqlite3_int64 n)
+{
+    if (n > conn->scratch_size[index] || conn->scratch[index] == NULL) {
+        unsigned char* scratch = sqlite3_realloc64(conn->scratch[index], n > 0 ? n : 1);
+        if (scratch == NULL) {
+            sqlite3_result_error_nomem(context);
+            return NULL;
+        }
+        conn->scratch[index] = scratch;
+        conn->scratch_size[index] = n;
+        stats_allocation();
+    }
+    return conn->scratch[index];
+}
+
+/// Returns the elements of the numpy BLOB `value` (described by `*header_data`), after checking
+/// that all of them are there. The data of a compressed BLOB is decoded to the connection's
+/// scratch buffer number `slot` (usually the argument number). With BLOB_NATIVE in `flags` the
+/// elements are byte swapped to native order, with BLOB_C_ORDER transposed to C order, both into
+/// a second scratch buffer, and `*header_data` is replaced by the header of the normalized data.
+/// Data that is already uncompressed and normalized is returned in place, without a copy.
+/// Scratch buffers and normalized headers stay valid until the next call that uses the same
+/// slot. So a function must not keep the pointers.
+/// @Returns a pointer to the first element or NULL (with an error set on `context`)
+const unsigned char* blob_payload(sqlite3_context *context, sqlite3_value *value,
+                                  const Header_data** header_data, int slot, int flags)
+{
+    const Header_data* header = *header_data;
+    const unsigned char* blob = sqlite3_value_blob(value);
+    int n_bytes = sqlite3_value_bytes(value);
+    sqlite3_int64 n_data = (sqlite3_int64) header->size * header->wordsize_in_bytes;
+
+    bool swap = (flags & BLOB_NATIVE) && !is_native(header);
+    bool transpose = (flags & BLOB_C_ORDER) && !is_c_contiguous(header);
+    if (!header->compressed && n_data > n_bytes - header->offset) {
+        sqlite3_result_error(context, "numpy BLOB is shorter than its shape", -1);
+        return NULL;
+    }
+    if (!header->compressed && !swap && !transpose)
+        return blob + header->offset;
+
+    if (slot >= BLOPY_SCRATCH) {
+        sqlite3_result_error(context, "too many compressed or non-native arguments", -1);
+        return NULL;
+    }
+    Blopy_conn* conn = ((Blopy_func*) sqlite3_user_data(context))->conn;
+    const unsigned char* data = blob + header->offset;
+    if (header->compressed) {
+        unsigned char* decoded = scratch_get(context, conn, slot, n_data);
+        if (decoded == NULL)
+            return NULL;
+        int rc = decompress_array(header, blob, n_bytes, decoded);
+        if (rc < 0) {
+            sqlite3_result_error(context, compress_error(rc), -1);
+            return NULL;
+        }
+        if (!swap && !transpose)
+            return decoded;
+        if (!transpose) {
+            // The decoded copy is ours, swap it in place
+            byteswap(header, decoded, decoded, header->size);
+            native_header(header, false, &conn->normalized[slot]);
+            *header_data = &conn->normalized[slot];
+            return decoded;
+        }
+        data = decoded;
+    }
+
+    unsigned char* out = scratch_get(context, conn, BLOPY_SCRATCH + slot, n_data);
+    if (out == NULL)
+        return NULL;
+    if (transpose) {
+        to_c_order(header, data, out);
+        data = out;
+    }
+    if (swap)
+        byteswap(header, data, out, header->size);
+    native_header(header, transpose, &conn->normalized[slot]);
+    *header_data = &conn->normalized[slot];
+    return out;
+}
+
+/// Returns how work on `n_bytes` of data may be split (see numpy_parallel.h): into parts if
+/// there are at least `parallel_threshold` of them, on the connection's pool if np_config
+/// asked for more than one thread. The pool is started here when it is needed the first time
+Parallel blob_parallel(sqlite3_context *context, sqlite3_int64 n_bytes)
+{
+    Blopy_conn* conn = ((Blopy_func*) sqlite3_user_data(context))->conn;
+    Parallel parallel = {NULL, conn->parallel_threshold};
+    if (n_bytes >= conn->parallel_threshold && conn->threads > 1) {
+        if (conn->pool == NULL)
+            conn->pool = pool_new(conn->threads);
+        parallel.pool = conn->pool;
+    }
+    return parallel;
+}
+
+/// np_config(name) reads, np_config(name, value) changes a setting of the connection:
+///   'threads'            threads working on one large array (default 1)
+///   'parallel_threshold' arrays of at least this many bytes are split into parts (16 MiB)
+///   'stats'              what np_stats counts: 0 nothing, 1 all but the time (default), 2 all
+/// Results do not depend on the number of threads, only on whether an array is split.
+/// Returns the value of the setting (after the change)
+static void numpy_config(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    Blopy_conn* conn = ((Blopy_func*) sqlite3_user_data(context))->conn;
+    const char* name = (const char*) sqlite3_value_text(argv[0]);
+    enum { CONFIG_THREADS, CONFIG_PARALLEL_THRESHOLD, CONFIG_STATS } setting;
+    if (name != NULL && strcmp(name, "threads") == 0) {
+        setting = CONFIG_THREADS;
+    } else if (name != NULL && strcmp(name, "parallel_threshold") == 0) {
+        setting = CONFIG_PARALLEL_THRESHOLD;
+    } else if (name != NULL && strcmp(name, "stats") == 0) {
+        setting = CONFIG_STATS;
+    } else {
+        sqlite3_result_error(context, "np_config: unknown setting", -1);
+        return;
+    }
+
+    if (argc == 2) {
+        sqlite3_int64 value = sqlite3_value_int64(argv[1]);
+        if (setting == CONFIG_THREADS && (value < 1 || value > BLOPY_MAX_THREADS)) {
+            sqlite3_result_error(context, "np_config: threads must be between 1 and 256", -1);
+            return;
+        }
+        if (setting == CONFIG_PARALLEL_THRESHOLD && value < 0) {
+            sqlite3_result_error(context, "np_config: parallel_threshold must not be negative",
+                                 -1);
+            return;
+        }
+        if (setting == CONFIG_STATS && (value < 0 || value > 2)) {
+            sqlite3_result_error(context, "np_config: stats must be 0, 1 or 2", -1);
+            return;
+        }
+        if (setting == CONFIG_THREADS && value != conn->threads) {
+            // Started again with the new number of threads when it is needed
+            pool_free(conn->pool);
+            conn->pool = NULL;
+            conn->threads = (int) value;
+        } else if (setting == CONFIG_PARALLEL_THRESHOLD) {
+            conn->parallel_threshold = value;
+        } else if (setting == CONFIG_STATS) {
+            conn->stats_level = (int) value;
+        }
+    }
+    if (setting == CONFIG_THREADS)
+        sqlite3_result_int64(context, conn->threads);
+    else if (setting == CONFIG_PARALLEL_THRESHOLD)
+        sqlite3_result_int64(context, conn->parallel_threshold);
+    else
+        sqlite3_result_int64(context, conn->stats_level);
+}
+
 /// Returns the numpy version number
 /// The identity if input is not a BLOB at all
 static void numpy_version(sqlite3_context *context, int argc, sqlite3_value **argv)
@@ -40,7 +408,7 @@ static void numpy_version(sqlite3_context *context, int argc, sqlite3_value **ar
         // Get the BLOB ptr and cast it to an unsigned char
         unsigned char* input = (unsigned char*) sqlite3_value_blob(argv[0]);
 
-        unsigned short version = read_magic(input);
+        short version = read_magic(input, sqlite3_value_bytes(argv[0]));
         if (version == -1)
             sqlite3_result_value(context, argv[0]);
         else
@@ -58,25 +426,36 @@ static void is_numpy_blob(sqlite3_context *context, int argc, sqlite3_value **ar
         // Get the BLOB ptr and cast it to an unsigned char
         unsigned char* input = (unsigned char*) sqlite3_value_blob(argv[0]);
 
-        if (read_magic(input) == -1)
-            sqlite3_result_text(context, "false", -1, SQLITE_TRANSIENT);
+        if (read_magic(input, sqlite3_value_bytes(argv[0])) == -1)
+            sqlite3_result_text(context, "false", -1, SQLITE_STATIC);
         else
-            sqlite3_result_text(context, "true", -1, SQLITE_TRANSIENT);
+            sqlite3_result_text(context, "true", -1, SQLITE_STATIC);
     } else {
         sqlite3_result_value(context, argv[0]);
     }
 }
 
-/// Returns the content of a numpy BLOB
+/// Returns the content of a numpy BLOB as TEXT: columns separated by '\t', rows by '\n'.
+/// With a second argument `fmt` (e.g. '%.3f') each value is formatted according to it
 /// Or the identity if input is not a BLOB at all
 static void numpy_reader(sqlite3_context *context, int argc, sqlite3_value **argv)
 {
     if (sqlite3_value_type(argv[0]) == SQLITE_BLOB) {
-        // Get the BLOB ptr and cast it to an unsigned char
-        unsigned char* input = (unsigned char*) sqlite3_value_blob(argv[0]);
+        const Header_data* header_data;
+        const unsigned char* data = blob_data(context, argv, 0, &header_data);
+        if (data == NULL)
+            return;
 
-        char* content = BLOB_to_str(input);
-        sqlite3_result_text(context, content, -1, SQLITE_TRANSIENT);
+        const char* fmt = argc > 1 ? (const char*) sqlite3_value_text(argv[1]) : NULL;
+        const char* error;
+        size_t len;
+        char* content = BLOB_to_str(header_data, data, fmt, &len, &error);
+        if (content == NULL) {
+            sqlite3_result_error(context, error, -1);
+            return;
+        }
+        // sqlite takes over the string and frees it, no copy
+        sqlite3_result_text64(context, content, len, free, SQLITE_UTF8);
     } else {
         sqlite3_result_value(context, argv[0]);
     }
@@ -85,18 +464,11 @@ static void numpy_reader(sqlite3_context *context, int argc, sqlite3_value **arg
 static void numpy_size(sqlite3_context *context, int argc, sqlite3_value **argv)
 {
     if (sqlite3_value_type(argv[0]) == SQLITE_BLOB) {
-        // Get the BLOB ptr and cast it to an unsigned char
-        unsigned char* input = (unsigned char*) sqlite3_value_blob(argv[0]);
+        const Header_data* header_data = blob_header(context, argv, 0);
+        if (header_data == NULL)
+            return;
 
-        Header_data* header_data;
-        header_data = malloc(sizeof(*header_data));
-
-        int header_length = read_header(input, header_data); // check that header_length > 0?
-        int out = header_data->size;
-
-        free(header_data);
-
-        sqlite3_result_int(context, out);
+        sqlite3_result_int64(context, header_data->size);
     } else {
         sqlite3_result_value(context, argv[0]);
     }
@@ -105,23 +477,82 @@ static void numpy_size(sqlite3_context *context, int argc, sqlite3_value **argv)
 static void numpy_desc(sqlite3_context *context, int argc, sqlite3_value **argv)
 {
     if (sqlite3_value_type(argv[0]) == SQLITE_BLOB) {
-        // Get the BLOB ptr and cast it to an unsigned char
-        unsigned char* input = (unsigned char*) sqlite3_value_blob(argv[0]);
+        const Header_data* header_data = blob_header(context, argv, 0);
+        if (header_data == NULL)
+            return;
+
+        sqlite3_result_text(context, header_data->descr, header_data->descr_len, SQLITE_TRANSIENT);
+    } else {
+        sqlite3_result_value(context, argv[0]);
+    }
+}
+
+/// Reduces all elements of a numpy BLOB (sum, mean, min, max or std, given by the user data).
+/// Integer results are returned as INTEGER, real ones as REAL and complex ones as TEXT in
+/// python notation, e.g. "(1+2j)".
+/// With a second argument `axis` a 2-d array is reduced along this axis and the result is a
+/// 1-d numpy BLOB instead (dtype <i8, <f8 or <c16).
+/// The identity if input is not a BLOB at all
+static void numpy_reduce(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    if (sqlite3_value_type(argv[0]) != SQLITE_BLOB) {
+        sqlite3_result_value(context, argv[0]);
+        return;
+    }
 
-        Header_data* header_data;
-        header_data = malloc(sizeof(*header_data));
+    Reduce_op op = ((Blopy_func*) sqlite3_user_data(context))->op;
 
-        int header_length = read_header(input, header_data); // check that header_length > 0?
-        char buffer[header_data->descr_len];
-        strcpy(buffer, header_data->descr);
+    const Header_data* header_data;
+    const unsigned char* data = blob_data(context, argv, 0, &header_data);
+    if (data == NULL)
+        return;
 
-        free(header_data);
+    int rc;
+    if (argc == 2) {
+        if (header_data->shape_len != 2) {
+            sqlite3_result_error(context, "axis reduction needs a 2-d array", -1);
+            return;
+        }
+        int axis = sqlite3_value_int(argv[1]);
+        if (axis < 0)
+            axis += 2;
+        if (axis != 0 && axis != 1) {
+            sqlite3_result_error(context, "axis out of bounds", -1);
+            return;
+        }
 
-//         sqlite3_result_text(context, header_data->descr, -1, SQLITE_TRANSIENT); // Is this safe?
-        sqlite3_result_text(context, buffer, -1, SQLITE_TRANSIENT); // Is this safe?
+        unsigned char* out;
+        int64_t len = reduce_axis(op, header_data, data, axis, &out);
+        if (len >= 0) {
+            sqlite3_result_blob64(context, out, len, free);
+            return;
+        }
+        rc = (int) len;
     } else {
-        sqlite3_result_value(context, argv[0]);
+        Reduce_value value;
+        Parallel parallel = blob_parallel(context, header_data->size
+                                                   * header_data->wordsize_in_bytes);
+        rc = reduce_parallel(&parallel, op, header_data->type, header_data->wordsize_in_bytes,
+                             data, header_data->size, &value);
+        if (rc == 0) {
+            if (value.kind == 'i') {
+                sqlite3_result_int64(context, value.i);
+            } else if (value.kind == 'f') {
+                sqlite3_result_double(context, value.re);
+            } else {
+                char* text = sqlite3_mprintf("(%.16g%+.16gj)", value.re, value.im);
+                sqlite3_result_text(context, text, -1, sqlite3_free);
+            }
+            return;
+        }
     }
+
+    if (rc == -2)
+        sqlite3_result_error(context, "zero-size array has no minimum or maximum", -1);
+    else if (rc == -3)
+        sqlite3_result_error_nomem(context);
+    else
+        sqlite3_result_error(context, "data type not supported", -1);
 }
 
 #ifdef _WIN32
@@ -133,21 +564,66 @@ int sqlite3_blopy_init(sqlite3 *db, char **pzErrMsg, const sqlite3_api_routines
   SQLITE_EXTENSION_INIT2(pApi);
   //   (void)pzErrMsg;  /* Unused parameter */
 
-  rc = sqlite3_create_function(db, "isnp", 1,
-                               SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, is_numpy_blob, 0, 0);
+  Blopy_conn* conn = sqlite3_malloc(sizeof(*conn));
+  if (conn == NULL)
+      return SQLITE_NOMEM;
+  memset(conn, 0, sizeof(*conn));
+  conn->cache = header_cache_new();
+  conn->refcount = 1; // held until all functions are registered
+  conn->threads = BLOPY_THREADS;
+  conn->parallel_threshold = BLOPY_PARALLEL_THRESHOLD;
+  conn->stats_level = BLOPY_STATS;
+  if (conn->cache == NULL) {
+      sqlite3_free(conn);
+      return SQLITE_NOMEM;
+  }
+
+  rc = create_function(db, conn, "isnp", 1, SQLITE_DETERMINISTIC, 0, is_numpy_blob, 0, 0);
+
+  rc = create_function(db, conn, "np_ver", 1, SQLITE_DETERMINISTIC, 0, numpy_version, 0, 0);
+
+  rc = create_function(db, conn, "np_config", 1, 0, 0, numpy_config, 0, 0);
+  rc = create_function(db, conn, "np_config", 2, 0, 0, numpy_config, 0, 0);
+
+  rc = create_function(db, conn, "np_size", 1, SQLITE_DETERMINISTIC, 0, numpy_size, 0, 0);
+//   rc = create_function(db, conn, "np_shape", 1, SQLITE_DETERMINISTIC, 0, numpy_shape, 0, 0);
+  rc = create_function(db, conn, "np_desc", 1, SQLITE_DETERMINISTIC, 0, numpy_desc, 0, 0);
+
+  rc = create_function(db, conn, "np", 1, SQLITE_DETERMINISTIC, 0, numpy_reader, 0, 0);
+  rc = create_function(db, conn, "np", 2, SQLITE_DETERMINISTIC, 0, numpy_reader, 0, 0);
 
-  rc = sqlite3_create_function(db, "np_ver", 1,
-                               SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, numpy_version, 0, 0);
+  static const struct {
+      const char* name;
+      Reduce_op op;
+  } reductions[] = {
+      {"np_sum", REDUCE_SUM}, {"np_mean", REDUCE_MEAN}, {"np_min", REDUCE_MIN},
+      {"np_max", REDUCE_MAX}, {"np_std", REDUCE_STD},
+  };
+  for (int i = 0; i < (int) (sizeof(reductions)/sizeof(reductions[0])); i++) {
+      for (int n_arg = 1; n_arg <= 2; n_arg++) {
+          rc = create_function(db, conn, reductions[i].name, n_arg, SQLITE_DETERMINISTIC,
+                               reductions[i].op, numpy_reduce, 0, 0);
+      }
+  }
 
-  rc = sqlite3_create_function(db, "np_size", 1,
-                               SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, numpy_size, 0, 0);
-//   rc = sqlite3_create_function(db, "np_shape", 1,
-//                                SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, numpy_shape, 0, 0);
-  rc = sqlite3_create_function(db, "np_desc", 1,
-                               SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, numpy_desc, 0, 0);
+  rc = np_each_init(db, conn);
+  rc = np_slice_init(db, conn);
+  rc = np_stack_init(db, conn);
+  rc = np_arith_init(db, conn);
+  rc = np_distance_init(db, conn);
+  rc = np_ann_init(db, conn);
+  rc = np_meta_init(db, conn);
+  rc = np_compress_init(db, conn);
+  rc = np_layout_init(db, conn);
+  rc = np_convert_init(db, conn);
+  rc = np_sketch_init(db, conn);
+  rc = np_window_init(db, conn);
+  rc = np_file_init(db, conn);
+  rc = np_search_init(db, conn);
+  rc = np_stats_init(db, conn);
 
-  rc = sqlite3_create_function(db, "np", 1,
-                               SQLITE_UTF8 | SQLITE_DETERMINISTIC, 0, numpy_reader, 0, 0);
+  // Drop the reference of the registration itself. From now on the functions keep it alive
+  release_conn(conn);
 
 //   if (rc) return rc;
 
@@ -0,0 +1,203 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+#ifndef BLOPY_FILE
+#define BLOPY_FILE
+#include <sqlite3ext.h> /* Do not use <sqlite3.h>! */
+#include "numpy_reader.h"
+#include "numpy_parallel.h"
+
+/// Declarations shared by the sqlite wrapper code (blopy*.c). Each of these files starts with
+///   #include "blopy.h"
+///   SQLITE_EXTENSION_INIT3
+/// only blopy.c itself uses SQLITE_EXTENSION_INIT1 instead.
+
+// Arguments of a single call that can be decoded at the same time (see blob_payload)
+#define BLOPY_SCRATCH 4
+
+// What blob_payload normalizes (see numpy_layout.h)
+#define BLOB_NATIVE 1   // byte order
+#define BLOB_C_ORDER 2  // memory order
+
+// Defaults of the settings of np_config: one thread, arrays from 16 MiB on are split
+#define BLOPY_THREADS 1
+#define BLOPY_PARALLEL_THRESHOLD (16 << 20)
+#define BLOPY_MAX_THREADS 256
+
+// Counters of the functions (see blopy_stats.c): at most this many names per connection. The
+// default of np_config('stats') is 1, counters without the time
+#define BLOPY_MAX_STATS 128
+#define BLOPY_STATS 1
+
+// What one function (all its numbers of arguments) or module cost so far, in a cache line of
+// its own. All are counted by the thread that runs the statement
+struct Blopy_stats {
+    _Alignas(64) const char* name;
+    sqlite3_int64 calls;          // calls, steps of aggregates, scans of virtual tables
+    sqlite3_int64 bytes;          // of the BLOB arguments
+    sqlite3_int64 header_parses;  // headers that were not in the cache
+    sqlite3_int64 header_hits;    // from the cache or from the auxdata of an argument
+    sqlite3_int64 allocations;    // results not held by sqlite already, grown scratch buffers
+    sqlite3_int64 errors;         // calls that failed
+    sqlite3_int64 nanoseconds;    // only counted with np_config('stats', 2)
+};
+typedef struct Blopy_stats Blopy_stats;
+
+// State shared by all functions of one database connection
+struct Blopy_conn {
+    Header_cache* cache;
+    // Decoded data of compressed BLOBs, then the normalized data, one buffer of each per
+    // argument. Kept for the next call
+    unsigned char* scratch[2*BLOPY_SCRATCH];
+    sqlite3_int64 scratch_size[2*BLOPY_SCRATCH];
+    Header_data normalized[BLOPY_SCRATCH]; // the header of the normalized data
+    // Work on one large array is split over `threads` threads (see blob_parallel). The pool
+    // is started on first use
+    int threads;
+    sqlite3_int64 parallel_threshold;
+    Pool* pool;
+    // The counters of np_stats, aligned to cache lines in `stats_memory`. Entries never move,
+    // so functions keep a pointer to theirs. `stats_level` is np_config('stats')
+    Blopy_stats* stats;
+    void* stats_memory;
+    int n_stats;
+    int stats_level;
+    int refcount; // one per registered function/module, the last one frees the connection state
+};
+typedef struct Blopy_conn Blopy_conn;
+
+// The user data of every registered function
+struct Blopy_func {
+    Blopy_conn* conn;
+    int op; // function specific, e.g. the Reduce_op of np_sum
+    // sqlite calls the counting functions of blopy_stats.c, which call these
+    Blopy_stats* stats;
+    void (*xFunc)(sqlite3_context*, int, sqlite3_value**);
+    void (*xStep)(sqlite3_context*, int, sqlite3_value**);
+    void (*xFinal)(sqlite3_context*);
+    void (*xValue)(sqlite3_context*);
+    void (*xInverse)(sqlite3_context*, int, sqlite3_value**);
+};
+typedef struct Blopy_func Blopy_func;
+
+// Prepared statements per virtual table that lives in shadow tables (see blopy_shadow.c)
+#define SHADOW_MAX_STMT 16
+
+// The first member of np_ann and np_meta, which keep their data in shadow tables <name>_<suffix>
+// and are filled by triggers on an indexed table
+struct Shadow_vtab {
+    sqlite3_vtab base;
+    Blopy_conn* conn;
+    Blopy_stats* stats;  // of the module, see stats_filter
+    sqlite3* db;
+    char* schema;
+    char* name;
+
+    // The configuration, as stored in <name>_config
+    char* table;
+    char* column;
+    char* triggers;  // name of the triggers (and indexes), the table may be renamed since
+
+    const char* const* sql;            // each with the schema and the name for the two %w
+    const char* const* shadow_tables;  // the suffixes, NULL terminated
+    sqlite3_stmt* stmt[SHADOW_MAX_STMT];
+};
+typedef struct Shadow_vtab Shadow_vtab;
+
+// blopy.c
+extern void retain_conn(Blopy_conn* conn);
+extern void release_conn(void* conn);
+extern int create_function(sqlite3 *db, Blopy_conn* conn, const char* name, int n_arg, int flags,
+                           int op, void (*xFunc)(sqlite3_context*, int, sqlite3_value**),
+                           void (*xStep)(sqlite3_context*, int, sqlite3_value**),
+                           void (*xFinal)(sqlite3_context*));
+extern int create_window_function(sqlite3 *db, Blopy_conn* conn, const char* name, int n_arg,
+                                  int flags, int op,
+                                  void (*xStep)(sqlite3_context*, int, sqlite3_value**),
+                                  void (*xFinal)(sqlite3_context*),
+                                  void (*xValue)(sqlite3_context*),
+                                  void (*xInverse)(sqlite3_context*, int, sqlite3_value**));
+extern const Header_data* blob_header(sqlite3_context *context, sqlite3_value **argv, int i);
+extern const Header_data* blob_header_ref(sqlite3_context *context, sqlite3_value **argv, int i);
+extern const unsigned char* blob_data(sqlite3_context *context, sqlite3_value **argv, int i,
+                                      const Header_data** header_data);
+extern const unsigned char* blob_payload(sqlite3_context *context, sqlite3_value *value,
+                                         const Header_data** header_data, int slot, int flags);
+extern Parallel blob_parallel(sqlite3_context *context, sqlite3_int64 n_bytes);
+extern int register_module(sqlite3 *db, Blopy_conn* conn, const char* name,
+                         const sqlite3_module* module);
+
+// blopy_stats.c
+extern Blopy_stats* stats_entry(Blopy_conn* conn, const char* name);
+extern void stats_func(sqlite3_context *context, int argc, sqlite3_value **argv);
+extern void stats_step(sqlite3_context *context, int argc, sqlite3_value **argv);
+extern void stats_final(sqlite3_context *context);
+extern void stats_value(sqlite3_context *context);
+extern void stats_inverse(sqlite3_context *context, int argc, sqlite3_value **argv);
+extern int stats_filter(Blopy_conn* conn, Blopy_stats* stats,
+                        int (*xFilter)(sqlite3_vtab_cursor*, int, const char*, int,
+                                       sqlite3_value**),
+                        sqlite3_vtab_cursor *pCursor, int idxNum, const char *idxStr, int argc,
+                        sqlite3_value **argv);
+extern void stats_header_hit(void);
+extern void stats_allocation(void);
+extern void stats_result_error(sqlite3_context *context, const char* message, int n);
+extern void stats_result_error_nomem(sqlite3_context *context);
+extern void stats_result_error_code(sqlite3_context *context, int code);
+extern void stats_result_blob64(sqlite3_context *context, const void* data, sqlite3_uint64 n,
+                                void (*destructor)(void*));
+extern void stats_result_text(sqlite3_context *context, const char* text, int n,
+                              void (*destructor)(void*));
+extern void stats_result_text64(sqlite3_context *context, const char* text, sqlite3_uint64 n,
+                                void (*destructor)(void*), unsigned char encoding);
+
+// blopy_shadow.c
+extern int shadow_init(Shadow_vtab* vtab, sqlite3* db, Blopy_conn* conn, const char* module,
+                       const char* const* argv, const char* const* sql,
+                       const char* const* tables);
+extern void shadow_free(Shadow_vtab* vtab);
+extern int shadow_error(Shadow_vtab* vtab, const char* fmt, const char* arg);
+extern sqlite3_stmt* shadow_stmt(Shadow_vtab* vtab, int which, int* rc);
+extern int shadow_step(sqlite3_stmt* stmt);
+extern int shadow_exec(Shadow_vtab* vtab, const char* fmt, ...);
+extern char* unquote(char* arg);
+extern int shadow_triggers(Shadow_vtab* vtab, const char* into);
+extern int shadow_destroy(Shadow_vtab* vtab);
+extern int shadow_rename(sqlite3_vtab *pVtab, const char *zNew);
+extern int shadow_is_table(const char* const* tables, const char *zName);
+
+// Virtual tables and groups of functions, each in its own file
+extern int np_each_init(sqlite3 *db, Blopy_conn* conn);
+extern int np_slice_init(sqlite3 *db, Blopy_conn* conn);
+extern int np_stack_init(sqlite3 *db, Blopy_conn* conn);
+extern int np_arith_init(sqlite3 *db, Blopy_conn* conn);
+extern int np_distance_init(sqlite3 *db, Blopy_conn* conn);
+extern int np_ann_init(sqlite3 *db, Blopy_conn* conn);
+extern int np_meta_init(sqlite3 *db, Blopy_conn* conn);
+extern int np_compress_init(sqlite3 *db, Blopy_conn* conn);
+extern int np_layout_init(sqlite3 *db, Blopy_conn* conn);
+extern int np_convert_init(sqlite3 *db, Blopy_conn* conn);
+extern int np_sketch_init(sqlite3 *db, Blopy_conn* conn);
+extern int np_window_init(sqlite3 *db, Blopy_conn* conn);
+extern int np_file_init(sqlite3 *db, Blopy_conn* conn);
+extern int np_stats_init(sqlite3 *db, Blopy_conn* conn);
+extern int np_search_init(sqlite3 *db, Blopy_conn* conn);
+
+// Errors and results of all wrapper code go through blopy_stats.c, where they are counted
+#ifndef BLOPY_STATS_FILE
+#undef sqlite3_result_error
+#define sqlite3_result_error stats_result_error
+#undef sqlite3_result_error_nomem
+#define sqlite3_result_error_nomem stats_result_error_nomem
+#undef sqlite3_result_error_code
+#define sqlite3_result_error_code stats_result_error_code
+#undef sqlite3_result_blob64
+#define sqlite3_result_blob64 stats_result_blob64
+#undef sqlite3_result_text
+#define sqlite3_result_text stats_result_text
+#undef sqlite3_result_text64
+#define sqlite3_result_text64 stats_result_text64
+#endif
+#endif
@@ -0,0 +1,1229 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+#include "blopy.h"
+SQLITE_EXTENSION_INIT3
+
+#include <limits.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "numpy_ann.h"
+#include "numpy_compress.h"
+
+/// np_ann: a persistent approximate nearest neighbour index (IVF-flat) over a numpy column
+///   CREATE VIRTUAL TABLE emb_idx USING np_ann(t, emb, cosine, nlist=1000, nprobe=16);
+///   SELECT rowid, distance FROM emb_idx WHERE vector MATCH :q AND k = 10;
+/// Arguments: the table and column to index, then optionally the metric (l2 (default), cosine
+/// or dot) and nlist (number of clusters, default: sqrt of the number of rows) and nprobe
+/// (number of clusters a query visits, default 8). All vectors must be float32 or float64 and
+/// share dtype and length with the first one.
+///
+/// The vectors are clustered by k-means and stored in the list of their nearest centroid.
+/// A query computes the distance to all centroids and then scans only the `nprobe` nearest lists.
+/// Everything lives in shadow tables (<name>_config, _centroids, _vectors and _ids), the
+/// vectors as bare payloads grouped by list, so a list is read in one go.
+///
+/// Triggers on the table keep the index up to date. New vectors go to the list of their nearest
+/// centroid, the centroids themselves stay. Until there are enough vectors to train on (1024,
+/// or 39 per cluster if nlist is given) everything is in one list that is searched exactly.
+/// After large changes the clusters are trained again with
+///   INSERT INTO emb_idx(command) VALUES ('rebuild');
+/// and the default of nprobe is changed with
+///   INSERT INTO emb_idx(command) VALUES ('nprobe=32');
+///
+/// Query constraints: `vector MATCH blob` (required for a search), `k = n` (or LIMIT n, default
+/// 10) and `nprobe = n`. The rows come out nearest first. `distance` is the euclidean or cosine
+/// distance, for dot the negative inner product (so that smaller is always nearer).
+
+#define ANN_VECTOR   0
+#define ANN_DISTANCE 1
+#define ANN_K        2
+#define ANN_NPROBE   3
+#define ANN_COMMAND  4
+
+// What xBestIndex handed to xFilter (idxNum). The arguments follow in this order
+#define PLAN_MATCH  0x01
+#define PLAN_K      0x02
+#define PLAN_NPROBE 0x04
+#define PLAN_LIMIT  0x08
+#define PLAN_ROWID  0x10
+
+#define DEFAULT_K      10
+#define DEFAULT_NPROBE 8
+// Vectors in the untrained list before the clusters are trained automatically
+#define TRAIN_MIN       1024
+#define TRAIN_PER_LIST  39
+// Rows per list in the k-means sample and the number of iterations
+#define SAMPLE_PER_LIST 64
+#define KMEANS_ITERATIONS 20
+// Vectors that wait for training live in this list
+#define UNTRAINED (-1)
+
+enum Ann_stmt {
+    STMT_LIST,
+    STMT_INSERT_VECTOR,
+    STMT_INSERT_ID,
+    STMT_FIND_ID,
+    STMT_DELETE_VECTOR,
+    STMT_DELETE_ID,
+    STMT_MOVE_VECTOR,
+    STMT_MOVE_ID,
+    STMT_GET_VECTOR,
+    STMT_SET_CONFIG,
+    STMT_GENERATION,
+    N_STMT
+};
+
+// Each with the schema and the name of the index for the two %w
+static const char* const ANN_SQL[N_STMT] = {
+    "SELECT id, vector FROM \"%w\".\"%w_vectors\" WHERE list = ?",
+    "INSERT INTO \"%w\".\"%w_vectors\"(list, id, vector) VALUES (?, ?, ?)",
+    "INSERT INTO \"%w\".\"%w_ids\"(id, list) VALUES (?, ?)",
+    "SELECT list FROM \"%w\".\"%w_ids\" WHERE id = ?",
+    "DELETE FROM \"%w\".\"%w_vectors\" WHERE list = ? AND id = ?",
+    "DELETE FROM \"%w\".\"%w_ids\" WHERE id = ?",
+    "UPDATE \"%w\".\"%w_vectors\" SET list = ?3 WHERE list = ?1 AND id = ?2",
+    "UPDATE \"%w\".\"%w_ids\" SET list = ?2 WHERE id = ?1",
+    "SELECT vector FROM \"%w\".\"%w_vectors\" WHERE list = ? AND id = ?",
+    "INSERT OR REPLACE INTO \"%w\".\"%w_config\"(key, value) VALUES (?, ?)",
+    "SELECT value FROM \"%w\".\"%w_config\" WHERE key = 'generation'",
+};
+
+static const char* const SHADOW_TABLES[] = {"config", "centroids", "vectors", "ids", NULL};
+_Static_assert(N_STMT <= SHADOW_MAX_STMT, "too many statements");
+
+typedef struct Ann_vtab {
+    Shadow_vtab base;
+
+    // The rest of the configuration, as stored in <name>_config
+    Distance_op op;
+    int nlist;                      // requested number of lists, 0: automatic
+    int nprobe;
+    char descr[DESCR_MAXLEN+1];     // of all vectors, empty until the first one arrives
+    int dim;
+    Header_data header_data;        // describes the stored payloads
+
+    // Centroids as of `generation` (-1: not loaded)
+    double* centroids;
+    int n_lists;
+    sqlite3_int64 generation;
+
+    unsigned char* decoded;         // the last compressed vector, see check_vector
+    bool bulk;                      // a rebuild is running, do not train after each insert
+    bool stale;                     // a rollback may have undone the config, see ann_rollback
+} Ann_vtab;
+
+typedef struct Ann_cursor {
+    sqlite3_vtab_cursor base;
+    // A search: the results, nearest first
+    Topk_entry* results;
+    int n_results;
+    int i;
+    int k, nprobe;
+    // Otherwise the rowids of <name>_ids
+    sqlite3_stmt* scan;
+    bool eof;
+} Ann_cursor;
+
+static int config_set(Ann_vtab* vtab, const char* key, const char* text, sqlite3_int64 value)
+{
+    int rc;
+    sqlite3_stmt* stmt = shadow_stmt(&vtab->base, STMT_SET_CONFIG, &rc);
+    if (stmt == NULL)
+        return rc;
+    sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+    if (text != NULL)
+        sqlite3_bind_text(stmt, 2, text, -1, SQLITE_TRANSIENT);
+    else
+        sqlite3_bind_int64(stmt, 2, value);
+    return shadow_step(stmt);
+}
+
+static const char* metric_name(Distance_op op)
+{
+    return op == DISTANCE_COSINE ? "cosine" : (op == DISTANCE_DOT ? "dot" : "l2");
+}
+
+static bool parse_metric(const char* text, Distance_op* op)
+{
+    if (sqlite3_stricmp(text, "l2") == 0 || sqlite3_stricmp(text, "euclidean") == 0)
+        *op = DISTANCE_L2;
+    else if (sqlite3_stricmp(text, "cosine") == 0)
+        *op = DISTANCE_COSINE;
+    else if (sqlite3_stricmp(text, "dot") == 0 || sqlite3_stricmp(text, "ip") == 0)
+        *op = DISTANCE_DOT;
+    else
+        return false;
+    return true;
+}
+
+static int config_load(Ann_vtab* vtab)
+{
+    sqlite3_stmt* stmt;
+    char* sql = sqlite3_mprintf("SELECT key, value FROM \"%w\".\"%w_config\"",
+                                vtab->base.schema, vtab->base.name);
+    if (sql == NULL)
+        return SQLITE_NOMEM;
+    int rc = sqlite3_prepare_v2(vtab->base.db, sql, -1, &stmt, NULL);
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char* key = (const char*) sqlite3_column_text(stmt, 0);
+        const char* text = (const char*) sqlite3_column_text(stmt, 1);
+        if (key == NULL || text == NULL)
+            continue;
+        if (strcmp(key, "table") == 0) {
+            sqlite3_free(vtab->base.table);
+            vtab->base.table = sqlite3_mprintf("%s", text);
+        }
+        else if (strcmp(key, "column") == 0) {
+            sqlite3_free(vtab->base.column);
+            vtab->base.column = sqlite3_mprintf("%s", text);
+        }
+        else if (strcmp(key, "triggers") == 0) {
+            sqlite3_free(vtab->base.triggers);
+            vtab->base.triggers = sqlite3_mprintf("%s", text);
+        }
+        else if (strcmp(key, "metric") == 0)
+            parse_metric(text, &vtab->op);
+        else if (strcmp(key, "nlist") == 0)
+            vtab->nlist = sqlite3_column_int(stmt, 1);
+        else if (strcmp(key, "nprobe") == 0)
+            vtab->nprobe = sqlite3_column_int(stmt, 1);
+        else if (strcmp(key, "descr") == 0)
+            snprintf(vtab->descr, sizeof(vtab->descr), "%s", text);
+        else if (strcmp(key, "dim") == 0)
+            vtab->dim = sqlite3_column_int(stmt, 1);
+    }
+    rc = sqlite3_finalize(stmt);
+    if (rc == SQLITE_OK && (vtab->base.table == NULL || vtab->base.column == NULL
+                            || vtab->base.triggers == NULL))
+        rc = SQLITE_CORRUPT_VTAB;
+    if (rc == SQLITE_OK && vtab->descr[0] != '\0')
+        vector_header(vtab->descr, vtab->dim, &vtab->header_data);
+    return rc;
+}
+
+/// Reads the configuration again after a rollback: the first vector (descr and dim) or an
+/// nprobe= command may be undone. The centroids follow their generation anyway
+static int config_reload(Ann_vtab* vtab)
+{
+    if (!vtab->stale)
+        return SQLITE_OK;
+    vtab->descr[0] = '\0';
+    vtab->dim = 0;
+    vtab->nprobe = DEFAULT_NPROBE;
+    int rc = config_load(vtab);
+    if (rc == SQLITE_OK)
+        vtab->stale = false;
+    return rc;
+}
+
+/// Reloads the centroids if they were trained again (by us or another connection)
+static int centroids_load(Ann_vtab* vtab)
+{
+    int rc;
+    sqlite3_stmt* stmt = shadow_stmt(&vtab->base, STMT_GENERATION, &rc);
+    if (stmt == NULL)
+        return rc;
+    sqlite3_int64 generation = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : 0;
+    sqlite3_reset(stmt);
+    if (generation == vtab->generation)
+        return SQLITE_OK;
+
+    sqlite3_free(vtab->centroids);
+    vtab->centroids = NULL;
+    vtab->n_lists = 0;
+    vtab->generation = -1;
+
+    char* sql = sqlite3_mprintf("SELECT list, centroid FROM \"%w\".\"%w_centroids\" ORDER BY list",
+                                vtab->base.schema, vtab->base.name);
+    if (sql == NULL)
+        return SQLITE_NOMEM;
+    rc = sqlite3_prepare_v2(vtab->base.db, sql, -1, &stmt, NULL);
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    int cap = 0;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        Header_data header_data;
+        const unsigned char* blob = sqlite3_column_blob(stmt, 1);
+        int n_bytes = sqlite3_column_bytes(stmt, 1);
+        if (sqlite3_column_int(stmt, 0) != vtab->n_lists
+                || read_header(blob, n_bytes, &header_data) < 0
+                || header_data.dtype != DTYPE_F8 || header_data.size != vtab->dim
+                || header_data.offset + vtab->dim * 8 > n_bytes) {
+            rc = SQLITE_CORRUPT_VTAB;
+            break;
+        }
+        if (vtab->n_lists == cap) {
+            cap = cap > 0 ? 2*cap : 64;
+            sqlite3_uint64 n_bytes_new = (sqlite3_uint64) cap * vtab->dim * sizeof(double);
+            double* centroids = sqlite3_realloc64(vtab->centroids, n_bytes_new);
+            if (centroids == NULL) {
+                rc = SQLITE_NOMEM;
+                break;
+            }
+            vtab->centroids = centroids;
+        }
+        memcpy(vtab->centroids + (size_t) vtab->n_lists * vtab->dim, blob + header_data.offset,
+               vtab->dim * sizeof(double));
+        vtab->n_lists++;
+    }
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_DONE) {
+        vtab->n_lists = 0;
+        return rc;
+    }
+    vtab->generation = generation;
+    return SQLITE_OK;
+}
+
+/// Checks that `value` is a numpy BLOB that fits the index (the first one defines the dtype
+/// and length of all). Its elements go to `*data`; those of a compressed BLOB are decoded to
+/// vtab->decoded, valid until the next call
+/// @Returns a reference to its header (release it) or NULL with the error in vtab->zErrMsg
+static const Header_data* check_vector(Ann_vtab* vtab, sqlite3_value* value,
+                                       const unsigned char** data, int* rc)
+{
+    const unsigned char* blob = sqlite3_value_blob(value);
+    int n_bytes = sqlite3_value_bytes(value);
+    const Header_data* header_data = header_cache_get(vtab->base.conn->cache, blob, n_bytes, rc);
+    if (header_data == NULL) {
+        *rc = shadow_error(&vtab->base, "np_ann: %s", header_error(*rc));
+        return NULL;
+    }
+
+    const char* error = NULL;
+    if (header_data->dtype != DTYPE_F4 && header_data->dtype != DTYPE_F8)
+        error = "vectors must be float32 or float64";
+    else if (!header_data->littleEndian)
+        error = "big-endian numpy BLOBs are not supported";
+    else if (header_data->fortran_order && header_data->shape_len > 1)
+        error = "vectors must be in C order";
+    else if (!header_data->compressed
+             && (sqlite3_int64) header_data->size * header_data->wordsize_in_bytes
+                > n_bytes - header_data->offset)
+        error = "numpy BLOB is shorter than its shape";
+    else if (header_data->size == 0)
+        error = "vectors must not be empty";
+    else if (header_data->size > INT_MAX / 16)
+        error = "vectors are too long";
+    else if (vtab->descr[0] != '\0'
+             && (strcmp(header_data->descr, vtab->descr) != 0 || header_data->size != vtab->dim))
+        error = "all vectors must have the same dtype and length";
+    else if (header_data->compressed) {
+        sqlite3_int64 n_data = (sqlite3_int64) header_data->size * header_data->wordsize_in_bytes;
+        unsigned char* decoded = sqlite3_realloc64(vtab->decoded, n_data);
+        if (decoded == NULL) {
+            header_release((void*) header_data);
+            *rc = SQLITE_NOMEM;
+            return NULL;
+        }
+        vtab->decoded = decoded;
+        int decode_rc = decompress_array(header_data, blob, n_bytes, decoded);
+        if (decode_rc < 0)
+            error = compress_error(decode_rc);
+    }
+    if (error != NULL) {
+        header_release((void*) header_data);
+        *rc = shadow_error(&vtab->base, "np_ann: %s", error);
+        return NULL;
+    }
+    *data = header_data->compressed ? vtab->decoded : blob + header_data->offset;
+    *rc = SQLITE_OK;
+    return header_data;
+}
+
+static int ann_delete(Ann_vtab* vtab, sqlite3_int64 id)
+{
+    int rc;
+    sqlite3_stmt* stmt = shadow_stmt(&vtab->base, STMT_FIND_ID, &rc);
+    if (stmt == NULL)
+        return rc;
+    sqlite3_bind_int64(stmt, 1, id);
+    if (sqlite3_step(stmt) != SQLITE_ROW)
+        return shadow_step(stmt);
+    int list = sqlite3_column_int(stmt, 0);
+    sqlite3_reset(stmt);
+
+    stmt = shadow_stmt(&vtab->base, STMT_DELETE_VECTOR, &rc);
+    if (stmt == NULL)
+        return rc;
+    sqlite3_bind_int(stmt, 1, list);
+    sqlite3_bind_int64(stmt, 2, id);
+    rc = shadow_step(stmt);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    stmt = shadow_stmt(&vtab->base, STMT_DELETE_ID, &rc);
+    if (stmt == NULL)
+        return rc;
+    sqlite3_bind_int64(stmt, 1, id);
+    return shadow_step(stmt);
+}
+
+/// The list a vector belongs to: the one of its nearest centroid
+static int assign_list(Ann_vtab* vtab, const Header_data* header_data, const void* data,
+                       int* list)
+{
+    *list = UNTRAINED;
+    if (vtab->n_lists == 0)
+        return SQLITE_OK;
+    int n = nearest_lists(vtab->op, vtab->centroids, vtab->n_lists, vtab->dim,
+                          header_data, data, 1, list);
+    if (n < 0)
+        return SQLITE_NOMEM;
+    if (n == 0)
+        *list = 0; // no direction at all (zero vector with cosine), any list will do
+    return SQLITE_OK;
+}
+
+static int ann_train(Ann_vtab* vtab);
+
+static int ann_insert(Ann_vtab* vtab, sqlite3_int64 id, sqlite3_value* value)
+{
+    int rc = ann_delete(vtab, id);
+    if (rc != SQLITE_OK || sqlite3_value_type(value) == SQLITE_NULL)
+        return rc;
+    if (sqlite3_value_type(value) != SQLITE_BLOB)
+        return shadow_error(&vtab->base, "np_ann: %s", "vectors must be numpy BLOBs");
+
+    const unsigned char* data;
+    const Header_data* header_data = check_vector(vtab, value, &data, &rc);
+    if (header_data == NULL)
+        return rc;
+    int n_bytes = (int) header_data->size * header_data->wordsize_in_bytes;
+
+    // The first vector decides for all others
+    if (vtab->descr[0] == '\0') {
+        snprintf(vtab->descr, sizeof(vtab->descr), "%s", header_data->descr);
+        vtab->dim = (int) header_data->size;
+        vector_header(vtab->descr, vtab->dim, &vtab->header_data);
+        rc = config_set(vtab, "descr", vtab->descr, 0);
+        if (rc == SQLITE_OK)
+            rc = config_set(vtab, "dim", NULL, vtab->dim);
+    }
+
+    int list = UNTRAINED;
+    if (rc == SQLITE_OK)
+        rc = centroids_load(vtab);
+    if (rc == SQLITE_OK)
+        rc = assign_list(vtab, header_data, data, &list);
+    header_release((void*) header_data);
+
+    sqlite3_stmt* stmt = rc == SQLITE_OK ? shadow_stmt(&vtab->base, STMT_INSERT_VECTOR, &rc) : NULL;
+    if (stmt == NULL)
+        return rc;
+    sqlite3_bind_int(stmt, 1, list);
+    sqlite3_bind_int64(stmt, 2, id);
+    sqlite3_bind_blob(stmt, 3, data, n_bytes, SQLITE_STATIC);
+    rc = shadow_step(stmt);
+    sqlite3_clear_bindings(stmt);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    stmt = shadow_stmt(&vtab->base, STMT_INSERT_ID, &rc);
+    if (stmt == NULL)
+        return rc;
+    sqlite3_bind_int64(stmt, 1, id);
+    sqlite3_bind_int(stmt, 2, list);
+    rc = shadow_step(stmt);
+    if (rc != SQLITE_OK || list != UNTRAINED || vtab->bulk)
+        return rc;
+
+    // Enough vectors waiting? Then it is time to train
+    sqlite3_int64 waiting = 0;
+    char* sql = sqlite3_mprintf("SELECT count(*) FROM \"%w\".\"%w_ids\" WHERE list = %d",
+                                vtab->base.schema, vtab->base.name, UNTRAINED);
+    if (sql == NULL)
+        return SQLITE_NOMEM;
+    rc = sqlite3_prepare_v2(vtab->base.db, sql, -1, &stmt, NULL);
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK)
+        return rc;
+    if (sqlite3_step(stmt) == SQLITE_ROW)
+        waiting = sqlite3_column_int64(stmt, 0);
+    sqlite3_finalize(stmt);
+
+    sqlite3_int64 needed = vtab->nlist > 0 ? (sqlite3_int64) vtab->nlist * TRAIN_PER_LIST
+                                           : TRAIN_MIN;
+    return waiting >= needed ? ann_train(vtab) : SQLITE_OK;
+}
+
+/// Copies a stored payload as doubles to `out` (normalized for the cosine distance)
+static void payload_to_double(Ann_vtab* vtab, const void* payload, double* out)
+{
+    if (vtab->header_data.dtype == DTYPE_F4) {
+        for (int j = 0; j < vtab->dim; j++)
+            out[j] = ((const float*) payload)[j];
+    } else {
+        memcpy(out, payload, vtab->dim * sizeof(double));
+    }
+    if (vtab->op == DISTANCE_COSINE) {
+        double norm = 0;
+        for (int j = 0; j < vtab->dim; j++)
+            norm += out[j] * out[j];
+        norm = sqrt(norm);
+        for (int j = 0; j < vtab->dim && norm > 0; j++)
+            out[j] /= norm;
+    }
+}
+
+static int write_centroids(Ann_vtab* vtab, const double* centroids, int n_lists)
+{
+    int rc = shadow_exec(&vtab->base, "DELETE FROM \"%w\".\"%w_centroids\"",
+                         vtab->base.schema, vtab->base.name);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    char* sql = sqlite3_mprintf("INSERT INTO \"%w\".\"%w_centroids\"(list, centroid) VALUES (?, ?)",
+                                vtab->base.schema, vtab->base.name);
+    if (sql == NULL)
+        return SQLITE_NOMEM;
+    sqlite3_stmt* stmt;
+    rc = sqlite3_prepare_v2(vtab->base.db, sql, -1, &stmt, NULL);
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    int64_t shape = vtab->dim;
+    int header_length = write_header(NULL, "<f8", false, &shape, 1);
+    int n_bytes = header_length + vtab->dim * 8;
+    unsigned char* blob = sqlite3_malloc(n_bytes);
+    if (blob == NULL) {
+        sqlite3_finalize(stmt);
+        return SQLITE_NOMEM;
+    }
+    write_header(blob, "<f8", false, &shape, 1);
+    for (int c = 0; c < n_lists && rc == SQLITE_OK; c++) {
+        memcpy(blob + header_length, centroids + (size_t) c * vtab->dim, vtab->dim * 8);
+        sqlite3_bind_int(stmt, 1, c);
+        sqlite3_bind_blob(stmt, 2, blob, n_bytes, SQLITE_STATIC);
+        rc = shadow_step(stmt);
+    }
+    sqlite3_free(blob);
+    sqlite3_finalize(stmt);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    // Tells all connections (including this one) to reload the centroids
+    return shadow_exec(&vtab->base, "UPDATE \"%w\".\"%w_config\" SET value = value + 1 "
+                          "WHERE key = 'generation'", vtab->base.schema, vtab->base.name);
+}
+
+/// Moves every vector to the list of its nearest centroid. The ids are visited in batches,
+/// so no statement reads a table while it is changed
+static int reassign(Ann_vtab* vtab)
+{
+    enum { BATCH = 1024 };
+    sqlite3_int64 ids[BATCH];
+    int lists[BATCH];
+    sqlite3_int64 last = INT64_MIN;
+
+    char* sql = sqlite3_mprintf("SELECT id, list FROM \"%w\".\"%w_ids\" WHERE id > ? "
+                                "ORDER BY id LIMIT %d", vtab->base.schema, vtab->base.name, BATCH);
+    if (sql == NULL)
+        return SQLITE_NOMEM;
+    sqlite3_stmt* batch;
+    int rc = sqlite3_prepare_v2(vtab->base.db, sql, -1, &batch, NULL);
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    for (;;) {
+        int n = 0;
+        sqlite3_bind_int64(batch, 1, last);
+        while (sqlite3_step(batch) == SQLITE_ROW) {
+            ids[n] = sqlite3_column_int64(batch, 0);
+            lists[n] = sqlite3_column_int(batch, 1);
+            n++;
+        }
+        rc = sqlite3_reset(batch);
+        if (rc != SQLITE_OK || n == 0)
+            break;
+        last = ids[n-1];
+
+        for (int i = 0; i < n && rc == SQLITE_OK; i++) {
+            sqlite3_stmt* stmt = shadow_stmt(&vtab->base, STMT_GET_VECTOR, &rc);
+            if (stmt == NULL)
+                break;
+            sqlite3_bind_int(stmt, 1, lists[i]);
+            sqlite3_bind_int64(stmt, 2, ids[i]);
+            int list = lists[i];
+            if (sqlite3_step(stmt) == SQLITE_ROW && sqlite3_column_bytes(stmt, 0)
+                    == vtab->dim * (int) vtab->header_data.wordsize_in_bytes)
+                rc = assign_list(vtab, &vtab->header_data, sqlite3_column_blob(stmt, 0), &list);
+            sqlite3_reset(stmt);
+            if (rc != SQLITE_OK || list == lists[i])
+                continue;
+
+            stmt = shadow_stmt(&vtab->base, STMT_MOVE_VECTOR, &rc);
+            if (stmt == NULL)
+                break;
+            sqlite3_bind_int(stmt, 1, lists[i]);
+            sqlite3_bind_int64(stmt, 2, ids[i]);
+            sqlite3_bind_int(stmt, 3, list);
+            rc = shadow_step(stmt);
+            if (rc != SQLITE_OK)
+                break;
+            stmt = shadow_stmt(&vtab->base, STMT_MOVE_ID, &rc);
+            if (stmt == NULL)
+                break;
+            sqlite3_bind_int64(stmt, 1, ids[i]);
+            sqlite3_bind_int(stmt, 2, list);
+            rc = shadow_step(stmt);
+        }
+        if (rc != SQLITE_OK)
+            break;
+    }
+    sqlite3_finalize(batch);
+    return rc;
+}
+
+/// Trains the centroids by k-means on a sample of all indexed vectors and sorts the vectors
+/// into the new lists
+static int ann_train(Ann_vtab* vtab)
+{
+    if (vtab->descr[0] == '\0')
+        return SQLITE_OK;
+
+    sqlite3_stmt* stmt;
+    char* sql = sqlite3_mprintf("SELECT count(*) FROM \"%w\".\"%w_ids\"",
+                                vtab->base.schema, vtab->base.name);
+    if (sql == NULL)
+        return SQLITE_NOMEM;
+    int rc = sqlite3_prepare_v2(vtab->base.db, sql, -1, &stmt, NULL);
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK)
+        return rc;
+    sqlite3_int64 n = sqlite3_step(stmt) == SQLITE_ROW ? sqlite3_column_int64(stmt, 0) : 0;
+    sqlite3_finalize(stmt);
+    if (n == 0)
+        return SQLITE_OK;
+
+    int n_lists = vtab->nlist > 0 ? vtab->nlist : (int) sqrt((double) n);
+    if (n_lists < 1)
+        n_lists = 1;
+    if (n_lists > n)
+        n_lists = (int) n;
+
+    // A uniform sample (reservoir sampling), always the same for the same data
+    sqlite3_int64 n_sample = (sqlite3_int64) n_lists * SAMPLE_PER_LIST;
+    if (n_sample > n)
+        n_sample = n;
+    double* sample = sqlite3_malloc64((sqlite3_uint64) n_sample * vtab->dim * sizeof(double));
+    double* centroids = sqlite3_malloc64((sqlite3_uint64) n_lists * vtab->dim * sizeof(double));
+    if (sample == NULL || centroids == NULL) {
+        sqlite3_free(sample);
+        sqlite3_free(centroids);
+        return SQLITE_NOMEM;
+    }
+
+    sql = sqlite3_mprintf("SELECT vector FROM \"%w\".\"%w_vectors\"",
+                          vtab->base.schema, vtab->base.name);
+    rc = sql != NULL ? sqlite3_prepare_v2(vtab->base.db, sql, -1, &stmt, NULL) : SQLITE_NOMEM;
+    sqlite3_free(sql);
+    sqlite3_int64 seen = 0;
+    unsigned long long state = 1;
+    while (rc == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW) {
+        if (sqlite3_column_bytes(stmt, 0) != vtab->dim * (int) vtab->header_data.wordsize_in_bytes)
+            continue;
+        sqlite3_int64 slot = seen;
+        if (seen >= n_sample) {
+            state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+            slot = (sqlite3_int64) ((state >> 11) % (unsigned long long) (seen + 1));
+        }
+        if (slot < n_sample)
+            payload_to_double(vtab, sqlite3_column_blob(stmt, 0), sample + slot * vtab->dim);
+        seen++;
+    }
+    if (rc == SQLITE_OK)
+        rc = sqlite3_finalize(stmt);
+    if (seen < n_sample)
+        n_sample = seen;
+    if (n_lists > n_sample)
+        n_lists = (int) n_sample;
+
+    if (rc == SQLITE_OK && n_lists > 0
+            && kmeans(sample, n_sample, vtab->dim, n_lists, vtab->op == DISTANCE_COSINE,
+                      KMEANS_ITERATIONS, centroids) < 0)
+        rc = SQLITE_NOMEM;
+    sqlite3_free(sample);
+
+    if (rc == SQLITE_OK)
+        rc = write_centroids(vtab, centroids, n_lists);
+    sqlite3_free(centroids);
+    if (rc == SQLITE_OK)
+        rc = centroids_load(vtab);
+    if (rc == SQLITE_OK)
+        rc = reassign(vtab);
+    return rc;
+}
+
+/// Indexes all rows of the table from scratch and trains the centroids
+static int ann_rebuild(Ann_vtab* vtab)
+{
+    int rc = shadow_exec(&vtab->base,
+                         "DELETE FROM \"%w\".\"%w_vectors\"; DELETE FROM \"%w\".\"%w_ids\"; "
+                         "DELETE FROM \"%w\".\"%w_centroids\"; "
+                         "UPDATE \"%w\".\"%w_config\" SET value = value + 1 "
+                         "WHERE key = 'generation'",
+                         vtab->base.schema, vtab->base.name, vtab->base.schema, vtab->base.name,
+                         vtab->base.schema, vtab->base.name, vtab->base.schema, vtab->base.name);
+    if (rc == SQLITE_OK)
+        rc = centroids_load(vtab);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    sqlite3_stmt* stmt;
+    char* sql = sqlite3_mprintf("SELECT rowid, \"%w\" FROM \"%w\".\"%w\"",
+                                vtab->base.column, vtab->base.schema, vtab->base.table);
+    if (sql == NULL)
+        return SQLITE_NOMEM;
+    rc = sqlite3_prepare_v2(vtab->base.db, sql, -1, &stmt, NULL);
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK)
+        return shadow_error(&vtab->base, "np_ann: %s", sqlite3_errmsg(vtab->base.db));
+
+    vtab->bulk = true;
+    while (rc == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW)
+        rc = ann_insert(vtab, sqlite3_column_int64(stmt, 0), sqlite3_column_value(stmt, 1));
+    vtab->bulk = false;
+    sqlite3_finalize(stmt);
+    if (rc == SQLITE_OK)
+        rc = ann_train(vtab);
+    return rc;
+}
+
+/// Reads a non-negative number
+static bool parse_count(const char* text, int* out)
+{
+    char* end;
+    long value = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || value < 0 || value > (1 << 24))
+        return false;
+    *out = (int) value;
+    return true;
+}
+
+static void ann_free(Ann_vtab* vtab)
+{
+    shadow_free(&vtab->base);
+    sqlite3_free(vtab->centroids);
+    sqlite3_free(vtab->decoded);
+    sqlite3_free(vtab);
+}
+
+static int ann_init(sqlite3 *db, void *pAux, int argc, const char *const*argv,
+                    sqlite3_vtab **ppVtab, char **pzErr, bool create)
+{
+    int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(vector HIDDEN, distance REAL, "
+                                      "k HIDDEN, nprobe HIDDEN, command HIDDEN)");
+    if (rc != SQLITE_OK)
+        return rc;
+
+    // The triggers on the table write to the index. It only ever touches its own shadow tables
+    sqlite3_vtab_config(db, SQLITE_VTAB_INNOCUOUS);
+
+    Ann_vtab* vtab = sqlite3_malloc(sizeof(*vtab));
+    if (vtab == NULL)
+        return SQLITE_NOMEM;
+    memset(vtab, 0, sizeof(*vtab));
+    vtab->op = DISTANCE_L2;
+    vtab->nprobe = DEFAULT_NPROBE;
+    vtab->generation = -1;
+    rc = shadow_init(&vtab->base, db, pAux, "np_ann", argv, ANN_SQL, SHADOW_TABLES);
+    if (rc != SQLITE_OK) {
+        ann_free(vtab);
+        return rc;
+    }
+
+    if (!create) {
+        rc = config_load(vtab);
+        if (rc != SQLITE_OK) {
+            *pzErr = sqlite3_mprintf("np_ann: cannot read %s_config", vtab->base.name);
+            ann_free(vtab);
+            return rc;
+        }
+        *ppVtab = &vtab->base.base;
+        return SQLITE_OK;
+    }
+
+    // Arguments: table, column, then the metric and key=value pairs in any order
+    for (int i = 3; i < argc && rc == SQLITE_OK; i++) {
+        char* arg = sqlite3_mprintf("%s", argv[i]);
+        if (arg == NULL) {
+            rc = SQLITE_NOMEM;
+            break;
+        }
+        char* value = strchr(arg, '=');
+        char* text = unquote(arg);
+        if (i == 3) {
+            vtab->base.table = sqlite3_mprintf("%s", text);
+        } else if (i == 4) {
+            vtab->base.column = sqlite3_mprintf("%s", text);
+        } else if (value == NULL) {
+            if (!parse_metric(text, &vtab->op)) {
+                *pzErr = sqlite3_mprintf("np_ann: unknown metric '%s'", text);
+                rc = SQLITE_ERROR;
+            }
+        } else {
+            *value++ = '\0';
+            while (*value == ' ')
+                value++;
+            char* key = text;
+            for (char* end = key + strlen(key); end > key && end[-1] == ' '; end--)
+                end[-1] = '\0';
+            value = unquote(value);
+            if (sqlite3_stricmp(key, "metric") == 0 && parse_metric(value, &vtab->op)) {
+                // done
+            } else if (sqlite3_stricmp(key, "nlist") == 0 && parse_count(value, &vtab->nlist)) {
+                // done
+            } else if (sqlite3_stricmp(key, "nprobe") == 0 && parse_count(value, &vtab->nprobe)
+                       && vtab->nprobe > 0) {
+                // done
+            } else {
+                *pzErr = sqlite3_mprintf("np_ann: bad argument '%s'", argv[i]);
+                rc = SQLITE_ERROR;
+            }
+        }
+        sqlite3_free(arg);
+    }
+    if (rc == SQLITE_OK && (vtab->base.table == NULL || vtab->base.column == NULL)) {
+        *pzErr = sqlite3_mprintf("np_ann: usage np_ann(table, column [, metric, nlist=, nprobe=])");
+        rc = SQLITE_ERROR;
+    }
+
+    if (rc == SQLITE_OK) {
+        rc = shadow_exec(&vtab->base,
+            "CREATE TABLE \"%w\".\"%w_config\"(key TEXT PRIMARY KEY, value) WITHOUT ROWID;"
+            "CREATE TABLE \"%w\".\"%w_centroids\"(list INTEGER PRIMARY KEY, centroid BLOB);"
+            "CREATE TABLE \"%w\".\"%w_vectors\"(list INTEGER, id INTEGER, vector BLOB, "
+            "PRIMARY KEY(list, id)) WITHOUT ROWID;"
+            "CREATE TABLE \"%w\".\"%w_ids\"(id INTEGER PRIMARY KEY, list INTEGER);"
+            "INSERT INTO \"%w\".\"%w_config\"(key, value) VALUES ('generation', 0);",
+            vtab->base.schema, vtab->base.name, vtab->base.schema, vtab->base.name,
+            vtab->base.schema, vtab->base.name, vtab->base.schema, vtab->base.name,
+            vtab->base.schema, vtab->base.name);
+    }
+    if (rc == SQLITE_OK)
+        rc = config_set(vtab, "table", vtab->base.table, 0);
+    if (rc == SQLITE_OK)
+        rc = config_set(vtab, "column", vtab->base.column, 0);
+    if (rc == SQLITE_OK)
+        rc = config_set(vtab, "triggers", vtab->base.triggers, 0);
+    if (rc == SQLITE_OK)
+        rc = config_set(vtab, "metric", metric_name(vtab->op), 0);
+    if (rc == SQLITE_OK)
+        rc = config_set(vtab, "nlist", NULL, vtab->nlist);
+    if (rc == SQLITE_OK)
+        rc = config_set(vtab, "nprobe", NULL, vtab->nprobe);
+
+    // Keep the index in sync with the table
+    if (rc == SQLITE_OK)
+        rc = shadow_triggers(&vtab->base, "vector");
+    if (rc == SQLITE_OK)
+        rc = ann_rebuild(vtab);
+
+    if (rc != SQLITE_OK) {
+        if (*pzErr == NULL)
+            *pzErr = sqlite3_mprintf("%s", vtab->base.base.zErrMsg != NULL ? vtab->base.base.zErrMsg
+                                                                      : sqlite3_errmsg(db));
+        sqlite3_free(vtab->base.base.zErrMsg);
+        ann_free(vtab);
+        return rc;
+    }
+    *ppVtab = &vtab->base.base;
+    return SQLITE_OK;
+}
+
+static int ann_create(sqlite3 *db, void *pAux, int argc, const char *const*argv,
+                      sqlite3_vtab **ppVtab, char **pzErr)
+{
+    return ann_init(db, pAux, argc, argv, ppVtab, pzErr, true);
+}
+
+static int ann_connect(sqlite3 *db, void *pAux, int argc, const char *const*argv,
+                       sqlite3_vtab **ppVtab, char **pzErr)
+{
+    return ann_init(db, pAux, argc, argv, ppVtab, pzErr, false);
+}
+
+static int ann_disconnect(sqlite3_vtab *pVtab)
+{
+    ann_free((Ann_vtab*) pVtab);
+    return SQLITE_OK;
+}
+
+static int ann_destroy(sqlite3_vtab *pVtab)
+{
+    Ann_vtab* vtab = (Ann_vtab*) pVtab;
+    int rc = shadow_destroy(&vtab->base);
+    if (rc == SQLITE_OK)
+        ann_free(vtab);
+    return rc;
+}
+
+static int ann_shadow_name(const char *zName)
+{
+    return shadow_is_table(SHADOW_TABLES, zName);
+}
+
+static int ann_open(sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCursor)
+{
+    Ann_cursor* cur = sqlite3_malloc(sizeof(*cur));
+    if (cur == NULL)
+        return SQLITE_NOMEM;
+    memset(cur, 0, sizeof(*cur));
+    *ppCursor = &cur->base;
+    return SQLITE_OK;
+}
+
+static void ann_reset(Ann_cursor* cur)
+{
+    sqlite3_free(cur->results);
+    sqlite3_finalize(cur->scan);
+    cur->results = NULL;
+    cur->scan = NULL;
+    cur->n_results = 0;
+    cur->i = 0;
+    cur->eof = true;
+}
+
+static int ann_close(sqlite3_vtab_cursor *pCursor)
+{
+    Ann_cursor* cur = (Ann_cursor*) pCursor;
+    ann_reset(cur);
+    sqlite3_free(cur);
+    return SQLITE_OK;
+}
+
+/// Scans one list and offers all its vectors to the heap of results
+static int search_list(Ann_vtab* vtab, Ann_cursor* cur, int list, const Header_data* query_header,
+                       const void* query)
+{
+    int rc;
+    sqlite3_stmt* stmt = shadow_stmt(&vtab->base, STMT_LIST, &rc);
+    if (stmt == NULL)
+        return rc;
+    sqlite3_bind_int(stmt, 1, list);
+
+    int n_bytes = vtab->dim * vtab->header_data.wordsize_in_bytes;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+        if (sqlite3_column_bytes(stmt, 1) != n_bytes)
+            continue;
+        double d;
+        distance(vtab->op, &vtab->header_data, sqlite3_column_blob(stmt, 1), query_header, query,
+                 &d);
+        topk_push(cur->results, &cur->n_results, cur->k, vtab->op == DISTANCE_DOT ? -d : d,
+                  sqlite3_column_int64(stmt, 0));
+    }
+    sqlite3_reset(stmt);
+    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+static int ann_search(Ann_vtab* vtab, Ann_cursor* cur, sqlite3_value* query)
+{
+    if (sqlite3_value_type(query) != SQLITE_BLOB)
+        return shadow_error(&vtab->base, "np_ann: %s", "MATCH needs a numpy BLOB");
+    if (vtab->descr[0] == '\0')
+        return SQLITE_OK; // nothing indexed yet
+
+    int rc;
+    const unsigned char* data;
+    const Header_data* query_header = check_vector(vtab, query, &data, &rc);
+    if (query_header == NULL)
+        return rc;
+
+    int* lists = NULL;
+    int n_lists = 0;
+    cur->results = sqlite3_malloc64((sqlite3_uint64) (cur->k + 1) * sizeof(Topk_entry));
+    rc = cur->results != NULL ? centroids_load(vtab) : SQLITE_NOMEM;
+    if (rc == SQLITE_OK && vtab->n_lists > 0) {
+        lists = sqlite3_malloc64((sqlite3_uint64) vtab->n_lists * sizeof(int));
+        n_lists = lists != NULL ? nearest_lists(vtab->op, vtab->centroids, vtab->n_lists, vtab->dim,
+                                                query_header, data, cur->nprobe, lists) : -1;
+        if (n_lists < 0)
+            rc = SQLITE_NOMEM;
+    }
+
+    // Vectors that wait for training are always searched
+    if (rc == SQLITE_OK)
+        rc = search_list(vtab, cur, UNTRAINED, query_header, data);
+    for (int i = 0; i < n_lists && rc == SQLITE_OK; i++)
+        rc = search_list(vtab, cur, lists[i], query_header, data);
+
+    sqlite3_free(lists);
+    header_release((void*) query_header);
+    if (rc == SQLITE_OK)
+        topk_sort(cur->results, cur->n_results);
+    return rc;
+}
+
+static int ann_scan(sqlite3_vtab_cursor *pCursor, int idxNum, const char *idxStr,
+                    int argc, sqlite3_value **argv)
+{
+    Ann_cursor* cur = (Ann_cursor*) pCursor;
+    Ann_vtab* vtab = (Ann_vtab*) pCursor->pVtab;
+    ann_reset(cur);
+    int rc = config_reload(vtab);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    if (!(idxNum & PLAN_MATCH)) {
+        // All indexed rowids, or a single one
+        char* sql = sqlite3_mprintf("SELECT id FROM \"%w\".\"%w_ids\"%s",
+                                    vtab->base.schema, vtab->base.name,
+                                    (idxNum & PLAN_ROWID) ? " WHERE id = ?" : "");
+        if (sql == NULL)
+            return SQLITE_NOMEM;
+        rc = sqlite3_prepare_v2(vtab->base.db, sql, -1, &cur->scan, NULL);
+        sqlite3_free(sql);
+        if (rc != SQLITE_OK)
+            return rc;
+        if (idxNum & PLAN_ROWID)
+            sqlite3_bind_value(cur->scan, 1, argv[0]);
+        rc = sqlite3_step(cur->scan);
+        cur->eof = rc != SQLITE_ROW;
+        return rc == SQLITE_ROW || rc == SQLITE_DONE ? SQLITE_OK : rc;
+    }
+
+    int arg = 1;
+    cur->k = DEFAULT_K;
+    cur->nprobe = vtab->nprobe;
+    if (idxNum & PLAN_K)
+        cur->k = sqlite3_value_int(argv[arg++]);
+    if (idxNum & PLAN_NPROBE)
+        cur->nprobe = sqlite3_value_int(argv[arg++]);
+    if (idxNum & PLAN_LIMIT) {
+        int limit = sqlite3_value_int(argv[arg++]);
+        if (!(idxNum & PLAN_K) || limit < cur->k)
+            cur->k = limit;
+    }
+    if (cur->k <= 0 || cur->nprobe <= 0) {
+        cur->eof = true;
+        return SQLITE_OK;
+    }
+    if (cur->k > (1 << 20))
+        return shadow_error(&vtab->base, "np_ann: %s", "k is too large");
+
+    rc = ann_search(vtab, cur, argv[0]);
+    cur->eof = cur->n_results == 0;
+    return rc;
+}
+
+static int ann_next(sqlite3_vtab_cursor *pCursor)
+{
+    Ann_cursor* cur = (Ann_cursor*) pCursor;
+    if (cur->scan != NULL) {
+        int rc = sqlite3_step(cur->scan);
+        cur->eof = rc != SQLITE_ROW;
+        return rc == SQLITE_ROW || rc == SQLITE_DONE ? SQLITE_OK : rc;
+    }
+    cur->eof = ++cur->i >= cur->n_results;
+    return SQLITE_OK;
+}
+
+static int ann_eof(sqlite3_vtab_cursor *pCursor)
+{
+    return ((Ann_cursor*) pCursor)->eof;
+}
+
+static int ann_column(sqlite3_vtab_cursor *pCursor, sqlite3_context *ctx, int i)
+{
+    Ann_cursor* cur = (Ann_cursor*) pCursor;
+    if (cur->scan != NULL) {
+        sqlite3_result_null(ctx);
+        return SQLITE_OK;
+    }
+    switch (i) {
+    case ANN_DISTANCE: sqlite3_result_double(ctx, cur->results[cur->i].distance); break;
+    case ANN_K: sqlite3_result_int(ctx, cur->k); break;
+    case ANN_NPROBE: sqlite3_result_int(ctx, cur->nprobe); break;
+    default: sqlite3_result_null(ctx); break;
+    }
+    return SQLITE_OK;
+}
+
+static int ann_rowid(sqlite3_vtab_cursor *pCursor, sqlite_int64 *pRowid)
+{
+    Ann_cursor* cur = (Ann_cursor*) pCursor;
+    if (cur->scan != NULL)
+        *pRowid = sqlite3_column_int64(cur->scan, 0);
+    else
+        *pRowid = cur->results[cur->i].id;
+    return SQLITE_OK;
+}
+
+static int ann_best_index(sqlite3_vtab *pVtab, sqlite3_index_info *pInfo)
+{
+    int match = -1, k = -1, nprobe = -1, limit = -1, rowid = -1;
+    bool filtered = false; // constraints sqlite checks on the rows that come out
+    for (int i = 0; i < pInfo->nConstraint; i++) {
+        const struct sqlite3_index_constraint* c = &pInfo->aConstraint[i];
+        if (!c->usable)
+            continue;
+        if (c->op == SQLITE_INDEX_CONSTRAINT_LIMIT)
+            limit = i;
+        else if (c->iColumn == ANN_VECTOR && c->op == SQLITE_INDEX_CONSTRAINT_MATCH)
+            match = i;
+        else if (c->iColumn == ANN_K && c->op == SQLITE_INDEX_CONSTRAINT_EQ)
+            k = i;
+        else if (c->iColumn == ANN_NPROBE && c->op == SQLITE_INDEX_CONSTRAINT_EQ)
+            nprobe = i;
+        else if (c->op != SQLITE_INDEX_CONSTRAINT_OFFSET) {
+            filtered = true;
+            if (c->iColumn == -1 && c->op == SQLITE_INDEX_CONSTRAINT_EQ)
+                rowid = i;
+        }
+    }
+
+    if (match < 0) {
+        if (rowid >= 0) {
+            pInfo->aConstraintUsage[rowid].argvIndex = 1;
+            pInfo->aConstraintUsage[rowid].omit = 1;
+            pInfo->idxNum = PLAN_ROWID;
+            pInfo->estimatedCost = 10;
+            pInfo->estimatedRows = 1;
+            pInfo->idxFlags = SQLITE_INDEX_SCAN_UNIQUE;
+        } else {
+            pInfo->idxNum = 0;
+            pInfo->estimatedCost = 1e7;
+        }
+        return SQLITE_OK;
+    }
+
+    // The results come out nearest first. LIMIT can only shrink k if sqlite neither sorts nor
+    // filters the rows afterwards
+    bool nearest_first = pInfo->nOrderBy == 1 && pInfo->aOrderBy[0].iColumn == ANN_DISTANCE
+                         && !pInfo->aOrderBy[0].desc;
+    if ((pInfo->nOrderBy > 0 && !nearest_first) || filtered)
+        limit = -1;
+
+    int used[] = {match, k, nprobe, limit};
+    int flags[] = {PLAN_MATCH, PLAN_K, PLAN_NPROBE, PLAN_LIMIT};
+    int n_arg = 0;
+    for (int i = 0; i < 4; i++) {
+        if (used[i] < 0)
+            continue;
+        pInfo->aConstraintUsage[used[i]].argvIndex = ++n_arg;
+        pInfo->aConstraintUsage[used[i]].omit = 1;
+        pInfo->idxNum |= flags[i];
+    }
+
+    if (nearest_first)
+        pInfo->orderByConsumed = 1;
+    pInfo->estimatedCost = 1000;
+    pInfo->estimatedRows = DEFAULT_K;
+    return SQLITE_OK;
+}
+
+static int ann_command(Ann_vtab* vtab, const char* command)
+{
+    if (sqlite3_stricmp(command, "rebuild") == 0)
+        return ann_rebuild(vtab);
+    int nprobe;
+    if (sqlite3_strnicmp(command, "nprobe=", 7) == 0 && parse_count(command + 7, &nprobe)
+            && nprobe > 0) {
+        vtab->nprobe = nprobe;
+        return config_set(vtab, "nprobe", NULL, vtab->nprobe);
+    }
+    return shadow_error(&vtab->base, "np_ann: unknown command '%s'", command);
+}
+
+static int ann_update(sqlite3_vtab *pVtab, int argc, sqlite3_value **argv, sqlite_int64 *pRowid)
+{
+    Ann_vtab* vtab = (Ann_vtab*) pVtab;
+    int rc = config_reload(vtab);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    // DELETE
+    if (argc == 1)
+        return ann_delete(vtab, sqlite3_value_int64(argv[0]));
+
+    // INSERT INTO idx(command) VALUES (...)
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL
+            && sqlite3_value_type(argv[2 + ANN_COMMAND]) != SQLITE_NULL)
+        return ann_command(vtab, (const char*) sqlite3_value_text(argv[2 + ANN_COMMAND]));
+
+    if (sqlite3_value_type(argv[1]) != SQLITE_INTEGER)
+        return shadow_error(&vtab->base, "np_ann: %s", "the rowid of the row is needed");
+
+    // UPDATE: remove the old row first (ann_insert replaces the new rowid anyway)
+    if (sqlite3_value_type(argv[0]) != SQLITE_NULL
+            && sqlite3_value_int64(argv[0]) != sqlite3_value_int64(argv[1])) {
+        rc = ann_delete(vtab, sqlite3_value_int64(argv[0]));
+        if (rc != SQLITE_OK)
+            return rc;
+    }
+    *pRowid = sqlite3_value_int64(argv[1]);
+    return ann_insert(vtab, *pRowid, argv[2 + ANN_VECTOR]);
+}
+
+static int ann_filter(sqlite3_vtab_cursor *pCursor, int idxNum, const char *idxStr,
+                      int argc, sqlite3_value **argv)
+{
+    Ann_vtab* vtab = (Ann_vtab*) pCursor->pVtab;
+    return stats_filter(vtab->base.conn, vtab->base.stats, ann_scan, pCursor, idxNum, idxStr,
+                        argc, argv);
+}
+
+/// Only there so that sqlite calls ann_rollback and ann_rollback_to
+static int ann_begin(sqlite3_vtab *pVtab)
+{
+    return SQLITE_OK;
+}
+
+/// sqlite runs no statements during a rollback, the configuration is read again on next use
+static int ann_rollback(sqlite3_vtab *pVtab)
+{
+    ((Ann_vtab*) pVtab)->stale = true;
+    return SQLITE_OK;
+}
+
+static int ann_rollback_to(sqlite3_vtab *pVtab, int iSavepoint)
+{
+    return ann_rollback(pVtab);
+}
+
+static sqlite3_module ann_module = {
+    3,                 /* iVersion */
+    ann_create,        /* xCreate */
+    ann_connect,       /* xConnect */
+    ann_best_index,    /* xBestIndex */
+    ann_disconnect,    /* xDisconnect */
+    ann_destroy,       /* xDestroy */
+    ann_open,          /* xOpen */
+    ann_close,         /* xClose */
+    ann_filter,        /* xFilter */
+    ann_next,          /* xNext */
+    ann_eof,           /* xEof */
+    ann_column,        /* xColumn */
+    ann_rowid,         /* xRowid */
+    ann_update,        /* xUpdate */
+    ann_begin,         /* xBegin */
+    0,                 /* xSync */
+    0,                 /* xCommit */
+    ann_rollback,      /* xRollback */
+    0,                 /* xFindFunction */
+    shadow_rename,        /* xRename */
+    0,                 /* xSavepoint */
+    0,                 /* xRelease */
+    ann_rollback_to,   /* xRollbackTo */
+    ann_shadow_name,   /* xShadowName */
+};
+
+int np_ann_init(sqlite3 *db, Blopy_conn* conn)
+{
+    return register_module(db, conn, "np_ann", &ann_module);
+}
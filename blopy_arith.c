@@ -0,0 +1,113 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+#include "blopy.h"
+SQLITE_EXTENSION_INIT3
+
+#include <stdlib.h>
+#include "numpy_arith.h"
+
+/// Element-wise arithmetic, each returning a new numpy BLOB:
+///   np_add(a, b), np_sub(a, b), np_mul(a, b), np_div(a, b)
+///     a and b are numpy BLOBs or numbers (at least one a BLOB). Shapes are broadcast and
+///     dtypes promoted like in numpy, e.g. np_sub(spectrum, background) or np_div(col, 2.5)
+///   np_scale(a, factor), np_scale(a, factor, offset)
+///     a * factor + offset in one pass, e.g. to normalize: np_scale(col, 1/norm, -mean/norm)
+/// NULL in, NULL out.
+///
+/// The result is computed straight into the buffer which is handed to sqlite.
+
+/// Reads argument `i` into `operand`
+/// @Returns false (with an error set on `context`) if it is neither a numpy BLOB nor a number
+static bool get_operand(sqlite3_context *context, sqlite3_value **argv, int i,
+                        Arith_operand* operand)
+{
+    operand->header_data = NULL;
+    operand->data = NULL;
+    switch (sqlite3_value_type(argv[i])) {
+    case SQLITE_BLOB:
+        operand->data = blob_data(context, argv, i, &operand->header_data);
+        return operand->data != NULL;
+    case SQLITE_INTEGER:
+        operand->is_int = true;
+        operand->i = sqlite3_value_int64(argv[i]);
+        return true;
+    case SQLITE_FLOAT:
+        operand->is_int = false;
+        operand->f = sqlite3_value_double(argv[i]);
+        return true;
+    default:
+        sqlite3_result_error(context, "arguments must be numpy BLOBs or numbers", -1);
+        return false;
+    }
+}
+
+static void numpy_arith(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    for (int i = 0; i < argc; i++) {
+        if (sqlite3_value_type(argv[i]) == SQLITE_NULL) {
+            sqlite3_result_null(context);
+            return;
+        }
+    }
+
+    Arith_op op = ((Blopy_func*) sqlite3_user_data(context))->op;
+
+    Arith_operand operands[3];
+    for (int i = 0; i < argc; i++) {
+        if (!get_operand(context, argv, i, &operands[i]))
+            return;
+    }
+
+    if (op == ARITH_SCALE) {
+        if (operands[0].header_data == NULL || operands[1].header_data != NULL
+                || (argc == 3 && operands[2].header_data != NULL)) {
+            sqlite3_result_error(context, "np_scale needs a numpy BLOB and numbers", -1);
+            return;
+        }
+    } else if (operands[0].header_data == NULL && operands[1].header_data == NULL) {
+        sqlite3_result_error(context, "at least one argument must be a numpy BLOB", -1);
+        return;
+    }
+
+    // Split by the larger array; the result is at least as large
+    sqlite3_int64 n_bytes = 0;
+    for (int i = 0; i < argc; i++) {
+        const Header_data* header_data = operands[i].header_data;
+        if (header_data != NULL && header_data->size * header_data->wordsize_in_bytes > n_bytes)
+            n_bytes = header_data->size * header_data->wordsize_in_bytes;
+    }
+    Parallel parallel = blob_parallel(context, n_bytes);
+
+    unsigned char* out;
+    size_t len;
+    int rc = arith(op, &operands[0], &operands[1], argc == 3 ? &operands[2] : NULL, &parallel,
+                   &out, &len);
+    if (rc < 0) {
+        sqlite3_result_error(context, arith_error(rc), -1);
+        return;
+    }
+    // sqlite takes over the buffer, no copy
+    sqlite3_result_blob64(context, out, len, free);
+}
+
+int np_arith_init(sqlite3 *db, Blopy_conn* conn)
+{
+    static const struct {
+        const char* name;
+        int n_arg;
+        Arith_op op;
+    } functions[] = {
+        {"np_add", 2, ARITH_ADD}, {"np_sub", 2, ARITH_SUB}, {"np_mul", 2, ARITH_MUL},
+        {"np_div", 2, ARITH_DIV}, {"np_scale", 2, ARITH_SCALE}, {"np_scale", 3, ARITH_SCALE},
+    };
+
+    int rc = SQLITE_OK;
+    for (int i = 0; i < (int) (sizeof(functions)/sizeof(functions[0])) && rc == SQLITE_OK; i++) {
+        rc = create_function(db, conn, functions[i].name, functions[i].n_arg,
+                             SQLITE_DETERMINISTIC, functions[i].op, numpy_arith, 0, 0);
+    }
+    return rc;
+}
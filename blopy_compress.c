@@ -0,0 +1,95 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+#include "blopy.h"
+SQLITE_EXTENSION_INIT3
+
+#include <stdlib.h>
+#include <string.h>
+#include "numpy_compress.h"
+
+/// Compressed numpy BLOBs (format in numpy_compress.h):
+///   np_compress(col)   -> the compressed form, unchanged if it is compressed already
+///   np_decompress(col) -> a plain numpy BLOB again, unchanged if it is not compressed
+/// All other functions read compressed BLOBs directly. The header is not compressed, so
+/// np_size or np_desc never touch the data, and slicing (np_head, np_slice, np_each) decodes
+/// only the chunks that hold selected elements. To store a column compressed:
+///   UPDATE t SET col = np_compress(col);
+
+static void numpy_compress(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    if (sqlite3_value_type(argv[0]) != SQLITE_BLOB) {
+        sqlite3_result_value(context, argv[0]);
+        return;
+    }
+
+    const Header_data* header_data = blob_header(context, argv, 0);
+    if (header_data == NULL)
+        return;
+    if (header_data->compressed) {
+        sqlite3_result_value(context, argv[0]);
+        return;
+    }
+    const unsigned char* data = blob_payload(context, argv[0], &header_data, 0, 0);
+    if (data == NULL)
+        return;
+
+    unsigned char* out;
+    size_t len;
+    int rc = compress_array(header_data, data, &out, &len);
+    if (rc < 0) {
+        sqlite3_result_error(context, compress_error(rc), -1);
+        return;
+    }
+    sqlite3_result_blob64(context, out, len, free);
+}
+
+static void numpy_decompress(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    if (sqlite3_value_type(argv[0]) != SQLITE_BLOB) {
+        sqlite3_result_value(context, argv[0]);
+        return;
+    }
+
+    const Header_data* header_data = blob_header(context, argv, 0);
+    if (header_data == NULL)
+        return;
+    if (!header_data->compressed) {
+        sqlite3_result_value(context, argv[0]);
+        return;
+    }
+
+    // Decoded straight into the result
+    int header_length = write_header(NULL, header_data->descr, header_data->fortran_order,
+                                     header_data->shape, header_data->shape_len);
+    sqlite3_int64 n_bytes = header_length
+                            + (sqlite3_int64) header_data->size * header_data->wordsize_in_bytes;
+    unsigned char* out = malloc(n_bytes);
+    if (out == NULL) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    write_header(out, header_data->descr, header_data->fortran_order, header_data->shape,
+                 header_data->shape_len);
+
+    int rc = decompress_array(header_data, sqlite3_value_blob(argv[0]),
+                              sqlite3_value_bytes(argv[0]), out + header_length);
+    if (rc < 0) {
+        free(out);
+        sqlite3_result_error(context, compress_error(rc), -1);
+        return;
+    }
+    sqlite3_result_blob64(context, out, n_bytes, free);
+}
+
+int np_compress_init(sqlite3 *db, Blopy_conn* conn)
+{
+    int rc;
+    rc = create_function(db, conn, "np_compress", 1, SQLITE_DETERMINISTIC, 0,
+                         numpy_compress, 0, 0);
+    rc = create_function(db, conn, "np_decompress", 1, SQLITE_DETERMINISTIC, 0,
+                         numpy_decompress, 0, 0);
+    return rc;
+}
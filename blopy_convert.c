@@ -0,0 +1,89 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+#include "blopy.h"
+SQLITE_EXTENSION_INIT3
+
+#include <stdlib.h>
+#include <string.h>
+#include "numpy_convert.h"
+#include "numpy_layout.h"
+
+/// np_astype(col, dtype), np_astype(col, dtype, mode): the array converted to `dtype`, like
+/// numpy's a.astype(dtype). `dtype` is a descr or a name: '<f2', 'f4', '>i8', 'u1', '?',
+/// 'float16', 'int8', 'bool', 'bfloat16', ... The shape and memory order are kept, an array
+/// that has the dtype already comes back unchanged. `mode` (see parse_convert_mode) is e.g.
+/// 'saturate' or 'saturate,round'. To store a float64 column with half the bytes:
+///   UPDATE t SET col = np_astype(col, 'f4');
+
+static void numpy_astype(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    if (sqlite3_value_type(argv[0]) != SQLITE_BLOB) {
+        sqlite3_result_value(context, argv[0]);
+        return;
+    }
+
+    const char* text = (const char*) sqlite3_value_text(argv[1]);
+    Dtype_code to;
+    char descr[DESCR_MAXLEN+1];
+    if (text == NULL || parse_dtype(text, &to, descr) < 0) {
+        sqlite3_result_error(context, "np_astype: unknown dtype", -1);
+        return;
+    }
+    Convert_mode mode = {false, ROUND_TRUNC};
+    if (argc == 3) {
+        text = (const char*) sqlite3_value_text(argv[2]);
+        if (text == NULL || parse_convert_mode(text, &mode) < 0) {
+            sqlite3_result_error(context, "np_astype: unknown mode", -1);
+            return;
+        }
+    }
+
+    const Header_data* header_data = blob_header(context, argv, 0);
+    if (header_data == NULL)
+        return;
+    if (!convertible(header_data->dtype)) {
+        sqlite3_result_error(context, "data type not supported", -1);
+        return;
+    }
+    if (strcmp(descr, header_data->descr) == 0) {
+        sqlite3_result_value(context, argv[0]);
+        return;
+    }
+    const unsigned char* data = blob_payload(context, argv[0], &header_data, 0, BLOB_NATIVE);
+    if (data == NULL)
+        return;
+
+    // Converted straight into the result
+    int header_length = write_header(NULL, descr, header_data->fortran_order, header_data->shape,
+                                     header_data->shape_len);
+    sqlite3_int64 n_bytes = header_length + (sqlite3_int64) header_data->size * dtype_size(to);
+    unsigned char* out = malloc(n_bytes);
+    if (out == NULL) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    write_header(out, descr, header_data->fortran_order, header_data->shape,
+                 header_data->shape_len);
+    Parallel parallel = blob_parallel(context, header_data->size * header_data->wordsize_in_bytes);
+    convert_parallel(&parallel, header_data->dtype, data, to, out + header_length,
+                     header_data->size, &mode);
+
+    if (descr[0] == '>') {
+        Header_data swapped = {.type = descr[1], .wordsize_in_bytes = dtype_size(to)};
+        byteswap(&swapped, out + header_length, out + header_length, header_data->size);
+    }
+    sqlite3_result_blob64(context, out, n_bytes, free);
+}
+
+int np_convert_init(sqlite3 *db, Blopy_conn* conn)
+{
+    int rc;
+    rc = create_function(db, conn, "np_astype", 2, SQLITE_DETERMINISTIC, 0,
+                         numpy_astype, 0, 0);
+    rc = create_function(db, conn, "np_astype", 3, SQLITE_DETERMINISTIC, 0,
+                         numpy_astype, 0, 0);
+    return rc;
+}
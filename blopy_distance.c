@@ -0,0 +1,157 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+#include "blopy.h"
+SQLITE_EXTENSION_INIT3
+
+#include <stdlib.h>
+#include "numpy_distance.h"
+#include "numpy_layout.h"
+
+/// Vector similarity for embeddings stored as numpy BLOBs (float32 or float64):
+///   np_dot(a, b)    -> inner product
+///   np_l2(a, b)     -> euclidean distance
+///   np_cosine(a, b) -> cosine distance (1 - cosine similarity)
+///   np_topk(id, distance, k) -> aggregate, the ids of the k smallest distances as a numpy BLOB
+///                               ('<i8', nearest first)
+/// A nearest neighbour search is then
+///   SELECT np_topk(rowid, np_cosine(emb, :q), 10) FROM t
+/// which keeps a heap of k entries instead of sorting all rows.
+
+static void numpy_distance(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL || sqlite3_value_type(argv[1]) == SQLITE_NULL) {
+        sqlite3_result_null(context);
+        return;
+    }
+    if (sqlite3_value_type(argv[0]) != SQLITE_BLOB || sqlite3_value_type(argv[1]) != SQLITE_BLOB) {
+        sqlite3_result_error(context, "arguments must be numpy BLOBs", -1);
+        return;
+    }
+
+    Distance_op op = ((Blopy_func*) sqlite3_user_data(context))->op;
+
+    const Header_data* header_a = blob_header(context, argv, 0);
+    if (header_a == NULL)
+        return;
+    const Header_data* header_b = blob_header(context, argv, 1);
+    if (header_b == NULL)
+        return;
+
+    // The arrays are read as flat vectors. If one is in C order and the other in Fortran order,
+    // both are brought to C order
+    int flags = BLOB_NATIVE;
+    if (is_c_contiguous(header_a) != is_c_contiguous(header_b))
+        flags |= BLOB_C_ORDER;
+    const unsigned char* a = blob_payload(context, argv[0], &header_a, 0, flags);
+    if (a == NULL)
+        return;
+    const unsigned char* b = blob_payload(context, argv[1], &header_b, 1, flags);
+    if (b == NULL)
+        return;
+
+    double value;
+    int rc = distance(op, header_a, a, header_b, b, &value);
+    if (rc < 0) {
+        sqlite3_result_error(context, distance_error(rc), -1);
+        return;
+    }
+    sqlite3_result_double(context, value);
+}
+
+struct Topk_state {
+    Topk_entry* heap;
+    int n, cap;
+    int k;
+    bool failed;
+};
+typedef struct Topk_state Topk_state;
+
+static void topk_step(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    Topk_state* state = sqlite3_aggregate_context(context, sizeof(*state));
+    if (state == NULL) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    if (state->failed || sqlite3_value_type(argv[1]) == SQLITE_NULL)
+        return;
+
+    if (state->k == 0) {
+        sqlite3_int64 k = sqlite3_value_int64(argv[2]);
+        if (k <= 0 || k > (1 << 24)) {
+            state->failed = true;
+            sqlite3_result_error(context, "np_topk: k must be between 1 and 16777216", -1);
+            return;
+        }
+        state->k = (int) k;
+    }
+    if (sqlite3_value_type(argv[0]) != SQLITE_INTEGER) {
+        state->failed = true;
+        sqlite3_result_error(context, "np_topk: id must be an integer", -1);
+        return;
+    }
+
+    // The heap grows with the number of rows, only up to k entries
+    if (state->n == state->cap && state->n < state->k) {
+        int cap = state->cap > 0 ? 2*state->cap : 16;
+        if (cap > state->k)
+            cap = state->k;
+        Topk_entry* heap = realloc(state->heap, cap * sizeof(*heap));
+        if (heap == NULL) {
+            state->failed = true;
+            sqlite3_result_error_nomem(context);
+            return;
+        }
+        state->heap = heap;
+        state->cap = cap;
+    }
+
+    topk_push(state->heap, &state->n, state->k, sqlite3_value_double(argv[1]),
+              sqlite3_value_int64(argv[0]));
+}
+
+static void topk_final(sqlite3_context *context)
+{
+    Topk_state* state = sqlite3_aggregate_context(context, 0);
+    if (state == NULL || state->failed || state->n == 0) {
+        if (state != NULL)
+            free(state->heap);
+        sqlite3_result_null(context);
+        return;
+    }
+
+    topk_sort(state->heap, state->n);
+
+    int64_t shape = state->n;
+    int header_length = write_header(NULL, "<i8", false, &shape, 1);
+    unsigned char* out = malloc(header_length + (size_t) state->n * 8);
+    if (out == NULL) {
+        free(state->heap);
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    write_header(out, "<i8", false, &shape, 1);
+    long long* ids = (long long*) (out + header_length);
+    for (int i = 0; i < state->n; i++)
+        ids[i] = state->heap[i].id;
+    free(state->heap);
+
+    sqlite3_result_blob64(context, out, header_length + (size_t) state->n * 8, free);
+}
+
+int np_distance_init(sqlite3 *db, Blopy_conn* conn)
+{
+    int rc;
+    rc = create_function(db, conn, "np_dot", 2, SQLITE_DETERMINISTIC, DISTANCE_DOT,
+                         numpy_distance, 0, 0);
+    rc = create_function(db, conn, "np_l2", 2, SQLITE_DETERMINISTIC, DISTANCE_L2,
+                         numpy_distance, 0, 0);
+    rc = create_function(db, conn, "np_cosine", 2, SQLITE_DETERMINISTIC, DISTANCE_COSINE,
+                         numpy_distance, 0, 0);
+    rc = create_function(db, conn, "np_topk", 3, SQLITE_DETERMINISTIC, 0,
+                         0, topk_step, topk_final);
+    return rc;
+}
@@ -0,0 +1,486 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+#include "blopy.h"
+SQLITE_EXTENSION_INIT3
+
+#include <limits.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "numpy_compress.h"
+#include "numpy_convert.h"
+#include "numpy_layout.h"
+
+/// np_each: a table-valued function with one row per element of a numpy BLOB
+///   SELECT idx, i, j, value FROM np_each(t.col)
+/// Columns:
+///   idx   : flat index in C order (row-major), also the rowid
+///   i, j  : the array seen as 2-d, i.e. i = idx / shape[-1] and j = idx % shape[-1].
+///           For 1-d arrays i = idx and j is NULL
+///   value : the element (INTEGER or REAL), the real part for complex arrays
+///   imag  : the imaginary part for complex arrays, NULL otherwise
+/// Constraints on idx as well as LIMIT and OFFSET are handled by the cursor itself, so
+///   SELECT value FROM np_each(col) WHERE idx BETWEEN 1000 AND 1010
+/// only touches those eleven elements. Of a compressed BLOB (in C order) only the chunks that
+/// hold them are decoded, and of a big-endian one only those elements are byte swapped.
+
+#define NP_EACH_IDX   0
+#define NP_EACH_I     1
+#define NP_EACH_J     2
+#define NP_EACH_VALUE 3
+#define NP_EACH_IMAG  4
+#define NP_EACH_ARR   5
+
+// Which constraints xBestIndex handed to xFilter (idxNum). The arguments follow in this order
+#define PLAN_ARR    0x01
+#define PLAN_EQ     0x02
+#define PLAN_GE     0x04
+#define PLAN_GT     0x08
+#define PLAN_LE     0x10
+#define PLAN_LT     0x20
+#define PLAN_LIMIT  0x40
+#define PLAN_OFFSET 0x80
+
+typedef struct Each_vtab {
+    sqlite3_vtab base;
+    Blopy_conn* conn;
+    Blopy_stats* stats;  // of np_each, see stats_filter
+} Each_vtab;
+
+typedef struct Each_cursor {
+    sqlite3_vtab_cursor base;
+    sqlite3_value* arr;             // our own reference to the array argument
+    const Header_data* header_data; // reference from the header cache
+    const unsigned char* data;      // first element
+    // Compressed BLOBs: C order ones are read through `reader`, chunk by chunk as the cursor
+    // moves. Fortran order ones are decoded to `decoded` at once
+    Chunk_reader reader;
+    bool chunked;
+    unsigned char* decoded;
+
+    sqlite3_int64 idx;              // current flat index
+    sqlite3_int64 end;              // one past the last index to visit
+    int64_t index[NPY_MAXDIMS];     // current multi-index, follows idx
+    long pos;                       // byte offset of the current element, follows index
+} Each_cursor;
+
+static int each_connect(sqlite3 *db, void *pAux, int argc, const char *const*argv,
+                        sqlite3_vtab **ppVtab, char **pzErr)
+{
+    int rc = sqlite3_declare_vtab(db,
+        "CREATE TABLE x(idx INTEGER, i INTEGER, j INTEGER, value, imag REAL, arr HIDDEN)");
+    if (rc != SQLITE_OK)
+        return rc;
+
+    Each_vtab* vtab = sqlite3_malloc(sizeof(*vtab));
+    if (vtab == NULL)
+        return SQLITE_NOMEM;
+    memset(vtab, 0, sizeof(*vtab));
+    vtab->conn = pAux;
+    vtab->stats = stats_entry(vtab->conn, "np_each");
+    sqlite3_vtab_config(db, SQLITE_VTAB_INNOCUOUS);
+
+    *ppVtab = &vtab->base;
+    return SQLITE_OK;
+}
+
+static int each_disconnect(sqlite3_vtab *pVtab)
+{
+    sqlite3_free(pVtab);
+    return SQLITE_OK;
+}
+
+static int each_open(sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCursor)
+{
+    Each_cursor* cur = sqlite3_malloc(sizeof(*cur));
+    if (cur == NULL)
+        return SQLITE_NOMEM;
+    memset(cur, 0, sizeof(*cur));
+    *ppCursor = &cur->base;
+    return SQLITE_OK;
+}
+
+static void each_reset(Each_cursor* cur)
+{
+    if (cur->header_data != NULL)
+        header_release((void*) cur->header_data);
+    sqlite3_value_free(cur->arr);
+    if (cur->chunked)
+        chunk_reader_close(&cur->reader);
+    free(cur->decoded);
+    cur->header_data = NULL;
+    cur->arr = NULL;
+    cur->data = NULL;
+    cur->chunked = false;
+    cur->decoded = NULL;
+    cur->idx = 0;
+    cur->end = 0;
+}
+
+static int each_close(sqlite3_vtab_cursor *pCursor)
+{
+    Each_cursor* cur = (Each_cursor*) pCursor;
+    each_reset(cur);
+    sqlite3_free(cur);
+    return SQLITE_OK;
+}
+
+/// Moves the multi-index and the byte position to flat index cur->idx (C order)
+static void each_seek(Each_cursor* cur)
+{
+    const Header_data* header_data = cur->header_data;
+    sqlite3_int64 rest = cur->idx;
+    cur->pos = 0;
+    for (int k = header_data->shape_len-1; k >= 0; k--) {
+        cur->index[k] = rest % header_data->shape[k];
+        rest /= header_data->shape[k];
+        cur->pos += cur->index[k] * header_data->strides[k];
+    }
+}
+
+static int each_next(sqlite3_vtab_cursor *pCursor)
+{
+    Each_cursor* cur = (Each_cursor*) pCursor;
+    const Header_data* header_data = cur->header_data;
+
+    // Count up like an odometer, the last axis being the fastest one
+    cur->idx++;
+    for (int k = header_data->shape_len-1; k >= 0; k--) {
+        cur->pos += header_data->strides[k];
+        if (++cur->index[k] < header_data->shape[k])
+            break;
+        cur->pos -= (long) cur->index[k] * header_data->strides[k];
+        cur->index[k] = 0;
+    }
+    return SQLITE_OK;
+}
+
+static int each_eof(sqlite3_vtab_cursor *pCursor)
+{
+    Each_cursor* cur = (Each_cursor*) pCursor;
+    return cur->idx >= cur->end;
+}
+
+/// Sets the element at `ptr` (or its real/imaginary part) as the result
+static void result_element(sqlite3_context *ctx, Dtype_code dtype, const unsigned char* ptr,
+                           bool imag)
+{
+    if (imag) {
+        if (dtype == DTYPE_C8)
+            sqlite3_result_double(ctx, ((const float*) ptr)[1]);
+        else if (dtype == DTYPE_C16)
+            sqlite3_result_double(ctx, ((const double*) ptr)[1]);
+        else
+            sqlite3_result_null(ctx);
+        return;
+    }
+
+    switch (dtype) {
+    case DTYPE_B1: sqlite3_result_int(ctx, *ptr != 0); break;
+    case DTYPE_I1: sqlite3_result_int(ctx, *(const signed char*) ptr); break;
+    case DTYPE_I2: sqlite3_result_int(ctx, *(const short*) ptr); break;
+    case DTYPE_I4: sqlite3_result_int(ctx, *(const int*) ptr); break;
+    case DTYPE_I8: sqlite3_result_int64(ctx, *(const long long*) ptr); break;
+    case DTYPE_U1: sqlite3_result_int(ctx, *ptr); break;
+    case DTYPE_U2: sqlite3_result_int(ctx, *(const unsigned short*) ptr); break;
+    case DTYPE_U4: sqlite3_result_int64(ctx, *(const unsigned int*) ptr); break;
+    case DTYPE_U8: {
+        unsigned long long v = *(const unsigned long long*) ptr;
+        // sqlite has no unsigned 64-bit integers
+        if (v > (unsigned long long) LLONG_MAX)
+            sqlite3_result_double(ctx, (double) v);
+        else
+            sqlite3_result_int64(ctx, (sqlite3_int64) v);
+        break;
+    }
+    case DTYPE_F2: sqlite3_result_double(ctx, half_to_double(*(const uint16_t*) ptr)); break;
+    case DTYPE_BF16:
+        sqlite3_result_double(ctx, bfloat16_to_double(*(const uint16_t*) ptr));
+        break;
+    case DTYPE_F4: sqlite3_result_double(ctx, *(const float*) ptr); break;
+    case DTYPE_F8: sqlite3_result_double(ctx, *(const double*) ptr); break;
+    case DTYPE_F16: sqlite3_result_double(ctx, (double) *(const long double*) ptr); break;
+    case DTYPE_C8: sqlite3_result_double(ctx, ((const float*) ptr)[0]); break;
+    case DTYPE_C16: sqlite3_result_double(ctx, ((const double*) ptr)[0]); break;
+    default: sqlite3_result_null(ctx); break;
+    }
+}
+
+static int each_column(sqlite3_vtab_cursor *pCursor, sqlite3_context *ctx, int i)
+{
+    Each_cursor* cur = (Each_cursor*) pCursor;
+    const Header_data* header_data = cur->header_data;
+    int last = header_data->shape_len-1;
+
+    switch (i) {
+    case NP_EACH_IDX:
+        sqlite3_result_int64(ctx, cur->idx);
+        break;
+    case NP_EACH_I:
+        if (last <= 0)
+            sqlite3_result_int64(ctx, cur->idx);
+        else
+            sqlite3_result_int64(ctx, cur->idx / header_data->shape[last]);
+        break;
+    case NP_EACH_J:
+        if (last <= 0)
+            sqlite3_result_null(ctx);
+        else
+            sqlite3_result_int64(ctx, cur->index[last]);
+        break;
+    case NP_EACH_VALUE:
+    case NP_EACH_IMAG:
+    {
+        // Room (and alignment) for the largest supported dtype, see supported_dtype
+        union { long double f16; double c16[2]; unsigned char bytes[16]; } element;
+        const unsigned char* ptr;
+        if (cur->chunked) {
+            int rc = chunk_reader_read(&cur->reader, element.bytes,
+                                       header_data->wordsize_in_bytes, cur->pos);
+            if (rc < 0) {
+                sqlite3_result_error(ctx, compress_error(rc), -1);
+                return SQLITE_ERROR;
+            }
+            ptr = element.bytes;
+        } else {
+            ptr = cur->data + cur->pos;
+        }
+        if (!is_native(header_data)) {
+            // Only the elements that are actually read get swapped
+            byteswap(header_data, ptr, element.bytes, 1);
+            ptr = element.bytes;
+        }
+        result_element(ctx, header_data->dtype, ptr, i == NP_EACH_IMAG);
+        break;
+    }
+    case NP_EACH_ARR:
+        sqlite3_result_value(ctx, cur->arr);
+        break;
+    }
+    return SQLITE_OK;
+}
+
+static int each_rowid(sqlite3_vtab_cursor *pCursor, sqlite_int64 *pRowid)
+{
+    *pRowid = ((Each_cursor*) pCursor)->idx;
+    return SQLITE_OK;
+}
+
+static int each_error(Each_cursor* cur, const char* msg)
+{
+    sqlite3_vtab* vtab = cur->base.pVtab;
+    sqlite3_free(vtab->zErrMsg);
+    vtab->zErrMsg = sqlite3_mprintf("np_each: %s", msg);
+    return SQLITE_ERROR;
+}
+
+static bool supported_dtype(Dtype_code dtype)
+{
+    return dtype != DTYPE_UNSUPPORTED && dtype != DTYPE_C32;
+}
+
+static int each_scan(sqlite3_vtab_cursor *pCursor, int idxNum, const char *idxStr,
+                     int argc, sqlite3_value **argv)
+{
+    Each_cursor* cur = (Each_cursor*) pCursor;
+    Each_vtab* vtab = (Each_vtab*) pCursor->pVtab;
+    each_reset(cur);
+
+    if (!(idxNum & PLAN_ARR) || sqlite3_value_type(argv[0]) != SQLITE_BLOB)
+        return SQLITE_OK; // no rows, like json_each(NULL)
+
+    // SQLite does not promise that argv stays valid after xFilter. A reference counted copy
+    // is the only safe way to keep the payload while the rows are produced
+    cur->arr = sqlite3_value_dup(argv[0]);
+    if (cur->arr == NULL)
+        return SQLITE_NOMEM;
+    const unsigned char* blob = sqlite3_value_blob(cur->arr);
+    int n_bytes = sqlite3_value_bytes(cur->arr);
+
+    int rc;
+    cur->header_data = header_cache_get(vtab->conn->cache, blob, n_bytes, &rc);
+    if (cur->header_data == NULL)
+        return each_error(cur, header_error(rc));
+    const Header_data* header_data = cur->header_data;
+
+    if (!supported_dtype(header_data->dtype))
+        return each_error(cur, "data type not supported");
+    if (header_data->compressed && header_data->fortran_order && header_data->shape_len > 1) {
+        // The rows come in C order, which would jump between the chunks all the time
+        cur->decoded = malloc((size_t) header_data->size * header_data->wordsize_in_bytes + 1);
+        if (cur->decoded == NULL)
+            return SQLITE_NOMEM;
+        rc = decompress_array(header_data, blob, n_bytes, cur->decoded);
+        if (rc < 0)
+            return each_error(cur, compress_error(rc));
+        cur->data = cur->decoded;
+    } else if (header_data->compressed) {
+        cur->chunked = true;
+        rc = chunk_reader_open(&cur->reader, header_data, blob, n_bytes, NULL, NULL);
+        if (rc < 0)
+            return each_error(cur, compress_error(rc));
+    } else if ((sqlite3_int64) header_data->size * header_data->wordsize_in_bytes
+               > n_bytes - header_data->offset) {
+        return each_error(cur, "numpy BLOB is shorter than its shape");
+    } else {
+        cur->data = blob + header_data->offset;
+    }
+
+    // Narrow [first, end) down with the constraints on idx, LIMIT and OFFSET
+    sqlite3_int64 first = 0;
+    sqlite3_int64 end = header_data->size;
+    int arg = 1;
+    if (idxNum & (PLAN_EQ | PLAN_GE | PLAN_GT)) {
+        if (sqlite3_value_type(argv[arg]) == SQLITE_NULL)
+            return SQLITE_OK;
+        double bound = sqlite3_value_double(argv[arg]);
+        double lower = (idxNum & PLAN_GT) ? floor(bound) + 1 : ceil(bound);
+        if (lower > first)
+            first = lower > end ? end : (sqlite3_int64) lower;
+        if (idxNum & PLAN_EQ) {
+            if (bound != floor(bound))
+                return SQLITE_OK;
+            double upper = bound + 1;
+            if (upper < end)
+                end = upper < first ? first : (sqlite3_int64) upper;
+        }
+        arg++;
+    }
+    if (idxNum & (PLAN_LE | PLAN_LT)) {
+        if (sqlite3_value_type(argv[arg]) == SQLITE_NULL)
+            return SQLITE_OK;
+        double bound = sqlite3_value_double(argv[arg]);
+        double upper = (idxNum & PLAN_LT) ? ceil(bound) : floor(bound) + 1;
+        if (upper < end)
+            end = upper < first ? first : (sqlite3_int64) upper;
+        arg++;
+    }
+    sqlite3_int64 limit = -1;
+    if (idxNum & PLAN_LIMIT)
+        limit = sqlite3_value_int64(argv[arg++]);
+    if (idxNum & PLAN_OFFSET) {
+        sqlite3_int64 offset = sqlite3_value_int64(argv[arg++]);
+        if (offset > 0)
+            first = offset > end - first ? end : first + offset;
+    }
+    if (limit >= 0 && limit < end - first)
+        end = first + limit;
+
+    cur->idx = first;
+    cur->end = end < first ? first : end;
+    if (cur->idx < cur->end)
+        each_seek(cur);
+    return SQLITE_OK;
+}
+
+static int each_best_index(sqlite3_vtab *pVtab, sqlite3_index_info *pInfo)
+{
+    // Index of the aConstraint entry used for each part of the plan, -1 if not used
+    int arr = -1, eq = -1, lower = -1, upper = -1, limit = -1, offset = -1;
+    int plan = 0;
+
+    for (int k = 0; k < pInfo->nConstraint; k++) {
+        const struct sqlite3_index_constraint* c = &pInfo->aConstraint[k];
+        if (!c->usable)
+            continue;
+        // LIMIT and OFFSET come with an arbitrary iColumn, so check them first
+        if (c->op == SQLITE_INDEX_CONSTRAINT_LIMIT) {
+            limit = k;
+        } else if (c->op == SQLITE_INDEX_CONSTRAINT_OFFSET) {
+            offset = k;
+        } else if (c->iColumn == NP_EACH_ARR && c->op == SQLITE_INDEX_CONSTRAINT_EQ) {
+            arr = k;
+        } else if (c->iColumn == NP_EACH_IDX) {
+            if (c->op == SQLITE_INDEX_CONSTRAINT_EQ && eq < 0) {
+                eq = k;
+            } else if ((c->op == SQLITE_INDEX_CONSTRAINT_GE || c->op == SQLITE_INDEX_CONSTRAINT_GT)
+                       && lower < 0) {
+                lower = k;
+                plan |= c->op == SQLITE_INDEX_CONSTRAINT_GE ? PLAN_GE : PLAN_GT;
+            } else if ((c->op == SQLITE_INDEX_CONSTRAINT_LE || c->op == SQLITE_INDEX_CONSTRAINT_LT)
+                       && upper < 0) {
+                upper = k;
+                plan |= c->op == SQLITE_INDEX_CONSTRAINT_LE ? PLAN_LE : PLAN_LT;
+            }
+        }
+    }
+
+    // Without an array there is nothing to iterate. Tell the planner to find another order
+    if (arr < 0)
+        return SQLITE_CONSTRAINT;
+
+    // An equality on idx makes other bounds on idx redundant (sqlite still checks them)
+    if (eq >= 0) {
+        lower = -1;
+        plan &= ~(PLAN_GE | PLAN_GT);
+        plan |= PLAN_EQ;
+    }
+
+    // The elements come out in idx order. LIMIT and OFFSET only cut the right rows if sqlite
+    // does not sort them afterwards
+    bool in_order = pInfo->nOrderBy == 1 && pInfo->aOrderBy[0].iColumn == NP_EACH_IDX
+                    && !pInfo->aOrderBy[0].desc;
+    if (pInfo->nOrderBy > 0 && !in_order) {
+        limit = -1;
+        offset = -1;
+    }
+
+    int used[] = {arr, eq >= 0 ? eq : lower, upper, limit, offset};
+    int flags[] = {PLAN_ARR, 0, 0, PLAN_LIMIT, PLAN_OFFSET};
+    int n_arg = 0;
+    for (int k = 0; k < 5; k++) {
+        if (used[k] < 0)
+            continue;
+        pInfo->aConstraintUsage[used[k]].argvIndex = ++n_arg;
+        pInfo->aConstraintUsage[used[k]].omit = 1;
+        plan |= flags[k];
+    }
+
+    double rows = 1000000;
+    if (plan & PLAN_EQ)
+        rows = 1;
+    else if (plan & (PLAN_GE | PLAN_GT | PLAN_LE | PLAN_LT | PLAN_LIMIT))
+        rows = 1000;
+
+    if (in_order)
+        pInfo->orderByConsumed = 1;
+
+    pInfo->idxNum = plan;
+    pInfo->estimatedCost = rows;
+    pInfo->estimatedRows = (sqlite3_int64) rows;
+    if (plan & PLAN_EQ)
+        pInfo->idxFlags = SQLITE_INDEX_SCAN_UNIQUE;
+    return SQLITE_OK;
+}
+
+static int each_filter(sqlite3_vtab_cursor *pCursor, int idxNum, const char *idxStr,
+                       int argc, sqlite3_value **argv)
+{
+    Each_vtab* vtab = (Each_vtab*) pCursor->pVtab;
+    return stats_filter(vtab->conn, vtab->stats, each_scan, pCursor, idxNum, idxStr, argc, argv);
+}
+
+static sqlite3_module each_module = {
+    0,                 /* iVersion */
+    0,                 /* xCreate: eponymous only */
+    each_connect,      /* xConnect */
+    each_best_index,   /* xBestIndex */
+    each_disconnect,   /* xDisconnect */
+    0,                 /* xDestroy */
+    each_open,         /* xOpen */
+    each_close,        /* xClose */
+    each_filter,       /* xFilter */
+    each_next,         /* xNext */
+    each_eof,          /* xEof */
+    each_column,       /* xColumn */
+    each_rowid,        /* xRowid */
+    /* all others (xUpdate, transactions, ...) are 0 */
+};
+
+int np_each_init(sqlite3 *db, Blopy_conn* conn)
+{
+    return register_module(db, conn, "np_each", &each_module);
+}
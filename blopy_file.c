@@ -0,0 +1,492 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+#include "blopy.h"
+SQLITE_EXTENSION_INIT3
+
+#include <stdlib.h>
+#include <string.h>
+#include "numpy_file.h"
+#include "numpy_format.h"
+#include "numpy_layout.h"
+
+/// Arrays in .npy and .npz files next to the database. Relative paths are relative to the
+/// working directory of the process. All functions here only work in statements (not in
+/// triggers, views or the schema), so a database file cannot make them read or write files on
+/// its own.
+///
+/// np_file(path): the .npy file as a numpy BLOB that all other functions accept. The file is
+/// memory mapped and the mapping is handed to sqlite as the BLOB, without a copy, so
+///   SELECT np_mean(np_file('run3.npy'))
+/// only reads the file once, through the page cache. A BLOB is at most SQLITE_LIMIT_LENGTH
+/// bytes (1 GB by default); larger files can be sliced with np_file(path, spec) (see
+/// blopy_slice.c), which only touches the selected elements.
+///
+/// np_npz: a table-valued function with one row per member of an .npz archive
+///   SELECT name, shape, dtype FROM np_npz('archive.npz')
+/// Columns:
+///   name  : as in numpy.load(path).files, i.e. without ".npy"
+///   shape : like numpy prints it, e.g. '(3, 4)'
+///   dtype : the descr, e.g. '<f8'
+///   data  : the member as a numpy BLOB, mapped only when the column is read
+/// shape, dtype and data are NULL for compressed members (numpy.savez_compressed).
+///
+/// np_export(path, col): an aggregate that writes the arrays of all rows to the .npy file
+/// `path`, stacked like np_stack into shape (number of rows, *shape of a row), and returns the
+/// number of rows. All arrays must have the same dtype and shape; NULLs are skipped. Each row
+/// goes to the file as soon as it arrives (big-endian and Fortran order rows converted on the
+/// way), through a buffer of NPY_WRITER_BUFFER bytes, and the header gets the number of rows at
+/// the end. So at most one row is held in memory, whatever the size of the result:
+///   SELECT np_export('train.npy', emb) FROM t WHERE split = 'train'
+/// np_export(path, col, offsets_path): for arrays of different lengths. The elements of all rows
+/// (flattened) go to `path` as one 1-d array and the start of each row to `offsets_path`, an
+/// int64 array of the number of rows + 1 offsets, like the offsets and values of an Arrow list
+/// column: row i is values[offsets[i]:offsets[i+1]]. All arrays must have the same dtype.
+/// Without rows no file is written. After an error the files are removed again.
+
+#define NP_NPZ_NAME  0
+#define NP_NPZ_SHAPE 1
+#define NP_NPZ_DTYPE 2
+#define NP_NPZ_DATA  3
+#define NP_NPZ_FILE  4
+
+/// Sets the mapping `map` of `n_bytes` as the result, after checking that it holds a numpy
+/// array small enough for a BLOB. The result takes over the mapping, also on error
+static void result_mapping(sqlite3_context *context, Blopy_conn* conn, const unsigned char* map,
+                           int64_t n_bytes)
+{
+    sqlite3* db = sqlite3_context_db_handle(context);
+    if (n_bytes > sqlite3_limit(db, SQLITE_LIMIT_LENGTH, -1)) {
+        file_unmap((void*) map);
+        sqlite3_result_error(context, "array is larger than the BLOB limit, use np_file(path, "
+                             "spec) to read a slice", -1);
+        return;
+    }
+
+    int rc;
+    const Header_data* header_data = header_cache_get(conn->cache, map, n_bytes, &rc);
+    if (header_data == NULL) {
+        file_unmap((void*) map);
+        sqlite3_result_error(context, header_error(rc), -1);
+        return;
+    }
+    bool short_data = !header_data->compressed
+        && header_data->size * (int64_t) header_data->wordsize_in_bytes
+           > n_bytes - header_data->offset;
+    header_release((void*) header_data);
+    if (short_data) {
+        file_unmap((void*) map);
+        sqlite3_result_error(context, "numpy BLOB is shorter than its shape", -1);
+        return;
+    }
+    sqlite3_result_blob64(context, map, n_bytes, file_unmap);
+}
+
+/// np_file(path)
+static void numpy_file(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    const char* path = (const char*) sqlite3_value_text(argv[0]);
+    if (path == NULL) {
+        sqlite3_result_null(context);
+        return;
+    }
+    const unsigned char* map;
+    int64_t n_bytes;
+    int rc = file_map(path, 0, -1, &map, &n_bytes);
+    if (rc < 0) {
+        char* error = sqlite3_mprintf("np_file: %s: %s", file_error(rc), path);
+        sqlite3_result_error(context, error, -1);
+        sqlite3_free(error);
+        return;
+    }
+    result_mapping(context, ((Blopy_func*) sqlite3_user_data(context))->conn, map, n_bytes);
+}
+
+typedef struct Npz_vtab {
+    sqlite3_vtab base;
+    Blopy_conn* conn;
+    Blopy_stats* stats;  // of np_npz, see stats_filter
+} Npz_vtab;
+
+typedef struct Npz_cursor {
+    sqlite3_vtab_cursor base;
+    char* path;
+    Npz npz;
+    int64_t i;  // current member
+} Npz_cursor;
+
+static int npz_connect(sqlite3 *db, void *pAux, int argc, const char *const*argv,
+                       sqlite3_vtab **ppVtab, char **pzErr)
+{
+    int rc = sqlite3_declare_vtab(db,
+        "CREATE TABLE x(name TEXT, shape TEXT, dtype TEXT, data BLOB, file HIDDEN)");
+    if (rc != SQLITE_OK)
+        return rc;
+
+    Npz_vtab* vtab = sqlite3_malloc(sizeof(*vtab));
+    if (vtab == NULL)
+        return SQLITE_NOMEM;
+    memset(vtab, 0, sizeof(*vtab));
+    vtab->conn = pAux;
+    vtab->stats = stats_entry(vtab->conn, "np_npz");
+    sqlite3_vtab_config(db, SQLITE_VTAB_DIRECTONLY);
+
+    *ppVtab = &vtab->base;
+    return SQLITE_OK;
+}
+
+static int npz_disconnect(sqlite3_vtab *pVtab)
+{
+    sqlite3_free(pVtab);
+    return SQLITE_OK;
+}
+
+static int npz_open_cursor(sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCursor)
+{
+    Npz_cursor* cur = sqlite3_malloc(sizeof(*cur));
+    if (cur == NULL)
+        return SQLITE_NOMEM;
+    memset(cur, 0, sizeof(*cur));
+    *ppCursor = &cur->base;
+    return SQLITE_OK;
+}
+
+static void npz_reset(Npz_cursor* cur)
+{
+    npz_close(&cur->npz);
+    sqlite3_free(cur->path);
+    cur->path = NULL;
+    cur->i = 0;
+}
+
+static int npz_close_cursor(sqlite3_vtab_cursor *pCursor)
+{
+    Npz_cursor* cur = (Npz_cursor*) pCursor;
+    npz_reset(cur);
+    sqlite3_free(cur);
+    return SQLITE_OK;
+}
+
+static int npz_next(sqlite3_vtab_cursor *pCursor)
+{
+    ((Npz_cursor*) pCursor)->i++;
+    return SQLITE_OK;
+}
+
+static int npz_eof(sqlite3_vtab_cursor *pCursor)
+{
+    Npz_cursor* cur = (Npz_cursor*) pCursor;
+    return cur->i >= cur->npz.n_members;
+}
+
+/// Writes the shape like numpy prints it: '()', '(3,)' or '(3, 4)'
+static void result_shape(sqlite3_context *ctx, const Header_data* header_data)
+{
+    char text[TUPLE_MAXLEN];
+    int len = format_tuple(text, header_data->shape, header_data->shape_len);
+    sqlite3_result_text(ctx, text, len, SQLITE_TRANSIENT);
+}
+
+static int npz_column(sqlite3_vtab_cursor *pCursor, sqlite3_context *ctx, int i)
+{
+    Npz_cursor* cur = (Npz_cursor*) pCursor;
+    Npz_vtab* vtab = (Npz_vtab*) pCursor->pVtab;
+    const Npz_member* member = &cur->npz.members[cur->i];
+
+    switch (i) {
+    case NP_NPZ_NAME:
+        sqlite3_result_text(ctx, member->name, -1, SQLITE_TRANSIENT);
+        break;
+    case NP_NPZ_SHAPE:
+    case NP_NPZ_DTYPE:
+    {
+        if (!member->stored)
+            break;
+        // The header is read from the mapping of the whole archive
+        int rc;
+        const Header_data* header_data = header_cache_get(vtab->conn->cache,
+                                                          cur->npz.map + member->offset,
+                                                          member->size, &rc);
+        if (header_data == NULL)
+            break;
+        if (i == NP_NPZ_SHAPE)
+            result_shape(ctx, header_data);
+        else if (header_data->descr_len > 0)
+            sqlite3_result_text(ctx, header_data->descr, header_data->descr_len,
+                                SQLITE_TRANSIENT);
+        header_release((void*) header_data);
+        break;
+    }
+    case NP_NPZ_DATA:
+    {
+        if (!member->stored)
+            break;
+        // A mapping of its own, which lives as long as sqlite keeps the BLOB
+        const unsigned char* map;
+        int64_t n_bytes;
+        int rc = file_map(cur->path, member->offset, member->size, &map, &n_bytes);
+        if (rc < 0)
+            sqlite3_result_error(ctx, file_error(rc), -1);
+        else
+            result_mapping(ctx, vtab->conn, map, n_bytes);
+        break;
+    }
+    case NP_NPZ_FILE:
+        sqlite3_result_text(ctx, cur->path, -1, SQLITE_TRANSIENT);
+        break;
+    }
+    return SQLITE_OK;
+}
+
+static int npz_rowid(sqlite3_vtab_cursor *pCursor, sqlite_int64 *pRowid)
+{
+    *pRowid = ((Npz_cursor*) pCursor)->i;
+    return SQLITE_OK;
+}
+
+static int npz_scan(sqlite3_vtab_cursor *pCursor, int idxNum, const char *idxStr,
+                    int argc, sqlite3_value **argv)
+{
+    Npz_cursor* cur = (Npz_cursor*) pCursor;
+    npz_reset(cur);
+    if (argc < 1 || sqlite3_value_type(argv[0]) == SQLITE_NULL)
+        return SQLITE_OK;
+
+    cur->path = sqlite3_mprintf("%s", sqlite3_value_text(argv[0]));
+    if (cur->path == NULL)
+        return SQLITE_NOMEM;
+    int rc = npz_open(cur->path, &cur->npz);
+    if (rc < 0) {
+        sqlite3_vtab* vtab = pCursor->pVtab;
+        sqlite3_free(vtab->zErrMsg);
+        vtab->zErrMsg = sqlite3_mprintf("np_npz: %s: %s", file_error(rc), cur->path);
+        return rc == -3 ? SQLITE_NOMEM : SQLITE_ERROR;
+    }
+    return SQLITE_OK;
+}
+
+static int npz_best_index(sqlite3_vtab *pVtab, sqlite3_index_info *pInfo)
+{
+    for (int k = 0; k < pInfo->nConstraint; k++) {
+        const struct sqlite3_index_constraint* c = &pInfo->aConstraint[k];
+        if (c->usable && c->iColumn == NP_NPZ_FILE && c->op == SQLITE_INDEX_CONSTRAINT_EQ) {
+            pInfo->aConstraintUsage[k].argvIndex = 1;
+            pInfo->aConstraintUsage[k].omit = 1;
+            pInfo->estimatedCost = 100;
+            pInfo->estimatedRows = 100;
+            return SQLITE_OK;
+        }
+    }
+    // Without a file there is nothing to list
+    return SQLITE_CONSTRAINT;
+}
+
+static int npz_filter(sqlite3_vtab_cursor *pCursor, int idxNum, const char *idxStr,
+                      int argc, sqlite3_value **argv)
+{
+    Npz_vtab* vtab = (Npz_vtab*) pCursor->pVtab;
+    return stats_filter(vtab->conn, vtab->stats, npz_scan, pCursor, idxNum, idxStr, argc, argv);
+}
+
+static sqlite3_module npz_module = {
+    0,                 /* iVersion */
+    0,                 /* xCreate: eponymous only */
+    npz_connect,       /* xConnect */
+    npz_best_index,    /* xBestIndex */
+    npz_disconnect,    /* xDisconnect */
+    0,                 /* xDestroy */
+    npz_open_cursor,   /* xOpen */
+    npz_close_cursor,  /* xClose */
+    npz_filter,        /* xFilter */
+    npz_next,          /* xNext */
+    npz_eof,           /* xEof */
+    npz_column,        /* xColumn */
+    npz_rowid,         /* xRowid */
+    /* all others (xUpdate, transactions, ...) are 0 */
+};
+
+struct Export_state {
+    Npy_writer values;
+    Npy_writer offsets;  // only with offsets_path
+    char* path;
+    char* offsets_path;
+    int64_t n_rows;
+    bool failed;
+};
+typedef struct Export_state Export_state;
+
+/// Reports an error of np_export, the files are removed in export_final
+static void export_error(sqlite3_context *context, Export_state* state, const char* error,
+                         const char* path)
+{
+    state->failed = true;
+    char* message = path != NULL ? sqlite3_mprintf("np_export: %s: %s", error, path)
+                                 : sqlite3_mprintf("np_export: %s", error);
+    sqlite3_result_error(context, message != NULL ? message : error, -1);
+    sqlite3_free(message);
+}
+
+/// Creates the file(s) for the first row, whose header is `header_data`
+static void export_open(sqlite3_context *context, Export_state* state, int argc,
+                        sqlite3_value **argv, const Header_data* header_data)
+{
+    bool ragged = argc > 2;
+    if (sqlite3_value_type(argv[0]) != SQLITE_TEXT
+            || (ragged && sqlite3_value_type(argv[2]) != SQLITE_TEXT)) {
+        export_error(context, state, "the paths must be TEXT", NULL);
+        return;
+    }
+    if (reject_structured(header_data)) {
+        export_error(context, state, STRUCTURED_ERROR, NULL);
+        return;
+    }
+    if (!ragged && header_data->shape_len + 1 > NPY_MAXDIMS) {
+        export_error(context, state, "too many dimensions", NULL);
+        return;
+    }
+    state->path = sqlite3_mprintf("%s", sqlite3_value_text(argv[0]));
+    state->offsets_path = ragged ? sqlite3_mprintf("%s", sqlite3_value_text(argv[2])) : NULL;
+    if (state->path == NULL || (ragged && state->offsets_path == NULL)) {
+        state->failed = true;
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+
+    int rc = ragged ? npy_writer_open(&state->values, state->path, header_data->descr, NULL, 0)
+                    : npy_writer_open(&state->values, state->path, header_data->descr,
+                                      header_data->shape, header_data->shape_len);
+    // A file that was not created is not removed after the error
+    if (rc < 0) {
+        export_error(context, state, file_error(rc), state->path);
+        sqlite3_free(state->path);
+        state->path = NULL;
+        return;
+    }
+    if (ragged) {
+        // Offsets are counted in elements, the first row starts at 0
+        int64_t zero = 0;
+        rc = npy_writer_open(&state->offsets, state->offsets_path, "<i8", NULL, 0);
+        if (rc == 0)
+            rc = npy_writer_append(&state->offsets, &zero, sizeof(zero), 1);
+        if (rc < 0) {
+            export_error(context, state, file_error(rc), state->offsets_path);
+            if (state->offsets.file == NULL) {
+                sqlite3_free(state->offsets_path);
+                state->offsets_path = NULL;
+            }
+        }
+    }
+}
+
+/// Checks a row against the first one and appends its elements (at `data`)
+static void export_row(sqlite3_context *context, Export_state* state,
+                       const Header_data* header_data, const unsigned char* data)
+{
+    bool ragged = state->offsets_path != NULL;
+    if (strcmp(state->values.descr, header_data->descr) != 0
+            || (!ragged && (state->values.shape_len != header_data->shape_len + 1
+                            || memcmp(state->values.shape + 1, header_data->shape,
+                                      header_data->shape_len * sizeof(int64_t)) != 0))) {
+        export_error(context, state, ragged ? "all arrays must have the same dtype"
+                                            : "all arrays must have the same dtype and shape",
+                     NULL);
+        return;
+    }
+
+    int64_t n_bytes = header_data->size * (int64_t) header_data->wordsize_in_bytes;
+    int rc = npy_writer_append(&state->values, data, n_bytes, ragged ? header_data->size : 1);
+    if (rc < 0) {
+        export_error(context, state, file_error(rc), state->path);
+        return;
+    }
+    if (ragged) {
+        int64_t end = state->values.shape[0];
+        rc = npy_writer_append(&state->offsets, &end, sizeof(end), 1);
+        if (rc < 0) {
+            export_error(context, state, file_error(rc), state->offsets_path);
+            return;
+        }
+    }
+    state->n_rows++;
+}
+
+static void export_step(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    Export_state* state = sqlite3_aggregate_context(context, sizeof(*state));
+    if (state == NULL) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    if (state->failed || sqlite3_value_type(argv[1]) == SQLITE_NULL)
+        return;
+    if (sqlite3_value_type(argv[1]) != SQLITE_BLOB) {
+        export_error(context, state, "not a numpy BLOB", NULL);
+        return;
+    }
+
+    const Header_data* header_data = blob_header_ref(context, argv, 1);
+    if (header_data == NULL) {
+        state->failed = true;
+        return;
+    }
+    // The file gets native byte order and C order, rows stored otherwise are converted
+    const Header_data* native = header_data;
+    const unsigned char* data = blob_payload(context, argv[1], &native, 0,
+                                             BLOB_NATIVE | BLOB_C_ORDER);
+    if (data == NULL)
+        state->failed = true;
+    else if (state->path == NULL)
+        export_open(context, state, argc, argv, native);
+    if (!state->failed)
+        export_row(context, state, native, data);
+    header_release((void*) header_data);
+}
+
+static void export_final(sqlite3_context *context)
+{
+    Export_state* state = sqlite3_aggregate_context(context, 0);
+    if (state == NULL || state->path == NULL) {
+        // No rows at all (or an error was reported already)
+        if (state == NULL || !state->failed)
+            sqlite3_result_int64(context, 0);
+        if (state != NULL)
+            sqlite3_free(state->offsets_path);
+        return;
+    }
+
+    int rc = npy_writer_close(&state->values);
+    int offsets_rc = npy_writer_close(&state->offsets);
+    if (!state->failed && (rc < 0 || offsets_rc < 0)) {
+        export_error(context, state, file_error(rc < 0 ? rc : offsets_rc),
+                     rc < 0 ? state->path : state->offsets_path);
+    }
+    if (state->failed) {
+        remove(state->path);
+        if (state->offsets_path != NULL)
+            remove(state->offsets_path);
+    } else {
+        sqlite3_result_int64(context, state->n_rows);
+    }
+    sqlite3_free(state->path);
+    sqlite3_free(state->offsets_path);
+}
+
+int np_file_init(sqlite3 *db, Blopy_conn* conn)
+{
+    int rc;
+    // Files can change, so this is not deterministic
+    rc = create_function(db, conn, "np_file", 1, SQLITE_DIRECTONLY, 0, numpy_file, 0, 0);
+    if (rc != SQLITE_OK)
+        return rc;
+    // Writes files: only in statements, like np_file
+    rc = create_function(db, conn, "np_export", 2, SQLITE_DIRECTONLY, 0, 0, export_step,
+                         export_final);
+    if (rc == SQLITE_OK)
+        rc = create_function(db, conn, "np_export", 3, SQLITE_DIRECTONLY, 0, 0, export_step,
+                             export_final);
+    if (rc != SQLITE_OK)
+        return rc;
+    return register_module(db, conn, "np_npz", &npz_module);
+}
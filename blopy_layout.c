@@ -0,0 +1,66 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+#include "blopy.h"
+SQLITE_EXTENSION_INIT3
+
+#include <stdlib.h>
+#include "numpy_layout.h"
+
+/// np_ascontiguous(col): the array in native byte order and C order, like
+/// numpy.ascontiguousarray(a.astype(a.dtype.newbyteorder('='))). Arrays that are stored like
+/// that already come back unchanged (no copy), compressed ones are decoded. All functions read
+/// big-endian and Fortran order arrays, but each read pays for the byte swap or the
+/// transposition. To pay once:
+///   UPDATE t SET col = np_ascontiguous(col);
+
+static void numpy_ascontiguous(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    if (sqlite3_value_type(argv[0]) != SQLITE_BLOB) {
+        sqlite3_result_value(context, argv[0]);
+        return;
+    }
+
+    const Header_data* header_data = blob_header(context, argv, 0);
+    if (header_data == NULL)
+        return;
+    if (!header_data->compressed && is_native(header_data) && !header_data->fortran_order) {
+        // Only checks the length, it returns such data in place
+        if (blob_payload(context, argv[0], &header_data, 0, 0) != NULL)
+            sqlite3_result_value(context, argv[0]);
+        return;
+    }
+    if (reject_structured(header_data)) {
+        sqlite3_result_error(context, "np_ascontiguous: " STRUCTURED_ERROR, -1);
+        return;
+    }
+    // Decoded, if compressed, but in the stored layout: normalized straight into the result
+    const unsigned char* data = blob_payload(context, argv[0], &header_data, 0, 0);
+    if (data == NULL)
+        return;
+
+    Header_data normalized;
+    native_header(header_data, true, &normalized);
+    int header_length = write_header(NULL, normalized.descr, false, normalized.shape,
+                                     normalized.shape_len);
+    sqlite3_int64 n_bytes = header_length
+                            + (sqlite3_int64) header_data->size * header_data->wordsize_in_bytes;
+    unsigned char* out = malloc(n_bytes);
+    if (out == NULL) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    write_header(out, normalized.descr, false, normalized.shape, normalized.shape_len);
+    to_c_order(header_data, data, out + header_length);
+    if (!is_native(header_data))
+        byteswap(header_data, out + header_length, out + header_length, header_data->size);
+    sqlite3_result_blob64(context, out, n_bytes, free);
+}
+
+int np_layout_init(sqlite3 *db, Blopy_conn* conn)
+{
+    return create_function(db, conn, "np_ascontiguous", 1, SQLITE_DETERMINISTIC, 0,
+                           numpy_ascontiguous, 0, 0);
+}
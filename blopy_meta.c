@@ -0,0 +1,529 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+#include "blopy.h"
+SQLITE_EXTENSION_INIT3
+
+#include <string.h>
+#include "numpy_format.h"
+
+/// np_meta: the parsed headers of a numpy column in a table of their own, so that filters on
+/// dtype and shape never read the BLOBs
+///   CREATE VIRTUAL TABLE t_meta USING np_meta(t, col);
+///   SELECT t.* FROM t_meta JOIN t ON t.rowid = t_meta.rowid
+///   WHERE dtype = '<f8' AND size > 1000;
+/// Arguments: the table and the column. The rowid of a row of np_meta is the rowid of the row
+/// of the table. Columns:
+///   dtype    : the descr, e.g. '<f8' (like np_desc)
+///   ndim     : the number of dimensions
+///   shape    : like numpy prints it, e.g. '(3, 4)'
+///   size     : the number of elements (like np_size)
+///   nbytes   : the length of the BLOB, header included
+///   checksum : a 64 bit hash of the whole BLOB, equal arrays have equal checksums
+/// Rows whose column is not a BLOB have no row in np_meta; BLOBs that are not numpy arrays
+/// only have nbytes and checksum.
+///
+/// Everything lives in the shadow tables <name>_config and <name>_data, with indexes on
+/// (dtype, size), shape, size and checksum. Constraints on the columns are handed on to a
+/// query of <name>_data, so sqlite answers them from these indexes. Triggers on the table keep
+/// np_meta up to date, each insert or update of the column parses the header once. After
+/// changes with the triggers dropped (or to start from scratch)
+///   INSERT INTO t_meta(command) VALUES ('rebuild');
+
+#define META_DTYPE    0
+#define META_NDIM     1
+#define META_SHAPE    2
+#define META_SIZE     3
+#define META_NBYTES   4
+#define META_CHECKSUM 5
+#define META_ARRAY    6
+#define META_COMMAND  7
+#define META_COLUMNS  6  // those stored in <name>_data
+
+// Names of the stored columns in <name>_data, in the order of the columns above
+static const char* const META_NAMES[META_COLUMNS] = {
+    "dtype", "ndim", "shape", "size", "nbytes", "checksum"
+};
+
+enum Meta_stmt {
+    STMT_UPSERT,
+    STMT_DELETE,
+    STMT_SET_CONFIG,
+    N_STMT
+};
+
+// Each with the schema and the name of the index for the two %w
+static const char* const META_SQL[N_STMT] = {
+    "INSERT OR REPLACE INTO \"%w\".\"%w_data\"(id, dtype, ndim, shape, size, nbytes, checksum) "
+    "VALUES (?, ?, ?, ?, ?, ?, ?)",
+    "DELETE FROM \"%w\".\"%w_data\" WHERE id = ?",
+    "INSERT OR REPLACE INTO \"%w\".\"%w_config\"(key, value) VALUES (?, ?)",
+};
+
+static const char* const SHADOW_TABLES[] = {"config", "data", NULL};
+_Static_assert(N_STMT <= SHADOW_MAX_STMT, "too many statements");
+
+// The indexes of <name>_data, named after the triggers (they keep their name on a rename)
+static const char* const META_INDEXES[][2] = {
+    {"dtype", "dtype, size"},
+    {"shape", "shape"},
+    {"size", "size"},
+    {"checksum", "checksum"},
+};
+#define N_INDEXES (int) (sizeof(META_INDEXES) / sizeof(META_INDEXES[0]))
+
+typedef struct Meta_vtab {
+    Shadow_vtab base;  // np_meta keeps nothing else
+} Meta_vtab;
+
+typedef struct Meta_cursor {
+    sqlite3_vtab_cursor base;
+    sqlite3_stmt* scan;  // rowid and the stored columns of <name>_data
+    bool eof;
+} Meta_cursor;
+
+static int config_set(Meta_vtab* vtab, const char* key, const char* text)
+{
+    int rc;
+    sqlite3_stmt* stmt = shadow_stmt(&vtab->base, STMT_SET_CONFIG, &rc);
+    if (stmt == NULL)
+        return rc;
+    sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+    sqlite3_bind_text(stmt, 2, text, -1, SQLITE_TRANSIENT);
+    return shadow_step(stmt);
+}
+
+static int config_load(Meta_vtab* vtab)
+{
+    sqlite3_stmt* stmt;
+    char* sql = sqlite3_mprintf("SELECT key, value FROM \"%w\".\"%w_config\"",
+                                vtab->base.schema, vtab->base.name);
+    if (sql == NULL)
+        return SQLITE_NOMEM;
+    int rc = sqlite3_prepare_v2(vtab->base.db, sql, -1, &stmt, NULL);
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    while (sqlite3_step(stmt) == SQLITE_ROW) {
+        const char* key = (const char*) sqlite3_column_text(stmt, 0);
+        const char* text = (const char*) sqlite3_column_text(stmt, 1);
+        if (key == NULL || text == NULL)
+            continue;
+        char** field = strcmp(key, "table") == 0 ? &vtab->base.table
+                     : strcmp(key, "column") == 0 ? &vtab->base.column
+                     : strcmp(key, "triggers") == 0 ? &vtab->base.triggers : NULL;
+        if (field != NULL) {
+            sqlite3_free(*field);
+            *field = sqlite3_mprintf("%s", text);
+        }
+    }
+    rc = sqlite3_finalize(stmt);
+    if (rc == SQLITE_OK && (vtab->base.table == NULL || vtab->base.column == NULL
+                            || vtab->base.triggers == NULL))
+        rc = SQLITE_CORRUPT_VTAB;
+    return rc;
+}
+
+static int meta_delete(Meta_vtab* vtab, sqlite3_int64 id)
+{
+    int rc;
+    sqlite3_stmt* stmt = shadow_stmt(&vtab->base, STMT_DELETE, &rc);
+    if (stmt == NULL)
+        return rc;
+    sqlite3_bind_int64(stmt, 1, id);
+    return shadow_step(stmt);
+}
+
+/// Stores the header fields of `value` as the row `id`, or removes the row if it is no BLOB
+static int meta_insert(Meta_vtab* vtab, sqlite3_int64 id, sqlite3_value* value)
+{
+    if (sqlite3_value_type(value) != SQLITE_BLOB)
+        return meta_delete(vtab, id);
+
+    int rc;
+    sqlite3_stmt* stmt = shadow_stmt(&vtab->base, STMT_UPSERT, &rc);
+    if (stmt == NULL)
+        return rc;
+    const unsigned char* blob = sqlite3_value_blob(value);
+    int n_bytes = sqlite3_value_bytes(value);
+    sqlite3_bind_int64(stmt, 1, id);
+    sqlite3_bind_int64(stmt, 2 + META_NBYTES, n_bytes);
+    sqlite3_bind_int64(stmt, 2 + META_CHECKSUM, (sqlite3_int64) hash_bytes(blob, n_bytes));
+
+    int header_rc;
+    const Header_data* header_data = header_cache_get(vtab->base.conn->cache, blob, n_bytes,
+                                                      &header_rc);
+    if (header_data != NULL) {
+        char shape[TUPLE_MAXLEN];
+        int len = format_tuple(shape, header_data->shape, header_data->shape_len);
+        if (header_data->descr_len > 0)
+            sqlite3_bind_text(stmt, 2 + META_DTYPE, header_data->descr, header_data->descr_len,
+                              SQLITE_TRANSIENT);
+        sqlite3_bind_int(stmt, 2 + META_NDIM, header_data->shape_len);
+        sqlite3_bind_text(stmt, 2 + META_SHAPE, shape, len, SQLITE_TRANSIENT);
+        sqlite3_bind_int64(stmt, 2 + META_SIZE, header_data->size);
+        header_release((void*) header_data);
+    }
+    return shadow_step(stmt);
+}
+
+/// Reads the headers of all rows of the table again
+static int meta_rebuild(Meta_vtab* vtab)
+{
+    int rc = shadow_exec(&vtab->base, "DELETE FROM \"%w\".\"%w_data\"",
+                         vtab->base.schema, vtab->base.name);
+    if (rc != SQLITE_OK)
+        return rc;
+
+    sqlite3_stmt* stmt;
+    char* sql = sqlite3_mprintf("SELECT rowid, \"%w\" FROM \"%w\".\"%w\"",
+                                vtab->base.column, vtab->base.schema, vtab->base.table);
+    if (sql == NULL)
+        return SQLITE_NOMEM;
+    rc = sqlite3_prepare_v2(vtab->base.db, sql, -1, &stmt, NULL);
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK)
+        return shadow_error(&vtab->base, "np_meta: %s", sqlite3_errmsg(vtab->base.db));
+
+    while (rc == SQLITE_OK && sqlite3_step(stmt) == SQLITE_ROW)
+        rc = meta_insert(vtab, sqlite3_column_int64(stmt, 0), sqlite3_column_value(stmt, 1));
+    sqlite3_finalize(stmt);
+    return rc;
+}
+
+static void meta_free(Meta_vtab* vtab)
+{
+    shadow_free(&vtab->base);
+    sqlite3_free(vtab);
+}
+
+static int meta_init(sqlite3 *db, void *pAux, int argc, const char *const*argv,
+                     sqlite3_vtab **ppVtab, char **pzErr, bool create)
+{
+    int rc = sqlite3_declare_vtab(db, "CREATE TABLE x(dtype TEXT, ndim INTEGER, shape TEXT, "
+                                      "size INTEGER, nbytes INTEGER, checksum INTEGER, "
+                                      "array HIDDEN, command HIDDEN)");
+    if (rc != SQLITE_OK)
+        return rc;
+
+    // The triggers on the table write to it. It only ever touches its own shadow tables
+    sqlite3_vtab_config(db, SQLITE_VTAB_INNOCUOUS);
+
+    Meta_vtab* vtab = sqlite3_malloc(sizeof(*vtab));
+    if (vtab == NULL)
+        return SQLITE_NOMEM;
+    memset(vtab, 0, sizeof(*vtab));
+    rc = shadow_init(&vtab->base, db, pAux, "np_meta", argv, META_SQL, SHADOW_TABLES);
+    if (rc != SQLITE_OK) {
+        meta_free(vtab);
+        return rc;
+    }
+
+    if (!create) {
+        rc = config_load(vtab);
+        if (rc != SQLITE_OK) {
+            *pzErr = sqlite3_mprintf("np_meta: cannot read %s_config", vtab->base.name);
+            meta_free(vtab);
+            return rc;
+        }
+        *ppVtab = &vtab->base.base;
+        return SQLITE_OK;
+    }
+
+    if (argc != 5) {
+        *pzErr = sqlite3_mprintf("np_meta: usage np_meta(table, column)");
+        meta_free(vtab);
+        return SQLITE_ERROR;
+    }
+    char* table = sqlite3_mprintf("%s", argv[3]);
+    char* column = sqlite3_mprintf("%s", argv[4]);
+    if (table != NULL && column != NULL) {
+        vtab->base.table = sqlite3_mprintf("%s", unquote(table));
+        vtab->base.column = sqlite3_mprintf("%s", unquote(column));
+    }
+    sqlite3_free(table);
+    sqlite3_free(column);
+    if (vtab->base.table == NULL || vtab->base.column == NULL) {
+        meta_free(vtab);
+        return SQLITE_NOMEM;
+    }
+
+    rc = shadow_exec(&vtab->base,
+        "CREATE TABLE \"%w\".\"%w_config\"(key TEXT PRIMARY KEY, value) WITHOUT ROWID;"
+        "CREATE TABLE \"%w\".\"%w_data\"(id INTEGER PRIMARY KEY, dtype TEXT, ndim INTEGER, "
+        "shape TEXT, size INTEGER, nbytes INTEGER, checksum INTEGER);",
+        vtab->base.schema, vtab->base.name, vtab->base.schema, vtab->base.name);
+    for (int i = 0; i < N_INDEXES && rc == SQLITE_OK; i++) {
+        rc = shadow_exec(&vtab->base, "CREATE INDEX \"%w\".\"%w_%s\" ON \"%w_data\"(%s)",
+                       vtab->base.schema, vtab->base.triggers, META_INDEXES[i][0], vtab->base.name,
+                       META_INDEXES[i][1]);
+    }
+    if (rc == SQLITE_OK)
+        rc = config_set(vtab, "table", vtab->base.table);
+    if (rc == SQLITE_OK)
+        rc = config_set(vtab, "column", vtab->base.column);
+    if (rc == SQLITE_OK)
+        rc = config_set(vtab, "triggers", vtab->base.triggers);
+
+    // Keep the headers in sync with the table
+    if (rc == SQLITE_OK)
+        rc = shadow_triggers(&vtab->base, "array");
+    if (rc == SQLITE_OK)
+        rc = meta_rebuild(vtab);
+
+    if (rc != SQLITE_OK) {
+        *pzErr = sqlite3_mprintf("%s", vtab->base.base.zErrMsg != NULL ? vtab->base.base.zErrMsg
+                                                                  : sqlite3_errmsg(db));
+        sqlite3_free(vtab->base.base.zErrMsg);
+        meta_free(vtab);
+        return rc;
+    }
+    *ppVtab = &vtab->base.base;
+    return SQLITE_OK;
+}
+
+static int meta_create(sqlite3 *db, void *pAux, int argc, const char *const*argv,
+                       sqlite3_vtab **ppVtab, char **pzErr)
+{
+    return meta_init(db, pAux, argc, argv, ppVtab, pzErr, true);
+}
+
+static int meta_connect(sqlite3 *db, void *pAux, int argc, const char *const*argv,
+                        sqlite3_vtab **ppVtab, char **pzErr)
+{
+    return meta_init(db, pAux, argc, argv, ppVtab, pzErr, false);
+}
+
+static int meta_disconnect(sqlite3_vtab *pVtab)
+{
+    meta_free((Meta_vtab*) pVtab);
+    return SQLITE_OK;
+}
+
+static int meta_destroy(sqlite3_vtab *pVtab)
+{
+    Meta_vtab* vtab = (Meta_vtab*) pVtab;
+    int rc = shadow_destroy(&vtab->base);
+    if (rc == SQLITE_OK)
+        meta_free(vtab);
+    return rc;
+}
+
+static int meta_shadow_name(const char *zName)
+{
+    return shadow_is_table(SHADOW_TABLES, zName);
+}
+
+static int meta_open(sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCursor)
+{
+    Meta_cursor* cur = sqlite3_malloc(sizeof(*cur));
+    if (cur == NULL)
+        return SQLITE_NOMEM;
+    memset(cur, 0, sizeof(*cur));
+    cur->eof = true;
+    *ppCursor = &cur->base;
+    return SQLITE_OK;
+}
+
+static int meta_close(sqlite3_vtab_cursor *pCursor)
+{
+    Meta_cursor* cur = (Meta_cursor*) pCursor;
+    sqlite3_finalize(cur->scan);
+    sqlite3_free(cur);
+    return SQLITE_OK;
+}
+
+/// idxStr (see meta_best_index) is the WHERE clause of the query of <name>_data, with one
+/// parameter per argument
+static int meta_scan(sqlite3_vtab_cursor *pCursor, int idxNum, const char *idxStr,
+                     int argc, sqlite3_value **argv)
+{
+    Meta_cursor* cur = (Meta_cursor*) pCursor;
+    Meta_vtab* vtab = (Meta_vtab*) pCursor->pVtab;
+    sqlite3_finalize(cur->scan);
+    cur->scan = NULL;
+    cur->eof = true;
+
+    char* sql = sqlite3_mprintf("SELECT id, dtype, ndim, shape, size, nbytes, checksum "
+                                "FROM \"%w\".\"%w_data\"%s%s", vtab->base.schema, vtab->base.name,
+                                idxStr != NULL ? " WHERE " : "", idxStr != NULL ? idxStr : "");
+    if (sql == NULL)
+        return SQLITE_NOMEM;
+    int rc = sqlite3_prepare_v2(vtab->base.db, sql, -1, &cur->scan, NULL);
+    sqlite3_free(sql);
+    if (rc != SQLITE_OK)
+        return rc;
+    for (int i = 0; i < argc; i++)
+        sqlite3_bind_value(cur->scan, i + 1, argv[i]);
+    rc = sqlite3_step(cur->scan);
+    cur->eof = rc != SQLITE_ROW;
+    return rc == SQLITE_ROW || rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+static int meta_next(sqlite3_vtab_cursor *pCursor)
+{
+    Meta_cursor* cur = (Meta_cursor*) pCursor;
+    int rc = sqlite3_step(cur->scan);
+    cur->eof = rc != SQLITE_ROW;
+    return rc == SQLITE_ROW || rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+static int meta_eof(sqlite3_vtab_cursor *pCursor)
+{
+    return ((Meta_cursor*) pCursor)->eof;
+}
+
+static int meta_column(sqlite3_vtab_cursor *pCursor, sqlite3_context *ctx, int i)
+{
+    Meta_cursor* cur = (Meta_cursor*) pCursor;
+    if (i < META_COLUMNS)
+        sqlite3_result_value(ctx, sqlite3_column_value(cur->scan, i + 1));
+    return SQLITE_OK;
+}
+
+static int meta_rowid(sqlite3_vtab_cursor *pCursor, sqlite_int64 *pRowid)
+{
+    *pRowid = sqlite3_column_int64(((Meta_cursor*) pCursor)->scan, 0);
+    return SQLITE_OK;
+}
+
+/// The SQL of a constraint operator, NULL for those left to sqlite. `unary` ones take no value
+static const char* constraint_sql(unsigned char op, bool* unary)
+{
+    *unary = false;
+    switch (op) {
+    case SQLITE_INDEX_CONSTRAINT_EQ: return "=";
+    case SQLITE_INDEX_CONSTRAINT_GT: return ">";
+    case SQLITE_INDEX_CONSTRAINT_LE: return "<=";
+    case SQLITE_INDEX_CONSTRAINT_LT: return "<";
+    case SQLITE_INDEX_CONSTRAINT_GE: return ">=";
+    case SQLITE_INDEX_CONSTRAINT_NE: return "!=";
+    case SQLITE_INDEX_CONSTRAINT_IS: return "IS";
+    case SQLITE_INDEX_CONSTRAINT_ISNOT: return "IS NOT";
+    case SQLITE_INDEX_CONSTRAINT_GLOB: return "GLOB";
+    case SQLITE_INDEX_CONSTRAINT_ISNULL: *unary = true; return "IS NULL";
+    case SQLITE_INDEX_CONSTRAINT_ISNOTNULL: *unary = true; return "IS NOT NULL";
+    default: return NULL;
+    }
+}
+
+/// Hands all constraints on the stored columns and the rowid on to <name>_data, as a WHERE
+/// clause in idxStr. The estimates assume that every equality on an indexed column leaves a
+/// hundredth of the rows and every other constraint a quarter
+static int meta_best_index(sqlite3_vtab *pVtab, sqlite3_index_info *pInfo)
+{
+    char* where = NULL;
+    int n_arg = 0;
+    double rows = 1e6;
+    bool unique = false;
+    for (int i = 0; i < pInfo->nConstraint; i++) {
+        const struct sqlite3_index_constraint* c = &pInfo->aConstraint[i];
+        bool unary;
+        const char* op = constraint_sql(c->op, &unary);
+        if (!c->usable || op == NULL || c->iColumn < -1 || c->iColumn >= META_COLUMNS)
+            continue;
+
+        const char* column = c->iColumn < 0 ? "id" : META_NAMES[c->iColumn];
+        char* clause = unary
+            ? sqlite3_mprintf("%z%s%s %s", where, where != NULL ? " AND " : "", column, op)
+            : sqlite3_mprintf("%z%s%s %s ?", where, where != NULL ? " AND " : "", column, op);
+        if (clause == NULL)
+            return SQLITE_NOMEM;
+        where = clause;
+        if (!unary)
+            pInfo->aConstraintUsage[i].argvIndex = ++n_arg;
+        pInfo->aConstraintUsage[i].omit = 1;
+
+        if (c->iColumn < 0 && c->op == SQLITE_INDEX_CONSTRAINT_EQ)
+            unique = true;
+        else if (c->op == SQLITE_INDEX_CONSTRAINT_EQ && c->iColumn != META_NDIM
+                 && c->iColumn != META_NBYTES)
+            rows /= 100;
+        else
+            rows /= 4;
+    }
+
+    if (unique) {
+        rows = 1;
+        pInfo->idxFlags = SQLITE_INDEX_SCAN_UNIQUE;
+    }
+    pInfo->idxStr = where;
+    pInfo->needToFreeIdxStr = 1;
+    pInfo->estimatedRows = rows < 1 ? 1 : (sqlite3_int64) rows;
+    pInfo->estimatedCost = where == NULL ? 1e6 : 10 + rows;
+    return SQLITE_OK;
+}
+
+static int meta_update(sqlite3_vtab *pVtab, int argc, sqlite3_value **argv, sqlite_int64 *pRowid)
+{
+    Meta_vtab* vtab = (Meta_vtab*) pVtab;
+
+    // DELETE
+    if (argc == 1)
+        return meta_delete(vtab, sqlite3_value_int64(argv[0]));
+
+    // INSERT INTO idx(command) VALUES (...)
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL
+            && sqlite3_value_type(argv[2 + META_COMMAND]) != SQLITE_NULL) {
+        const char* command = (const char*) sqlite3_value_text(argv[2 + META_COMMAND]);
+        if (sqlite3_stricmp(command, "rebuild") == 0)
+            return meta_rebuild(vtab);
+        return shadow_error(&vtab->base, "np_meta: unknown command '%s'", command);
+    }
+
+    if (sqlite3_value_type(argv[1]) != SQLITE_INTEGER)
+        return shadow_error(&vtab->base, "np_meta: %s", "the rowid of the row is needed");
+
+    // UPDATE of the rowid: remove the old row first (meta_insert replaces the new one anyway)
+    if (sqlite3_value_type(argv[0]) != SQLITE_NULL
+            && sqlite3_value_int64(argv[0]) != sqlite3_value_int64(argv[1])) {
+        int rc = meta_delete(vtab, sqlite3_value_int64(argv[0]));
+        if (rc != SQLITE_OK)
+            return rc;
+    }
+    *pRowid = sqlite3_value_int64(argv[1]);
+    return meta_insert(vtab, *pRowid, argv[2 + META_ARRAY]);
+}
+
+static int meta_filter(sqlite3_vtab_cursor *pCursor, int idxNum, const char *idxStr,
+                       int argc, sqlite3_value **argv)
+{
+    Meta_vtab* vtab = (Meta_vtab*) pCursor->pVtab;
+    return stats_filter(vtab->base.conn, vtab->base.stats, meta_scan, pCursor, idxNum, idxStr,
+                        argc, argv);
+}
+
+static sqlite3_module meta_module = {
+    3,                 /* iVersion */
+    meta_create,       /* xCreate */
+    meta_connect,      /* xConnect */
+    meta_best_index,   /* xBestIndex */
+    meta_disconnect,   /* xDisconnect */
+    meta_destroy,      /* xDestroy */
+    meta_open,         /* xOpen */
+    meta_close,        /* xClose */
+    meta_filter,       /* xFilter */
+    meta_next,         /* xNext */
+    meta_eof,          /* xEof */
+    meta_column,       /* xColumn */
+    meta_rowid,        /* xRowid */
+    meta_update,       /* xUpdate */
+    0,                 /* xBegin */
+    0,                 /* xSync */
+    0,                 /* xCommit */
+    0,                 /* xRollback */
+    0,                 /* xFindFunction */
+    shadow_rename,       /* xRename */
+    0,                 /* xSavepoint */
+    0,                 /* xRelease */
+    0,                 /* xRollbackTo */
+    meta_shadow_name,  /* xShadowName */
+};
+
+int np_meta_init(sqlite3 *db, Blopy_conn* conn)
+{
+    return register_module(db, conn, "np_meta", &meta_module);
+}
@@ -0,0 +1,177 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+#include "blopy.h"
+SQLITE_EXTENSION_INIT3
+
+#include <string.h>
+#include "numpy_format.h"
+#include "numpy_search.h"
+
+/// Predicates over the elements of a numpy BLOB, for WHERE clauses that would otherwise need
+/// np_each or the client:
+///   np_any(col, op, value)         -> 1 if the comparison holds for any element, else 0
+///   np_all(col, op, value)         -> 1 if it holds for all elements (also for empty arrays)
+///   np_count_where(col, op, value) -> the number of elements for which it holds
+/// `op` is '>', '>=', '<', '<=', '==' or '!=', or 'isnan' without a value:
+///   SELECT id FROM t WHERE np_any(spectrum, '>', 1e3);
+///   SELECT count(*) FROM t WHERE np_any(spectrum, 'isnan');
+/// np_any and np_all stop at the first chunk of elements that decides the result.
+///
+///   np_argmax(col), np_argmin(col) -> the flat index (C order) of the first largest or smallest
+///                                     element, like numpy.argmax; the first NaN if there is one
+///   np_argmax(col, 'nd'), ...      -> the same index per dimension as TEXT, e.g. '(2, 0)', like
+///                                     numpy.unravel_index(numpy.argmax(a), a.shape)
+/// NULL gives NULL, for all of them.
+
+enum Search_fn {
+    SEARCH_ANY,
+    SEARCH_ALL,
+    SEARCH_COUNT
+};
+
+static const char* search_name(sqlite3_context *context)
+{
+    static const char* names[] = {"np_any", "np_all", "np_count_where"};
+    return names[((Blopy_func*) sqlite3_user_data(context))->op];
+}
+
+static void search_fail(sqlite3_context *context, const char* name, const char* message)
+{
+    char* error = sqlite3_mprintf("%s: %s", name, message);
+    sqlite3_result_error(context, error, -1);
+    sqlite3_free(error);
+}
+
+/// np_any, np_all and np_count_where, given by the user data
+static void numpy_search(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    enum Search_fn fn = ((Blopy_func*) sqlite3_user_data(context))->op;
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL
+            || (argc == 3 && sqlite3_value_type(argv[2]) == SQLITE_NULL)) {
+        sqlite3_result_null(context);
+        return;
+    }
+    if (sqlite3_value_type(argv[0]) != SQLITE_BLOB) {
+        search_fail(context, search_name(context), "not a numpy BLOB");
+        return;
+    }
+    Search_op op;
+    if (parse_search_op((const char*) sqlite3_value_text(argv[1]), &op) < 0) {
+        search_fail(context, search_name(context),
+                    "op must be '>', '>=', '<', '<=', '==', '!=' or 'isnan'");
+        return;
+    }
+    if ((op == SEARCH_ISNAN) != (argc == 2)) {
+        search_fail(context, search_name(context), op == SEARCH_ISNAN ? "isnan takes no value"
+                                                                       : "op needs a value");
+        return;
+    }
+
+    const Header_data* header_data = blob_header(context, argv, 0);
+    if (header_data == NULL)
+        return;
+    const unsigned char* data = blob_payload(context, argv[0], &header_data, 0, BLOB_NATIVE);
+    if (data == NULL)
+        return;
+
+    Search search;
+    if (search_compile(&search, header_data->dtype, op, argc == 3 ? sqlite3_value_double(argv[2])
+                                                                  : 0) < 0) {
+        search_fail(context, search_name(context), search_error(-1));
+        return;
+    }
+    switch (fn) {
+    case SEARCH_ANY:
+        sqlite3_result_int(context, search_find(&search, data, header_data->size, true) >= 0);
+        break;
+    case SEARCH_ALL:
+        sqlite3_result_int(context, search_find(&search, data, header_data->size, false) < 0);
+        break;
+    case SEARCH_COUNT:
+    {
+        Parallel parallel = blob_parallel(context, header_data->size
+                                                   * header_data->wordsize_in_bytes);
+        sqlite3_result_int64(context, search_count_parallel(&parallel, &search, data,
+                                                            header_data->size));
+        break;
+    }
+    }
+}
+
+/// np_argmax (user data 1) and np_argmin (0)
+static void numpy_argext(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    bool is_max = ((Blopy_func*) sqlite3_user_data(context))->op;
+    const char* name = is_max ? "np_argmax" : "np_argmin";
+    if (sqlite3_value_type(argv[0]) == SQLITE_NULL) {
+        sqlite3_result_null(context);
+        return;
+    }
+    if (sqlite3_value_type(argv[0]) != SQLITE_BLOB) {
+        search_fail(context, name, "not a numpy BLOB");
+        return;
+    }
+    bool nd = false;
+    if (argc == 2) {
+        const char* mode = (const char*) sqlite3_value_text(argv[1]);
+        nd = mode != NULL && strcmp(mode, "nd") == 0;
+        if (!nd && (mode == NULL || strcmp(mode, "flat") != 0)) {
+            search_fail(context, name, "mode must be 'flat' or 'nd'");
+            return;
+        }
+    }
+
+    const Header_data* header_data = blob_header(context, argv, 0);
+    if (header_data == NULL)
+        return;
+    // The flat index counts in C order, like numpy
+    const unsigned char* data = blob_payload(context, argv[0], &header_data, 0,
+                                             BLOB_NATIVE | BLOB_C_ORDER);
+    if (data == NULL)
+        return;
+
+    int64_t index = search_argext(header_data->dtype, data, header_data->size, is_max);
+    if (index < 0) {
+        search_fail(context, name, search_error((int) index));
+        return;
+    }
+    if (!nd) {
+        sqlite3_result_int64(context, index);
+        return;
+    }
+    int64_t indices[NPY_MAXDIMS];
+    for (int k = header_data->shape_len - 1; k >= 0; k--) {
+        indices[k] = index % header_data->shape[k];
+        index /= header_data->shape[k];
+    }
+    char text[TUPLE_MAXLEN];
+    int len = format_tuple(text, indices, header_data->shape_len);
+    sqlite3_result_text(context, text, len, SQLITE_TRANSIENT);
+}
+
+int np_search_init(sqlite3 *db, Blopy_conn* conn)
+{
+    static const struct {
+        const char* name;
+        enum Search_fn fn;
+    } predicates[] = {
+        {"np_any", SEARCH_ANY}, {"np_all", SEARCH_ALL}, {"np_count_where", SEARCH_COUNT},
+    };
+    int rc = SQLITE_OK;
+    for (int i = 0; i < (int) (sizeof(predicates)/sizeof(predicates[0])); i++) {
+        for (int n_arg = 2; n_arg <= 3; n_arg++) {
+            rc = create_function(db, conn, predicates[i].name, n_arg, SQLITE_DETERMINISTIC,
+                                 predicates[i].fn, numpy_search, 0, 0);
+        }
+    }
+    for (int n_arg = 1; n_arg <= 2; n_arg++) {
+        rc = create_function(db, conn, "np_argmax", n_arg, SQLITE_DETERMINISTIC, 1,
+                             numpy_argext, 0, 0);
+        rc = create_function(db, conn, "np_argmin", n_arg, SQLITE_DETERMINISTIC, 0,
+                             numpy_argext, 0, 0);
+    }
+    return rc;
+}
@@ -0,0 +1,177 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+#include "blopy.h"
+SQLITE_EXTENSION_INIT3
+
+#include <stdarg.h>
+#include <string.h>
+
+/// What the virtual tables that live in shadow tables <name>_<suffix> (np_ann, np_meta) have in
+/// common: the prepared statements, the triggers on the indexed table and the shadow tables
+/// themselves, which go with the virtual table on a DROP or RENAME
+
+int shadow_init(Shadow_vtab* vtab, sqlite3* db, Blopy_conn* conn, const char* module,
+                const char* const* argv, const char* const* sql, const char* const* tables)
+{
+    vtab->conn = conn;
+    vtab->stats = stats_entry(conn, module);
+    vtab->db = db;
+    vtab->sql = sql;
+    vtab->shadow_tables = tables;
+    vtab->schema = sqlite3_mprintf("%s", argv[1]);
+    vtab->name = sqlite3_mprintf("%s", argv[2]);
+    vtab->triggers = sqlite3_mprintf("%s", argv[2]);
+    if (vtab->schema == NULL || vtab->name == NULL || vtab->triggers == NULL)
+        return SQLITE_NOMEM;
+    return SQLITE_OK;
+}
+
+/// Frees what shadow_init and config loading allocated, not `vtab` itself
+void shadow_free(Shadow_vtab* vtab)
+{
+    for (int i = 0; i < SHADOW_MAX_STMT; i++)
+        sqlite3_finalize(vtab->stmt[i]);
+    sqlite3_free(vtab->schema);
+    sqlite3_free(vtab->name);
+    sqlite3_free(vtab->table);
+    sqlite3_free(vtab->column);
+    sqlite3_free(vtab->triggers);
+}
+
+int shadow_error(Shadow_vtab* vtab, const char* fmt, const char* arg)
+{
+    sqlite3_free(vtab->base.zErrMsg);
+    vtab->base.zErrMsg = sqlite3_mprintf(fmt, arg);
+    return SQLITE_ERROR;
+}
+
+/// The prepared statement `which` (of vtab->sql), reset and with all bindings cleared
+sqlite3_stmt* shadow_stmt(Shadow_vtab* vtab, int which, int* rc)
+{
+    sqlite3_stmt* stmt = vtab->stmt[which];
+    if (stmt == NULL) {
+        char* sql = sqlite3_mprintf(vtab->sql[which], vtab->schema, vtab->name);
+        if (sql == NULL) {
+            *rc = SQLITE_NOMEM;
+            return NULL;
+        }
+        *rc = sqlite3_prepare_v3(vtab->db, sql, -1, SQLITE_PREPARE_PERSISTENT, &stmt, NULL);
+        sqlite3_free(sql);
+        if (*rc != SQLITE_OK)
+            return NULL;
+        vtab->stmt[which] = stmt;
+    }
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+    *rc = SQLITE_OK;
+    return stmt;
+}
+
+/// Runs a statement that returns no rows (or whose rows are not needed)
+int shadow_step(sqlite3_stmt* stmt)
+{
+    int rc;
+    while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {}
+    sqlite3_reset(stmt);
+    return rc == SQLITE_DONE ? SQLITE_OK : rc;
+}
+
+int shadow_exec(Shadow_vtab* vtab, const char* fmt, ...)
+{
+    va_list args;
+    va_start(args, fmt);
+    char* sql = sqlite3_vmprintf(fmt, args);
+    va_end(args);
+    if (sql == NULL)
+        return SQLITE_NOMEM;
+    int rc = sqlite3_exec(vtab->db, sql, 0, 0, NULL);
+    sqlite3_free(sql);
+    return rc;
+}
+
+/// Removes surrounding quotes from a module argument (in place)
+char* unquote(char* arg)
+{
+    size_t len = strlen(arg);
+    if (len >= 2 && (arg[0] == '\'' || arg[0] == '"' || arg[0] == '`' || arg[0] == '[')) {
+        arg[len-1] = '\0';
+        return arg + 1;
+    }
+    return arg;
+}
+
+/// Creates the triggers that keep the virtual table in sync with the indexed table, they write
+/// the column to the hidden column `into`
+int shadow_triggers(Shadow_vtab* vtab, const char* into)
+{
+    const char* schema = vtab->schema;
+    const char* name = vtab->name;
+    const char* table = vtab->table;
+    const char* column = vtab->column;
+    return shadow_exec(vtab,
+        "CREATE TRIGGER \"%w\".\"%w_insert\" AFTER INSERT ON \"%w\" BEGIN "
+        "INSERT INTO \"%w\"(rowid, %s) VALUES (new.rowid, new.\"%w\"); END;"
+        "CREATE TRIGGER \"%w\".\"%w_update\" AFTER UPDATE ON \"%w\" "
+        "WHEN new.rowid IS NOT old.rowid OR new.\"%w\" IS NOT old.\"%w\" BEGIN "
+        "DELETE FROM \"%w\" WHERE rowid = old.rowid; "
+        "INSERT INTO \"%w\"(rowid, %s) VALUES (new.rowid, new.\"%w\"); END;"
+        "CREATE TRIGGER \"%w\".\"%w_delete\" AFTER DELETE ON \"%w\" BEGIN "
+        "DELETE FROM \"%w\" WHERE rowid = old.rowid; END;",
+        schema, name, table, name, into, column,
+        schema, name, table, column, column,
+        name, name, into, column,
+        schema, name, table, name);
+}
+
+/// Drops the triggers and the shadow tables (their indexes go with them)
+int shadow_destroy(Shadow_vtab* vtab)
+{
+    int rc = shadow_exec(vtab,
+        "DROP TRIGGER IF EXISTS \"%w\".\"%w_insert\";"
+        "DROP TRIGGER IF EXISTS \"%w\".\"%w_update\";"
+        "DROP TRIGGER IF EXISTS \"%w\".\"%w_delete\";",
+        vtab->schema, vtab->triggers, vtab->schema, vtab->triggers, vtab->schema, vtab->triggers);
+    for (int i = 0; vtab->shadow_tables[i] != NULL && rc == SQLITE_OK; i++) {
+        rc = shadow_exec(vtab, "DROP TABLE IF EXISTS \"%w\".\"%w_%s\"",
+                         vtab->schema, vtab->name, vtab->shadow_tables[i]);
+    }
+    return rc;
+}
+
+/// xRename of both modules. The triggers keep their name
+int shadow_rename(sqlite3_vtab *pVtab, const char *zNew)
+{
+    Shadow_vtab* vtab = (Shadow_vtab*) pVtab;
+    int rc = SQLITE_OK;
+    for (int i = 0; vtab->shadow_tables[i] != NULL && rc == SQLITE_OK; i++) {
+        rc = shadow_exec(vtab, "ALTER TABLE \"%w\".\"%w_%s\" RENAME TO \"%w_%s\"",
+                         vtab->schema, vtab->name, vtab->shadow_tables[i],
+                         zNew, vtab->shadow_tables[i]);
+    }
+    if (rc != SQLITE_OK)
+        return rc;
+
+    char* name = sqlite3_mprintf("%s", zNew);
+    if (name == NULL)
+        return SQLITE_NOMEM;
+    sqlite3_free(vtab->name);
+    vtab->name = name;
+    for (int i = 0; i < SHADOW_MAX_STMT; i++) {
+        sqlite3_finalize(vtab->stmt[i]);
+        vtab->stmt[i] = NULL;
+    }
+    return SQLITE_OK;
+}
+
+/// Whether `zName` is one of `tables` (for xShadowName, which gets no vtab)
+int shadow_is_table(const char* const* tables, const char *zName)
+{
+    for (int i = 0; tables[i] != NULL; i++) {
+        if (sqlite3_stricmp(zName, tables[i]) == 0)
+            return 1;
+    }
+    return 0;
+}
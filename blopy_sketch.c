@@ -0,0 +1,281 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+#include "blopy.h"
+SQLITE_EXTENSION_INIT3
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "numpy_convert.h"
+#include "numpy_sketch.h"
+
+/// np_histogram(col, lo, hi, bins): an aggregate that counts the elements of the arrays of all
+/// rows in `bins` equal bins from lo to hi, like numpy.histogram(a, bins, range=(lo, hi)). The
+/// counts come back as a numpy BLOB of dtype '<i8' and shape (bins,). lo, hi and bins are taken
+/// from the first row. NULLs are skipped, elements outside of the range and NaN are not counted.
+///
+/// np_quantile(col, q), np_quantile(col, q, k): an aggregate for the q-th quantile (0 <= q <= 1)
+/// of the elements of the arrays of all rows, like numpy.quantile. `q` may be a numpy BLOB of
+/// quantiles, then the result is a '<f8' BLOB of the same shape, e.g. for three percentiles in
+/// one pass, with q bound to a BLOB of numpy.array([0.05, 0.5, 0.95]):
+///   SELECT np_quantile(col, ?) FROM t;
+/// The elements go through a KLL sketch, so memory stays bounded (about 3k doubles for the
+/// default k = 200) however many rows there are. The result is exact for small inputs, after
+/// that the rank of the result is off by ~1.3% (k = 200) or ~0.3% (k = 1000) of the number of
+/// elements. NaN in the input gives NULL, like numpy gives nan.
+
+struct Histogram_state {
+    Histogram histogram;
+    bool failed;
+};
+typedef struct Histogram_state Histogram_state;
+
+struct Quantile_state {
+    Kll kll;
+    double* q;  // from the first row
+    int64_t n_q;
+    bool q_array;
+    int64_t shape[NPY_MAXDIMS]; int shape_len;
+    bool failed;
+};
+typedef struct Quantile_state Quantile_state;
+
+/// The elements of the numpy BLOB argv[0] in native byte order and the header describing them.
+/// Called by the step functions, the reference in `*header_ref` has to be released.
+/// @Returns the elements or NULL (with an error set on `context`)
+static const unsigned char* step_data(sqlite3_context *context, sqlite3_value **argv,
+                                      const char* name, const Header_data** header_ref,
+                                      const Header_data** native)
+{
+    if (sqlite3_value_type(argv[0]) != SQLITE_BLOB) {
+        char* error = sqlite3_mprintf("%s: not a numpy BLOB", name);
+        sqlite3_result_error(context, error, -1);
+        sqlite3_free(error);
+        return NULL;
+    }
+    *header_ref = blob_header_ref(context, argv, 0);
+    if (*header_ref == NULL)
+        return NULL;
+    if (!sketch_dtype((*header_ref)->dtype)) {
+        header_release((void*) *header_ref);
+        sqlite3_result_error(context, "data type not supported", -1);
+        return NULL;
+    }
+    *native = *header_ref;
+    const unsigned char* data = blob_payload(context, argv[0], native, 0, BLOB_NATIVE);
+    if (data == NULL)
+        header_release((void*) *header_ref);
+    return data;
+}
+
+static void histogram_step(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    Histogram_state* state = sqlite3_aggregate_context(context, sizeof(*state));
+    if (state == NULL) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    if (state->failed || sqlite3_value_type(argv[0]) == SQLITE_NULL)
+        return;
+
+    if (state->histogram.counts == NULL) {
+        int rc = histogram_init(&state->histogram, sqlite3_value_double(argv[1]),
+                                sqlite3_value_double(argv[2]), sqlite3_value_int64(argv[3]));
+        if (rc < 0) {
+            state->failed = true;
+            if (rc == -2)
+                sqlite3_result_error(context, "np_histogram: bins out of range", -1);
+            else if (rc == -3)
+                sqlite3_result_error_nomem(context);
+            else
+                sqlite3_result_error(context, "np_histogram: lo and hi must be finite and "
+                                     "lo <= hi", -1);
+            return;
+        }
+    }
+
+    const Header_data* header_data;
+    const Header_data* native;
+    const unsigned char* data = step_data(context, argv, "np_histogram", &header_data, &native);
+    if (data == NULL) {
+        state->failed = true;
+        return;
+    }
+    histogram_add(&state->histogram, native->dtype, data, native->size);
+    header_release((void*) header_data);
+}
+
+static void histogram_final(sqlite3_context *context)
+{
+    Histogram_state* state = sqlite3_aggregate_context(context, 0);
+    if (state == NULL || state->failed || state->histogram.counts == NULL) {
+        if (state != NULL)
+            histogram_free(&state->histogram);
+        sqlite3_result_null(context);
+        return;
+    }
+
+    int64_t bins = state->histogram.bins;
+    int header_length = write_header(NULL, "<i8", false, &bins, 1);
+    sqlite3_int64 n_bytes = header_length + bins * (sqlite3_int64) sizeof(int64_t);
+    unsigned char* out = malloc(n_bytes);
+    if (out == NULL) {
+        histogram_free(&state->histogram);
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    write_header(out, "<i8", false, &bins, 1);
+    memcpy(out + header_length, state->histogram.counts, bins * sizeof(int64_t));
+    histogram_free(&state->histogram);
+    sqlite3_result_blob64(context, out, n_bytes, free);
+}
+
+/// Takes the quantiles from argv[1], a number or a numpy BLOB of real numbers
+/// @Returns NULL or an error message ("" if one is set on `context` already)
+static const char* quantile_q(sqlite3_context *context, sqlite3_value **argv,
+                              Quantile_state* state)
+{
+    if (sqlite3_value_type(argv[1]) != SQLITE_BLOB) {
+        if (sqlite3_value_type(argv[1]) == SQLITE_NULL)
+            return "np_quantile: q must be between 0 and 1";
+        state->q = malloc(sizeof(double));
+        if (state->q == NULL)
+            return "np_quantile: out of memory";
+        state->q[0] = sqlite3_value_double(argv[1]);
+        state->n_q = 1;
+    } else {
+        const Header_data* header_data = blob_header_ref(context, argv, 1);
+        if (header_data == NULL)
+            return "";
+        const Header_data* native = header_data;
+        const unsigned char* data = blob_payload(context, argv[1], &native, 1,
+                                                 BLOB_NATIVE | BLOB_C_ORDER);
+        if (data == NULL) {
+            header_release((void*) header_data);
+            return "";
+        }
+        if (!sketch_dtype(native->dtype)) {
+            header_release((void*) header_data);
+            return "data type not supported";
+        }
+        state->q = malloc((native->size > 0 ? native->size : 1) * sizeof(double));
+        if (state->q == NULL) {
+            header_release((void*) header_data);
+            return "np_quantile: out of memory";
+        }
+        Convert_mode mode = {false, ROUND_TRUNC};
+        convert_array(native->dtype, data, DTYPE_F8, (unsigned char*) state->q, native->size,
+                      &mode);
+        state->n_q = native->size;
+        state->q_array = true;
+        state->shape_len = native->shape_len;
+        memcpy(state->shape, native->shape, native->shape_len * sizeof(int64_t));
+        header_release((void*) header_data);
+    }
+    for (int64_t j = 0; j < state->n_q; j++) {
+        if (!(state->q[j] >= 0 && state->q[j] <= 1))
+            return "np_quantile: q must be between 0 and 1";
+    }
+    return NULL;
+}
+
+static void quantile_step(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    Quantile_state* state = sqlite3_aggregate_context(context, sizeof(*state));
+    if (state == NULL) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    if (state->failed || sqlite3_value_type(argv[0]) == SQLITE_NULL)
+        return;
+
+    if (state->q == NULL) {
+        sqlite3_int64 k = argc == 3 ? sqlite3_value_int64(argv[2]) : KLL_K;
+        const char* error = k < 8 || k > 65536 ? "np_quantile: k must be between 8 and 65536"
+                                               : quantile_q(context, argv, state);
+        if (error != NULL) {
+            state->failed = true;
+            if (error[0] != '\0')
+                sqlite3_result_error(context, error, -1);
+            return;
+        }
+        kll_init(&state->kll, (int) k);
+    }
+
+    const Header_data* header_data;
+    const Header_data* native;
+    const unsigned char* data = step_data(context, argv, "np_quantile", &header_data, &native);
+    if (data == NULL) {
+        state->failed = true;
+        return;
+    }
+    int rc = kll_add(&state->kll, native->dtype, data, native->size);
+    header_release((void*) header_data);
+    if (rc < 0) {
+        state->failed = true;
+        sqlite3_result_error(context, sketch_error(rc), -1);
+    }
+}
+
+static void quantile_final(sqlite3_context *context)
+{
+    Quantile_state* state = sqlite3_aggregate_context(context, 0);
+    if (state == NULL)  {
+        sqlite3_result_null(context);
+        return;
+    }
+    if (state->failed || state->q == NULL) {
+        free(state->q);
+        kll_free(&state->kll);
+        sqlite3_result_null(context);
+        return;
+    }
+
+    int header_length = 0;
+    sqlite3_int64 n_bytes = 0;
+    unsigned char* out;
+    if (state->q_array) {
+        header_length = write_header(NULL, "<f8", false, state->shape, state->shape_len);
+        n_bytes = header_length + state->n_q * (sqlite3_int64) sizeof(double);
+    } else {
+        n_bytes = sizeof(double);
+    }
+    out = malloc(n_bytes);
+    if (out == NULL || kll_quantiles(&state->kll, state->q, state->n_q,
+                                     (double*) (out + header_length)) < 0) {
+        free(out);
+        free(state->q);
+        kll_free(&state->kll);
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    free(state->q);
+    kll_free(&state->kll);
+
+    if (state->q_array) {
+        write_header(out, "<f8", false, state->shape, state->shape_len);
+        sqlite3_result_blob64(context, out, n_bytes, free);
+    } else {
+        double value = *(double*) out;
+        free(out);
+        if (isnan(value))
+            sqlite3_result_null(context);
+        else
+            sqlite3_result_double(context, value);
+    }
+}
+
+int np_sketch_init(sqlite3 *db, Blopy_conn* conn)
+{
+    int rc;
+    rc = create_function(db, conn, "np_histogram", 4, SQLITE_DETERMINISTIC, 0,
+                         0, histogram_step, histogram_final);
+    rc = create_function(db, conn, "np_quantile", 2, SQLITE_DETERMINISTIC, 0,
+                         0, quantile_step, quantile_final);
+    rc = create_function(db, conn, "np_quantile", 3, SQLITE_DETERMINISTIC, 0,
+                         0, quantile_step, quantile_final);
+    return rc;
+}
@@ -0,0 +1,632 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+#include "blopy.h"
+SQLITE_EXTENSION_INIT3
+
+#include <stdlib.h>
+#include <string.h>
+#include "numpy_compress.h"
+#include "numpy_file.h"
+#include "numpy_layout.h"
+
+/// Slicing of numpy BLOBs. Every function returns a new numpy BLOB with the selected elements
+/// (same dtype and memory order as the input).
+///   np_head(col, num), np_tail(col, num)                : first/last `num` rows
+///   np_slice(col, spec)                                 : numpy slicing, e.g. '10:20, ::2'
+///   np_head(table, column, rowid, num), np_tail(...)    : the same, but without loading the
+///   np_slice(table, column, rowid, spec)                  BLOB; see below
+///   np_slice(table, column, rowid, start, count)        : `count` rows from `start` on
+///   np_field(col, name)                                 : a field of a structured dtype
+///   np_file(path, spec)                                 : np_slice of an .npy file
+/// The variants with (table, column, rowid) open the BLOB with sqlite3_blob_open and read only
+/// the header and the byte ranges that hold selected elements. This saves loading (and
+/// copying) the whole array but sqlite still has to find the overflow pages of the BLOB.
+/// With auto_vacuum enabled it finds them through the pointer map instead of walking the chain
+/// of pages.
+/// Of compressed BLOBs only the chunks with selected elements are read and decoded.
+
+// What is selected along one axis: `count` elements, starting at `start`, `step` apart
+struct Slice_axis {
+    long start;
+    long step;
+    long count;
+    bool drop; // selected by a single integer, the axis does not show up in the result
+};
+typedef struct Slice_axis Slice_axis;
+
+// Where the bytes come from: either the BLOB is in memory or it is read incrementally. The
+// data of a compressed BLOB comes from the chunk reader, which uses one of both
+struct Source {
+    sqlite3_blob* blob;
+    const unsigned char* data;
+    Chunk_reader* reader;
+    int decode_rc;  // the last error of the chunk reader (numpy_compress.c), for its message
+};
+typedef struct Source Source;
+
+/// Maps the errors of numpy_compress.c to sqlite result codes. A damaged value is the error of
+/// the value, not of the database file, so no SQLITE_CORRUPT
+static int chunk_rc(int rc)
+{
+    return rc == 0 ? SQLITE_OK : rc == -3 ? SQLITE_NOMEM : rc < 0 ? SQLITE_ERROR : rc;
+}
+
+/// Reads `n` bytes at `offset`, which counts from the start of the BLOB as if it was not
+/// compressed
+static int source_read(Source* src, void* dst, long n, long offset)
+{
+    if (src->reader != NULL) {
+        int rc = chunk_reader_read(src->reader, dst, n, offset - src->reader->header_data->offset);
+        if (rc < 0)
+            src->decode_rc = rc;
+        return chunk_rc(rc);
+    }
+    if (src->blob != NULL)
+        return sqlite3_blob_read(src->blob, dst, (int) n, (int) offset);
+    memcpy(dst, src->data + offset, n);
+    return SQLITE_OK;
+}
+
+// A Blob_read for the chunk reader
+static int blob_read(void* ctx, void* dst, long n, long offset)
+{
+    return sqlite3_blob_read(ctx, dst, (int) n, (int) offset);
+}
+
+/// Normalizes start:stop:step for an axis of length n, exactly like python's slice.indices
+static void slice_indices(long n, bool has_start, long start, bool has_stop, long stop, long step,
+                          Slice_axis* axis)
+{
+    if (step > 0) {
+        start = has_start ? (start < 0 ? start + n : start) : 0;
+        stop = has_stop ? (stop < 0 ? stop + n : stop) : n;
+        start = start < 0 ? 0 : (start > n ? n : start);
+        stop = stop < 0 ? 0 : (stop > n ? n : stop);
+        axis->count = stop > start ? (stop - start + step - 1) / step : 0;
+    } else {
+        start = has_start ? (start < 0 ? start + n : start) : n - 1;
+        stop = has_stop ? (stop < 0 ? stop + n : stop) : -1;
+        start = start < -1 ? -1 : (start >= n ? n - 1 : start);
+        stop = stop < -1 ? -1 : (stop >= n ? n - 1 : stop);
+        axis->count = start > stop ? (start - stop - step - 1) / -step : 0;
+    }
+    axis->start = start;
+    axis->step = step;
+    axis->drop = false;
+}
+
+static void select_all(const Header_data* header_data, Slice_axis* axes)
+{
+    for (int k = 0; k < header_data->shape_len; k++) {
+        slice_indices(header_data->shape[k], false, 0, false, 0, 1, &axes[k]);
+    }
+}
+
+/// Reads an optional integer at *p. @Returns false if there is none
+static bool parse_long(const char** p, long* value)
+{
+    while (**p == ' ')
+        (*p)++;
+    char* end;
+    *value = strtol(*p, &end, 10);
+    if (end == *p)
+        return false;
+    *p = end;
+    while (**p == ' ')
+        (*p)++;
+    return true;
+}
+
+/// Parses a numpy slicing expression like "3", "10:20, ::2" or "-5:" into one Slice_axis per
+/// axis. Axes without an entry are selected completely.
+/// @Returns NULL or an error message
+static const char* parse_slice_spec(const char* spec, const Header_data* header_data,
+                                    Slice_axis* axes)
+{
+    select_all(header_data, axes);
+
+    const char* p = spec;
+    int k = 0;
+    while (*p != '\0') {
+        if (k == header_data->shape_len)
+            return "too many indices for array";
+        long n = header_data->shape[k];
+
+        long start, stop, step = 1;
+        bool has_start = parse_long(&p, &start);
+        if (*p != ':') {
+            // A single index
+            if (!has_start)
+                return "invalid slice";
+            if (start < -n || start >= n)
+                return "index out of bounds";
+            axes[k].start = start < 0 ? start + n : start;
+            axes[k].step = 1;
+            axes[k].count = 1;
+            axes[k].drop = true;
+        } else {
+            p++;
+            bool has_stop = parse_long(&p, &stop);
+            if (*p == ':') {
+                p++;
+                if (!parse_long(&p, &step))
+                    step = 1;
+                if (step == 0)
+                    return "slice step cannot be zero";
+            }
+            slice_indices(n, has_start, start, has_stop, stop, step, &axes[k]);
+        }
+
+        if (*p == ',')
+            p++;
+        else if (*p != '\0')
+            return "invalid slice";
+        while (*p == ' ')
+            p++;
+        k++;
+    }
+    return NULL;
+}
+
+/// Copies the selected elements to `out` in the memory order of the input (C or Fortran).
+/// Elements along the fastest axis are read as one run if they are adjacent, as one span that is
+/// then picked from if they lie close together, and one by one otherwise.
+static int gather(Source* src, const Header_data* header_data, const Slice_axis* axes,
+                  unsigned char* out)
+{
+    int nd = header_data->shape_len;
+    long ws = header_data->wordsize_in_bytes;
+
+    if (nd == 0)
+        return source_read(src, out, ws, header_data->offset);
+    for (int k = 0; k < nd; k++) {
+        if (axes[k].count == 0)
+            return SQLITE_OK;
+    }
+
+    int inner = header_data->fortran_order ? 0 : nd-1;
+    long run_count = axes[inner].count;
+    long run_stride = header_data->strides[inner] * axes[inner].step;
+    long span = (run_count-1) * (run_stride < 0 ? -run_stride : run_stride) + ws;
+    bool use_span = run_stride != ws && span <= 8 * run_count * ws;
+
+    unsigned char* tmp = NULL;
+    if (use_span) {
+        tmp = malloc(span);
+        if (tmp == NULL)
+            return SQLITE_NOMEM;
+    }
+
+    int64_t counter[NPY_MAXDIMS] = {0};
+    int rc = SQLITE_OK;
+    while (rc == SQLITE_OK) {
+        long base = header_data->offset;
+        for (int k = 0; k < nd; k++) {
+            base += (axes[k].start + counter[k] * axes[k].step) * header_data->strides[k];
+        }
+
+        if (run_stride == ws) {
+            rc = source_read(src, out, run_count * ws, base);
+        } else if (use_span) {
+            long low = run_stride < 0 ? base + (run_count-1) * run_stride : base;
+            rc = source_read(src, tmp, span, low);
+            for (long i = 0; i < run_count; i++) {
+                memcpy(out + i*ws, tmp + (base - low) + i*run_stride, ws);
+            }
+        } else {
+            for (long i = 0; i < run_count && rc == SQLITE_OK; i++) {
+                rc = source_read(src, out + i*ws, ws, base + i*run_stride);
+            }
+        }
+        out += run_count * ws;
+
+        // Next run: count up the other axes, the fastest one (in memory) first
+        int j;
+        for (j = 1; j < nd; j++) {
+            int k = header_data->fortran_order ? j : nd-1-j;
+            if (++counter[k] < axes[k].count)
+                break;
+            counter[k] = 0;
+        }
+        if (j == nd)
+            break;
+    }
+
+    free(tmp);
+    return rc;
+}
+
+/// Builds the result BLOB for the selection `axes` and hands it to sqlite
+static void result_slice(sqlite3_context *context, Source* src, const Header_data* header_data,
+                         const Slice_axis* axes)
+{
+    if (reject_structured(header_data)) {
+        sqlite3_result_error(context, STRUCTURED_ERROR, -1);
+        return;
+    }
+
+    int64_t shape[NPY_MAXDIMS];
+    int shape_len = 0;
+    sqlite3_int64 size = 1;
+    for (int k = 0; k < header_data->shape_len; k++) {
+        if (!axes[k].drop)
+            shape[shape_len++] = axes[k].count;
+        size *= axes[k].count;
+    }
+
+    bool fortran_order = header_data->fortran_order && shape_len > 1;
+    int header_length = write_header(NULL, header_data->descr, fortran_order, shape, shape_len);
+    sqlite3_int64 n_bytes = header_length + size * header_data->wordsize_in_bytes;
+    unsigned char* out = malloc(n_bytes);
+    if (out == NULL) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    write_header(out, header_data->descr, fortran_order, shape, shape_len);
+
+    int rc = gather(src, header_data, axes, out + header_length);
+    if (rc != SQLITE_OK) {
+        free(out);
+        if (rc == SQLITE_ERROR && src->decode_rc < 0)
+            sqlite3_result_error(context, compress_error(src->decode_rc), -1);
+        else
+            sqlite3_result_error_code(context, rc);
+        return;
+    }
+    sqlite3_result_blob64(context, out, n_bytes, free);
+}
+
+/// Selects rows along the first axis: the first `num` (head), the last `num` (tail) or `num`
+/// from `start` on
+static const char* select_rows(const Header_data* header_data, Slice_axis* axes, long start,
+                               long num)
+{
+    if (header_data->shape_len == 0)
+        return "cannot slice a 0-d array";
+    if (num < 0)
+        return "number of rows must not be negative";
+
+    select_all(header_data, axes);
+    long n = header_data->shape[0];
+    if (start < 0)
+        start += n;
+    start = start < 0 ? 0 : (start > n ? n : start);
+    axes[0].start = start;
+    axes[0].count = num < n - start ? num : n - start;
+    return NULL;
+}
+
+// The kinds of slicing, stored as `op` in the user data
+#define SLICE_HEAD  0
+#define SLICE_TAIL  1
+#define SLICE_SPEC  2
+#define SLICE_RANGE 3
+
+/// Selects according to the kind of slicing and the arguments from `arg` on
+static const char* select_by_args(const Header_data* header_data, int op, sqlite3_value **argv,
+                                  int arg, Slice_axis* axes)
+{
+    switch (op) {
+    case SLICE_HEAD:
+        return select_rows(header_data, axes, 0, sqlite3_value_int64(argv[arg]));
+    case SLICE_TAIL: {
+        long num = sqlite3_value_int64(argv[arg]);
+        long n = header_data->shape_len > 0 ? header_data->shape[0] : 0;
+        return select_rows(header_data, axes, num < n ? n - num : 0, num);
+    }
+    case SLICE_RANGE:
+        return select_rows(header_data, axes, sqlite3_value_int64(argv[arg]),
+                           sqlite3_value_int64(argv[arg+1]));
+    default: {
+        const char* spec = (const char*) sqlite3_value_text(argv[arg]);
+        return parse_slice_spec(spec != NULL ? spec : "", header_data, axes);
+    }
+    }
+}
+
+/// np_head(col, num), np_tail(col, num) and np_slice(col, spec) on a BLOB value
+/// The identity if input is not a BLOB at all
+static void numpy_slice(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    if (sqlite3_value_type(argv[0]) != SQLITE_BLOB) {
+        sqlite3_result_value(context, argv[0]);
+        return;
+    }
+
+    const Header_data* header_data = blob_header(context, argv, 0);
+    if (header_data == NULL)
+        return;
+    const unsigned char* blob = sqlite3_value_blob(argv[0]);
+    int n_bytes = sqlite3_value_bytes(argv[0]);
+    if (!header_data->compressed
+            && (sqlite3_int64) header_data->size * header_data->wordsize_in_bytes
+               > n_bytes - header_data->offset) {
+        sqlite3_result_error(context, "numpy BLOB is shorter than its shape", -1);
+        return;
+    }
+
+    Slice_axis axes[NPY_MAXDIMS];
+    int op = ((Blopy_func*) sqlite3_user_data(context))->op;
+    const char* error = select_by_args(header_data, op, argv, 1, axes);
+    if (error != NULL) {
+        sqlite3_result_error(context, error, -1);
+        return;
+    }
+
+    Source src = {NULL, blob, NULL};
+    if (!header_data->compressed) {
+        result_slice(context, &src, header_data, axes);
+        return;
+    }
+    Chunk_reader reader;
+    int rc = chunk_reader_open(&reader, header_data, blob, n_bytes, NULL, NULL);
+    if (rc < 0) {
+        sqlite3_result_error(context, compress_error(rc), -1);
+    } else {
+        src.reader = &reader;
+        result_slice(context, &src, header_data, axes);
+    }
+    chunk_reader_close(&reader);
+}
+
+// The field of np_field, kept as auxdata of the name argument for the header it was looked up in
+struct Field_cache {
+    const Header_data* header_data; // a reference, so the pointer cannot be reused by another
+    Field_data field;
+};
+typedef struct Field_cache Field_cache;
+
+static void field_cache_free(void* ptr)
+{
+    Field_cache* cache = ptr;
+    header_release((void*) cache->header_data);
+    sqlite3_free(cache);
+}
+
+/// np_field(col, name): the field `name` of an array of records (a structured dtype), e.g.
+///   np_field(points, 'x'), np_field(points, 'pos.lat') for a nested structure
+/// as a numpy BLOB of the field's dtype and the shape of the array (followed by the shape of a
+/// subarray field like ('v', '<f4', (3,))). The field is picked out of the records in place,
+/// with the record size as stride, the result is always in C order.
+/// The identity if input is not a BLOB at all
+static void numpy_field(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    if (sqlite3_value_type(argv[0]) != SQLITE_BLOB) {
+        sqlite3_result_value(context, argv[0]);
+        return;
+    }
+    const char* name = (const char*) sqlite3_value_text(argv[1]);
+    const Header_data* header_data = blob_header(context, argv, 0);
+    if (header_data == NULL || name == NULL)
+        return;
+
+    // Headers are shared through the cache, so the field of the last row usually fits
+    Field_cache* cache = sqlite3_get_auxdata(context, 1);
+    if (cache == NULL || cache->header_data != header_data) {
+        Field_data field;
+        int rc = read_field(sqlite3_value_blob(argv[0]), sqlite3_value_bytes(argv[0]), name, &field);
+        if (rc < 0) {
+            sqlite3_result_error(context, header_error(rc), -1);
+            return;
+        }
+        cache = sqlite3_malloc(sizeof(*cache));
+        if (cache == NULL) {
+            sqlite3_result_error_nomem(context);
+            return;
+        }
+        header_retain(header_data);
+        cache->header_data = header_data;
+        cache->field = field;
+        sqlite3_set_auxdata(context, 1, cache, field_cache_free);
+    }
+    const Field_data* field = &cache->field;
+
+    int64_t shape[NPY_MAXDIMS];
+    int shape_len = header_data->shape_len + field->shape_len;
+    if (shape_len > NPY_MAXDIMS) {
+        sqlite3_result_error(context, "too many dimensions", -1);
+        return;
+    }
+    memcpy(shape, header_data->shape, header_data->shape_len * sizeof(int64_t));
+    memcpy(shape + header_data->shape_len, field->shape, field->shape_len * sizeof(int64_t));
+
+    // Compressed records are decoded, all others read in place
+    const unsigned char* data = blob_payload(context, argv[0], &header_data, 0, 0);
+    if (data == NULL)
+        return;
+
+    int header_length = write_header(NULL, field->descr, false, shape, shape_len);
+    sqlite3_int64 n_bytes = header_length + header_data->size * field->size;
+    unsigned char* out = malloc(n_bytes);
+    if (out == NULL) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    write_header(out, field->descr, false, shape, shape_len);
+
+    // The records in C order, like an odometer over their strides
+    unsigned char* dst = out + header_length;
+    int nd = header_data->shape_len;
+    int64_t index[NPY_MAXDIMS] = {0};
+    int64_t pos = field->offset;
+    for (int64_t i = 0; i < header_data->size; i++) {
+        memcpy(dst + i * field->size, data + pos, field->size);
+        for (int k = nd-1; k >= 0; k--) {
+            pos += header_data->strides[k];
+            if (++index[k] < header_data->shape[k])
+                break;
+            pos -= index[k] * header_data->strides[k];
+            index[k] = 0;
+        }
+    }
+    sqlite3_result_blob64(context, out, n_bytes, free);
+}
+
+/// Opens table.column at rowid for incremental reading. `table` may be given as schema.table
+static int open_blob(sqlite3_context *context, sqlite3_value **argv, sqlite3_blob** blob)
+{
+    sqlite3* db = sqlite3_context_db_handle(context);
+    const char* table = (const char*) sqlite3_value_text(argv[0]);
+    const char* column = (const char*) sqlite3_value_text(argv[1]);
+    if (table == NULL || column == NULL)
+        return SQLITE_MISUSE;
+
+    char* schema = NULL;
+    const char* dot = strchr(table, '.');
+    if (dot != NULL) {
+        schema = sqlite3_mprintf("%.*s", (int) (dot - table), table);
+        table = dot + 1;
+    }
+
+    int rc = sqlite3_blob_open(db, schema != NULL ? schema : "main", table, column,
+                               sqlite3_value_int64(argv[2]), 0, blob);
+    sqlite3_free(schema);
+    if (rc != SQLITE_OK)
+        sqlite3_result_error(context, sqlite3_errmsg(db), -1);
+    return rc;
+}
+
+/// The (table, column, rowid, ...) variants of np_head, np_tail and np_slice
+static void numpy_slice_incremental(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    sqlite3_blob* blob;
+    if (open_blob(context, argv, &blob) != SQLITE_OK)
+        return;
+    int n_bytes = sqlite3_blob_bytes(blob);
+
+    // Read the beginning of the BLOB, which holds the whole header for all but a few arrays
+    unsigned char first[512];
+    int n_read = n_bytes < (int) sizeof(first) ? n_bytes : (int) sizeof(first);
+    unsigned char* head = first;
+    int rc = sqlite3_blob_read(blob, first, n_read, 0);
+
+    if (rc == SQLITE_OK) {
+        int64_t header_length = header_size(first, n_read);
+        if (header_length > n_read && header_length <= n_bytes) {
+            head = malloc(header_length);
+            if (head == NULL)
+                rc = SQLITE_NOMEM;
+            else
+                rc = sqlite3_blob_read(blob, head, (int) header_length, 0);
+            n_read = (int) header_length;
+        }
+    }
+
+    const Header_data* header_data = NULL;
+    if (rc == SQLITE_OK) {
+        Blopy_func* func = sqlite3_user_data(context);
+        header_data = header_cache_get(func->conn->cache, head, n_read, &rc);
+        if (header_data == NULL)
+            sqlite3_result_error(context, header_error(rc), -1);
+        else if (!header_data->compressed
+                 && (sqlite3_int64) header_data->size * header_data->wordsize_in_bytes
+                    > n_bytes - header_data->offset)
+            sqlite3_result_error(context, "numpy BLOB is shorter than its shape", -1);
+        else {
+            Slice_axis axes[NPY_MAXDIMS];
+            int op = func->op;
+            const char* error = select_by_args(header_data, op, argv, 3, axes);
+            Source src = {blob, NULL, NULL};
+            Chunk_reader reader;
+            if (error == NULL && header_data->compressed) {
+                // Only the directory and the chunks with selected elements are read
+                rc = chunk_reader_open(&reader, header_data, NULL, n_bytes, blob_read, blob);
+                if (rc < 0)
+                    error = compress_error(rc);
+                else if (rc > 0)
+                    error = sqlite3_errstr(rc);
+                src.reader = &reader;
+            }
+            if (error != NULL)
+                sqlite3_result_error(context, error, -1);
+            else
+                result_slice(context, &src, header_data, axes);
+            if (src.reader != NULL)
+                chunk_reader_close(&reader);
+        }
+    } else {
+        sqlite3_result_error_code(context, rc);
+    }
+
+    if (header_data != NULL)
+        header_release((void*) header_data);
+    if (head != first)
+        free(head);
+    sqlite3_blob_close(blob);
+}
+
+/// np_file(path, spec): np_slice of the .npy file `path` (see blopy_file.c), for files of any
+/// size. The file is memory mapped, so only the pages that hold selected elements are read
+static void numpy_slice_file(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    const char* path = (const char*) sqlite3_value_text(argv[0]);
+    if (path == NULL) {
+        sqlite3_result_null(context);
+        return;
+    }
+    const unsigned char* map;
+    int64_t n_bytes;
+    int rc = file_map(path, 0, -1, &map, &n_bytes);
+    if (rc < 0) {
+        char* error = sqlite3_mprintf("np_file: %s: %s", file_error(rc), path);
+        sqlite3_result_error(context, error, -1);
+        sqlite3_free(error);
+        return;
+    }
+
+    Blopy_func* func = sqlite3_user_data(context);
+    const Header_data* header_data = header_cache_get(func->conn->cache, map, n_bytes, &rc);
+    const char* error = NULL;
+    if (header_data == NULL)
+        error = header_error(rc);
+    else if (!header_data->compressed
+             && header_data->size * (int64_t) header_data->wordsize_in_bytes
+                > n_bytes - header_data->offset)
+        error = "numpy BLOB is shorter than its shape";
+
+    Slice_axis axes[NPY_MAXDIMS];
+    if (error == NULL)
+        error = select_by_args(header_data, func->op, argv, 1, axes);
+    Source src = {NULL, map, NULL};
+    Chunk_reader reader;
+    if (error == NULL && header_data->compressed) {
+        rc = chunk_reader_open(&reader, header_data, map, n_bytes, NULL, NULL);
+        if (rc < 0)
+            error = compress_error(rc);
+        src.reader = &reader;
+    }
+    if (error != NULL)
+        sqlite3_result_error(context, error, -1);
+    else
+        result_slice(context, &src, header_data, axes);
+    if (src.reader != NULL)
+        chunk_reader_close(&reader);
+
+    if (header_data != NULL)
+        header_release((void*) header_data);
+    file_unmap((void*) map);
+}
+
+int np_slice_init(sqlite3 *db, Blopy_conn* conn)
+{
+    int rc;
+    rc = create_function(db, conn, "np_head", 2, SQLITE_DETERMINISTIC, SLICE_HEAD,
+                         numpy_slice, 0, 0);
+    rc = create_function(db, conn, "np_tail", 2, SQLITE_DETERMINISTIC, SLICE_TAIL,
+                         numpy_slice, 0, 0);
+    rc = create_function(db, conn, "np_slice", 2, SQLITE_DETERMINISTIC, SLICE_SPEC,
+                         numpy_slice, 0, 0);
+    rc = create_function(db, conn, "np_field", 2, SQLITE_DETERMINISTIC, 0, numpy_field, 0, 0);
+
+    // These read from the database or a file and are therefore not deterministic
+    rc = create_function(db, conn, "np_head", 4, 0, SLICE_HEAD, numpy_slice_incremental, 0, 0);
+    rc = create_function(db, conn, "np_tail", 4, 0, SLICE_TAIL, numpy_slice_incremental, 0, 0);
+    rc = create_function(db, conn, "np_slice", 4, 0, SLICE_SPEC, numpy_slice_incremental, 0, 0);
+    rc = create_function(db, conn, "np_slice", 5, 0, SLICE_RANGE, numpy_slice_incremental, 0, 0);
+    rc = create_function(db, conn, "np_file", 2, SQLITE_DIRECTONLY, SLICE_SPEC, numpy_slice_file,
+                         0, 0);
+    return rc;
+}
@@ -0,0 +1,158 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+#include "blopy.h"
+SQLITE_EXTENSION_INIT3
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include "numpy_layout.h"
+
+/// np_stack(col): an aggregate that stacks the arrays of all rows into a single numpy BLOB of
+/// shape (number of rows, *shape of a row), like numpy.stack. All arrays must have the same
+/// dtype and shape. NULLs are skipped.
+///
+/// The payloads are appended to one buffer that doubles its size whenever it runs out. Room for
+/// the header is reserved at its beginning (enough for INT_MAX rows) and the header is written
+/// only once at the end, padded to exactly that room. So the buffer can be handed to sqlite as
+/// it is.
+
+struct Stack_state {
+    unsigned char* arena;
+    sqlite3_int64 len;      // bytes used, including the reserved header
+    sqlite3_int64 cap;
+    int header_reserve;
+    int n_rows;
+
+    // Taken from the first row, all others have to match
+    char descr[DESCR_MAXLEN+1];
+    int64_t shape[NPY_MAXDIMS]; int shape_len;
+    sqlite3_int64 row_bytes;
+    bool failed;
+};
+typedef struct Stack_state Stack_state;
+
+static bool stack_reserve(Stack_state* state, sqlite3_int64 extra)
+{
+    if (state->len + extra <= state->cap)
+        return true;
+
+    sqlite3_int64 cap = state->cap > 0 ? state->cap : state->header_reserve + 8 * extra;
+    while (state->len + extra > cap)
+        cap *= 2;
+    unsigned char* arena = realloc(state->arena, cap);
+    if (arena == NULL)
+        return false;
+    state->arena = arena;
+    state->cap = cap;
+    return true;
+}
+
+/// Appends the elements of a row in C order. Rows in Fortran order are transposed on the way
+static void append_row(Stack_state* state, const Header_data* header_data,
+                       const unsigned char* data)
+{
+    to_c_order(header_data, data, state->arena + state->len);
+    state->len += state->row_bytes;
+    state->n_rows++;
+}
+
+/// Checks a row (its elements at `data`) against the first one and appends it
+/// @Returns NULL or an error message
+static const char* stack_row(Stack_state* state, const Header_data* header_data,
+                             const unsigned char* data)
+{
+    sqlite3_int64 row_bytes = (sqlite3_int64) header_data->size * header_data->wordsize_in_bytes;
+
+    if (state->arena == NULL) {
+        if (header_data->shape_len >= NPY_MAXDIMS)
+            return "np_stack: too many dimensions";
+        if (reject_structured(header_data))
+            return "np_stack: " STRUCTURED_ERROR;
+        memcpy(state->descr, header_data->descr, sizeof(state->descr));
+        memcpy(state->shape + 1, header_data->shape, header_data->shape_len * sizeof(int64_t));
+        state->shape_len = header_data->shape_len + 1;
+        state->row_bytes = row_bytes;
+
+        // The longest header this result can get: INT_MAX rows
+        state->shape[0] = INT_MAX;
+        state->header_reserve = write_header(NULL, state->descr, false, state->shape,
+                                             state->shape_len);
+        state->len = state->header_reserve;
+    } else if (strcmp(state->descr, header_data->descr) != 0
+               || state->shape_len != header_data->shape_len + 1
+               || memcmp(state->shape + 1, header_data->shape,
+                         header_data->shape_len * sizeof(int64_t)) != 0) {
+        return "np_stack: all arrays must have the same dtype and shape";
+    }
+
+    if (state->n_rows == INT_MAX || !stack_reserve(state, row_bytes))
+        return "np_stack: out of memory";
+    append_row(state, header_data, data);
+    return NULL;
+}
+
+static void stack_step(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    Stack_state* state = sqlite3_aggregate_context(context, sizeof(*state));
+    if (state == NULL) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    if (state->failed || sqlite3_value_type(argv[0]) == SQLITE_NULL)
+        return;
+    if (sqlite3_value_type(argv[0]) != SQLITE_BLOB) {
+        state->failed = true;
+        sqlite3_result_error(context, "np_stack: not a numpy BLOB", -1);
+        return;
+    }
+
+    const Header_data* header_data = blob_header_ref(context, argv, 0);
+    if (header_data == NULL) {
+        state->failed = true;
+        return;
+    }
+    // Big-endian rows are swapped, so they stack with little-endian ones of the same type
+    const Header_data* native = header_data;
+    const unsigned char* data = blob_payload(context, argv[0], &native, 0, BLOB_NATIVE);
+    if (data == NULL) {
+        header_release((void*) header_data);
+        state->failed = true;
+        return;
+    }
+    const char* error = stack_row(state, native, data);
+    header_release((void*) header_data);
+    if (error != NULL) {
+        state->failed = true;
+        sqlite3_result_error(context, error, -1);
+    }
+}
+
+static void stack_final(sqlite3_context *context)
+{
+    Stack_state* state = sqlite3_aggregate_context(context, 0);
+    if (state == NULL || state->failed || state->arena == NULL) {
+        // No rows at all (or an error was reported already)
+        if (state != NULL)
+            free(state->arena);
+        sqlite3_result_null(context);
+        return;
+    }
+
+    state->shape[0] = state->n_rows;
+    write_header_len(state->arena, state->header_reserve, state->descr, false,
+                     state->shape, state->shape_len);
+
+    // sqlite takes over the buffer
+    sqlite3_result_blob64(context, state->arena, state->len, free);
+    state->arena = NULL;
+}
+
+int np_stack_init(sqlite3 *db, Blopy_conn* conn)
+{
+    return create_function(db, conn, "np_stack", 1, SQLITE_DETERMINISTIC, 0,
+                           0, stack_step, stack_final);
+}
@@ -0,0 +1,455 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+// The only file that calls sqlite3_result_error and friends directly (see blopy.h)
+#define BLOPY_STATS_FILE
+#include "blopy.h"
+SQLITE_EXTENSION_INIT3
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+/// np_stats: what every function and module of the extension cost on this connection so far,
+/// one row per name (all numbers of arguments of a function share one):
+///   SELECT name, calls, bytes, header_parses, header_hits FROM np_stats ORDER BY bytes DESC
+/// Columns:
+///   calls         : calls of scalar functions, steps of aggregates and window functions, scans
+///                   of virtual tables
+///   bytes         : of the BLOB arguments, i.e. the payload handed to the function
+///   header_parses : headers that had to be parsed (not in the connection's cache)
+///   header_hits   : headers that were not parsed again (cache or auxdata of an argument)
+///   allocations   : results sqlite does not hold already (allocated or copied) and growths of
+///                   the scratch buffers of blob_payload. Memory an aggregate keeps between its
+///                   steps is not counted
+///   errors        : calls that failed
+///   nanoseconds   : wall clock time, only counted with np_config('stats', 2)
+/// np_stats_reset() sets all of them back to 0. np_config('stats', 0) stops the counting.
+///
+/// sqlite calls the functions through stats_func, stats_step, ... (see create_function), which
+/// count and then call the real one through the Blopy_func. The counters of a name are in a
+/// cache line of their own, so the counting is a handful of additions per call. The clock is
+/// not read by default, it costs about as much as a small function itself. Calls can nest (e.g.
+/// np_ann runs SQL in xFilter): the time and the header counts of the outer one include those
+/// of the inner one.
+
+// initial-exec: no call to __tls_get_addr for every access, the pointer fits into the static
+// TLS glibc keeps for libraries that are loaded later
+#if defined(_MSC_VER)
+#define THREAD_LOCAL __declspec(thread)
+#elif defined(__GNUC__)
+#define THREAD_LOCAL _Thread_local __attribute__((tls_model("initial-exec")))
+#else
+#define THREAD_LOCAL _Thread_local
+#endif
+
+// A call that is being counted
+struct Stats_frame {
+    Blopy_stats* stats;
+    struct Stats_frame* outer;
+    int64_t hits, parses;        // of the header cache when the call started
+    sqlite3_int64 start;         // in nanoseconds, if `timed`
+    sqlite3_int64 allocations;
+    bool timed;
+    bool error;
+};
+typedef struct Stats_frame Stats_frame;
+
+// The innermost call of this thread, for the result functions below
+static THREAD_LOCAL Stats_frame* current;
+
+static sqlite3_int64 now(void)
+{
+    struct timespec ts;
+#ifdef _WIN32
+    timespec_get(&ts, TIME_UTC);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#endif
+    return ts.tv_sec * (sqlite3_int64) 1000000000 + ts.tv_nsec;
+}
+
+/// Returns the counters of `name`, which are added if there are none yet. `name` has to stay
+/// valid as long as the connection (the names of the init functions are string literals).
+/// @Returns the counters or NULL if there is no memory or room for them
+Blopy_stats* stats_entry(Blopy_conn* conn, const char* name)
+{
+    for (int i = 0; i < conn->n_stats; i++) {
+        if (strcmp(conn->stats[i].name, name) == 0)
+            return &conn->stats[i];
+    }
+    if (conn->stats == NULL) {
+        // One more entry leaves room to align the first one to a cache line
+        conn->stats_memory = sqlite3_malloc64((BLOPY_MAX_STATS + 1) * sizeof(Blopy_stats));
+        if (conn->stats_memory == NULL)
+            return NULL;
+        uintptr_t align = _Alignof(Blopy_stats);
+        conn->stats = (Blopy_stats*) (((uintptr_t) conn->stats_memory + align - 1)
+                                      / align * align);
+    }
+    if (conn->n_stats == BLOPY_MAX_STATS)
+        return NULL;
+    Blopy_stats* stats = &conn->stats[conn->n_stats++];
+    memset(stats, 0, sizeof(*stats));
+    stats->name = name;
+    return stats;
+}
+
+static void frame_begin(Stats_frame* frame, Blopy_conn* conn, Blopy_stats* stats)
+{
+    frame->stats = stats;
+    frame->outer = current;
+    header_cache_counts(conn->cache, &frame->hits, &frame->parses);
+    frame->allocations = 0;
+    frame->error = false;
+    frame->timed = conn->stats_level > 1;
+    if (frame->timed)
+        frame->start = now();
+    current = frame;
+}
+
+static void frame_end(Stats_frame* frame, Blopy_conn* conn)
+{
+    Blopy_stats* stats = frame->stats;
+    if (frame->timed)
+        stats->nanoseconds += now() - frame->start;
+    int64_t hits, parses;
+    header_cache_counts(conn->cache, &hits, &parses);
+    stats->header_hits += hits - frame->hits;
+    stats->header_parses += parses - frame->parses;
+    stats->allocations += frame->allocations;
+    stats->errors += frame->error;
+    current = frame->outer;
+}
+
+static void count_arguments(Blopy_stats* stats, int argc, sqlite3_value **argv)
+{
+    stats->calls++;
+    for (int i = 0; i < argc; i++) {
+        if (sqlite3_value_type(argv[i]) == SQLITE_BLOB)
+            stats->bytes += sqlite3_value_bytes(argv[i]);
+    }
+}
+
+/// The xFunc sqlite calls for every function of create_function
+void stats_func(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    Blopy_func* func = sqlite3_user_data(context);
+    if (func->conn->stats_level == 0) {
+        func->xFunc(context, argc, argv);
+        return;
+    }
+    Stats_frame frame;
+    frame_begin(&frame, func->conn, func->stats);
+    count_arguments(func->stats, argc, argv);
+    func->xFunc(context, argc, argv);
+    frame_end(&frame, func->conn);
+}
+
+void stats_step(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    Blopy_func* func = sqlite3_user_data(context);
+    if (func->conn->stats_level == 0) {
+        func->xStep(context, argc, argv);
+        return;
+    }
+    Stats_frame frame;
+    frame_begin(&frame, func->conn, func->stats);
+    count_arguments(func->stats, argc, argv);
+    func->xStep(context, argc, argv);
+    frame_end(&frame, func->conn);
+}
+
+void stats_inverse(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    Blopy_func* func = sqlite3_user_data(context);
+    if (func->conn->stats_level == 0) {
+        func->xInverse(context, argc, argv);
+        return;
+    }
+    Stats_frame frame;
+    frame_begin(&frame, func->conn, func->stats);
+    count_arguments(func->stats, argc, argv);
+    func->xInverse(context, argc, argv);
+    frame_end(&frame, func->conn);
+}
+
+/// xFinal and xValue are not calls of their own, only their cost is counted
+void stats_final(sqlite3_context *context)
+{
+    Blopy_func* func = sqlite3_user_data(context);
+    if (func->conn->stats_level == 0) {
+        func->xFinal(context);
+        return;
+    }
+    Stats_frame frame;
+    frame_begin(&frame, func->conn, func->stats);
+    func->xFinal(context);
+    frame_end(&frame, func->conn);
+}
+
+void stats_value(sqlite3_context *context)
+{
+    Blopy_func* func = sqlite3_user_data(context);
+    if (func->conn->stats_level == 0) {
+        func->xValue(context);
+        return;
+    }
+    Stats_frame frame;
+    frame_begin(&frame, func->conn, func->stats);
+    func->xValue(context);
+    frame_end(&frame, func->conn);
+}
+
+/// Calls the xFilter of a module and counts it as a call of `stats` (see register_module)
+int stats_filter(Blopy_conn* conn, Blopy_stats* stats,
+                 int (*xFilter)(sqlite3_vtab_cursor*, int, const char*, int, sqlite3_value**),
+                 sqlite3_vtab_cursor *pCursor, int idxNum, const char *idxStr, int argc,
+                 sqlite3_value **argv)
+{
+    if (stats == NULL || conn->stats_level == 0)
+        return xFilter(pCursor, idxNum, idxStr, argc, argv);
+    Stats_frame frame;
+    frame_begin(&frame, conn, stats);
+    count_arguments(stats, argc, argv);
+    int rc = xFilter(pCursor, idxNum, idxStr, argc, argv);
+    frame.error |= rc != SQLITE_OK;
+    frame_end(&frame, conn);
+    return rc;
+}
+
+/// A header that was taken from the auxdata of an argument (see blob_header)
+void stats_header_hit(void)
+{
+    if (current != NULL)
+        current->stats->header_hits++;
+}
+
+/// Memory that had to be allocated (see scratch_get)
+void stats_allocation(void)
+{
+    if (current != NULL)
+        current->allocations++;
+}
+
+static void count_error(void)
+{
+    if (current != NULL)
+        current->error = true;
+}
+
+/// sqlite copies results with SQLITE_TRANSIENT, others are handed over with their destructor
+static void count_result(void (*destructor)(void*))
+{
+    if (current != NULL && destructor != SQLITE_STATIC)
+        current->allocations++;
+}
+
+void stats_result_error(sqlite3_context *context, const char* message, int n)
+{
+    count_error();
+    sqlite3_result_error(context, message, n);
+}
+
+void stats_result_error_nomem(sqlite3_context *context)
+{
+    count_error();
+    sqlite3_result_error_nomem(context);
+}
+
+void stats_result_error_code(sqlite3_context *context, int code)
+{
+    count_error();
+    sqlite3_result_error_code(context, code);
+}
+
+void stats_result_blob64(sqlite3_context *context, const void* data, sqlite3_uint64 n,
+                         void (*destructor)(void*))
+{
+    count_result(destructor);
+    sqlite3_result_blob64(context, data, n, destructor);
+}
+
+void stats_result_text(sqlite3_context *context, const char* text, int n,
+                       void (*destructor)(void*))
+{
+    count_result(destructor);
+    sqlite3_result_text(context, text, n, destructor);
+}
+
+void stats_result_text64(sqlite3_context *context, const char* text, sqlite3_uint64 n,
+                         void (*destructor)(void*), unsigned char encoding)
+{
+    count_result(destructor);
+    sqlite3_result_text64(context, text, n, destructor, encoding);
+}
+
+#define NP_STATS_NAME        0
+#define NP_STATS_CALLS       1
+#define NP_STATS_BYTES       2
+#define NP_STATS_PARSES      3
+#define NP_STATS_HITS        4
+#define NP_STATS_ALLOCATIONS 5
+#define NP_STATS_ERRORS      6
+#define NP_STATS_NANOSECONDS 7
+
+typedef struct Stats_vtab {
+    sqlite3_vtab base;
+    Blopy_conn* conn;
+    Blopy_stats* stats;  // of np_stats itself
+} Stats_vtab;
+
+typedef struct Stats_cursor {
+    sqlite3_vtab_cursor base;
+    int i;  // current entry
+} Stats_cursor;
+
+static int stats_connect(sqlite3 *db, void *pAux, int argc, const char *const*argv,
+                         sqlite3_vtab **ppVtab, char **pzErr)
+{
+    int rc = sqlite3_declare_vtab(db,
+        "CREATE TABLE x(name TEXT, calls INTEGER, bytes INTEGER, header_parses INTEGER, "
+        "header_hits INTEGER, allocations INTEGER, errors INTEGER, nanoseconds INTEGER)");
+    if (rc != SQLITE_OK)
+        return rc;
+
+    Stats_vtab* vtab = sqlite3_malloc(sizeof(*vtab));
+    if (vtab == NULL)
+        return SQLITE_NOMEM;
+    memset(vtab, 0, sizeof(*vtab));
+    vtab->conn = pAux;
+    vtab->stats = stats_entry(vtab->conn, "np_stats");
+    sqlite3_vtab_config(db, SQLITE_VTAB_INNOCUOUS);
+
+    *ppVtab = &vtab->base;
+    return SQLITE_OK;
+}
+
+static int stats_disconnect(sqlite3_vtab *pVtab)
+{
+    sqlite3_free(pVtab);
+    return SQLITE_OK;
+}
+
+static int stats_open(sqlite3_vtab *pVtab, sqlite3_vtab_cursor **ppCursor)
+{
+    Stats_cursor* cur = sqlite3_malloc(sizeof(*cur));
+    if (cur == NULL)
+        return SQLITE_NOMEM;
+    memset(cur, 0, sizeof(*cur));
+    *ppCursor = &cur->base;
+    return SQLITE_OK;
+}
+
+static int stats_close(sqlite3_vtab_cursor *pCursor)
+{
+    sqlite3_free(pCursor);
+    return SQLITE_OK;
+}
+
+static int stats_next(sqlite3_vtab_cursor *pCursor)
+{
+    ((Stats_cursor*) pCursor)->i++;
+    return SQLITE_OK;
+}
+
+static int stats_eof(sqlite3_vtab_cursor *pCursor)
+{
+    Stats_vtab* vtab = (Stats_vtab*) pCursor->pVtab;
+    return ((Stats_cursor*) pCursor)->i >= vtab->conn->n_stats;
+}
+
+static int stats_column(sqlite3_vtab_cursor *pCursor, sqlite3_context *ctx, int i)
+{
+    Stats_vtab* vtab = (Stats_vtab*) pCursor->pVtab;
+    const Blopy_stats* stats = &vtab->conn->stats[((Stats_cursor*) pCursor)->i];
+    switch (i) {
+    case NP_STATS_NAME:
+        sqlite3_result_text(ctx, stats->name, -1, SQLITE_STATIC);
+        break;
+    case NP_STATS_CALLS:       sqlite3_result_int64(ctx, stats->calls); break;
+    case NP_STATS_BYTES:       sqlite3_result_int64(ctx, stats->bytes); break;
+    case NP_STATS_PARSES:      sqlite3_result_int64(ctx, stats->header_parses); break;
+    case NP_STATS_HITS:        sqlite3_result_int64(ctx, stats->header_hits); break;
+    case NP_STATS_ALLOCATIONS: sqlite3_result_int64(ctx, stats->allocations); break;
+    case NP_STATS_ERRORS:      sqlite3_result_int64(ctx, stats->errors); break;
+    case NP_STATS_NANOSECONDS: sqlite3_result_int64(ctx, stats->nanoseconds); break;
+    }
+    return SQLITE_OK;
+}
+
+static int stats_rowid(sqlite3_vtab_cursor *pCursor, sqlite_int64 *pRowid)
+{
+    *pRowid = ((Stats_cursor*) pCursor)->i;
+    return SQLITE_OK;
+}
+
+static int stats_scan(sqlite3_vtab_cursor *pCursor, int idxNum, const char *idxStr,
+                      int argc, sqlite3_value **argv)
+{
+    ((Stats_cursor*) pCursor)->i = 0;
+    return SQLITE_OK;
+}
+
+static int stats_filter_counted(sqlite3_vtab_cursor *pCursor, int idxNum, const char *idxStr,
+                                int argc, sqlite3_value **argv)
+{
+    Stats_vtab* vtab = (Stats_vtab*) pCursor->pVtab;
+    return stats_filter(vtab->conn, vtab->stats, stats_scan, pCursor, idxNum, idxStr, argc,
+                        argv);
+}
+
+static int stats_best_index(sqlite3_vtab *pVtab, sqlite3_index_info *pInfo)
+{
+    Stats_vtab* vtab = (Stats_vtab*) pVtab;
+    pInfo->estimatedCost = vtab->conn->n_stats;
+    pInfo->estimatedRows = vtab->conn->n_stats;
+    return SQLITE_OK;
+}
+
+static sqlite3_module stats_module = {
+    0,                     /* iVersion */
+    0,                     /* xCreate: eponymous only */
+    stats_connect,         /* xConnect */
+    stats_best_index,      /* xBestIndex */
+    stats_disconnect,      /* xDisconnect */
+    0,                     /* xDestroy */
+    stats_open,            /* xOpen */
+    stats_close,           /* xClose */
+    stats_filter_counted,  /* xFilter */
+    stats_next,            /* xNext */
+    stats_eof,             /* xEof */
+    stats_column,          /* xColumn */
+    stats_rowid,           /* xRowid */
+    /* all others (xUpdate, transactions, ...) are 0 */
+};
+
+/// np_stats_reset(): sets all counters back to 0. Returns NULL
+static void numpy_stats_reset(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    Blopy_conn* conn = ((Blopy_func*) sqlite3_user_data(context))->conn;
+    for (int i = 0; i < conn->n_stats; i++) {
+        Blopy_stats* stats = &conn->stats[i];
+        const char* name = stats->name;
+        memset(stats, 0, sizeof(*stats));
+        stats->name = name;
+    }
+    // The call that is running is counted after it returns. Its header counts start again here
+    for (Stats_frame* frame = current; frame != NULL; frame = frame->outer) {
+        if (frame->stats >= conn->stats && frame->stats < conn->stats + conn->n_stats)
+            header_cache_counts(conn->cache, &frame->hits, &frame->parses);
+    }
+    sqlite3_result_null(context);
+}
+
+int np_stats_init(sqlite3 *db, Blopy_conn* conn)
+{
+    int rc;
+    rc = create_function(db, conn, "np_stats_reset", 0, 0, 0, numpy_stats_reset, 0, 0);
+    if (rc != SQLITE_OK)
+        return rc;
+    return register_module(db, conn, "np_stats", &stats_module);
+}
@@ -0,0 +1,153 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+#include "blopy.h"
+SQLITE_EXTENSION_INIT3
+
+#include <stdlib.h>
+#include <string.h>
+#include "numpy_accumulate.h"
+#include "numpy_layout.h"
+
+/// np_sum_rows(col), np_mean_rows(col): element-wise sum and mean of the arrays of all rows, like
+/// numpy.sum(numpy.stack(arrays), axis=0), as a numpy BLOB of the same shape. All arrays must
+/// have the same dtype and shape, NULLs are skipped. The sum of integers is '<i8' ('<u8' for
+/// unsigned ones), everything else is '<f8'.
+///
+/// Both are window functions as well. The running sum stays in the aggregate context, every row
+/// that enters the frame is added and every row that leaves it is taken away again (xInverse),
+/// so a rolling mean costs two arrays per row, however wide the frame is:
+///   SELECT ts, np_mean_rows(spectrum) OVER (ORDER BY ts ROWS 10 PRECEDING) FROM t;
+/// (np_sum and np_mean are taken: they reduce the elements of a single array.)
+
+enum Window_op {
+    WINDOW_SUM,
+    WINDOW_MEAN
+};
+
+struct Window_state {
+    Accumulator acc;
+    int64_t shape[NPY_MAXDIMS]; int shape_len;  // from the first row, all others have to match
+    bool started;
+    bool failed;
+};
+typedef struct Window_state Window_state;
+
+static void window_error(sqlite3_context *context, const char* message)
+{
+    enum Window_op op = ((Blopy_func*) sqlite3_user_data(context))->op;
+    char* error = sqlite3_mprintf("%s: %s", op == WINDOW_SUM ? "np_sum_rows" : "np_mean_rows",
+                                  message);
+    sqlite3_result_error(context, error, -1);
+    sqlite3_free(error);
+}
+
+/// Adds (sign 1) or takes away (sign -1) the array of argv[0]
+static void window_add(sqlite3_context *context, sqlite3_value **argv, int sign)
+{
+    Window_state* state = sqlite3_aggregate_context(context, sizeof(*state));
+    if (state == NULL) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    if (state->failed || sqlite3_value_type(argv[0]) == SQLITE_NULL)
+        return;
+    if (sqlite3_value_type(argv[0]) != SQLITE_BLOB) {
+        state->failed = true;
+        window_error(context, "not a numpy BLOB");
+        return;
+    }
+
+    const Header_data* header_data = blob_header_ref(context, argv, 0);
+    if (header_data == NULL) {
+        state->failed = true;
+        return;
+    }
+    const Header_data* native = header_data;
+    const unsigned char* data = blob_payload(context, argv[0], &native, 0,
+                                             BLOB_NATIVE | BLOB_C_ORDER);
+    if (data == NULL) {
+        header_release((void*) header_data);
+        state->failed = true;
+        return;
+    }
+
+    const char* error = NULL;
+    int rc = 0;
+    if (!state->started) {
+        rc = accumulator_init(&state->acc, native->dtype, native->size);
+        memcpy(state->shape, native->shape, native->shape_len * sizeof(int64_t));
+        state->shape_len = native->shape_len;
+        state->started = true;
+    } else if (native->dtype != state->acc.dtype || native->shape_len != state->shape_len
+               || memcmp(native->shape, state->shape, state->shape_len * sizeof(int64_t)) != 0) {
+        error = "all arrays must have the same dtype and shape";
+    }
+    if (rc == 0 && error == NULL)
+        rc = accumulator_add(&state->acc, data, sign);
+    header_release((void*) header_data);
+
+    if (rc == -1) {
+        state->failed = true;
+        sqlite3_result_error(context, "data type not supported", -1);
+    } else if (rc == -3 || error != NULL) {
+        state->failed = true;
+        window_error(context, rc == -3 ? "out of memory" : error);
+    }
+}
+
+static void window_step(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    window_add(context, argv, 1);
+}
+
+static void window_inverse(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    window_add(context, argv, -1);
+}
+
+/// The current sum or mean as a numpy BLOB, NULL if the frame has no arrays
+static void window_value(sqlite3_context *context)
+{
+    Window_state* state = sqlite3_aggregate_context(context, 0);
+    if (state == NULL || state->failed || !state->started || state->acc.rows == 0) {
+        sqlite3_result_null(context);
+        return;
+    }
+
+    enum Window_op op = ((Blopy_func*) sqlite3_user_data(context))->op;
+    const char* descr = op == WINDOW_SUM ? accumulator_descr(&state->acc) : "<f8";
+    int header_length = write_header(NULL, descr, false, state->shape, state->shape_len);
+    sqlite3_int64 n_bytes = header_length + state->acc.size * (sqlite3_int64) 8;
+    unsigned char* out = malloc(n_bytes);
+    if (out == NULL) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    write_header(out, descr, false, state->shape, state->shape_len);
+    if (op == WINDOW_SUM)
+        accumulator_sum(&state->acc, out + header_length);
+    else
+        accumulator_mean(&state->acc, (double*) (out + header_length));
+    sqlite3_result_blob64(context, out, n_bytes, free);
+}
+
+static void window_final(sqlite3_context *context)
+{
+    window_value(context);
+    Window_state* state = sqlite3_aggregate_context(context, 0);
+    if (state != NULL)
+        accumulator_free(&state->acc);
+}
+
+int np_window_init(sqlite3 *db, Blopy_conn* conn)
+{
+    int rc;
+    rc = create_window_function(db, conn, "np_sum_rows", 1, SQLITE_DETERMINISTIC, WINDOW_SUM,
+                                window_step, window_final, window_value, window_inverse);
+    rc = create_window_function(db, conn, "np_mean_rows", 1, SQLITE_DETERMINISTIC, WINDOW_MEAN,
+                                window_step, window_final, window_value, window_inverse);
+    return rc;
+}
@@ -0,0 +1,209 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+#include "numpy_accumulate.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "numpy_convert.h"
+
+// Elements converted per step (8 KiB)
+#define BLOCK 1024
+
+static bool is_unsigned(Dtype_code dtype)
+{
+    return dtype == DTYPE_U1 || dtype == DTYPE_U2 || dtype == DTYPE_U4 || dtype == DTYPE_U8;
+}
+
+static bool is_integer(Dtype_code dtype)
+{
+    return dtype == DTYPE_B1 || dtype == DTYPE_I1 || dtype == DTYPE_I2 || dtype == DTYPE_I4
+        || dtype == DTYPE_I8 || is_unsigned(dtype);
+}
+
+/// @Returns true for the real dtypes: booleans, integers and floats
+bool accumulator_dtype(Dtype_code dtype)
+{
+    return convertible(dtype) && dtype != DTYPE_C8 && dtype != DTYPE_C16;
+}
+
+/// Starts an empty sum of arrays of `size` elements of dtype `dtype`.
+/// @Returns 0, -1 if the dtype is not supported or -3 if memory ran out
+int accumulator_init(Accumulator* acc, Dtype_code dtype, int64_t size)
+{
+    memset(acc, 0, sizeof(*acc));
+    if (!accumulator_dtype(dtype))
+        return -1;
+    acc->dtype = dtype;
+    acc->integer = is_integer(dtype);
+    acc->size = size;
+    size_t n = size > 0 ? size : 1;
+    if (acc->integer) {
+        acc->exact = calloc(n, sizeof(int64_t));
+        if (acc->exact == NULL)
+            return -3;
+    } else {
+        acc->sum = calloc(n, sizeof(double));
+        acc->compensation = calloc(n, sizeof(double));
+        if (acc->sum == NULL || acc->compensation == NULL) {
+            accumulator_free(acc);
+            return -3;
+        }
+    }
+    return 0;
+}
+
+/// Counts the infinities and NaN of a block (one bit is not enough: the same element may be
+/// NaN in several arrays of a window)
+static int count_nonfinite(Accumulator* acc, const double* values, int64_t start, int64_t n,
+                           int sign)
+{
+    if (acc->n_nan == NULL) {
+        acc->n_nan = calloc(acc->size, sizeof(int32_t));
+        acc->n_inf = calloc(acc->size, sizeof(int32_t));
+        acc->n_neg_inf = calloc(acc->size, sizeof(int32_t));
+        if (acc->n_nan == NULL || acc->n_inf == NULL || acc->n_neg_inf == NULL)
+            return -3;
+    }
+    for (int64_t i = 0; i < n; i++) {
+        double value = values[i];
+        if (isnan(value))
+            acc->n_nan[start + i] += sign;
+        else if (value == INFINITY)
+            acc->n_inf[start + i] += sign;
+        else if (value == -INFINITY)
+            acc->n_neg_inf[start + i] += sign;
+    }
+    return 0;
+}
+
+/// Adds (sign 1) or takes away (sign -1) the array at `data`: `size` elements of the dtype of
+/// the accumulator in native byte order.
+/// @Returns 0 or -3 if memory ran out
+int accumulator_add(Accumulator* acc, const unsigned char* data, int sign)
+{
+    Convert_mode mode = {false, ROUND_TRUNC};
+    int64_t n = acc->size;
+
+    if (acc->integer) {
+        int64_t block[BLOCK];
+        // Unsigned arithmetic wraps around without undefined behaviour
+        uint64_t* exact = (uint64_t*) acc->exact;
+        for (int64_t start = 0; start < n; start += BLOCK) {
+            int64_t m = n - start < BLOCK ? n - start : BLOCK;
+            const uint64_t* values;
+            if (acc->dtype == DTYPE_I8 || acc->dtype == DTYPE_U8) {
+                values = (const uint64_t*) data + start;
+            } else {
+                convert_array(acc->dtype, data + start * dtype_size(acc->dtype), DTYPE_I8,
+                              (unsigned char*) block, m, &mode);
+                values = (const uint64_t*) block;
+            }
+            if (sign > 0) {
+                for (int64_t i = 0; i < m; i++)
+                    exact[start + i] += values[i];
+            } else {
+                for (int64_t i = 0; i < m; i++)
+                    exact[start + i] -= values[i];
+            }
+        }
+        acc->rows += sign;
+        return 0;
+    }
+
+    double block[BLOCK];
+    double* sum = acc->sum;
+    double* compensation = acc->compensation;
+    for (int64_t start = 0; start < n; start += BLOCK) {
+        int64_t m = n - start < BLOCK ? n - start : BLOCK;
+        const double* values;
+        if (acc->dtype == DTYPE_F8) {
+            values = (const double*) data + start;
+        } else {
+            convert_array(acc->dtype, data + start * dtype_size(acc->dtype), DTYPE_F8,
+                          (unsigned char*) block, m, &mode);
+            values = block;
+        }
+
+        // Neumaier's summation, branch-free so it vectorizes. Infinities and NaN count as 0
+        int nonfinite = 0;
+        for (int64_t i = 0; i < m; i++) {
+            double x = values[i] * sign;
+            bool finite = x - x == 0;
+            nonfinite |= !finite;
+            x = finite ? x : 0;
+            double s = sum[start + i];
+            double t = s + x;
+            compensation[start + i] += fabs(s) >= fabs(x) ? (s - t) + x : (x - t) + s;
+            sum[start + i] = t;
+        }
+        if (nonfinite && count_nonfinite(acc, values, start, m, sign) < 0)
+            return -3;
+    }
+    acc->rows += sign;
+    return 0;
+}
+
+/// The element i of a float sum, with the infinities and NaN put back
+static double float_sum(const Accumulator* acc, int64_t i)
+{
+    double value = acc->sum[i] + acc->compensation[i];
+    if (acc->n_nan != NULL) {
+        if (acc->n_nan[i] > 0 || (acc->n_inf[i] > 0 && acc->n_neg_inf[i] > 0))
+            return NAN;
+        if (acc->n_inf[i] > 0)
+            return INFINITY;
+        if (acc->n_neg_inf[i] > 0)
+            return -INFINITY;
+    }
+    return value;
+}
+
+/// Writes the sum to `out`, `size` elements of the dtype accumulator_descr names
+void accumulator_sum(const Accumulator* acc, unsigned char* out)
+{
+    if (acc->integer) {
+        memcpy(out, acc->exact, acc->size * sizeof(int64_t));
+        return;
+    }
+    double* result = (double*) out;
+    for (int64_t i = 0; i < acc->size; i++)
+        result[i] = float_sum(acc, i);
+}
+
+/// Writes the mean (the sum divided by the number of arrays) to `out`, `size` doubles
+void accumulator_mean(const Accumulator* acc, double* out)
+{
+    double rows = (double) acc->rows;
+    for (int64_t i = 0; i < acc->size; i++) {
+        if (!acc->integer)
+            out[i] = float_sum(acc, i) / rows;
+        else if (is_unsigned(acc->dtype))
+            out[i] = (double) (uint64_t) acc->exact[i] / rows;
+        else
+            out[i] = (double) acc->exact[i] / rows;
+    }
+}
+
+/// @Returns the descr of the sum, like numpy: '<u8' for unsigned integers, '<i8' for other
+/// integers and booleans, '<f8' for floats
+const char* accumulator_descr(const Accumulator* acc)
+{
+    if (!acc->integer)
+        return "<f8";
+    return is_unsigned(acc->dtype) ? "<u8" : "<i8";
+}
+
+void accumulator_free(Accumulator* acc)
+{
+    free(acc->exact);
+    free(acc->sum);
+    free(acc->compensation);
+    free(acc->n_nan);
+    free(acc->n_inf);
+    free(acc->n_neg_inf);
+    memset(acc, 0, sizeof(*acc));
+}
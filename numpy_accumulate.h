@@ -0,0 +1,44 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+#ifndef NUMPYACCUMULATE_FILE
+#define NUMPYACCUMULATE_FILE
+#include <stdbool.h>
+#include <stdint.h>
+#include "numpy_reader.h"
+
+/// NOTE This is not a sqlite extention. Wrapper code is in blopy_window.c
+
+/// Element-wise running sum of arrays of the same shape, to which arrays can be added and from
+/// which they can be taken away again (a sliding window). Integers and booleans are summed
+/// exactly in 64 bit (wrapping around like numpy). Floats are summed as doubles with a second
+/// array for the rounding error (Neumaier), so taking an array away again leaves (nearly) the
+/// sum of the others rather than the rounding errors of all arrays seen. Infinities and NaN are
+/// counted instead of summed, so they leave the sum with the array they came with.
+
+struct Accumulator {
+    Dtype_code dtype;  // of the arrays added
+    bool integer;      // summed in `exact`, otherwise in `sum` and `compensation`
+    int64_t size;      // elements per array
+    int64_t rows;      // arrays added minus arrays taken away
+    int64_t* exact;
+    double* sum;
+    double* compensation;
+    // Allocated when the first one comes along
+    int32_t* n_nan;
+    int32_t* n_inf;      // +inf
+    int32_t* n_neg_inf;
+};
+typedef struct Accumulator Accumulator;
+
+// Public:
+extern bool accumulator_dtype(Dtype_code dtype);
+extern int accumulator_init(Accumulator* acc, Dtype_code dtype, int64_t size);
+extern int accumulator_add(Accumulator* acc, const unsigned char* data, int sign);
+extern void accumulator_sum(const Accumulator* acc, unsigned char* out);
+extern void accumulator_mean(const Accumulator* acc, double* out);
+extern const char* accumulator_descr(const Accumulator* acc);
+extern void accumulator_free(Accumulator* acc);
+#endif
@@ -0,0 +1,166 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+**/
+
+#include "numpy_ann.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LANES 8
+
+/// Fills `header_data` for a 1-d array of `dim` elements of type `descr`, as if it was read
+/// from a BLOB. The index stores bare payloads and uses this header for all of them.
+/// @Returns the result of read_header
+int vector_header(const char* descr, int dim, Header_data* header_data)
+{
+    unsigned char header[128];
+    int64_t shape = dim;
+    int len = write_header(NULL, descr, false, &shape, 1);
+    if (len > (int) sizeof(header))
+        return -4;
+    write_header(header, descr, false, &shape, 1);
+    return read_header(header, len, header_data);
+}
+
+static double squared_distance(const double* a, const double* b, int dim)
+{
+    double lane[LANES] = {0};
+    int i = 0;
+    for (; i + LANES <= dim; i += LANES)
+        for (int k = 0; k < LANES; k++) {
+            double d = a[i+k] - b[i+k];
+            lane[k] += d*d;
+        }
+    double sum = 0;
+    for (; i < dim; i++)
+        sum += (a[i] - b[i]) * (a[i] - b[i]);
+    for (int k = 0; k < LANES; k++)
+        sum += lane[k];
+    return sum;
+}
+
+static void normalize(double* v, int dim)
+{
+    double norm = 0;
+    for (int i = 0; i < dim; i++)
+        norm += v[i] * v[i];
+    norm = sqrt(norm);
+    if (norm > 0) {
+        for (int i = 0; i < dim; i++)
+            v[i] /= norm;
+    }
+}
+
+// A small deterministic generator, so that the same data always gives the same index
+static unsigned long long next_random(unsigned long long* state)
+{
+    *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+    return *state >> 33;
+}
+
+/// Lloyd's k-means on the `n` rows (of `dim` values each) in `data`, k <= n. The initial
+/// centroids are k distinct random rows. Clusters that run empty restart at a random row.
+/// With `spherical` the centroids are normalized after each step (the rows should be as well),
+/// which clusters by cosine distance.
+/// The k * dim result goes to `centroids`.
+/// @Returns 0, or -3 if memory ran out
+int kmeans(const double* data, long n, int dim, int k, bool spherical, int iterations,
+           double* centroids)
+{
+    int* assignment = malloc(n * sizeof(int));
+    long* order = malloc(n * sizeof(long));
+    long* counts = malloc(k * sizeof(long));
+    if (assignment == NULL || order == NULL || counts == NULL) {
+        free(assignment); free(order); free(counts);
+        return -3;
+    }
+
+    unsigned long long seed = 42;
+    for (long i = 0; i < n; i++)
+        order[i] = i;
+    for (int c = 0; c < k; c++) {
+        long pick = c + next_random(&seed) % (n - c);
+        long tmp = order[c]; order[c] = order[pick]; order[pick] = tmp;
+        memcpy(centroids + (size_t) c*dim, data + (size_t) order[c]*dim, dim * sizeof(double));
+    }
+    for (long i = 0; i < n; i++)
+        assignment[i] = -1;
+
+    for (int iteration = 0; iteration < iterations; iteration++) {
+        long changed = 0;
+        for (long i = 0; i < n; i++) {
+            int best = 0;
+            double best_distance = INFINITY;
+            for (int c = 0; c < k; c++) {
+                double d = squared_distance(data + (size_t) i*dim, centroids + (size_t) c*dim, dim);
+                if (d < best_distance) {
+                    best_distance = d;
+                    best = c;
+                }
+            }
+            if (assignment[i] != best) {
+                assignment[i] = best;
+                changed++;
+            }
+        }
+        if (changed == 0)
+            break;
+
+        memset(centroids, 0, (size_t) k * dim * sizeof(double));
+        memset(counts, 0, k * sizeof(long));
+        for (long i = 0; i < n; i++) {
+            double* centroid = centroids + (size_t) assignment[i]*dim;
+            const double* row = data + (size_t) i*dim;
+            for (int j = 0; j < dim; j++)
+                centroid[j] += row[j];
+            counts[assignment[i]]++;
+        }
+        for (int c = 0; c < k; c++) {
+            double* centroid = centroids + (size_t) c*dim;
+            if (counts[c] == 0) {
+                memcpy(centroid, data + (size_t) (next_random(&seed) % n)*dim,
+                       dim * sizeof(double));
+                continue;
+            }
+            for (int j = 0; j < dim; j++)
+                centroid[j] /= counts[c];
+            if (spherical)
+                normalize(centroid, dim);
+        }
+    }
+
+    free(assignment);
+    free(order);
+    free(counts);
+    return 0;
+}
+
+/// Finds the `nprobe` centroids nearest to `vector` (described by `header_data`) under the
+/// metric `op`. For DISTANCE_DOT the largest inner product counts as nearest.
+/// @Returns the number of lists written to `lists` (nearest first), or -3 if memory ran out
+int nearest_lists(Distance_op op, const double* centroids, int n_lists, int dim,
+                  const Header_data* header_data, const void* vector, int nprobe, int* lists)
+{
+    Header_data centroid_header;
+    vector_header("<f8", dim, &centroid_header);
+
+    if (nprobe > n_lists)
+        nprobe = n_lists;
+    Topk_entry* heap = malloc((nprobe + 1) * sizeof(*heap));
+    if (heap == NULL)
+        return -3;
+
+    int n = 0;
+    for (int c = 0; c < n_lists; c++) {
+        double d;
+        distance(op, &centroid_header, centroids + (size_t) c*dim, header_data, vector, &d);
+        topk_push(heap, &n, nprobe, op == DISTANCE_DOT ? -d : d, c);
+    }
+    topk_sort(heap, n);
+    for (int i = 0; i < n; i++)
+        lists[i] = (int) heap[i].id;
+    free(heap);
+    return n;
+}
@@ -0,0 +1,25 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+#ifndef NUMPYANN_FILE
+#define NUMPYANN_FILE
+#include <stdbool.h>
+#include "numpy_reader.h"
+#include "numpy_distance.h"
+
+/// NOTE This is not a sqlite extention. Wrapper code is in blopy_ann.c
+
+/// Building blocks of an IVF-flat index: the vectors are clustered by k-means, each vector is
+/// stored in the list of its nearest centroid and a query only visits the lists of the
+/// `nprobe` centroids nearest to it.
+
+// Public:
+extern int vector_header(const char* descr, int dim, Header_data* header_data);
+extern int kmeans(const double* data, long n, int dim, int k, bool spherical, int iterations,
+                  double* centroids);
+extern int nearest_lists(Distance_op op, const double* centroids, int n_lists, int dim,
+                         const Header_data* header_data, const void* vector, int nprobe,
+                         int* lists);
+#endif
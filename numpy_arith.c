@@ -0,0 +1,458 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+**/
+
+#include "numpy_arith.h"
+#include <complex.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Elements are converted (if needed) and processed in blocks of this many
+#define BLOCK 512
+
+/// The kernels work on operands of the result type T only and with a stride of 1 (array) or 0
+/// (scalar or broadcast axis). Written as plain loops gcc/clang vectorize them at -O3.
+/// U is the type the integer operations are done in: unsigned, so that overflows wrap around
+/// like in numpy instead of being undefined behaviour. For floats and complex it is T itself.
+#define ARITH_LOOP(T, EXPR)                                                             \
+    if (sa == 1 && sb == 1) {                                                           \
+        for (long i = 0; i < n; i++) {                                                  \
+            T x = a[i], y = b[i];                                                       \
+            out[i] = EXPR;                                                              \
+        }                                                                               \
+    } else if (sa == 1) {                                                               \
+        T y = b[0];                                                                     \
+        for (long i = 0; i < n; i++) {                                                  \
+            T x = a[i];                                                                 \
+            out[i] = EXPR;                                                              \
+        }                                                                               \
+    } else if (sb == 1) {                                                               \
+        T x = a[0];                                                                     \
+        for (long i = 0; i < n; i++) {                                                  \
+            T y = b[i];                                                                 \
+            out[i] = EXPR;                                                              \
+        }                                                                               \
+    } else {                                                                            \
+        T x = a[0], y = b[0];                                                           \
+        for (long i = 0; i < n; i++)                                                    \
+            out[i] = EXPR;                                                              \
+    }
+
+#define DEFINE_ARITH_KERNELS(SUFFIX, T, U)                                              \
+static void kernel_##SUFFIX(Arith_op op, void* ptr_out, const void* ptr_a, long sa,     \
+                            const void* ptr_b, long sb, const void* ptr_c, long n)      \
+{                                                                                       \
+    T* out = ptr_out;                                                                   \
+    const T* a = ptr_a;                                                                 \
+    const T* b = ptr_b;                                                                 \
+    T c = ptr_c != NULL ? *(const T*) ptr_c : 0;                                        \
+    switch (op) {                                                                       \
+    case ARITH_ADD:   ARITH_LOOP(T, (T) ((U) x + (U) y)) break;                          \
+    case ARITH_SUB:   ARITH_LOOP(T, (T) ((U) x - (U) y)) break;                          \
+    case ARITH_MUL:   ARITH_LOOP(T, (T) ((U) x * (U) y)) break;                          \
+    /* Only reached for float and complex types, see result_dtype */                    \
+    case ARITH_DIV:   ARITH_LOOP(T, x / y) break;                                        \
+    case ARITH_SCALE: ARITH_LOOP(T, (T) ((U) x * (U) y + (U) c)) break;                  \
+    }                                                                                   \
+}                                                                                       \
+                                                                                        \
+/* Copies n elements of any supported dtype, `stride` bytes apart, as T to `out`.       \
+   Complex ones only ever go to complex T, see promote */                               \
+static void convert_##SUFFIX(void* ptr_out, Dtype_code dtype, const unsigned char* src, \
+                             long stride, long n)                                       \
+{                                                                                       \
+    T* out = ptr_out;                                                                   \
+    switch (dtype) {                                                                    \
+    case DTYPE_I1: CONVERT_LOOP(signed char) break;                                     \
+    case DTYPE_I2: CONVERT_LOOP(short) break;                                           \
+    case DTYPE_I4: CONVERT_LOOP(int) break;                                             \
+    case DTYPE_I8: CONVERT_LOOP(long long) break;                                       \
+    case DTYPE_U1: CONVERT_LOOP(unsigned char) break;                                   \
+    case DTYPE_U2: CONVERT_LOOP(unsigned short) break;                                  \
+    case DTYPE_U4: CONVERT_LOOP(unsigned int) break;                                    \
+    case DTYPE_U8: CONVERT_LOOP(unsigned long long) break;                              \
+    case DTYPE_F4: CONVERT_LOOP(float) break;                                           \
+    case DTYPE_F8: CONVERT_LOOP(double) break;                                          \
+    case DTYPE_C8: CONVERT_LOOP(float complex) break;                                   \
+    case DTYPE_C16: CONVERT_LOOP(double complex) break;                                 \
+    default: break;                                                                     \
+    }                                                                                   \
+}                                                                                       \
+                                                                                        \
+static void scalar_##SUFFIX(void* ptr_out, const Arith_operand* scalar)                 \
+{                                                                                       \
+    *(T*) ptr_out = scalar->is_int ? (T) scalar->i : (T) scalar->f;                     \
+}
+
+#define CONVERT_LOOP(S)                                                                 \
+    for (long i = 0; i < n; i++) {                                                      \
+        S v;                                                                            \
+        memcpy(&v, src + i*stride, sizeof(v));                                          \
+        out[i] = v;                                                                     \
+    }
+
+DEFINE_ARITH_KERNELS(i1, signed char, unsigned int)
+DEFINE_ARITH_KERNELS(i2, short, unsigned int)
+DEFINE_ARITH_KERNELS(i4, int, unsigned int)
+DEFINE_ARITH_KERNELS(i8, long long, unsigned long long)
+DEFINE_ARITH_KERNELS(u1, unsigned char, unsigned int)
+DEFINE_ARITH_KERNELS(u2, unsigned short, unsigned int)
+DEFINE_ARITH_KERNELS(u4, unsigned int, unsigned int)
+DEFINE_ARITH_KERNELS(u8, unsigned long long, unsigned long long)
+DEFINE_ARITH_KERNELS(f4, float, float)
+DEFINE_ARITH_KERNELS(f8, double, double)
+DEFINE_ARITH_KERNELS(c8, float complex, float complex)
+DEFINE_ARITH_KERNELS(c16, double complex, double complex)
+
+// Everything the driver needs to know about a result type
+struct Arith_type {
+    Dtype_code dtype;
+    const char* descr;
+    int size;
+    void (*kernel)(Arith_op, void*, const void*, long, const void*, long, const void*, long);
+    void (*convert)(void*, Dtype_code, const unsigned char*, long, long);
+    void (*scalar)(void*, const Arith_operand*);
+};
+typedef struct Arith_type Arith_type;
+
+#define ARITH_TYPE(DTYPE, DESCR, SIZE, SUFFIX) \
+    {DTYPE, DESCR, SIZE, kernel_##SUFFIX, convert_##SUFFIX, scalar_##SUFFIX}
+
+static const Arith_type ARITH_TYPES[] = {
+    ARITH_TYPE(DTYPE_I1, "|i1", 1, i1), ARITH_TYPE(DTYPE_I2, "<i2", 2, i2),
+    ARITH_TYPE(DTYPE_I4, "<i4", 4, i4), ARITH_TYPE(DTYPE_I8, "<i8", 8, i8),
+    ARITH_TYPE(DTYPE_U1, "|u1", 1, u1), ARITH_TYPE(DTYPE_U2, "<u2", 2, u2),
+    ARITH_TYPE(DTYPE_U4, "<u4", 4, u4), ARITH_TYPE(DTYPE_U8, "<u8", 8, u8),
+    ARITH_TYPE(DTYPE_F4, "<f4", 4, f4), ARITH_TYPE(DTYPE_F8, "<f8", 8, f8),
+    ARITH_TYPE(DTYPE_C8, "<c8", 8, c8), ARITH_TYPE(DTYPE_C16, "<c16", 16, c16),
+};
+
+static const Arith_type* arith_type(Dtype_code dtype)
+{
+    for (int i = 0; i < (int) (sizeof(ARITH_TYPES)/sizeof(ARITH_TYPES[0])); i++) {
+        if (ARITH_TYPES[i].dtype == dtype)
+            return &ARITH_TYPES[i];
+    }
+    return NULL;
+}
+
+static bool is_signed(Dtype_code dtype) { return dtype >= DTYPE_I1 && dtype <= DTYPE_I8; }
+static bool is_unsigned(Dtype_code dtype) { return dtype >= DTYPE_U1 && dtype <= DTYPE_U8; }
+static bool is_float(Dtype_code dtype) { return dtype == DTYPE_F4 || dtype == DTYPE_F8; }
+static bool is_complex(Dtype_code dtype) { return dtype == DTYPE_C8 || dtype == DTYPE_C16; }
+
+static Dtype_code int_dtype(bool is_signed, int size)
+{
+    switch (size) {
+    case 1: return is_signed ? DTYPE_I1 : DTYPE_U1;
+    case 2: return is_signed ? DTYPE_I2 : DTYPE_U2;
+    case 4: return is_signed ? DTYPE_I4 : DTYPE_U4;
+    default: return is_signed ? DTYPE_I8 : DTYPE_U8;
+    }
+}
+
+/// numpy's type promotion for two arrays, e.g. i2 + u2 -> i4, i4 + f4 -> f8, i4 / i4 -> f8,
+/// f8 * c8 -> c16
+static Dtype_code promote(Arith_op op, Dtype_code a, Dtype_code b)
+{
+    int size_a = arith_type(a)->size, size_b = arith_type(b)->size;
+    if (is_complex(a) || is_complex(b)) {
+        // complex64 has the precision of float32, see below
+        bool needs_c16 = a == DTYPE_C16 || b == DTYPE_C16 || a == DTYPE_F8 || b == DTYPE_F8
+                      || (!is_complex(a) && !is_float(a) && size_a > 2)
+                      || (!is_complex(b) && !is_float(b) && size_b > 2);
+        return needs_c16 ? DTYPE_C16 : DTYPE_C8;
+    }
+    if (is_float(a) || is_float(b)) {
+        // float32 holds integers of up to 16 bits exactly, anything bigger needs float64
+        bool needs_f8 = a == DTYPE_F8 || b == DTYPE_F8
+                     || (!is_float(a) && size_a > 2) || (!is_float(b) && size_b > 2);
+        return needs_f8 ? DTYPE_F8 : DTYPE_F4;
+    }
+    if (op == ARITH_DIV)
+        return DTYPE_F8;
+    if (is_signed(a) == is_signed(b))
+        return int_dtype(is_signed(a), size_a > size_b ? size_a : size_b);
+
+    // Mixed signedness: a signed type which holds the unsigned one, float64 for u8
+    int size_signed = is_signed(a) ? size_a : size_b;
+    int size_unsigned = is_unsigned(a) ? size_a : size_b;
+    int size = 2*size_unsigned > size_signed ? 2*size_unsigned : size_signed;
+    return size > 8 ? DTYPE_F8 : int_dtype(true, size);
+}
+
+/// A python number meets an array: integers take the dtype of the array, floats that of a float
+/// or complex array (float64 for integer arrays)
+static Dtype_code promote_scalar(Arith_op op, Dtype_code array, const Arith_operand* scalar)
+{
+    if (is_float(array) || is_complex(array))
+        return array;
+    if (!scalar->is_int || op == ARITH_DIV)
+        return DTYPE_F8;
+    return array;
+}
+
+/// The dtype of the result, DTYPE_UNSUPPORTED if an array has a type we do not compute with
+static Dtype_code result_dtype(Arith_op op, const Arith_operand* a, const Arith_operand* b,
+                               const Arith_operand* c)
+{
+    if ((a->header_data != NULL && arith_type(a->header_data->dtype) == NULL)
+            || (b->header_data != NULL && arith_type(b->header_data->dtype) == NULL))
+        return DTYPE_UNSUPPORTED;
+
+    if (a->header_data != NULL && b->header_data != NULL)
+        return promote(op, a->header_data->dtype, b->header_data->dtype);
+
+    const Arith_operand* array = a->header_data != NULL ? a : b;
+    const Arith_operand* scalar = a->header_data != NULL ? b : a;
+    Dtype_code dtype = promote_scalar(op, array->header_data->dtype, scalar);
+    if (op == ARITH_SCALE && c != NULL)
+        dtype = promote_scalar(op, dtype, c);
+    return dtype;
+}
+
+// An operand on its way through the broadcast loop
+struct Arith_input {
+    const Arith_operand* operand;
+    long strides[NPY_MAXDIMS];  // bytes per step along each axis of the result, 0 if broadcast
+    const unsigned char* ptr;   // current position
+    double scalar[2];           // scalars, converted to the result type (up to complex128)
+    bool direct;                // already of the result type, no conversion needed
+};
+typedef struct Arith_input Arith_input;
+
+/// Applies numpy's broadcasting rules to the shapes of `a` and `b` (scalars have no axes).
+/// Sets the shape of the result and the strides each input uses to walk along it.
+/// @Returns the number of axes, or -2 if the shapes do not fit together
+static int broadcast(Arith_input* inputs, int n_inputs, int64_t* shape)
+{
+    int nd = 0;
+    for (int k = 0; k < n_inputs; k++) {
+        const Header_data* header_data = inputs[k].operand->header_data;
+        if (header_data != NULL && header_data->shape_len > nd)
+            nd = header_data->shape_len;
+    }
+
+    for (int axis = 0; axis < nd; axis++) {
+        shape[axis] = 1;
+        for (int k = 0; k < n_inputs; k++) {
+            const Header_data* header_data = inputs[k].operand->header_data;
+            // Shapes are aligned at their last axis, missing axes count as 1
+            int own = header_data != NULL ? axis - (nd - header_data->shape_len) : -1;
+            int64_t dim = own >= 0 ? header_data->shape[own] : 1;
+            if (dim != 1 && shape[axis] != 1 && dim != shape[axis])
+                return -2;
+            if (dim != 1)
+                shape[axis] = dim;
+            inputs[k].strides[axis] = dim != 1 ? header_data->strides[own] : 0;
+        }
+    }
+    return nd;
+}
+
+/// Drops axes of length 1 and merges neighbouring axes that all inputs walk through in one go,
+/// e.g. two C-ordered arrays of the same shape become a single long axis. This keeps the inner
+/// loop long, which is what the kernels are fast at.
+/// @Returns the new number of axes
+static int coalesce(Arith_input* inputs, int n_inputs, int64_t* shape, int nd)
+{
+    int kept = 0;
+    for (int axis = 0; axis < nd; axis++) {
+        if (shape[axis] == 1)
+            continue;
+        bool merge = kept > 0;
+        for (int k = 0; k < n_inputs && merge; k++) {
+            merge = inputs[k].strides[kept-1] == inputs[k].strides[axis] * shape[axis];
+        }
+        if (merge) {
+            shape[kept-1] *= shape[axis];
+            for (int k = 0; k < n_inputs; k++)
+                inputs[k].strides[kept-1] = inputs[k].strides[axis];
+        } else {
+            shape[kept] = shape[axis];
+            for (int k = 0; k < n_inputs; k++)
+                inputs[k].strides[kept] = inputs[k].strides[axis];
+            kept++;
+        }
+    }
+    return kept;
+}
+
+/// Returns a pointer to `m` elements of the result type for the current position of `input`
+/// and their stride (0 or 1). Converts them into `tmp` if they are not usable as they are.
+static const void* block_of(const Arith_type* type, Arith_input* input, long inner_stride,
+                            long j, long m, void* tmp, long* stride)
+{
+    if (input->operand->header_data == NULL) {
+        *stride = 0;
+        return input->scalar;
+    }
+
+    const unsigned char* ptr = input->ptr + j * inner_stride;
+    Dtype_code dtype = input->operand->header_data->dtype;
+    if (inner_stride == 0) {
+        *stride = 0;
+        if (input->direct)
+            return ptr;
+        type->convert(tmp, dtype, ptr, 0, 1);
+        return tmp;
+    }
+
+    *stride = 1;
+    if (input->direct && inner_stride == type->size)
+        return ptr;
+    type->convert(tmp, dtype, ptr, inner_stride, m);
+    return tmp;
+}
+
+// Everything a part of the result needs, see arith_range
+struct Arith_job {
+    Arith_op op;
+    const Arith_type* type;
+    Arith_input inputs[2];      // positioned at the first element
+    const void* scalar_c;
+    int64_t shape[NPY_MAXDIMS]; int nd;
+    unsigned char* out_data;
+    int64_t size;
+    int64_t per_part;
+};
+typedef struct Arith_job Arith_job;
+
+/// Computes the elements `start` to `end` (flat, in C order) of the result
+static void arith_range(const Arith_job* job, int64_t start, int64_t end)
+{
+    const Arith_type* type = job->type;
+    int nd = job->nd;
+    const int64_t* shape = job->shape;
+    // The innermost axis is done by the kernels, all others by the odometer below
+    long inner = nd > 0 ? shape[nd-1] : 1;
+    long inner_strides[2] = {nd > 0 ? job->inputs[0].strides[nd-1] : 0,
+                             nd > 0 ? job->inputs[1].strides[nd-1] : 0};
+
+    // Own copies of the inputs, moved to the position of `start`
+    Arith_input inputs[2] = {job->inputs[0], job->inputs[1]};
+    int64_t index[NPY_MAXDIMS] = {0};
+    int64_t rest = start / inner;
+    for (int axis = nd-2; axis >= 0; axis--) {
+        index[axis] = rest % shape[axis];
+        rest /= shape[axis];
+        for (int k = 0; k < 2; k++)
+            inputs[k].ptr += (long) index[axis] * inputs[k].strides[axis];
+    }
+
+    // Blocks of converted elements. long double keeps them aligned for every type
+    long double tmp[2][BLOCK * 16 / sizeof(long double)];
+
+    long first = (long) (start % inner);
+    for (int64_t done = start - first; done < end; done += inner) {
+        long last = end - done < inner ? (long) (end - done) : inner;
+        for (long j = first; j < last; j += BLOCK) {
+            long m = last - j < BLOCK ? last - j : BLOCK;
+            long sa, sb;
+            const void* block_a = block_of(type, &inputs[0], inner_strides[0], j, m, tmp[0], &sa);
+            const void* block_b = block_of(type, &inputs[1], inner_strides[1], j, m, tmp[1], &sb);
+            type->kernel(job->op, job->out_data + (size_t) (done + j) * type->size, block_a, sa,
+                         block_b, sb, job->scalar_c, m);
+        }
+        first = 0;
+
+        // Next run: count up the outer axes like an odometer
+        for (int axis = nd-2; axis >= 0; axis--) {
+            for (int k = 0; k < 2; k++)
+                inputs[k].ptr += inputs[k].strides[axis];
+            if (++index[axis] < shape[axis])
+                break;
+            for (int k = 0; k < 2; k++)
+                inputs[k].ptr -= (long) index[axis] * inputs[k].strides[axis];
+            index[axis] = 0;
+        }
+    }
+}
+
+static void arith_task(void* arg, long index)
+{
+    const Arith_job* job = arg;
+    int64_t start = index * job->per_part;
+    arith_range(job, start, job->size - start < job->per_part ? job->size : start + job->per_part);
+}
+
+/// Computes `a op b` element by element with broadcasting (for ARITH_SCALE: a * b + c, where b
+/// and c are scalars and c may be NULL) and writes the result as a new numpy BLOB to `*ptr_out`
+/// (malloc'ed, the caller has to free it, length in `*len`).
+/// At least one of `a` and `b` has to be an array. Arrays have to be in native byte order.
+/// A large result is cut into the parts of `parallel` (may be NULL), computed in parallel.
+///
+/// @Returns
+///    *  0, on success
+///    * -1, if a data type is not supported
+///    * -2, if the shapes cannot be broadcast together
+///    * -3, if memory ran out
+///    * -4, if the result would have more than INT_MAX elements
+int arith(Arith_op op, const Arith_operand* a, const Arith_operand* b,
+          const Arith_operand* c, const Parallel* parallel, unsigned char** ptr_out,
+          size_t* len)
+{
+    Dtype_code dtype = result_dtype(op, a, b, c);
+    if (dtype == DTYPE_UNSUPPORTED)
+        return -1;
+    const Arith_type* type = arith_type(dtype);
+
+    Arith_job job = {.op = op, .type = type, .inputs = {{.operand = a}, {.operand = b}}};
+    Arith_input* inputs = job.inputs;
+    int64_t* shape = job.shape;
+    int nd = broadcast(inputs, 2, shape);
+    if (nd < 0)
+        return nd;
+
+    long long size = 1;
+    for (int axis = 0; axis < nd; axis++) {
+        size *= shape[axis];
+        if (size > INT_MAX)
+            return -4;
+    }
+
+    int header_length = write_header(NULL, type->descr, false, shape, nd);
+    unsigned char* out = malloc(header_length + (size_t) size * type->size);
+    if (out == NULL)
+        return -3;
+    write_header(out, type->descr, false, shape, nd);
+    *ptr_out = out;
+    *len = header_length + (size_t) size * type->size;
+
+    double scalar_c[2];
+    if (c != NULL)
+        type->scalar(scalar_c, c);
+    for (int k = 0; k < 2; k++) {
+        const Header_data* header_data = inputs[k].operand->header_data;
+        if (header_data == NULL)
+            type->scalar(inputs[k].scalar, inputs[k].operand);
+        else
+            inputs[k].direct = header_data->dtype == dtype;
+        inputs[k].ptr = inputs[k].operand->data;
+    }
+
+    if (size == 0)
+        return 0;
+
+    job.nd = coalesce(inputs, 2, shape, nd);
+    job.scalar_c = c != NULL ? scalar_c : NULL;
+    job.out_data = out + header_length;
+    job.size = size;
+    long parts = parallel_parts(parallel, size * type->size);
+    job.per_part = (size + parts - 1) / parts;
+    parallel_run(parallel, parts, arith_task, &job);
+    return 0;
+}
+
+const char* arith_error(int rc)
+{
+    switch (rc) {
+    case -1: return "data type not supported";
+    case -2: return "operands could not be broadcast together";
+    case -3: return "out of memory";
+    case -4: return "result too large";
+    default: return "unknown error";
+    }
+}
@@ -0,0 +1,40 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+#ifndef NUMPYARITH_FILE
+#define NUMPYARITH_FILE
+#include <stdbool.h>
+#include <stddef.h>
+#include "numpy_reader.h"
+#include "numpy_parallel.h"
+
+/// NOTE This is not a sqlite extention. Wrapper code is in blopy_arith.c
+
+typedef enum Arith_op {
+    ARITH_ADD,
+    ARITH_SUB,
+    ARITH_MUL,
+    ARITH_DIV,   // true division, integer arrays give float64 like in numpy
+    ARITH_SCALE  // a * b + c with scalars b and c
+} Arith_op;
+
+// One side of an operation: an array (header_data != NULL) or a scalar number.
+// Scalars are "weak" like python numbers in numpy: they adapt to the dtype of the array
+struct Arith_operand {
+    const Header_data* header_data;
+    const unsigned char* data;  // first element, native byte order
+
+    bool is_int;
+    long long i;
+    double f;
+};
+typedef struct Arith_operand Arith_operand;
+
+// Public:
+extern int arith(Arith_op op, const Arith_operand* a, const Arith_operand* b,
+                 const Arith_operand* c, const Parallel* parallel, unsigned char** ptr_out,
+                 size_t* len);
+extern const char* arith_error(int rc);
+#endif
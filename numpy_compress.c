@@ -0,0 +1,533 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+**/
+
+#include "numpy_compress.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define METHOD_STORED 0
+#define METHOD_LZ     1
+
+#define LZ_MIN_MATCH   4
+#define LZ_MAX_OFFSET  65535
+#define LZ_HASH_BITS   12
+
+// What is done to the elements before they are shuffled
+enum Filter { FILTER_NONE, FILTER_DELTA, FILTER_XOR };
+
+/// Integers are replaced by the difference to the previous element and floats by the XOR
+/// with it, which turns slowly changing data into mostly zero bytes. For complex numbers the
+/// XOR is done per part. `*lane` is the size of the words the filter works on
+static enum Filter filter_of(const Header_data* header_data, int* lane)
+{
+    int ws = header_data->wordsize_in_bytes;
+    *lane = ws;
+    if (!header_data->littleEndian)
+        return FILTER_NONE;
+    switch (header_data->type) {
+    case 'i':
+    case 'u':
+        return ws == 1 || ws == 2 || ws == 4 || ws == 8 ? FILTER_DELTA : FILTER_NONE;
+    case 'f':
+        return ws == 2 || ws == 4 || ws == 8 ? FILTER_XOR : FILTER_NONE;
+    case 'c':
+        *lane = ws/2;
+        return ws == 8 || ws == 16 ? FILTER_XOR : FILTER_NONE;
+    }
+    return FILTER_NONE;
+}
+
+/// Filters `n` words of type T from `in` to `out` (encode) or reverts it in place (decode).
+/// `distance` is the number of words from one element to the next
+#define DEFINE_FILTER(T)                                                                \
+static void encode_##T(const unsigned char* in, unsigned char* out, long n, int distance, \
+                       bool delta)                                                      \
+{                                                                                       \
+    const T* x = (const T*) in;                                                         \
+    T* y = (T*) out;                                                                    \
+    long i = 0;                                                                         \
+    for (; i < distance && i < n; i++)                                                  \
+        y[i] = x[i];                                                                    \
+    if (delta) {                                                                        \
+        for (; i < n; i++)                                                              \
+            y[i] = x[i] - x[i-distance];                                                \
+    } else {                                                                            \
+        for (; i < n; i++)                                                              \
+            y[i] = x[i] ^ x[i-distance];                                                \
+    }                                                                                   \
+}                                                                                       \
+                                                                                        \
+static void decode_##T(unsigned char* data, long n, int distance, bool delta)           \
+{                                                                                       \
+    T* y = (T*) data;                                                                   \
+    if (delta) {                                                                        \
+        for (long i = distance; i < n; i++)                                             \
+            y[i] += y[i-distance];                                                      \
+    } else {                                                                            \
+        for (long i = distance; i < n; i++)                                             \
+            y[i] ^= y[i-distance];                                                      \
+    }                                                                                   \
+}
+
+DEFINE_FILTER(uint8_t)
+DEFINE_FILTER(uint16_t)
+DEFINE_FILTER(uint32_t)
+DEFINE_FILTER(uint64_t)
+
+static void filter_encode(const Header_data* header_data, const unsigned char* in,
+                          unsigned char* out, long n_bytes)
+{
+    int lane;
+    enum Filter filter = filter_of(header_data, &lane);
+    if (filter == FILTER_NONE) {
+        memcpy(out, in, n_bytes);
+        return;
+    }
+    int distance = header_data->wordsize_in_bytes / lane;
+    bool delta = filter == FILTER_DELTA;
+    switch (lane) {
+    case 1: encode_uint8_t(in, out, n_bytes, distance, delta); break;
+    case 2: encode_uint16_t(in, out, n_bytes/2, distance, delta); break;
+    case 4: encode_uint32_t(in, out, n_bytes/4, distance, delta); break;
+    default: encode_uint64_t(in, out, n_bytes/8, distance, delta); break;
+    }
+}
+
+static void filter_decode(const Header_data* header_data, unsigned char* data, long n_bytes)
+{
+    int lane;
+    enum Filter filter = filter_of(header_data, &lane);
+    if (filter == FILTER_NONE)
+        return;
+    int distance = header_data->wordsize_in_bytes / lane;
+    bool delta = filter == FILTER_DELTA;
+    switch (lane) {
+    case 1: decode_uint8_t(data, n_bytes, distance, delta); break;
+    case 2: decode_uint16_t(data, n_bytes/2, distance, delta); break;
+    case 4: decode_uint32_t(data, n_bytes/4, distance, delta); break;
+    default: decode_uint64_t(data, n_bytes/8, distance, delta); break;
+    }
+}
+
+/// Byte k of element i goes to position k*n + i
+static void shuffle(const unsigned char* in, unsigned char* out, long n, int ws)
+{
+    for (int k = 0; k < ws; k++) {
+        unsigned char* plane = out + k*n;
+        for (long i = 0; i < n; i++)
+            plane[i] = in[i*ws + k];
+    }
+}
+
+static void unshuffle(const unsigned char* in, unsigned char* out, long n, int ws)
+{
+    for (int k = 0; k < ws; k++) {
+        const unsigned char* plane = in + k*n;
+        for (long i = 0; i < n; i++)
+            out[i*ws + k] = plane[i];
+    }
+}
+
+static uint32_t load32(const unsigned char* p)
+{
+    uint32_t v;
+    memcpy(&v, p, 4);
+    return v;
+}
+
+/// Writes a length that did not fit into the 4 bits of the token: 255 as long as needed
+static long put_length(unsigned char* dst, long o, long len)
+{
+    for (; len >= 255; len -= 255)
+        dst[o++] = 255;
+    dst[o++] = (unsigned char) len;
+    return o;
+}
+
+/// Writes `n_literals` literals and (if `match` > 0) a match of `match` bytes `offset` bytes
+/// back. @Returns the new output position, or -1 if more than `cap` bytes were needed
+static long put_sequence(unsigned char* dst, long o, long cap, const unsigned char* literals,
+                         long n_literals, long offset, long match)
+{
+    long needed = 1 + n_literals/255 + 1 + n_literals + 2 + match/255 + 1;
+    if (o + needed > cap)
+        return -1;
+
+    long match_code = match > 0 ? match - LZ_MIN_MATCH : 0;
+    dst[o++] = (unsigned char) ((n_literals < 15 ? n_literals : 15) << 4
+                                | (match_code < 15 ? match_code : 15));
+    if (n_literals >= 15)
+        o = put_length(dst, o, n_literals - 15);
+    memcpy(dst + o, literals, n_literals);
+    o += n_literals;
+    if (match > 0) {
+        dst[o++] = offset & 0xff;
+        dst[o++] = offset >> 8;
+        if (match_code >= 15)
+            o = put_length(dst, o, match_code - 15);
+    }
+    return o;
+}
+
+/// A greedy LZ77 in the format of LZ4 blocks: a sequence is a token (4 bits number of
+/// literals, 4 bits match length - 4; 15 means more length bytes follow), the literals, the
+/// 2 byte offset of the match and the rest of its length. The last sequence has no match.
+/// @Returns the compressed size, or -1 if it would be more than `cap` bytes
+static long lz_compress(const unsigned char* src, long n, unsigned char* dst, long cap)
+{
+    uint32_t table[1 << LZ_HASH_BITS];
+    memset(table, 0, sizeof(table));
+
+    long o = 0, anchor = 0, i = 0;
+    while (i + LZ_MIN_MATCH <= n) {
+        uint32_t sequence = load32(src + i);
+        uint32_t h = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+        long candidate = table[h];
+        table[h] = (uint32_t) i;
+        if (candidate >= i || i - candidate > LZ_MAX_OFFSET || load32(src + candidate) != sequence) {
+            // Runs without matches are skipped faster and faster
+            i += 1 + ((i - anchor) >> 6);
+            continue;
+        }
+        long match = LZ_MIN_MATCH;
+        while (i + match < n && src[candidate + match] == src[i + match])
+            match++;
+        o = put_sequence(dst, o, cap, src + anchor, i - anchor, i - candidate, match);
+        if (o < 0)
+            return -1;
+        i += match;
+        anchor = i;
+    }
+    return put_sequence(dst, o, cap, src + anchor, n - anchor, 0, 0);
+}
+
+/// Reads a length continued after the token
+static bool get_length(const unsigned char* src, long n, long* ip, long* len)
+{
+    unsigned char b;
+    do {
+        if (*ip >= n)
+            return false;
+        b = src[(*ip)++];
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+/// Decodes what lz_compress made of exactly `dst_len` bytes. Corrupt input is detected, nothing
+/// is read or written out of bounds
+/// @Returns true on success
+static bool lz_decompress(const unsigned char* src, long n, unsigned char* dst, long dst_len)
+{
+    long ip = 0, op = 0;
+    while (ip < n) {
+        int token = src[ip++];
+        long n_literals = token >> 4;
+        if (n_literals == 15 && !get_length(src, n, &ip, &n_literals))
+            return false;
+        if (n_literals > n - ip || n_literals > dst_len - op)
+            return false;
+        memcpy(dst + op, src + ip, n_literals);
+        ip += n_literals;
+        op += n_literals;
+        if (ip == n)
+            break;
+
+        if (n - ip < 2)
+            return false;
+        long offset = src[ip] | src[ip+1] << 8;
+        ip += 2;
+        long match = token & 15;
+        if (match == 15 && !get_length(src, n, &ip, &match))
+            return false;
+        match += LZ_MIN_MATCH;
+        if (offset == 0 || offset > op || match > dst_len - op)
+            return false;
+        unsigned char* from = dst + op - offset;
+        if (offset >= match) {
+            memcpy(dst + op, from, match);
+        } else {
+            // Overlapping, e.g. a run of one byte repeated
+            for (long k = 0; k < match; k++)
+                dst[op + k] = from[k];
+        }
+        op += match;
+    }
+    return op == dst_len;
+}
+
+/// Compresses the `n` elements at `in` to `out` (room for 1 + n*ws bytes). `tmp` and `tmp2`
+/// hold n*ws bytes each
+/// @Returns the number of bytes written
+static long compress_chunk(const Header_data* header_data, const unsigned char* in, long n,
+                           unsigned char* out, unsigned char* tmp, unsigned char* tmp2)
+{
+    int ws = header_data->wordsize_in_bytes;
+    long raw = n * ws;
+
+    filter_encode(header_data, in, tmp, raw);
+    shuffle(tmp, tmp2, n, ws);
+    long len = lz_compress(tmp2, raw, out+1, raw-1);
+    if (len >= 0) {
+        out[0] = METHOD_LZ;
+        return 1 + len;
+    }
+    out[0] = METHOD_STORED;
+    memcpy(out+1, in, raw);
+    return 1 + raw;
+}
+
+/// Decodes one chunk of `n` elements from the `len` bytes at `in` to `out`. `tmp` holds n*ws
+/// bytes
+/// @Returns 0, or -6 if the chunk is corrupt
+static int decompress_chunk(const Header_data* header_data, const unsigned char* in, long len,
+                            long n, unsigned char* out, unsigned char* tmp)
+{
+    int ws = header_data->wordsize_in_bytes;
+    long raw = n * ws;
+    if (len < 1)
+        return -6;
+
+    switch (in[0]) {
+    case METHOD_STORED:
+        if (len - 1 != raw)
+            return -6;
+        memcpy(out, in+1, raw);
+        return 0;
+    case METHOD_LZ:
+        if (!lz_decompress(in+1, len-1, tmp, raw))
+            return -6;
+        unshuffle(tmp, out, n, ws);
+        filter_decode(header_data, out, raw);
+        return 0;
+    }
+    return -6;
+}
+
+static long chunk_count(const Header_data* header_data)
+{
+    return header_data->size == 0 ? 0 : (header_data->size - 1L) / header_data->chunk + 1;
+}
+
+/// Elements in chunk `c`
+static long chunk_length(const Header_data* header_data, long c)
+{
+    long rest = header_data->size - c * header_data->chunk;
+    return rest < header_data->chunk ? rest : header_data->chunk;
+}
+
+static void put_uint32(unsigned char* p, unsigned int v)
+{
+    p[0] = v & 0xff;
+    p[1] = (v >> 8) & 0xff;
+    p[2] = (v >> 16) & 0xff;
+    p[3] = v >> 24;
+}
+
+static unsigned int get_uint32(const unsigned char* p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (unsigned int) p[3] << 24;
+}
+
+/// Compresses the array described by `header_data` (the data at `data`) into a new compressed
+/// numpy BLOB, which the caller has to free.
+/// @Returns
+///    *  0, on success (BLOB in `*out`, its size in `*len`)
+///    * -1, if the data type is not supported (objects and structured types)
+///    * -3, if memory ran out
+///    * -5, if the array is too large for the format
+int compress_array(const Header_data* header_data, const unsigned char* data,
+                   unsigned char** out, size_t* len)
+{
+    int ws = header_data->wordsize_in_bytes;
+    if (ws == 0 || header_data->descr_len == 0 || header_data->type == 'O')
+        return -1;
+
+    Header_data chunked = *header_data;
+    chunked.chunk = ws < COMPRESS_CHUNK_BYTES ? COMPRESS_CHUNK_BYTES / ws : 1;
+    long n_chunks = chunk_count(&chunked);
+    size_t raw = (size_t) header_data->size * ws;
+    if (raw + n_chunks * 5 > UINT32_MAX)
+        return -5;
+
+    int header_length = write_header_chunked(NULL, header_data->descr, header_data->fortran_order,
+                                             header_data->shape, header_data->shape_len,
+                                             chunked.chunk);
+    size_t directory = header_length + n_chunks * 4;
+    long chunk_bytes = (long) chunked.chunk * ws;
+    unsigned char* blob = malloc(directory + n_chunks + raw);
+    unsigned char* tmp = malloc(chunk_bytes);
+    unsigned char* tmp2 = malloc(chunk_bytes);
+    if (blob == NULL || tmp == NULL || tmp2 == NULL) {
+        free(blob); free(tmp); free(tmp2);
+        return -3;
+    }
+    write_header_chunked(blob, header_data->descr, header_data->fortran_order,
+                         header_data->shape, header_data->shape_len, chunked.chunk);
+
+    size_t end = 0;
+    for (long c = 0; c < n_chunks; c++) {
+        end += compress_chunk(&chunked, data + c * chunk_bytes, chunk_length(&chunked, c),
+                              blob + directory + end, tmp, tmp2);
+        put_uint32(blob + header_length + c*4, (unsigned int) end);
+    }
+    free(tmp);
+    free(tmp2);
+
+    *len = directory + end;
+    unsigned char* shrunk = realloc(blob, *len > 0 ? *len : 1);
+    *out = shrunk != NULL ? shrunk : blob;
+    return 0;
+}
+
+/// Decodes all data of the compressed BLOB `blob` (`n_bytes` long, described by `header_data`)
+/// to `out`, which has room for size * wordsize_in_bytes bytes.
+/// @Returns 0, -3 if memory ran out or -6 if the BLOB is corrupt
+int decompress_array(const Header_data* header_data, const unsigned char* blob, long n_bytes,
+                     unsigned char* out)
+{
+    long n_chunks = chunk_count(header_data);
+    long directory = header_data->offset + n_chunks * 4;
+    if (directory > n_bytes)
+        return -6;
+
+    long chunk_bytes = (long) header_data->chunk * header_data->wordsize_in_bytes;
+    unsigned char* tmp = malloc(chunk_bytes);
+    if (tmp == NULL)
+        return -3;
+
+    int rc = 0;
+    long start = 0;
+    for (long c = 0; c < n_chunks && rc == 0; c++) {
+        long end = get_uint32(blob + header_data->offset + c*4);
+        if (end < start || end > n_bytes - directory) {
+            rc = -6;
+            break;
+        }
+        rc = decompress_chunk(header_data, blob + directory + start, end - start,
+                              chunk_length(header_data, c), out + c * chunk_bytes, tmp);
+        start = end;
+    }
+    free(tmp);
+    return rc;
+}
+
+/// Human readable text for the negative return values of this file
+const char* compress_error(int rc)
+{
+    switch (rc) {
+    case -1: return "data type not supported";
+    case -3: return "out of memory";
+    case -5: return "numpy array is too large";
+    case -6: return "compressed numpy BLOB is corrupt";
+    default: return "unknown error";
+    }
+}
+
+/// Prepares to read the data of a compressed BLOB of `n_bytes` bytes, either from memory
+/// (`blob`) or through `read`. The directory is read and checked right away.
+/// @Returns 0, the result of `read` (if it failed), -3 if memory ran out or -6 if the BLOB is
+///          corrupt. Call chunk_reader_close in any case
+int chunk_reader_open(Chunk_reader* reader, const Header_data* header_data,
+                      const unsigned char* blob, long n_bytes, Blob_read read, void* ctx)
+{
+    memset(reader, 0, sizeof(*reader));
+    reader->header_data = header_data;
+    reader->blob = blob;
+    reader->read = read;
+    reader->ctx = ctx;
+    reader->n_bytes = n_bytes;
+    reader->n_chunks = chunk_count(header_data);
+    reader->current = -1;
+    if (reader->n_chunks == 0)
+        return 0;
+
+    long directory = reader->n_chunks * 4;
+    if (header_data->offset + directory > n_bytes)
+        return -6;
+    long chunk_bytes = (long) header_data->chunk * header_data->wordsize_in_bytes;
+    reader->ends = malloc(reader->n_chunks * sizeof(*reader->ends));
+    reader->chunk = malloc(2 * chunk_bytes);
+    if (read != NULL)
+        reader->packed = malloc(chunk_bytes + 1);
+    if (reader->ends == NULL || reader->chunk == NULL || (read != NULL && reader->packed == NULL))
+        return -3;
+
+    const unsigned char* raw = blob != NULL ? blob + header_data->offset : NULL;
+    if (raw == NULL) {
+        // Only temporarily, the decoded chunk is not needed yet
+        if (directory > 2 * chunk_bytes)
+            return -6;
+        int rc = read(ctx, reader->chunk, directory, header_data->offset);
+        if (rc != 0)
+            return rc;
+        raw = reader->chunk;
+    }
+    long last = 0;
+    for (long c = 0; c < reader->n_chunks; c++) {
+        reader->ends[c] = get_uint32(raw + c*4);
+        if (reader->ends[c] < last || reader->ends[c] > n_bytes - header_data->offset - directory)
+            return -6;
+        last = reader->ends[c];
+    }
+    return 0;
+}
+
+/// Copies `n` bytes of the decoded data, starting at byte `pos`, to `dst`. Only the chunks
+/// they lie in are decoded, the last one is kept for the next call.
+/// @Returns 0 or an error like chunk_reader_open
+int chunk_reader_read(Chunk_reader* reader, void* dst, long n, long pos)
+{
+    const Header_data* header_data = reader->header_data;
+    long chunk_bytes = (long) header_data->chunk * header_data->wordsize_in_bytes;
+    long data_start = header_data->offset + reader->n_chunks * 4;
+    unsigned char* out = dst;
+    if (pos < 0 || n > (long) header_data->size * header_data->wordsize_in_bytes - pos)
+        return -6;
+
+    while (n > 0) {
+        long c = pos / chunk_bytes;
+        if (c >= reader->n_chunks)
+            return -6;
+        if (c != reader->current) {
+            long start = c > 0 ? reader->ends[c-1] : 0;
+            long len = reader->ends[c] - start;
+            const unsigned char* packed = reader->blob != NULL ? reader->blob + data_start + start
+                                                               : reader->packed;
+            if (reader->blob == NULL) {
+                if (len > chunk_bytes + 1)
+                    return -6;
+                int rc = reader->read(reader->ctx, reader->packed, len, data_start + start);
+                if (rc != 0)
+                    return rc;
+            }
+            reader->current = -1;
+            int rc = decompress_chunk(header_data, packed, len, chunk_length(header_data, c),
+                                      reader->chunk, reader->chunk + chunk_bytes);
+            if (rc != 0)
+                return rc;
+            reader->current = c;
+        }
+
+        long in_chunk = pos - c * chunk_bytes;
+        long take = chunk_bytes - in_chunk < n ? chunk_bytes - in_chunk : n;
+        memcpy(out, reader->chunk + in_chunk, take);
+        out += take;
+        pos += take;
+        n -= take;
+    }
+    return 0;
+}
+
+void chunk_reader_close(Chunk_reader* reader)
+{
+    free(reader->ends);
+    free(reader->packed);
+    free(reader->chunk);
+    reader->ends = NULL;
+    reader->packed = NULL;
+    reader->chunk = NULL;
+}
@@ -0,0 +1,59 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+#ifndef NUMPYCOMPRESS_FILE
+#define NUMPYCOMPRESS_FILE
+#include <stdbool.h>
+#include <stddef.h>
+#include "numpy_reader.h"
+
+/// NOTE This is not a sqlite extention. Wrapper code is in blopy.c
+
+/// A compressed numpy BLOB is a numpy BLOB with the magic "\x93NUMPZ" instead of "\x93NUMPY"
+/// and one more key in the header, the number of elements per chunk:
+///   {'descr': '<f8', 'fortran_order': False, 'shape': (3, 4), 'chunk': 8192, }
+/// So read_header understands it as is (header_data->compressed is set). The data is cut into
+/// chunks of `chunk` elements (in memory order) and each chunk is compressed on its own, which
+/// allows to decode only the chunks a slice needs. After the header follows the directory,
+/// one little-endian uint32 per chunk with the end of the chunk (counted from the end of the
+/// directory), then the chunks. Each chunk starts with a byte for its method:
+///   0 : stored as is
+///   1 : delta (integers) or XOR (floats, complex) with the previous element, then the bytes
+///       are shuffled (all first bytes of the words, then all second bytes, ...), then LZ
+///       compressed (an LZ4 like format, see lz_compress)
+
+// Uncompressed bytes per chunk (fewer for the last chunk, at least one element)
+#define COMPRESS_CHUNK_BYTES 65536
+
+// Reads `n` bytes at `offset` of the compressed BLOB to `dst`. @Returns 0 on success
+typedef int (*Blob_read)(void* ctx, void* dst, long n, long offset);
+
+// Decodes the data of a compressed BLOB chunk by chunk, keeping the last one
+struct Chunk_reader {
+    const Header_data* header_data;
+    const unsigned char* blob;      // the BLOB in memory, or NULL to go through `read`
+    Blob_read read;
+    void* ctx;
+    long n_bytes;                   // of the BLOB
+    long n_chunks;
+    unsigned int* ends;             // the directory
+    unsigned char* packed;          // one compressed chunk (only with `read`)
+    unsigned char* chunk;           // the decoded chunk with index `current`
+    long current;
+};
+typedef struct Chunk_reader Chunk_reader;
+
+// Public:
+extern int compress_array(const Header_data* header_data, const unsigned char* data,
+                          unsigned char** out, size_t* len);
+extern int decompress_array(const Header_data* header_data, const unsigned char* blob,
+                            long n_bytes, unsigned char* out);
+extern const char* compress_error(int rc);
+
+extern int chunk_reader_open(Chunk_reader* reader, const Header_data* header_data,
+                             const unsigned char* blob, long n_bytes, Blob_read read, void* ctx);
+extern int chunk_reader_read(Chunk_reader* reader, void* dst, long n, long pos);
+extern void chunk_reader_close(Chunk_reader* reader);
+#endif
@@ -0,0 +1,538 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+#include "numpy_convert.h"
+
+#include <float.h>
+#include <limits.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Elements converted per step: the block of doubles (8 KiB) stays in L1 between the two loops
+#define BLOCK 1024
+
+struct Dtype_info {
+    Dtype_code dtype;
+    char type;  // as in descr, '\0' for bfloat16 which has no short form
+    int size;
+    const char* name;
+};
+typedef struct Dtype_info Dtype_info;
+
+static const Dtype_info DTYPES[] = {
+    {DTYPE_B1, 'b', 1, "bool"},
+    {DTYPE_I1, 'i', 1, "int8"}, {DTYPE_I2, 'i', 2, "int16"},
+    {DTYPE_I4, 'i', 4, "int32"}, {DTYPE_I8, 'i', 8, "int64"},
+    {DTYPE_U1, 'u', 1, "uint8"}, {DTYPE_U2, 'u', 2, "uint16"},
+    {DTYPE_U4, 'u', 4, "uint32"}, {DTYPE_U8, 'u', 8, "uint64"},
+    {DTYPE_F2, 'f', 2, "float16"}, {DTYPE_F4, 'f', 4, "float32"}, {DTYPE_F8, 'f', 8, "float64"},
+    {DTYPE_C8, 'c', 8, "complex64"}, {DTYPE_C16, 'c', 16, "complex128"},
+    {DTYPE_BF16, '\0', 2, "bfloat16"},
+};
+#define N_DTYPES ((int) (sizeof(DTYPES)/sizeof(DTYPES[0])))
+
+static const Dtype_info* dtype_info(Dtype_code dtype)
+{
+    for (int i = 0; i < N_DTYPES; i++) {
+        if (DTYPES[i].dtype == dtype)
+            return &DTYPES[i];
+    }
+    return NULL;
+}
+
+/// Parses a numpy dtype, either as descr ('<f2', 'f2', '>i8', '|u1', 'b1' or '?') or by name
+/// ('float16', 'int8', 'bool', 'bfloat16', ...), and writes the descr of the new array to
+/// `descr` (at least DESCR_MAXLEN+1 bytes), e.g. '<f2'. Without byte order the new array is
+/// little-endian.
+/// @Returns 0 or -1 if `text` is not one of the numeric dtypes np_astype supports
+int parse_dtype(const char* text, Dtype_code* dtype, char* descr)
+{
+    const Dtype_info* info = NULL;
+    char order = '<';
+    for (int i = 0; i < N_DTYPES && info == NULL; i++) {
+        if (strcmp(text, DTYPES[i].name) == 0)
+            info = &DTYPES[i];
+    }
+
+    if (info == NULL) {
+        const char* p = text;
+        if (*p == '<' || *p == '>' || *p == '=' || *p == '|')
+            order = *p++ == '>' ? '>' : '<';
+        char type = *p++;
+        long size = 0;
+        if (type == '?' && *p == '\0') {
+            type = 'b';
+            size = 1;
+        } else if (*p >= '1' && *p <= '9') {
+            char* end;
+            size = strtol(p, &end, 10);
+            if (*end != '\0')
+                return -1;
+        }
+        for (int i = 0; i < N_DTYPES && info == NULL; i++) {
+            if (DTYPES[i].type == type && DTYPES[i].size == size)
+                info = &DTYPES[i];
+        }
+    }
+    if (info == NULL)
+        return -1;
+
+    *dtype = info->dtype;
+    if (info->dtype == DTYPE_BF16)
+        snprintf(descr, DESCR_MAXLEN+1, "%s", info->name);
+    else if (info->size == 1)
+        snprintf(descr, DESCR_MAXLEN+1, "|%c1", info->type);
+    else
+        snprintf(descr, DESCR_MAXLEN+1, "%c%c%d", order, info->type, info->size);
+    return 0;
+}
+
+/// Parses the mode of a conversion: words separated by ',' or ' ', 'saturate' or 'wrap' (the
+/// default) and one of 'trunc' (the default), 'round', 'floor' or 'ceil'.
+/// @Returns 0 or -1 for an unknown word
+int parse_convert_mode(const char* text, Convert_mode* mode)
+{
+    static const char* const WORDS[] = {"wrap", "saturate", "trunc", "round", "floor", "ceil"};
+    mode->saturate = false;
+    mode->round = ROUND_TRUNC;
+
+    for (;;) {
+        while (*text == ',' || *text == ' ')
+            text++;
+        if (*text == '\0')
+            return 0;
+        size_t len = strcspn(text, ", ");
+        int word = -1;
+        for (int i = 0; i < (int) (sizeof(WORDS)/sizeof(WORDS[0])); i++) {
+            if (strlen(WORDS[i]) == len && strncmp(text, WORDS[i], len) == 0)
+                word = i;
+        }
+        if (word < 0)
+            return -1;
+        if (word <= 1)
+            mode->saturate = word == 1;
+        else
+            mode->round = (Convert_round) (word - 2);
+        text += len;
+    }
+}
+
+/// @Returns true if arrays of `dtype` can be converted (all numeric types but long double)
+bool convertible(Dtype_code dtype)
+{
+    return dtype_info(dtype) != NULL;
+}
+
+/// @Returns the size in bytes of one element of `dtype`, 0 if it is not convertible
+int dtype_size(Dtype_code dtype)
+{
+    const Dtype_info* info = dtype_info(dtype);
+    return info != NULL ? info->size : 0;
+}
+
+static bool is_integer(Dtype_code dtype)
+{
+    return dtype == DTYPE_B1 || (dtype >= DTYPE_I1 && dtype <= DTYPE_U8);
+}
+
+static bool is_complex(Dtype_code dtype)
+{
+    return dtype == DTYPE_C8 || dtype == DTYPE_C16;
+}
+
+// The 16 bit floats -------------------------------------------------------------------------
+
+/// The bits of float16 (5 bit exponent, 10 bit mantissa) to double, exactly. The exponent and
+/// mantissa are moved to where a float keeps them, and the multiplication corrects the bias,
+/// which turns subnormals into normal numbers on the way
+double half_to_double(uint16_t bits)
+{
+    uint32_t magnitude = (uint32_t) (bits & 0x7fff) << 13;
+    float value;
+    memcpy(&value, &magnitude, sizeof(value));
+    value *= 0x1p112f;
+    if ((bits & 0x7c00) == 0x7c00) { // infinity or nan
+        magnitude |= 0x7f800000;
+        memcpy(&value, &magnitude, sizeof(value));
+    }
+    return (bits & 0x8000) ? -(double) value : (double) value;
+}
+
+/// The bits of bfloat16 to double, exactly: bfloat16 is the upper half of a float
+double bfloat16_to_double(uint16_t bits)
+{
+    uint32_t word = (uint32_t) bits << 16;
+    float value;
+    memcpy(&value, &word, sizeof(value));
+    return value;
+}
+
+/// Rounds `value` to nearest even in a 16 bit float with `exp_bits` bits of exponent and
+/// `man_bits` bits of mantissa. Rounding straight from the double (instead of via float) never
+/// rounds twice. With `saturate` finite values too large for the format give its largest
+/// finite value instead of infinity
+static uint16_t encode_float16(double value, int exp_bits, int man_bits, bool saturate)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    uint16_t sign = (uint16_t) ((bits >> 63) << (exp_bits + man_bits));
+    int max_exp = (1 << exp_bits) - 1;
+    uint16_t inf = (uint16_t) (max_exp << man_bits);
+    int exp = (int) (bits >> 52) & 0x7ff;
+    uint64_t man = bits & ((1ull << 52) - 1);
+
+    if (exp == 0x7ff) // infinity stays, nan stays a quiet nan
+        return sign | inf | (man ? 1 << (man_bits - 1) : 0);
+    int e = exp - 1023 + (max_exp >> 1); // biased exponent in the small format
+    if (e >= max_exp)
+        return sign | (saturate ? inf - 1 : inf);
+
+    // Below the smallest normal number the result is subnormal: shift out more bits
+    uint64_t m = man | (1ull << 52);
+    int shift = 52 - man_bits + (e < 1 ? 1 - e : 0);
+    if (shift > 53) // less than half of the smallest subnormal (also for subnormal doubles)
+        return sign;
+    uint64_t q = m >> shift;
+    uint64_t rest = m & ((1ull << shift) - 1), half = 1ull << (shift - 1);
+    q += rest > half || (rest == half && (q & 1));
+
+    // A carry of the rounding moves into the exponent, up to infinity
+    uint16_t r = e < 1 ? (uint16_t) q
+                       : (uint16_t) (((uint64_t) e << man_bits) + q - (1ull << man_bits));
+    if (saturate && r == inf)
+        r = inf - 1;
+    return sign | r;
+}
+
+/// `x` as a double rounded to odd: the bits beyond the 53 of a double are ORed into the last
+/// one. Rounding that double to nearest even with fewer bits (encode_float16) gives the same as
+/// rounding `x` itself, a plain conversion would round twice
+static double round_to_odd(uint64_t x)
+{
+    if (x < (1ull << 53))
+        return (double) x;
+    int shift = 11 - __builtin_clzll(x);
+    uint64_t kept = (x >> shift) | ((x & ((1ull << shift) - 1)) != 0);
+    return ldexp((double) kept, shift);
+}
+
+uint16_t double_to_half(double value)
+{
+    return encode_float16(value, 5, 10, false);
+}
+
+uint16_t double_to_bfloat16(double value)
+{
+    return encode_float16(value, 8, 7, false);
+}
+
+// Kernels -----------------------------------------------------------------------------------
+
+#define LOAD_LOOP(T, STEP)                                                              \
+    { const T* x = (const T*) in; for (long i = 0; i < n; i++) buf[i] = x[i*STEP]; } break;
+
+/// Reads `n` elements (real parts of complex numbers) of `dtype` from `in` as doubles
+static void load_double(Dtype_code dtype, const unsigned char* in, double* buf, long n)
+{
+    switch (dtype) {
+    case DTYPE_B1:
+        for (long i = 0; i < n; i++)
+            buf[i] = in[i] != 0;
+        break;
+    case DTYPE_I1: LOAD_LOOP(signed char, 1)
+    case DTYPE_I2: LOAD_LOOP(short, 1)
+    case DTYPE_I4: LOAD_LOOP(int, 1)
+    case DTYPE_I8: LOAD_LOOP(long long, 1)
+    case DTYPE_U1: LOAD_LOOP(unsigned char, 1)
+    case DTYPE_U2: LOAD_LOOP(unsigned short, 1)
+    case DTYPE_U4: LOAD_LOOP(unsigned int, 1)
+    case DTYPE_U8: LOAD_LOOP(unsigned long long, 1)
+    case DTYPE_F2: {
+        const uint16_t* x = (const uint16_t*) in;
+        for (long i = 0; i < n; i++)
+            buf[i] = half_to_double(x[i]);
+        break;
+    }
+    case DTYPE_BF16: {
+        const uint16_t* x = (const uint16_t*) in;
+        for (long i = 0; i < n; i++)
+            buf[i] = bfloat16_to_double(x[i]);
+        break;
+    }
+    case DTYPE_F4: LOAD_LOOP(float, 1)
+    case DTYPE_F8: LOAD_LOOP(double, 1)
+    case DTYPE_C8: LOAD_LOOP(float, 2)
+    case DTYPE_C16: LOAD_LOOP(double, 2)
+    default: break;
+    }
+}
+
+/// Reads `n` elements of the integer (or bool) `dtype` from `in` as 64 bit integers. uint64
+/// values above INT64_MAX keep their bits, or become INT64_MAX if the conversion saturates
+static void load_int(Dtype_code dtype, const unsigned char* in, int64_t* buf, long n,
+                     bool saturate)
+{
+    switch (dtype) {
+    case DTYPE_B1:
+        for (long i = 0; i < n; i++)
+            buf[i] = in[i] != 0;
+        break;
+    case DTYPE_I1: LOAD_LOOP(signed char, 1)
+    case DTYPE_I2: LOAD_LOOP(short, 1)
+    case DTYPE_I4: LOAD_LOOP(int, 1)
+    case DTYPE_I8: LOAD_LOOP(long long, 1)
+    case DTYPE_U1: LOAD_LOOP(unsigned char, 1)
+    case DTYPE_U2: LOAD_LOOP(unsigned short, 1)
+    case DTYPE_U4: LOAD_LOOP(unsigned int, 1)
+    case DTYPE_U8: {
+        const unsigned long long* x = (const unsigned long long*) in;
+        for (long i = 0; i < n; i++)
+            buf[i] = saturate && x[i] > LLONG_MAX ? LLONG_MAX : (int64_t) x[i];
+        break;
+    }
+    default: break;
+    }
+}
+
+#define STORE_INT_LOOP(T, MIN, MAX)                                                     \
+    {                                                                                   \
+        T* y = (T*) out;                                                                \
+        if (saturate) {                                                                 \
+            for (long i = 0; i < n; i++)                                                \
+                y[i] = buf[i] < MIN ? MIN : buf[i] > MAX ? MAX : (T) buf[i];            \
+        } else {                                                                        \
+            for (long i = 0; i < n; i++)                                                \
+                y[i] = (T) buf[i];                                                      \
+        }                                                                               \
+    } break;
+
+/// Writes `n` 64 bit integers to `out` as the integer (or bool) `dtype`
+static void store_int(Dtype_code dtype, const int64_t* buf, unsigned char* out, long n,
+                      bool saturate)
+{
+    switch (dtype) {
+    case DTYPE_B1:
+        for (long i = 0; i < n; i++)
+            out[i] = buf[i] != 0;
+        break;
+    case DTYPE_I1: STORE_INT_LOOP(signed char, SCHAR_MIN, SCHAR_MAX)
+    case DTYPE_I2: STORE_INT_LOOP(short, SHRT_MIN, SHRT_MAX)
+    case DTYPE_I4: STORE_INT_LOOP(int, INT_MIN, INT_MAX)
+    case DTYPE_I8: STORE_INT_LOOP(long long, LLONG_MIN, LLONG_MAX)
+    case DTYPE_U1: STORE_INT_LOOP(unsigned char, 0, UCHAR_MAX)
+    case DTYPE_U2: STORE_INT_LOOP(unsigned short, 0, USHRT_MAX)
+    case DTYPE_U4: STORE_INT_LOOP(unsigned int, 0, (int64_t) UINT_MAX)
+    case DTYPE_U8: STORE_INT_LOOP(unsigned long long, 0, LLONG_MAX)
+    default: break;
+    }
+}
+
+// Out of range float to integer conversions are undefined in C. Without saturation values go
+// through int64 and wrap around, like numpy does on x86; the rest (nan included) give INT64_MIN
+static inline long long wrap_int(double v)
+{
+    return v > -0x1p63 && v < 0x1p63 ? (long long) v : LLONG_MIN;
+}
+
+static inline unsigned long long wrap_uint(double v)
+{
+    return v >= 0x1p63 && v < 0x1p64 ? (unsigned long long) v : (unsigned long long) wrap_int(v);
+}
+
+static inline float to_float(double v, bool saturate)
+{
+    if (saturate && v > FLT_MAX && v < INFINITY)
+        return FLT_MAX;
+    if (saturate && v < -FLT_MAX && v > -INFINITY)
+        return -FLT_MAX;
+    return (float) v;
+}
+
+// HI is the first value above the range (exact as a double, unlike MAX for 64 bits)
+#define STORE_DOUBLE_LOOP(T, MIN, MAX, HI, WRAP)                                        \
+    {                                                                                   \
+        T* y = (T*) out;                                                                \
+        if (saturate) {                                                                 \
+            for (long i = 0; i < n; i++) {                                              \
+                double v = buf[i];                                                      \
+                y[i] = v <= (double) MIN ? MIN : v >= HI ? MAX : v == v ? (T) v : 0;    \
+            }                                                                           \
+        } else {                                                                        \
+            for (long i = 0; i < n; i++)                                                \
+                y[i] = (T) WRAP(buf[i]);                                                \
+        }                                                                               \
+    } break;
+
+/// Writes `n` doubles to `out` as `dtype`, complex numbers with an imaginary part of 0
+static void store_double(Dtype_code dtype, const double* buf, unsigned char* out, long n,
+                         bool saturate)
+{
+    switch (dtype) {
+    case DTYPE_B1:
+        for (long i = 0; i < n; i++)
+            out[i] = buf[i] != 0;
+        break;
+    case DTYPE_I1: STORE_DOUBLE_LOOP(signed char, SCHAR_MIN, SCHAR_MAX, 0x1p7, wrap_int)
+    case DTYPE_I2: STORE_DOUBLE_LOOP(short, SHRT_MIN, SHRT_MAX, 0x1p15, wrap_int)
+    case DTYPE_I4: STORE_DOUBLE_LOOP(int, INT_MIN, INT_MAX, 0x1p31, wrap_int)
+    case DTYPE_I8: STORE_DOUBLE_LOOP(long long, LLONG_MIN, LLONG_MAX, 0x1p63, wrap_int)
+    case DTYPE_U1: STORE_DOUBLE_LOOP(unsigned char, 0, UCHAR_MAX, 0x1p8, wrap_int)
+    case DTYPE_U2: STORE_DOUBLE_LOOP(unsigned short, 0, USHRT_MAX, 0x1p16, wrap_int)
+    case DTYPE_U4: STORE_DOUBLE_LOOP(unsigned int, 0, UINT_MAX, 0x1p32, wrap_int)
+    case DTYPE_U8: STORE_DOUBLE_LOOP(unsigned long long, 0, ULLONG_MAX, 0x1p64, wrap_uint)
+    case DTYPE_F2: {
+        uint16_t* y = (uint16_t*) out;
+        for (long i = 0; i < n; i++)
+            y[i] = encode_float16(buf[i], 5, 10, saturate);
+        break;
+    }
+    case DTYPE_BF16: {
+        uint16_t* y = (uint16_t*) out;
+        for (long i = 0; i < n; i++)
+            y[i] = encode_float16(buf[i], 8, 7, saturate);
+        break;
+    }
+    case DTYPE_F4: {
+        float* y = (float*) out;
+        for (long i = 0; i < n; i++)
+            y[i] = to_float(buf[i], saturate);
+        break;
+    }
+    case DTYPE_F8:
+        memcpy(out, buf, n * sizeof(double));
+        break;
+    case DTYPE_C8: {
+        float* y = (float*) out;
+        for (long i = 0; i < n; i++) {
+            y[2*i] = to_float(buf[i], saturate);
+            y[2*i+1] = 0;
+        }
+        break;
+    }
+    case DTYPE_C16: {
+        double* y = (double*) out;
+        for (long i = 0; i < n; i++) {
+            y[2*i] = buf[i];
+            y[2*i+1] = 0;
+        }
+        break;
+    }
+    default: break;
+    }
+}
+
+static void round_block(double* buf, long n, Convert_round round)
+{
+    switch (round) {
+    case ROUND_NEAREST:
+        for (long i = 0; i < n; i++)
+            buf[i] = nearbyint(buf[i]);
+        break;
+    case ROUND_FLOOR:
+        for (long i = 0; i < n; i++)
+            buf[i] = floor(buf[i]);
+        break;
+    case ROUND_CEIL:
+        for (long i = 0; i < n; i++)
+            buf[i] = ceil(buf[i]);
+        break;
+    case ROUND_TRUNC: // the conversion itself truncates
+        break;
+    }
+}
+
+/// Converts `n` elements of `from` at `in` (native byte order) to `to` at `out`, which must not
+/// overlap `in`. Both types have to be convertible. Complex numbers lose their imaginary part
+/// when converted to a real type (numpy warns about it, we don't).
+void convert_array(Dtype_code from, const unsigned char* in, Dtype_code to,
+                   unsigned char* out, int64_t n, const Convert_mode* mode)
+{
+    int in_size = dtype_size(from), out_size = dtype_size(to);
+    if (from == to) {
+        memcpy(out, in, (size_t) n * in_size);
+        return;
+    }
+    if (is_complex(from) && is_complex(to)) { // part by part
+        convert_array(from == DTYPE_C8 ? DTYPE_F4 : DTYPE_F8, in,
+                      to == DTYPE_C8 ? DTYPE_F4 : DTYPE_F8, out, 2*n, mode);
+        return;
+    }
+    if (to == DTYPE_F4 && (from == DTYPE_I8 || from == DTYPE_U8)) {
+        // Directly, a double in between would round large values twice
+        float* y = (float*) out;
+        for (int64_t i = 0; i < n; i++) {
+            y[i] = from == DTYPE_I8 ? (float) ((const long long*) in)[i]
+                                    : (float) ((const unsigned long long*) in)[i];
+        }
+        return;
+    }
+    if ((to == DTYPE_F2 || to == DTYPE_BF16) && (from == DTYPE_I8 || from == DTYPE_U8)) {
+        uint16_t* y = (uint16_t*) out;
+        int exp_bits = to == DTYPE_F2 ? 5 : 8;
+        for (int64_t i = 0; i < n; i++) {
+            double value;
+            if (from == DTYPE_I8) {
+                long long x = ((const long long*) in)[i];
+                value = x < 0 ? -round_to_odd(-(uint64_t) x) : round_to_odd((uint64_t) x);
+            } else {
+                value = round_to_odd(((const unsigned long long*) in)[i]);
+            }
+            y[i] = encode_float16(value, exp_bits, 15 - exp_bits, mode->saturate);
+        }
+        return;
+    }
+
+    bool integers = is_integer(from) && is_integer(to);
+    bool rounding = !is_integer(from) && is_integer(to) && to != DTYPE_B1;
+    double dbuf[BLOCK];
+    int64_t ibuf[BLOCK];
+    for (int64_t i = 0; i < n; i += BLOCK) {
+        long m = n - i < BLOCK ? (long) (n - i) : BLOCK;
+        const unsigned char* src = in + i * in_size;
+        unsigned char* dst = out + i * out_size;
+        if (integers) {
+            load_int(from, src, ibuf, m, mode->saturate);
+            store_int(to, ibuf, dst, m, mode->saturate);
+        } else {
+            load_double(from, src, dbuf, m);
+            if (rounding)
+                round_block(dbuf, m, mode->round);
+            store_double(to, dbuf, dst, m, mode->saturate);
+        }
+    }
+}
+
+// One part of convert_parallel per task
+struct Convert_job {
+    Dtype_code from, to;
+    const unsigned char* in;
+    unsigned char* out;
+    int64_t n;
+    int64_t per_part;
+    const Convert_mode* mode;
+};
+typedef struct Convert_job Convert_job;
+
+static void convert_task(void* arg, long index)
+{
+    Convert_job* job = arg;
+    int64_t start = index * job->per_part;
+    int64_t n = job->n - start < job->per_part ? job->n - start : job->per_part;
+    convert_array(job->from, job->in + start * dtype_size(job->from), job->to,
+                  job->out + start * dtype_size(job->to), n, job->mode);
+}
+
+/// convert_array with large arrays cut into the parts of `parallel` (by the size of the
+/// larger of the two types), converted in parallel
+void convert_parallel(const Parallel* parallel, Dtype_code from, const unsigned char* in,
+                      Dtype_code to, unsigned char* out, int64_t n, const Convert_mode* mode)
+{
+    int size = dtype_size(from) > dtype_size(to) ? dtype_size(from) : dtype_size(to);
+    long parts = parallel_parts(parallel, n * size);
+    Convert_job job = {from, to, in, out, n, (n + parts - 1) / parts, mode};
+    parallel_run(parallel, parts, convert_task, &job);
+}
@@ -0,0 +1,52 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+#ifndef NUMPYCONVERT_FILE
+#define NUMPYCONVERT_FILE
+#include <stdbool.h>
+#include <stdint.h>
+#include "numpy_reader.h"
+#include "numpy_parallel.h"
+
+/// NOTE This is not a sqlite extention. Wrapper code is in blopy*.c
+
+/// Conversion of the elements of an array from one numeric dtype to another, like numpy's
+/// ndarray.astype. Elements go through a block of doubles (or of 64 bit integers, if both types
+/// are integers) in two plain loops per block, which the compiler vectorizes. The 16 bit floats
+/// (float16 and bfloat16) are rounded to nearest even, directly from the double.
+
+// How float values become integers (ignored for all other conversions)
+typedef enum Convert_round {
+    ROUND_TRUNC,    // towards zero, like numpy
+    ROUND_NEAREST,  // to nearest, ties to even
+    ROUND_FLOOR,
+    ROUND_CEIL
+} Convert_round;
+
+struct Convert_mode {
+    // Values out of the range of the new type become its minimum or maximum (NaN becomes 0 for
+    // integers), infinities stay infinite for floats. Otherwise integers wrap around like in
+    // numpy and floats overflow to infinity
+    bool saturate;
+    Convert_round round;
+};
+typedef struct Convert_mode Convert_mode;
+
+// Public:
+extern int parse_dtype(const char* text, Dtype_code* dtype, char* descr);
+extern int parse_convert_mode(const char* text, Convert_mode* mode);
+extern bool convertible(Dtype_code dtype);
+extern int dtype_size(Dtype_code dtype);
+extern void convert_array(Dtype_code from, const unsigned char* in, Dtype_code to,
+                          unsigned char* out, int64_t n, const Convert_mode* mode);
+extern void convert_parallel(const Parallel* parallel, Dtype_code from, const unsigned char* in,
+                             Dtype_code to, unsigned char* out, int64_t n,
+                             const Convert_mode* mode);
+
+extern double half_to_double(uint16_t bits);
+extern double bfloat16_to_double(uint16_t bits);
+extern uint16_t double_to_half(double value);
+extern uint16_t double_to_bfloat16(double value);
+#endif
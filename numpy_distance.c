@@ -0,0 +1,205 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+**/
+
+#include "numpy_distance.h"
+#include "numpy_layout.h"
+#include <math.h>
+
+// Independent accumulators per sum, see numpy_reduce.c. With them gcc/clang vectorize the
+// loops below at -O3
+#define LANES 8
+
+/// Fused kernels for a pair of element types TA and TB. ACC is float for float32 pairs (like
+/// numpy's float32 dot) and double as soon as a float64 is involved.
+/// All three sums of the cosine distance are collected in a single pass over the data.
+#define DEFINE_DISTANCE_KERNELS(SUFFIX, TA, TB, ACC)                                    \
+static double dot_##SUFFIX(const TA* a, const TB* b, long n)                            \
+{                                                                                       \
+    ACC lane[LANES] = {0};                                                              \
+    long i = 0;                                                                         \
+    for (; i + LANES <= n; i += LANES)                                                  \
+        for (int k = 0; k < LANES; k++)                                                 \
+            lane[k] += (ACC) a[i+k] * (ACC) b[i+k];                                     \
+    ACC sum = 0;                                                                        \
+    for (; i < n; i++)                                                                  \
+        sum += (ACC) a[i] * (ACC) b[i];                                                 \
+    for (int k = 0; k < LANES; k++)                                                     \
+        sum += lane[k];                                                                 \
+    return sum;                                                                         \
+}                                                                                       \
+                                                                                        \
+static double sqdist_##SUFFIX(const TA* a, const TB* b, long n)                         \
+{                                                                                       \
+    ACC lane[LANES] = {0};                                                              \
+    long i = 0;                                                                         \
+    for (; i + LANES <= n; i += LANES)                                                  \
+        for (int k = 0; k < LANES; k++) {                                               \
+            ACC d = (ACC) a[i+k] - (ACC) b[i+k];                                        \
+            lane[k] += d*d;                                                             \
+        }                                                                               \
+    ACC sum = 0;                                                                        \
+    for (; i < n; i++) {                                                                \
+        ACC d = (ACC) a[i] - (ACC) b[i];                                                \
+        sum += d*d;                                                                     \
+    }                                                                                   \
+    for (int k = 0; k < LANES; k++)                                                     \
+        sum += lane[k];                                                                 \
+    return sum;                                                                         \
+}                                                                                       \
+                                                                                        \
+static double cosine_##SUFFIX(const TA* a, const TB* b, long n)                         \
+{                                                                                       \
+    ACC ab[LANES] = {0}, aa[LANES] = {0}, bb[LANES] = {0};                              \
+    long i = 0;                                                                         \
+    for (; i + LANES <= n; i += LANES)                                                  \
+        for (int k = 0; k < LANES; k++) {                                               \
+            ACC x = a[i+k], y = b[i+k];                                                 \
+            ab[k] += x*y;                                                               \
+            aa[k] += x*x;                                                               \
+            bb[k] += y*y;                                                               \
+        }                                                                               \
+    ACC sum_ab = 0, sum_aa = 0, sum_bb = 0;                                             \
+    for (; i < n; i++) {                                                                \
+        ACC x = a[i], y = b[i];                                                         \
+        sum_ab += x*y;                                                                  \
+        sum_aa += x*x;                                                                  \
+        sum_bb += y*y;                                                                  \
+    }                                                                                   \
+    for (int k = 0; k < LANES; k++) {                                                   \
+        sum_ab += ab[k];                                                                \
+        sum_aa += aa[k];                                                                \
+        sum_bb += bb[k];                                                                \
+    }                                                                                   \
+    /* Zero vectors have no direction: NaN like scipy */                                \
+    return 1.0 - (double) sum_ab / sqrt((double) sum_aa * (double) sum_bb);             \
+}                                                                                       \
+                                                                                        \
+static double distance_##SUFFIX(Distance_op op, const void* a, const void* b, long n)   \
+{                                                                                       \
+    switch (op) {                                                                       \
+    case DISTANCE_DOT: return dot_##SUFFIX(a, b, n);                                    \
+    case DISTANCE_L2: return sqrt(sqdist_##SUFFIX(a, b, n));                            \
+    default: return cosine_##SUFFIX(a, b, n);                                           \
+    }                                                                                   \
+}
+
+DEFINE_DISTANCE_KERNELS(f4f4, float, float, float)
+DEFINE_DISTANCE_KERNELS(f4f8, float, double, double)
+DEFINE_DISTANCE_KERNELS(f8f4, double, float, double)
+DEFINE_DISTANCE_KERNELS(f8f8, double, double, double)
+
+/// Both arrays are read as flat vectors, so their elements have to be in the same order
+static bool same_layout(const Header_data* header_a, const Header_data* header_b)
+{
+    if (header_a->shape_len <= 1 && header_b->shape_len <= 1)
+        return true;
+    if (is_c_contiguous(header_a) != is_c_contiguous(header_b)
+            || header_a->shape_len != header_b->shape_len)
+        return false;
+    for (int i = 0; i < header_a->shape_len; i++) {
+        if (header_a->shape[i] != header_b->shape[i])
+            return false;
+    }
+    return true;
+}
+
+/// Computes the dot product, euclidean or cosine distance of two arrays with the same number of
+/// elements (float32 or float64, also mixed). Arrays have to be in native byte order.
+///
+/// @Returns
+///    *  0, on success (result in `*out`)
+///    * -1, if a data type is not supported
+///    * -2, if the arrays differ in size or shape
+int distance(Distance_op op, const Header_data* header_a, const void* a,
+             const Header_data* header_b, const void* b, double* out)
+{
+    if (header_a->size != header_b->size || !same_layout(header_a, header_b))
+        return -2;
+
+    long n = header_a->size;
+    Dtype_code dtype_a = header_a->dtype, dtype_b = header_b->dtype;
+    if (dtype_a == DTYPE_F4 && dtype_b == DTYPE_F4)
+        *out = distance_f4f4(op, a, b, n);
+    else if (dtype_a == DTYPE_F4 && dtype_b == DTYPE_F8)
+        *out = distance_f4f8(op, a, b, n);
+    else if (dtype_a == DTYPE_F8 && dtype_b == DTYPE_F4)
+        *out = distance_f8f4(op, a, b, n);
+    else if (dtype_a == DTYPE_F8 && dtype_b == DTYPE_F8)
+        *out = distance_f8f8(op, a, b, n);
+    else
+        return -1;
+    return 0;
+}
+
+const char* distance_error(int rc)
+{
+    switch (rc) {
+    case -1: return "data type not supported (float32 and float64 only)";
+    case -2: return "arrays must have the same shape";
+    default: return "unknown error";
+    }
+}
+
+// The heap is ordered by distance, the largest (worst) at the root. Among equal distances the
+// bigger id counts as worse, which makes the result independent of the order of the rows
+static bool worse(const Topk_entry* x, const Topk_entry* y)
+{
+    return x->distance > y->distance || (x->distance == y->distance && x->id > y->id);
+}
+
+static void sift_down(Topk_entry* heap, int n, int i)
+{
+    for (;;) {
+        int largest = i;
+        int left = 2*i + 1, right = 2*i + 2;
+        if (left < n && worse(&heap[left], &heap[largest]))
+            largest = left;
+        if (right < n && worse(&heap[right], &heap[largest]))
+            largest = right;
+        if (largest == i)
+            return;
+        Topk_entry tmp = heap[i];
+        heap[i] = heap[largest];
+        heap[largest] = tmp;
+        i = largest;
+    }
+}
+
+/// Offers (distance, id) to the `k` best entries kept in `heap` (`*n` of them so far). The
+/// heap needs room for `*n + 1` entries while `*n < k`. NaN distances are ignored.
+/// @Returns true if the entry was taken
+bool topk_push(Topk_entry* heap, int* n, int k, double distance, long long id)
+{
+    Topk_entry entry = {distance, id};
+    if (isnan(distance))
+        return false;
+
+    if (*n < k) {
+        // Sift up
+        int i = (*n)++;
+        while (i > 0 && worse(&entry, &heap[(i-1)/2])) {
+            heap[i] = heap[(i-1)/2];
+            i = (i-1)/2;
+        }
+        heap[i] = entry;
+        return true;
+    }
+    if (k == 0 || !worse(&heap[0], &entry))
+        return false;
+    heap[0] = entry;
+    sift_down(heap, *n, 0);
+    return true;
+}
+
+/// Sorts the heap in place, best (smallest distance) first
+void topk_sort(Topk_entry* heap, int n)
+{
+    for (int end = n-1; end > 0; end--) {
+        Topk_entry tmp = heap[0];
+        heap[0] = heap[end];
+        heap[end] = tmp;
+        sift_down(heap, end, 0);
+    }
+}
@@ -0,0 +1,33 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+#ifndef NUMPYDISTANCE_FILE
+#define NUMPYDISTANCE_FILE
+#include <stdbool.h>
+#include "numpy_reader.h"
+
+/// NOTE This is not a sqlite extention. Wrapper code is in blopy_distance.c
+
+typedef enum Distance_op {
+    DISTANCE_DOT,    // inner product
+    DISTANCE_L2,     // euclidean distance
+    DISTANCE_COSINE  // 1 - cosine similarity, like scipy.spatial.distance.cosine
+} Distance_op;
+
+// One entry of a top-k heap
+struct Topk_entry {
+    double distance;
+    long long id;
+};
+typedef struct Topk_entry Topk_entry;
+
+// Public:
+extern int distance(Distance_op op, const Header_data* header_a, const void* a,
+                    const Header_data* header_b, const void* b, double* out);
+extern const char* distance_error(int rc);
+
+extern bool topk_push(Topk_entry* heap, int* n, int k, double distance, long long id);
+extern void topk_sort(Topk_entry* heap, int n);
+#endif
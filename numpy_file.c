@@ -0,0 +1,383 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+#include "numpy_file.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// A mapping is preceded by one page of our own that holds the length of the whole region, so
+// that file_unmap can find it from the pointer alone:
+//   | page: total length | file pages, the first from the page boundary before `offset` |
+//   ^ region                          ^ ptr = region + page + offset % page
+
+/// Maps `length` bytes of the file `path` from `offset` on (length -1: up to the end of the
+/// file) read-only, writes the first mapped byte to `*ptr` and the number of bytes to `*mapped`.
+/// The mapping stays valid until file_unmap(*ptr), also after the file was deleted.
+/// @Returns
+///    *  0, on success
+///    * -1, if the file cannot be opened
+///    * -2, if the range lies outside of the file
+///    * -3, if it cannot be mapped
+int file_map(const char* path, int64_t offset, int64_t length, const unsigned char** ptr,
+             int64_t* mapped)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return -1;
+    }
+    if (length < 0)
+        length = st.st_size - offset;
+    if (offset < 0 || length < 0 || offset > st.st_size || length > st.st_size - offset) {
+        close(fd);
+        return -2;
+    }
+
+    int64_t page = sysconf(_SC_PAGESIZE);
+    int64_t delta = offset % page;
+    size_t total = page + ((delta + length + page - 1) / page) * page;
+    unsigned char* region = mmap(NULL, total, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED) {
+        close(fd);
+        return -3;
+    }
+    if (delta + length > 0
+            && mmap(region + page, delta + length, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd,
+                    offset - delta) == MAP_FAILED) {
+        munmap(region, total);
+        close(fd);
+        return -3;
+    }
+    close(fd);
+    memcpy(region, &total, sizeof(total));
+    mprotect(region, page, PROT_READ);
+
+    *ptr = region + page + delta;
+    *mapped = length;
+    return 0;
+}
+
+/// Unmaps what file_map mapped. The signature fits the destructors of sqlite
+void file_unmap(void* ptr)
+{
+    if (ptr == NULL)
+        return;
+    uintptr_t page = sysconf(_SC_PAGESIZE);
+    unsigned char* region = (unsigned char*) (((uintptr_t) ptr / page) * page - page);
+    size_t total;
+    memcpy(&total, region, sizeof(total));
+    munmap(region, total);
+}
+
+#else
+// Without mmap the range is read into memory, behind a few bytes that keep the pointer of the
+// allocation aligned
+#define FILE_PREFIX 16
+
+int file_map(const char* path, int64_t offset, int64_t length, const unsigned char** ptr,
+             int64_t* mapped)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+        return -1;
+    if (_fseeki64(file, 0, SEEK_END) != 0) {
+        fclose(file);
+        return -1;
+    }
+    int64_t file_size = _ftelli64(file);
+    if (length < 0)
+        length = file_size - offset;
+    if (offset < 0 || length < 0 || offset > file_size || length > file_size - offset) {
+        fclose(file);
+        return -2;
+    }
+    unsigned char* buffer = malloc(FILE_PREFIX + length);
+    if (buffer == NULL) {
+        fclose(file);
+        return -3;
+    }
+    if (_fseeki64(file, offset, SEEK_SET) != 0
+            || fread(buffer + FILE_PREFIX, 1, length, file) != (size_t) length) {
+        free(buffer);
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+    *ptr = buffer + FILE_PREFIX;
+    *mapped = length;
+    return 0;
+}
+
+void file_unmap(void* ptr)
+{
+    if (ptr != NULL)
+        free((unsigned char*) ptr - FILE_PREFIX);
+}
+#endif
+
+static uint16_t le16(const unsigned char* p)
+{
+    return p[0] | p[1] << 8;
+}
+
+static uint32_t le32(const unsigned char* p)
+{
+    return p[0] | p[1] << 8 | p[2] << 16 | (uint32_t) p[3] << 24;
+}
+
+static uint64_t le64(const unsigned char* p)
+{
+    return le32(p) | (uint64_t) le32(p + 4) << 32;
+}
+
+#define ZIP_LOCAL     0x04034b50
+#define ZIP_CENTRAL   0x02014b50
+#define ZIP_END       0x06054b50
+#define ZIP64_END     0x06064b50
+#define ZIP64_LOCATOR 0x07064b50
+#define ZIP64_EXTRA   0x0001
+
+/// Finds the central directory of the zip file `map`: its offset and the number of entries.
+/// @Returns 0 or -2 if there is none
+static int find_directory(const unsigned char* map, int64_t n, int64_t* offset,
+                          int64_t* entries)
+{
+    // The end record (22 bytes) is followed by a comment of at most 65535 bytes
+    int64_t end = -1;
+    for (int64_t pos = n - 22; pos >= 0 && pos >= n - 22 - 65535; pos--) {
+        if (le32(map + pos) == ZIP_END) {
+            end = pos;
+            break;
+        }
+    }
+    if (end < 0)
+        return -2;
+    *entries = le16(map + end + 10);
+    *offset = le32(map + end + 16);
+    if (*entries != 0xFFFF && *offset != 0xFFFFFFFF)
+        return 0;
+
+    // Zip64: a locator right before the end record points to the zip64 end record
+    if (end < 20 || le32(map + end - 20) != ZIP64_LOCATOR)
+        return -2;
+    uint64_t end64 = le64(map + end - 20 + 8);
+    if (n < 56 || end64 > (uint64_t) (n - 56) || le32(map + end64) != ZIP64_END)
+        return -2;
+    *entries = le64(map + end64 + 32);
+    *offset = le64(map + end64 + 48);
+    return *entries >= 0 && *offset >= 0 ? 0 : -2;
+}
+
+/// Reads the central directory entry at `pos` into `member` and moves `pos` to the next one.
+/// @Returns 0, -2 if the entry is broken or -3 if memory ran out
+static int read_entry(const unsigned char* map, int64_t n, int64_t* pos, Npz_member* member)
+{
+    if (*pos > n - 46 || le32(map + *pos) != ZIP_CENTRAL)
+        return -2;
+    const unsigned char* p = map + *pos;
+    int flags = le16(p + 8);
+    int method = le16(p + 10);
+    uint64_t compressed = le32(p + 20);
+    uint64_t size = le32(p + 24);
+    int name_len = le16(p + 28);
+    int extra_len = le16(p + 30);
+    int comment_len = le16(p + 32);
+    uint64_t local = le32(p + 42);
+    if (*pos + 46 + name_len + extra_len + comment_len > n)
+        return -2;
+
+    // Fields that do not fit into 32 bit are in the zip64 extra field, in this order
+    const unsigned char* extra = p + 46 + name_len;
+    for (int i = 0; i + 4 <= extra_len; ) {
+        int id = le16(extra + i), len = le16(extra + i + 2);
+        if (i + 4 + len > extra_len)
+            return -2;
+        if (id == ZIP64_EXTRA) {
+            const unsigned char* field = extra + i + 4;
+            const unsigned char* field_end = field + len;
+            if (size == 0xFFFFFFFF && field + 8 <= field_end) {
+                size = le64(field);
+                field += 8;
+            }
+            if (compressed == 0xFFFFFFFF && field + 8 <= field_end) {
+                compressed = le64(field);
+                field += 8;
+            }
+            if (local == 0xFFFFFFFF && field + 8 <= field_end)
+                local = le64(field);
+        }
+        i += 4 + len;
+    }
+
+    member->name = malloc(name_len + 1);
+    if (member->name == NULL)
+        return -3;
+    memcpy(member->name, p + 46, name_len);
+    member->name[name_len] = '\0';
+    if (name_len >= 4 && strcmp(member->name + name_len - 4, ".npy") == 0)
+        member->name[name_len - 4] = '\0';
+    *pos += 46 + name_len + extra_len + comment_len;
+
+    // The data follows the local header, whose name and extra field can differ in length
+    member->stored = false;
+    member->size = size;
+    member->offset = 0;
+    if (method != 0 || (flags & 1) || compressed != size || n < 30 || local > (uint64_t) (n - 30)
+            || le32(map + local) != ZIP_LOCAL)
+        return 0;
+    uint64_t data = local + 30 + le16(map + local + 26) + le16(map + local + 28);
+    if (data > (uint64_t) n || size > (uint64_t) n - data)
+        return 0;
+    member->stored = true;
+    member->offset = data;
+    return 0;
+}
+
+/// Maps the archive `path` and reads its list of members.
+/// @Returns 0, -1 if the file cannot be opened, -2 if it is no zip file or -3 if memory ran out
+int npz_open(const char* path, Npz* npz)
+{
+    memset(npz, 0, sizeof(*npz));
+    int rc = file_map(path, 0, -1, &npz->map, &npz->map_size);
+    if (rc < 0)
+        return rc;
+
+    int64_t pos, entries;
+    rc = find_directory(npz->map, npz->map_size, &pos, &entries);
+    if (rc == 0 && entries > npz->map_size / 46)
+        rc = -2;
+    if (rc == 0) {
+        npz->members = calloc(entries > 0 ? entries : 1, sizeof(Npz_member));
+        if (npz->members == NULL)
+            rc = -3;
+    }
+    for (int64_t i = 0; rc == 0 && i < entries; i++) {
+        rc = read_entry(npz->map, npz->map_size, &pos, &npz->members[i]);
+        if (rc == 0)
+            npz->n_members++;
+    }
+    if (rc < 0)
+        npz_close(npz);
+    return rc;
+}
+
+void npz_close(Npz* npz)
+{
+    for (int64_t i = 0; i < npz->n_members; i++)
+        free(npz->members[i].name);
+    free(npz->members);
+    file_unmap((void*) npz->map);
+    memset(npz, 0, sizeof(*npz));
+}
+
+/// Creates (or truncates) the .npy file `path` for an array of `descr` in C order, whose first
+/// dimension grows with npy_writer_append; the others are `shape` (`shape_len` of them). The
+/// header is reserved for the longest first dimension, so it never has to move.
+/// @Returns
+///    *  0, on success
+///    * -1, if the file cannot be created
+///    * -2, if there are too many dimensions
+///    * -4, if the header cannot be written
+///    * -5, if there is not enough memory
+int npy_writer_open(Npy_writer* writer, const char* path, const char* descr,
+                    const int64_t* shape, int shape_len)
+{
+    memset(writer, 0, sizeof(*writer));
+    if (shape_len + 1 > NPY_MAXDIMS)
+        return -2;
+    snprintf(writer->descr, sizeof(writer->descr), "%s", descr);
+    if (shape_len > 0)
+        memcpy(writer->shape + 1, shape, shape_len * sizeof(int64_t));
+    writer->shape_len = shape_len + 1;
+
+    writer->shape[0] = INT64_MAX;
+    writer->header_reserve = write_header(NULL, writer->descr, false, writer->shape,
+                                          writer->shape_len);
+    unsigned char* header = malloc(writer->header_reserve);
+    writer->buffer = malloc(NPY_WRITER_BUFFER);
+    if (header == NULL || writer->buffer == NULL) {
+        free(header);
+        free(writer->buffer);
+        writer->buffer = NULL;
+        return -5;
+    }
+    writer->file = fopen(path, "wb");
+    if (writer->file == NULL) {
+        free(header);
+        free(writer->buffer);
+        writer->buffer = NULL;
+        return -1;
+    }
+    setvbuf(writer->file, writer->buffer, _IOFBF, NPY_WRITER_BUFFER);
+
+    // A valid header already, with no rows so far
+    writer->shape[0] = 0;
+    write_header_len(header, writer->header_reserve, writer->descr, false, writer->shape,
+                     writer->shape_len);
+    size_t written = fwrite(header, 1, writer->header_reserve, writer->file);
+    free(header);
+    return written == (size_t) writer->header_reserve ? 0 : -4;
+}
+
+/// Appends `n_bytes` of elements, `n_items` along the first dimension
+/// @Returns 0, or -4 if they cannot be written
+int npy_writer_append(Npy_writer* writer, const void* data, int64_t n_bytes, int64_t n_items)
+{
+    if (n_bytes > 0 && fwrite(data, 1, n_bytes, writer->file) != (size_t) n_bytes)
+        return -4;
+    writer->shape[0] += n_items;
+    return 0;
+}
+
+/// Writes the header with the final shape and closes the file. Also to be called after errors
+/// @Returns 0, or -4 if the file could not be written completely
+int npy_writer_close(Npy_writer* writer)
+{
+    if (writer->file == NULL)
+        return 0;
+    int rc = 0;
+    unsigned char* header = malloc(writer->header_reserve);
+    if (header == NULL)
+        rc = -5;
+    else {
+        write_header_len(header, writer->header_reserve, writer->descr, false, writer->shape,
+                         writer->shape_len);
+        if (fflush(writer->file) != 0 || fseek(writer->file, 0, SEEK_SET) != 0
+                || fwrite(header, 1, writer->header_reserve, writer->file)
+                   != (size_t) writer->header_reserve)
+            rc = -4;
+        free(header);
+    }
+    if (fclose(writer->file) != 0)
+        rc = -4;
+    free(writer->buffer);
+    writer->file = NULL;
+    writer->buffer = NULL;
+    return rc;
+}
+
+const char* file_error(int rc)
+{
+    switch (rc) {
+    case -1: return "cannot open file";
+    case -2: return "not a valid file";
+    case -3: return "cannot map file";
+    case -4: return "cannot write file";
+    case -5: return "out of memory";
+    default: return "unknown error";
+    }
+}
@@ -0,0 +1,65 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+#ifndef NUMPYFILE_FILE
+#define NUMPYFILE_FILE
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "numpy_reader.h"
+
+/// NOTE This is not a sqlite extention. Wrapper code is in blopy_file.c
+
+/// Arrays in files next to the database: .npy files and the members of .npz archives (zip
+/// files of .npy files, as written by numpy.savez). Files are memory mapped read-only, so only
+/// the pages that are actually read are loaded, and a mapping can be handed to sqlite as a BLOB
+/// without a copy: file_unmap only needs the pointer, so it serves as the BLOB's destructor.
+/// Npy_writer goes the other way and writes an array to an .npy file piece by piece.
+
+// Bytes an Npy_writer collects before it writes them to the file. Larger pieces are written
+// directly
+#define NPY_WRITER_BUFFER (1 << 20)
+
+// One member of an .npz archive
+struct Npz_member {
+    char* name;      // without the ".npy" numpy adds, as in numpy.load(...).files
+    bool stored;     // neither compressed (numpy.savez_compressed) nor encrypted
+    int64_t offset;  // of the member's data (an .npy file) in the archive, if stored
+    int64_t size;    // of the .npy file
+};
+typedef struct Npz_member Npz_member;
+
+struct Npz {
+    Npz_member* members;
+    int64_t n_members;
+    const unsigned char* map;  // the whole archive, see file_map
+    int64_t map_size;
+};
+typedef struct Npz Npz;
+
+// An .npy file that grows along its first dimension (see npy_writer_open). Room for the header
+// is reserved at the start of the file, the header with the final shape is written on close
+struct Npy_writer {
+    FILE* file;
+    char* buffer;  // of `file`
+    char descr[DESCR_MAXLEN+1];
+    int64_t shape[NPY_MAXDIMS]; int shape_len;  // shape[0]: what was appended so far
+    int header_reserve;
+};
+typedef struct Npy_writer Npy_writer;
+
+// Public:
+extern int file_map(const char* path, int64_t offset, int64_t length, const unsigned char** ptr,
+                    int64_t* mapped);
+extern void file_unmap(void* ptr);
+extern int npz_open(const char* path, Npz* npz);
+extern void npz_close(Npz* npz);
+extern int npy_writer_open(Npy_writer* writer, const char* path, const char* descr,
+                           const int64_t* shape, int shape_len);
+extern int npy_writer_append(Npy_writer* writer, const void* data, int64_t n_bytes,
+                             int64_t n_items);
+extern int npy_writer_close(Npy_writer* writer);
+extern const char* file_error(int rc);
+#endif
@@ -0,0 +1,511 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+**/
+
+#include "numpy_format.h"
+#include "numpy_convert.h" // the 16 bit floats
+#include <float.h>  // DBL_DIG, DBL_MIN, ...
+#include <limits.h> // LLONG_MAX
+#include <math.h>
+#include <stdlib.h>
+#include <stdio.h>  // snprintf()
+#include <string.h>
+
+void strbuf_init(Str_buffer* buffer, size_t capacity)
+{
+    buffer->len = 0;
+    buffer->cap = capacity > 0 ? capacity : 64;
+    buffer->data = malloc(buffer->cap);
+    buffer->failed = buffer->data == NULL;
+}
+
+/// Makes sure that `extra` more bytes (plus the terminating '\0') fit into the buffer
+/// @Returns false if the buffer could not grow
+bool strbuf_reserve(Str_buffer* buffer, size_t extra)
+{
+    if (buffer->failed)
+        return false;
+    if (buffer->len + extra + 1 <= buffer->cap)
+        return true;
+
+    size_t cap = buffer->cap;
+    while (buffer->len + extra + 1 > cap)
+        cap *= 2;
+    char* data = realloc(buffer->data, cap);
+    if (data == NULL) {
+        buffer->failed = true;
+        return false;
+    }
+    buffer->data = data;
+    buffer->cap = cap;
+    return true;
+}
+
+void strbuf_append(Str_buffer* buffer, const char* str, size_t len)
+{
+    if (!strbuf_reserve(buffer, len))
+        return;
+    memcpy(buffer->data + buffer->len, str, len);
+    buffer->len += len;
+}
+
+/// Terminates the string and hands it over to the caller, who has to free it.
+/// @Returns NULL if an allocation failed on the way
+char* strbuf_finish(Str_buffer* buffer, size_t* len)
+{
+    if (buffer->failed) {
+        free(buffer->data);
+        buffer->data = NULL;
+        return NULL;
+    }
+    buffer->data[buffer->len] = '\0';
+    if (len != NULL)
+        *len = buffer->len;
+    return buffer->data;
+}
+
+/// Writes the decimal digits of `value` to `out` (no '\0'), returns their number
+static int format_int(char* out, long long value)
+{
+    char digits[24];
+    int n = 0;
+    unsigned long long v = value < 0 ? 0ULL - (unsigned long long) value : (unsigned long long) value;
+    do {
+        digits[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v != 0);
+
+    int len = 0;
+    if (value < 0)
+        out[len++] = '-';
+    while (n > 0)
+        out[len++] = digits[--n];
+    return len;
+}
+
+static int format_uint(char* out, unsigned long long value)
+{
+    if (value <= (unsigned long long) LLONG_MAX)
+        return format_int(out, (long long) value);
+    return snprintf(out, NUMBER_MAXLEN, "%llu", value);
+}
+
+/// Special values are written like numpy does: nan, inf and -inf
+static int format_special(char* out, double value)
+{
+    const char* text = isnan(value) ? "nan" : (value > 0 ? "inf" : "-inf");
+    int len = strlen(text);
+    memcpy(out, text, len);
+    return len;
+}
+
+/// Writes the shortest text that reads back as exactly `value` (like python's repr) to `out`,
+/// which must hold NUMBER_MAXLEN chars. Whole numbers get a ".0" to show that they are floats.
+/// @Returns the length of the text (no '\0' is written)
+int format_double(char* out, double value)
+{
+    if (!isfinite(value))
+        return format_special(out, value);
+
+    // Whole numbers are common (counts, indices, ...) and need no search for the precision
+    if (fabs(value) < 1e16 && value == (double) (long long) value) {
+        int len = 0;
+        if (signbit(value) && value == 0)
+            out[len++] = '-';
+        len += format_int(out + len, (long long) value);
+        out[len++] = '.';
+        out[len++] = '0';
+        return len;
+    }
+
+    // 17 significant digits are always enough for a double, often much less are. A text of up
+    // to DBL_DIG digits that reads back comes out of %.15g as well (%g drops trailing zeros),
+    // except for subnormals: they hold fewer digits, e.g. 5e-324 is %.15g 4.94065645841247e-324
+    int precision = fabs(value) < DBL_MIN ? 1 : DBL_DIG;
+    char buffer[NUMBER_MAXLEN];
+    int len = 0;
+    for (; precision <= 17; precision++) {
+        len = snprintf(buffer, sizeof(buffer), "%.*g", precision, value);
+        if (precision == 17 || strtod(buffer, NULL) == value)
+            break;
+    }
+    // From 1e16 on whole numbers have no ".0", but %.17g writes 17 digit ones without exponent
+    if (strpbrk(buffer, ".e") == NULL)
+        len = snprintf(buffer, sizeof(buffer), "%.*e", precision - 1, value);
+    memcpy(out, buffer, len);
+    return len;
+}
+
+/// Like format_double, but only as many digits as a float needs (at most 9)
+int format_float(char* out, float value)
+{
+    if (!isfinite(value))
+        return format_special(out, value);
+
+    if (fabsf(value) < 1e16f && value == (float) (long long) value) {
+        int len = 0;
+        if (signbit(value) && value == 0)
+            out[len++] = '-';
+        len += format_int(out + len, (long long) value);
+        out[len++] = '.';
+        out[len++] = '0';
+        return len;
+    }
+
+    int precision = fabsf(value) < FLT_MIN ? 1 : FLT_DIG;
+    char buffer[NUMBER_MAXLEN];
+    int len = 0;
+    for (; precision <= 9; precision++) {
+        len = snprintf(buffer, sizeof(buffer), "%.*g", precision, value);
+        if (precision == 9 || strtof(buffer, NULL) == value)
+            break;
+    }
+    if (strpbrk(buffer, ".e") == NULL)
+        len = snprintf(buffer, sizeof(buffer), "%.*e", precision - 1, value);
+    memcpy(out, buffer, len);
+    return len;
+}
+
+/// Writes `values` like python prints a tuple, e.g. a shape: '()', '(3,)' or '(3, 4)'. `out`
+/// must hold TUPLE_MAXLEN chars.
+/// @Returns the length of the text (no '\0' is written)
+int format_tuple(char* out, const int64_t* values, int n)
+{
+    int len = 0;
+    out[len++] = '(';
+    for (int k = 0; k < n; k++) {
+        if (k > 0) {
+            out[len++] = ',';
+            out[len++] = ' ';
+        }
+        len += format_int(out + len, values[k]);
+    }
+    if (n == 1)
+        out[len++] = ',';
+    out[len++] = ')';
+    return len;
+}
+
+/// Like format_float for float16 or bfloat16 (`dtype`) with the bits `bits`: the fewest digits
+/// (at most 5) that convert back to the same bits
+static int format_float16(char* out, Dtype_code dtype, uint16_t bits)
+{
+    double value = dtype == DTYPE_F2 ? half_to_double(bits) : bfloat16_to_double(bits);
+    if (!isfinite(value) || (fabs(value) < 1e16 && value == (double) (long long) value))
+        return format_double(out, value);
+
+    // As in format_double: 3 (float16) or 2 (bfloat16) digits always read back, subnormals
+    // (below 2^-14 or FLT_MIN) may need fewer
+    double min_normal = dtype == DTYPE_F2 ? 6.103515625e-05 : FLT_MIN;
+    int precision = fabs(value) < min_normal ? 1 : (dtype == DTYPE_F2 ? 3 : 2);
+    char buffer[NUMBER_MAXLEN];
+    int len = 0;
+    for (; precision <= 5; precision++) {
+        len = snprintf(buffer, sizeof(buffer), "%.*g", precision, value);
+        double back = strtod(buffer, NULL);
+        uint16_t back_bits = dtype == DTYPE_F2 ? double_to_half(back) : double_to_bfloat16(back);
+        if (precision == 5 || back_bits == bits)
+            break;
+    }
+    memcpy(out, buffer, len);
+    return len;
+}
+
+/// Checks that `fmt` is a printf format with exactly one conversion for a number, e.g. "%.3f",
+/// "%8d" or "x=%g". Flags, width and precision are allowed, '*' and length modifiers are not,
+/// "%%" is a literal '%'.
+/// @Returns NULL if the format is fine, an error message otherwise
+const char* check_format(const char* fmt)
+{
+    int conversions = 0;
+    for (const char* p = fmt; *p != '\0'; p++) {
+        if (*p != '%')
+            continue;
+        p++;
+        if (*p == '%')
+            continue;
+        while (*p != '\0' && strchr("-+ #0", *p) != NULL)
+            p++;
+        while (*p >= '0' && *p <= '9')
+            p++;
+        if (*p == '.') {
+            p++;
+            while (*p >= '0' && *p <= '9')
+                p++;
+        }
+        if (*p == '\0' || strchr("diouxXeEfFgGaA", *p) == NULL)
+            return "format must only contain conversions for numbers (diouxX or eEfFgGaA)";
+        conversions++;
+    }
+    if (conversions != 1)
+        return "format must contain exactly one conversion, e.g. '%.3f'";
+    return NULL;
+}
+
+// A user format as given to np(col, fmt), prepared for snprintf
+struct User_format {
+    char* fmt;     // the format with "ll" in front of integer conversions
+    bool integer;  // the conversion takes a long long (else a double)
+};
+typedef struct User_format User_format;
+
+static bool prepare_format(const char* fmt, User_format* user_format)
+{
+    size_t len = strlen(fmt);
+    user_format->fmt = malloc(len + 3);
+    if (user_format->fmt == NULL)
+        return false;
+
+    const char* p = fmt;
+    char* q = user_format->fmt;
+    while (*p != '\0') {
+        if (*p == '%' && p[1] == '%') {
+            *q++ = *p++;
+            *q++ = *p++;
+            continue;
+        }
+        if (*p == '%') {
+            *q++ = *p++;
+            while (*p != '\0' && strchr("diouxXeEfFgGaA", *p) == NULL)
+                *q++ = *p++;
+            user_format->integer = strchr("diouxX", *p) != NULL;
+            if (user_format->integer) {
+                *q++ = 'l';
+                *q++ = 'l';
+            }
+        }
+        *q++ = *p++;
+    }
+    *q = '\0';
+    return true;
+}
+
+static void append_user(Str_buffer* buffer, const User_format* user_format, double value,
+                        long long int_value, bool is_int)
+{
+    if (!strbuf_reserve(buffer, NUMBER_MAXLEN))
+        return;
+    for (int attempt = 0; attempt < 2; attempt++) {
+        size_t room = buffer->cap - buffer->len;
+        int n;
+        if (user_format->integer)
+            n = snprintf(buffer->data + buffer->len, room, user_format->fmt,
+                         is_int ? int_value : (long long) value);
+        else
+            n = snprintf(buffer->data + buffer->len, room, user_format->fmt,
+                         is_int ? (double) int_value : value);
+        if (n < 0)
+            return;
+        if ((size_t) n < room) {
+            buffer->len += n;
+            return;
+        }
+        // Did not fit, grow and write it again
+        if (!strbuf_reserve(buffer, n))
+            return;
+    }
+}
+
+/// Appends a text element (UTF-32, padded with '\0') as UTF-8
+static void append_unicode(Str_buffer* buffer, const unsigned char* ptr, int n_chars)
+{
+    if (!strbuf_reserve(buffer, 4 * (size_t) n_chars))
+        return;
+    char* out = buffer->data + buffer->len;
+    for (int i = 0; i < n_chars; i++) {
+        unsigned int c;
+        memcpy(&c, ptr + 4*i, 4);
+        if (c == 0)
+            break;
+        if (c < 0x80) {
+            *out++ = c;
+        } else if (c < 0x800) {
+            *out++ = 0xc0 | (c >> 6);
+            *out++ = 0x80 | (c & 0x3f);
+        } else if (c < 0x10000) {
+            *out++ = 0xe0 | (c >> 12);
+            *out++ = 0x80 | ((c >> 6) & 0x3f);
+            *out++ = 0x80 | (c & 0x3f);
+        } else {
+            *out++ = 0xf0 | (c >> 18);
+            *out++ = 0x80 | ((c >> 12) & 0x3f);
+            *out++ = 0x80 | ((c >> 6) & 0x3f);
+            *out++ = 0x80 | (c & 0x3f);
+        }
+    }
+    buffer->len = out - buffer->data;
+}
+
+/// Appends a single real value, either in the shortest form or with the user's format
+static void append_real(Str_buffer* buffer, const User_format* user_format, Dtype_code dtype,
+                        const unsigned char* ptr)
+{
+    char number[NUMBER_MAXLEN];
+    int len;
+    long long int_value = 0;
+    double value = 0;
+    bool is_int = true;
+
+    switch (dtype) {
+    case DTYPE_I1: int_value = *(const signed char*) ptr; break;
+    case DTYPE_I2: int_value = *(const short*) ptr; break;
+    case DTYPE_I4: int_value = *(const int*) ptr; break;
+    case DTYPE_I8: int_value = *(const long long*) ptr; break;
+    case DTYPE_U1: int_value = *ptr; break;
+    case DTYPE_U2: int_value = *(const unsigned short*) ptr; break;
+    case DTYPE_U4: int_value = *(const unsigned int*) ptr; break;
+    case DTYPE_U8:
+        if (user_format->fmt == NULL) {
+            len = format_uint(number, *(const unsigned long long*) ptr);
+            strbuf_append(buffer, number, len);
+            return;
+        }
+        int_value = (long long) *(const unsigned long long*) ptr;
+        break;
+    case DTYPE_F4:
+        if (user_format->fmt == NULL) {
+            len = format_float(number, *(const float*) ptr);
+            strbuf_append(buffer, number, len);
+            return;
+        }
+        value = *(const float*) ptr;
+        is_int = false;
+        break;
+    case DTYPE_F2:
+    case DTYPE_BF16: {
+        uint16_t bits = *(const uint16_t*) ptr;
+        if (user_format->fmt == NULL) {
+            len = format_float16(number, dtype, bits);
+            strbuf_append(buffer, number, len);
+            return;
+        }
+        value = dtype == DTYPE_F2 ? half_to_double(bits) : bfloat16_to_double(bits);
+        is_int = false;
+        break;
+    }
+    case DTYPE_F16:
+        value = (double) *(const long double*) ptr;
+        is_int = false;
+        break;
+    default: // DTYPE_F8
+        value = *(const double*) ptr;
+        is_int = false;
+        break;
+    }
+
+    if (user_format->fmt != NULL) {
+        append_user(buffer, user_format, value, int_value, is_int);
+    } else {
+        len = is_int ? format_int(number, int_value) : format_double(number, value);
+        strbuf_append(buffer, number, len);
+    }
+}
+
+static void append_element(Str_buffer* buffer, const User_format* user_format,
+                           const Header_data* header_data, const unsigned char* ptr)
+{
+    switch (header_data->dtype) {
+    case DTYPE_B1:
+        if (*ptr)
+            strbuf_append(buffer, "True", 4);
+        else
+            strbuf_append(buffer, "False", 5);
+        break;
+    case DTYPE_C8:
+    case DTYPE_C16: {
+        // python notation, e.g. (1+2j)
+        Dtype_code part = header_data->dtype == DTYPE_C8 ? DTYPE_F4 : DTYPE_F8;
+        int part_size = header_data->wordsize_in_bytes / 2;
+        strbuf_append(buffer, "(", 1);
+        append_real(buffer, user_format, part, ptr);
+        size_t sign = buffer->len;
+        append_real(buffer, user_format, part, ptr + part_size);
+        // Add a '+' unless the imaginary part brought its own sign
+        if (!buffer->failed && buffer->data[sign] != '-' && buffer->data[sign] != '+') {
+            strbuf_reserve(buffer, 1);
+            if (!buffer->failed) {
+                memmove(buffer->data + sign + 1, buffer->data + sign, buffer->len - sign);
+                buffer->data[sign] = '+';
+                buffer->len++;
+            }
+        }
+        strbuf_append(buffer, "j)", 2);
+        break;
+    }
+    default:
+        if (header_data->type == 'U')
+            append_unicode(buffer, ptr, header_data->wordsize_in_bytes / 4);
+        else
+            append_real(buffer, user_format, header_data->dtype, ptr);
+        break;
+    }
+}
+
+/// Returns a string representation (malloc'ed, length in `*len`) of the whole array described by
+/// `header_data` whose elements start at `data`. Columns (the last axis) are separated by '\t',
+/// rows by '\n' and for arrays with more than two dimensions the 2-d blocks by an empty line.
+/// Elements are written in the shortest form that reads back exactly, or formatted with `fmt`
+/// (a printf format with one conversion, see check_format) unless `fmt` is NULL.
+///
+/// @Returns the string, or NULL with a message in `*error`
+char* BLOB_to_str(const Header_data* header_data, const unsigned char* data,
+                  const char* fmt, size_t* len, const char** error)
+{
+    bool readable = header_data->type == 'U'
+        || (header_data->dtype != DTYPE_UNSUPPORTED && header_data->dtype != DTYPE_C32);
+    if (!readable) {
+        *error = "data type not supported";
+        return NULL;
+    }
+
+    User_format user_format = {NULL, false};
+    if (fmt != NULL) {
+        *error = check_format(fmt);
+        if (*error != NULL)
+            return NULL;
+        if (!prepare_format(fmt, &user_format)) {
+            *error = "out of memory";
+            return NULL;
+        }
+    }
+
+    // Most numbers need less than 12 characters plus a separator. Start with that (up to 1 MB)
+    // to get away without growing most of the time
+    size_t guess = (size_t) header_data->size * 12 + 16;
+    Str_buffer buffer;
+    strbuf_init(&buffer, guess < (1 << 20) ? guess : (1 << 20));
+
+    int nd = header_data->shape_len;
+    int64_t index[NPY_MAXDIMS] = {0};
+    long pos = 0;
+    for (long i = 0; i < header_data->size && !buffer.failed; i++) {
+        append_element(&buffer, &user_format, header_data, data + pos);
+
+        // Next element in C order: count up like an odometer, the last axis being the fastest.
+        // The number of axes which wrapped around decides on the separator
+        int wrapped = 0;
+        for (int k = nd-1; k >= 0; k--) {
+            pos += header_data->strides[k];
+            if (++index[k] < header_data->shape[k])
+                break;
+            pos -= (long) index[k] * header_data->strides[k];
+            index[k] = 0;
+            wrapped++;
+        }
+        if (i + 1 < header_data->size) {
+            if (wrapped == 0)
+                strbuf_append(&buffer, "\t", 1);
+            else if (wrapped == 1)
+                strbuf_append(&buffer, "\n", 1);
+            else
+                strbuf_append(&buffer, "\n\n", 2);
+        }
+    }
+
+    free(user_format.fmt);
+    char* out = strbuf_finish(&buffer, len);
+    if (out == NULL)
+        *error = "out of memory";
+    return out;
+}
@@ -0,0 +1,41 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+#ifndef NUMPYFORMAT_FILE
+#define NUMPYFORMAT_FILE
+#include <stdbool.h>
+#include <stddef.h>
+#include "numpy_reader.h"
+
+/// NOTE This is not a sqlite extention. Wrapper code is in blopy.c
+
+// A growable string which is only ever appended to. The capacity doubles whenever it runs out,
+// so building a string of length n costs O(n) no matter how many pieces it is made of
+struct Str_buffer {
+    char* data;
+    size_t len;
+    size_t cap;
+    bool failed; // an allocation failed, everything appended afterwards is dropped
+};
+typedef struct Str_buffer Str_buffer;
+
+// Enough for any number formatted by format_double or format_float
+#define NUMBER_MAXLEN 32
+// Enough for a tuple of NPY_MAXDIMS numbers written by format_tuple
+#define TUPLE_MAXLEN (NPY_MAXDIMS * 22 + 3)
+
+// Public:
+extern void strbuf_init(Str_buffer* buffer, size_t capacity);
+extern bool strbuf_reserve(Str_buffer* buffer, size_t extra);
+extern void strbuf_append(Str_buffer* buffer, const char* str, size_t len);
+extern char* strbuf_finish(Str_buffer* buffer, size_t* len);
+
+extern int format_double(char* out, double value);
+extern int format_float(char* out, float value);
+extern int format_tuple(char* out, const int64_t* values, int n);
+extern const char* check_format(const char* fmt);
+extern char* BLOB_to_str(const Header_data* header_data, const unsigned char* data,
+                         const char* fmt, size_t* len, const char** error);
+#endif
@@ -0,0 +1,200 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+#include "numpy_layout.h"
+
+#include <stdint.h>
+#include <string.h>
+
+// Elements per side of a tile of the transposition. 32x32 tiles of 8-byte words (8 KiB) read
+// and write whole cache lines and leave room in L1 for both the source and the destination
+#define TILE 32
+
+/// @Returns true if the elements are stored in native (little-endian) byte order, or byte
+/// order does not apply ('|')
+bool is_native(const Header_data* header_data)
+{
+    return header_data->littleEndian;
+}
+
+/// @Returns true if the elements are stored in C order. A Fortran order array with at most one
+/// axis longer than one is C ordered as well
+bool is_c_contiguous(const Header_data* header_data)
+{
+    if (!header_data->fortran_order)
+        return true;
+    int long_axes = 0;
+    for (int j = 0; j < header_data->shape_len; j++)
+        long_axes += header_data->shape[j] > 1;
+    return long_axes <= 1;
+}
+
+/// @Returns true if functions that write a new header have to reject the array: of a structured
+/// dtype only the size of a record is known, its descr could not be written back
+bool reject_structured(const Header_data* header_data)
+{
+    return header_data->descr_len == 0;
+}
+
+/// Copies `header_data` to `out` for the normalized data: native byte order, not compressed
+/// and, if `c_order`, in C order
+void native_header(const Header_data* header_data, bool c_order, Header_data* out)
+{
+    *out = *header_data;
+    if (!out->littleEndian) {
+        // Like numpy, single byte types have no byte order
+        bool single = out->wordsize_in_bytes == 1 || out->type == 'S' || out->type == 'V';
+        out->descr[0] = single ? '|' : '<';
+        out->littleEndian = true;
+    }
+    if (c_order && out->fortran_order) {
+        out->fortran_order = false;
+        header_strides(out);
+    }
+    out->compressed = false;
+    out->chunk = 0;
+}
+
+// Plain loops over words: with -O3 gcc and clang turn them into vector shuffles (pshufb, tbl)
+#define DEFINE_SWAP(bits)                                                        \
+static void swap##bits(const unsigned char* in, unsigned char* out, long n)     \
+{                                                                               \
+    for (long i = 0; i < n; i++) {                                              \
+        uint##bits##_t v;                                                       \
+        memcpy(&v, in + i*sizeof(v), sizeof(v));                                \
+        v = __builtin_bswap##bits(v);                                           \
+        memcpy(out + i*sizeof(v), &v, sizeof(v));                               \
+    }                                                                           \
+}
+DEFINE_SWAP(16)
+DEFINE_SWAP(32)
+DEFINE_SWAP(64)
+
+static void swap_words(const unsigned char* in, unsigned char* out, long n, int lane)
+{
+    for (long i = 0; i < n; i++) {
+        const unsigned char* src = in + i*lane;
+        unsigned char* dst = out + i*lane;
+        for (int k = 0; k < lane/2; k++) {
+            unsigned char b = src[k];
+            dst[k] = src[lane-1-k];
+            dst[lane-1-k] = b;
+        }
+    }
+}
+
+/// Swaps the byte order of `n` elements from `in` to `out`, which may be the same buffer.
+/// Complex numbers are swapped per part and unicode strings per character
+void byteswap(const Header_data* header_data, const unsigned char* in, unsigned char* out,
+              long n)
+{
+    int lane = header_data->wordsize_in_bytes;
+    if (header_data->type == 'c')
+        lane /= 2;
+    else if (header_data->type == 'U')
+        lane = 4;
+    else if (header_data->type == 'S' || header_data->type == 'V')
+        lane = 1;
+    if (lane <= 1) {
+        if (out != in)
+            memcpy(out, in, n * header_data->wordsize_in_bytes);
+        return;
+    }
+
+    long words = n * (header_data->wordsize_in_bytes / lane);
+    switch (lane) {
+    case 2:  swap16(in, out, words); break;
+    case 4:  swap32(in, out, words); break;
+    case 8:  swap64(in, out, words); break;
+    default: swap_words(in, out, words, lane); break;
+    }
+}
+
+// One tile of a transposition: out[i*out_row + j] = in[i + j*in_col] for i < rows, j < cols
+// (in elements). Reading down the columns of `in` stays within TILE cache lines
+#define DEFINE_TILE(name, T)                                                     \
+static void name(const unsigned char* in_ptr, unsigned char* out_ptr, long in_col,  \
+                 long out_row, int rows, int cols, int ws)                      \
+{                                                                               \
+    const T* in = (const T*) in_ptr;                                            \
+    T* out = (T*) out_ptr;                                                      \
+    for (int i = 0; i < rows; i++)                                              \
+        for (int j = 0; j < cols; j++)                                          \
+            out[i*out_row + j] = in[i + j*in_col];                              \
+}
+DEFINE_TILE(tile8, uint8_t)
+DEFINE_TILE(tile16, uint16_t)
+DEFINE_TILE(tile32, uint32_t)
+DEFINE_TILE(tile64, uint64_t)
+
+static void tile_bytes(const unsigned char* in, unsigned char* out, long in_col, long out_row,
+                       int rows, int cols, int ws)
+{
+    for (int i = 0; i < rows; i++)
+        for (int j = 0; j < cols; j++)
+            memcpy(out + (i*out_row + j) * ws, in + (i + j*in_col) * ws, ws);
+}
+
+/// Writes the elements of `in` in C order to `out`, which must not overlap `in`. Data in
+/// Fortran order is transposed: the first axis (contiguous in `in`) against the last one
+/// (contiguous in `out`) in TILE x TILE tiles, once for every index of the axes in between
+void to_c_order(const Header_data* header_data, const unsigned char* in, unsigned char* out)
+{
+    int ws = header_data->wordsize_in_bytes;
+    if (is_c_contiguous(header_data) || header_data->size == 0) {
+        memcpy(out, in, (size_t) header_data->size * ws);
+        return;
+    }
+
+    void (*tile)(const unsigned char*, unsigned char*, long, long, int, int, int);
+    uintptr_t align = (uintptr_t) in | (uintptr_t) out;
+    if (ws == 1)
+        tile = tile8;
+    else if (ws == 2 && align % 2 == 0)
+        tile = tile16;
+    else if (ws == 4 && align % 4 == 0)
+        tile = tile32;
+    else if (ws == 8 && align % 8 == 0)
+        tile = tile64;
+    else
+        tile = tile_bytes;
+
+    int nd = header_data->shape_len;
+    const int64_t* shape = header_data->shape;
+    int64_t rows = shape[0], cols = shape[nd-1];
+    // In elements: along the last axis in `in`, along the first axis in `out`
+    long in_col = header_data->strides[nd-1] / ws;
+    long out_row = (long) header_data->size / rows;
+
+    // Odometer over the axes between the first and the last one
+    int64_t index[NPY_MAXDIMS] = {0};
+    long in_base = 0, out_base = 0;
+    for (;;) {
+        for (int64_t i = 0; i < rows; i += TILE) {
+            for (int64_t j = 0; j < cols; j += TILE) {
+                long in_at = in_base + i + j*in_col;
+                long out_at = out_base + i*out_row + j;
+                tile(in + in_at*ws, out + out_at*ws, in_col, out_row,
+                     rows - i < TILE ? rows - i : TILE, cols - j < TILE ? cols - j : TILE, ws);
+            }
+        }
+
+        int axis = nd - 2;
+        long out_stride = cols;
+        while (axis >= 1) {
+            in_base += header_data->strides[axis] / ws;
+            out_base += out_stride;
+            if (++index[axis] < shape[axis])
+                break;
+            in_base -= (long) shape[axis] * (header_data->strides[axis] / ws);
+            out_base -= (long) shape[axis] * out_stride;
+            index[axis] = 0;
+            out_stride *= shape[axis];
+            axis--;
+        }
+        if (axis < 1)
+            return;
+    }
+}
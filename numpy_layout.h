@@ -0,0 +1,29 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+#ifndef NUMPYLAYOUT_FILE
+#define NUMPYLAYOUT_FILE
+#include <stdbool.h>
+#include "numpy_reader.h"
+
+/// NOTE This is not a sqlite extention. Wrapper code is in blopy*.c
+
+/// Normalizing the memory layout of an array: native (little-endian) byte order and C order.
+/// Data that is already normalized is never copied; otherwise the byte swap runs over whole
+/// words at once and Fortran order is transposed in cache sized tiles.
+
+// The error for arrays that reject_structured rejects, callers put their name in front
+#define STRUCTURED_ERROR "structured dtypes are not supported, use np_field"
+
+// Public:
+extern bool is_native(const Header_data* header_data);
+extern bool is_c_contiguous(const Header_data* header_data);
+extern bool reject_structured(const Header_data* header_data);
+extern void native_header(const Header_data* header_data, bool c_order, Header_data* out);
+extern void byteswap(const Header_data* header_data, const unsigned char* in, unsigned char* out,
+                     long n);
+extern void to_c_order(const Header_data* header_data, const unsigned char* in,
+                       unsigned char* out);
+#endif
@@ -0,0 +1,164 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+#include "numpy_parallel.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <pthread.h>
+
+// One job at a time: `n_tasks` calls of `task`, handed out in order of their index to
+// whichever thread asks next, the caller of pool_run included
+struct Pool {
+    pthread_mutex_t lock;
+    pthread_cond_t work;  // a new job (or stop)
+    pthread_cond_t done;  // the last task of the job finished
+    pthread_t* threads;
+    int n_threads;
+
+    void (*task)(void*, long);
+    void* arg;
+    long n_tasks;
+    long next;      // index of the next task to hand out
+    long finished;  // tasks done
+    bool stop;
+};
+
+/// Runs tasks of the current job until there are none left. Called with the lock held
+static void work_off(Pool* pool)
+{
+    while (pool->next < pool->n_tasks) {
+        long index = pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+        pool->task(pool->arg, index);
+        pthread_mutex_lock(&pool->lock);
+        if (++pool->finished == pool->n_tasks)
+            pthread_cond_signal(&pool->done);
+    }
+}
+
+static void* worker(void* ptr)
+{
+    Pool* pool = ptr;
+    pthread_mutex_lock(&pool->lock);
+    while (!pool->stop) {
+        work_off(pool);
+        if (!pool->stop)
+            pthread_cond_wait(&pool->work, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/// Starts a pool for `threads` threads in total: the calling thread works along, so
+/// threads - 1 workers are started.
+/// @Returns the pool or NULL if `threads` is at most 1 or no thread could be started
+Pool* pool_new(int threads)
+{
+    if (threads <= 1)
+        return NULL;
+    Pool* pool = calloc(1, sizeof(*pool));
+    if (pool == NULL)
+        return NULL;
+    pool->threads = malloc((threads - 1) * sizeof(pthread_t));
+    if (pool->threads == NULL) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->done, NULL);
+
+    for (int i = 0; i < threads - 1; i++) {
+        if (pthread_create(&pool->threads[i], NULL, worker, pool) != 0)
+            break;
+        pool->n_threads++;
+    }
+    if (pool->n_threads == 0) {
+        pool_free(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+/// Stops and joins the workers and frees the pool. NULL is fine
+void pool_free(Pool* pool)
+{
+    if (pool == NULL)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    pool->stop = true;
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->n_threads; i++)
+        pthread_join(pool->threads[i], NULL);
+
+    pthread_cond_destroy(&pool->done);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+}
+
+/// Calls task(arg, index) for every index below `n_tasks` on the workers and the calling
+/// thread and returns when all of them are done. Jobs of one pool must not overlap, which
+/// holds as long as the pool belongs to one sqlite connection
+static void pool_run(Pool* pool, long n_tasks, void (*task)(void*, long), void* arg)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->task = task;
+    pool->arg = arg;
+    pool->n_tasks = n_tasks;
+    pool->next = 0;
+    pool->finished = 0;
+    pthread_cond_broadcast(&pool->work);
+    work_off(pool);
+    while (pool->finished < pool->n_tasks)
+        pthread_cond_wait(&pool->done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+#else
+// Without pthreads everything runs on the calling thread
+struct Pool { int unused; };
+
+Pool* pool_new(int threads)
+{
+    return NULL;
+}
+
+void pool_free(Pool* pool)
+{
+}
+
+static void pool_run(Pool* pool, long n_tasks, void (*task)(void*, long), void* arg)
+{
+    for (long i = 0; i < n_tasks; i++)
+        task(arg, i);
+}
+#endif
+
+/// @Returns the number of parts (at least 1) to cut `n_bytes` of data into
+long parallel_parts(const Parallel* parallel, int64_t n_bytes)
+{
+    if (parallel == NULL || n_bytes < parallel->threshold)
+        return 1;
+    return (long) ((n_bytes + PARALLEL_CHUNK - 1) / PARALLEL_CHUNK);
+}
+
+/// Calls task(arg, index) for every index below `n_tasks`, on the pool of `parallel` if there
+/// is one and there is more than one task. The tasks must not use sqlite
+void parallel_run(const Parallel* parallel, long n_tasks, void (*task)(void* arg, long index),
+                  void* arg)
+{
+    if (parallel == NULL || parallel->pool == NULL || n_tasks <= 1) {
+        for (long i = 0; i < n_tasks; i++)
+            task(arg, i);
+        return;
+    }
+    pool_run(parallel->pool, n_tasks, task, arg);
+}
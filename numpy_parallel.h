@@ -0,0 +1,38 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+#ifndef NUMPYPARALLEL_FILE
+#define NUMPYPARALLEL_FILE
+#include <stdint.h>
+
+/// NOTE This is not a sqlite extention. Wrapper code is in blopy*.c
+
+/// Splitting the work on one large array over several threads. Arrays of at least `threshold`
+/// bytes are cut into parts of PARALLEL_CHUNK bytes (about the size of a core's L2 cache).
+/// The parts depend on the size of the array only, never on the number of threads, and
+/// partial results are combined in the order of the parts. So a reduction gives bit for bit
+/// the same result with 1 or 64 threads; with 1 thread the parts just run one after the other.
+
+// Bytes per part
+#define PARALLEL_CHUNK (1 << 20)
+
+// A fixed set of worker threads, which sleep while there is no work (see pool_run)
+typedef struct Pool Pool;
+
+// How a function may split its work. A NULL Parallel (or pool) runs everything on the calling
+// thread
+struct Parallel {
+    Pool* pool;
+    int64_t threshold; // in bytes, smaller arrays are done in one piece
+};
+typedef struct Parallel Parallel;
+
+// Public:
+extern Pool* pool_new(int threads);
+extern void pool_free(Pool* pool);
+extern long parallel_parts(const Parallel* parallel, int64_t n_bytes);
+extern void parallel_run(const Parallel* parallel, long n_tasks,
+                         void (*task)(void* arg, long index), void* arg);
+#endif
@@ -4,364 +4,785 @@
 **/
 
 #include "numpy_reader.h"
-#include <math.h>
-#include <complex.h>
 #include <stdlib.h>
-#include <stdio.h>  // printf()
+#include <stdio.h>  // snprintf()
 #include <stdbool.h>
 #include <string.h>
-#include <assert.h>
-#include <limits.h> // provides us with CHAR_BIT
+#include <limits.h> // INT_MAX, UINT_MAX
 
 #define SIGN_SQ '\''
 #define SIGN_DQ '"'
 
 //                                 \\x93,   N,  U,  M,  P,  Y
 const unsigned short MAGIC_NUMPY[] = {147, 78, 85, 77, 80, 89};
+// The compressed variant (see numpy_compress.h): \x93NUMPZ
+const unsigned short MAGIC_NUMPZ[] = {147, 78, 85, 77, 80, 90};
 const short MAGIC_LEN = 6; // Unlike numpy, I define the MAGIC_LEN *without* the version
 const short VERSION_LEN = 2;
 
-/// Reads the first MAGIC_LEN bytes from ptr_inputBlob. If it's a numpy file it reads the next
-/// VERSION_LEN bytes and returns the numpy version.
-/// ASSUMPTION (not checked): The input `ptr_inputBlob` is an array with at least MAGIC_LEN+VERSION_LEN elements
+/// Reads the first MAGIC_LEN bytes from ptr_inputBlob. If it's a numpy file (plain or
+/// compressed) it reads the next VERSION_LEN bytes and returns the numpy version
+/// (major*10 + minor, e.g. 10 for "1.0"). Nothing is read beyond `n_bytes`
 ///
 /// @Returns
 ///    * -1,      if no numpy object was detected
 ///    * VERSION, otherwise
-short read_magic(unsigned char* ptr_inputBlob)
+short read_magic(const unsigned char* ptr_inputBlob, int64_t n_bytes)
 {
+    if (n_bytes < MAGIC_LEN+VERSION_LEN)
+        return -1;
+
     for (int i = 0; i < MAGIC_LEN; i++) {
-        if ((unsigned short) ptr_inputBlob[i] != MAGIC_NUMPY[i]) {
+        if ((unsigned short) ptr_inputBlob[i] != MAGIC_NUMPY[i]
+                && (unsigned short) ptr_inputBlob[i] != MAGIC_NUMPZ[i]) {
             return -1;
         }
     }
 
-    unsigned short out = 0;
-    for (int i = 0; i < VERSION_LEN; i++) {
-        out += ((unsigned short) ptr_inputBlob[MAGIC_LEN+i]) * pow(10, VERSION_LEN-i-1);
-    }
-
-    return out;
+    return ptr_inputBlob[MAGIC_LEN]*10 + ptr_inputBlob[MAGIC_LEN+1];
 }
 
 
-/// Return the header length from the next two small-endian bytes
-static int read_header_length(unsigned char* ptr_inputBlob)
+/// Where the header (the dictionary) starts: after magic, version and header length. The
+/// header length has two bytes in version 1.x and four bytes since version 2.0
+static int header_start(short version)
 {
-    // Multiplying with 0x100u has the same effect as shifting 8 to the left (with '<< 8' ?)
-    return ptr_inputBlob[MAGIC_LEN+VERSION_LEN+1]*0x100u
-          +ptr_inputBlob[MAGIC_LEN+VERSION_LEN];
+    return MAGIC_LEN+VERSION_LEN + (version >= 20 ? 4 : 2);
 }
 
-/// Returns the length (number of characters) of the header
-/// If negative it contains an error message
-int read_header(unsigned char* ptr_inputBlob, Header_data* header_data)
+/// Return the header length from the next two (version 1.x) or four small-endian bytes
+static int64_t read_header_length(const unsigned char* ptr_inputBlob, short version)
 {
-    int version = read_magic(ptr_inputBlob);
-    //printf("VERSION=%d", version);
+    const unsigned char* p = ptr_inputBlob + MAGIC_LEN+VERSION_LEN;
+    // Multiplying with 0x100u has the same effect as shifting 8 to the left (with '<< 8' ?)
+    if (version < 20)
+        return p[1]*0x100u + p[0];
+    return ((int64_t) p[3] << 24) + p[2]*0x10000u + p[1]*0x100u + p[0];
+}
 
-    if (version == -1) {
-        printf("No valid numpy BLOB found\n");
+/// The length of magic, version, header length and header, i.e. the offset of the data, from
+/// the first (at most 12) bytes of a numpy BLOB. Allows to read exactly the header of a BLOB or
+/// file that is read piece by piece.
+/// @Returns the offset or -1 if these are not the first bytes of a numpy BLOB
+int64_t header_size(const unsigned char* ptr_inputBlob, int64_t n_bytes)
+{
+    short version = read_magic(ptr_inputBlob, n_bytes);
+    if (version < 0 || n_bytes < header_start(version))
         return -1;
-    }
+    return header_start(version) + read_header_length(ptr_inputBlob, version);
+}
 
-    if ((version < 10) || (version >= 20)) {
-        printf("Error in understanding file definition version. Only Ver. 1 supported");
-        return -2;
+/// Human readable text for the negative return values of read_header
+const char* header_error(int rc)
+{
+    switch (rc) {
+    case -1: return "no valid numpy BLOB found";
+    case -2: return "unsupported numpy file format version (only 1.x, 2.x and 3.x are supported)";
+    case -3: return "numpy header is truncated";
+    case -4: return "numpy header is malformed";
+    case -5: return "numpy array is too large";
+    case -6: return "no such field";
+    case -7: return "not a structured dtype";
+    default: return "unknown numpy header error";
     }
+}
 
-    int header_length = read_header_length(ptr_inputBlob);
+static const char* skip_blanks(const char* p, const char* end)
+{
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r'))
+        p++;
+    return p;
+}
 
-    if (header_length <= 0) {
-        printf("Header has length 0 (or smaller)\n");
-        return -3;
+/// Copies the python string literal starting at `p` (with its quote) into `out` (cut after
+/// `out_cap`-1 characters, always terminated).
+/// @Returns the position after the closing quote or NULL if the string is not terminated
+static const char* parse_string(const char* p, const char* end, char* out, int out_cap, int* out_len)
+{
+    char quote = *p++;
+    int len = 0;
+    while (p < end && *p != quote) {
+        if (len < out_cap-1)
+            out[len++] = *p;
+        p++;
     }
+    out[len] = '\0';
+    if (out_len != NULL)
+        *out_len = len;
+    return p < end ? p+1 : NULL;
+}
 
-    // The header describes the array's format. It's a Python literal expression of a dictionary.
-    // It is terminated by a newline and padded with spaces
-    char buffer[header_length];
-    char cur_char;
-    int counter;
-    bool is_open;
-    int start_hdr = MAGIC_LEN+VERSION_LEN+2;
-    for (int i = 0; i < header_length; i++) {
-        cur_char = (char) ptr_inputBlob[start_hdr+i];
-        if (cur_char == 'd') {
-            // Check for right closing quoting sign of key 'descr'
-            cur_char = (char) ptr_inputBlob[start_hdr+i+5];
-            if (   (cur_char == SIGN_SQ) || (cur_char == SIGN_DQ) ) {
-                i += 6;
-
-                // Move the description content between the quotes to the buffer
-                counter = 0;
-                is_open = false;
-                for (int j = i; j < header_length; j++) {
-                    cur_char = (char) ptr_inputBlob[start_hdr+j];
-                    if ( (cur_char == SIGN_SQ) || (cur_char == SIGN_DQ) ) {
-                        if (is_open)
-                            break;
-                        else
-                            is_open = true;
-                    }
-                    else {
-                        if (is_open) {
-                            buffer[counter++] = cur_char;
-                        }
-                    }
-                }
+/// Skips any value we do not care about: a string, a (nested) list/tuple/dict or a bare token
+/// @Returns the position after the value or NULL if the value is not terminated
+static const char* skip_value(const char* p, const char* end)
+{
+    int depth = 0;
+    while (p < end) {
+        char c = *p;
+        if (c == SIGN_SQ || c == SIGN_DQ) {
+            char quote = c;
+            for (p++; p < end && *p != quote; p++)
+                ;
+            if (p == end)
+                return NULL;
+        } else if (c == '(' || c == '[' || c == '{') {
+            depth++;
+        } else if (c == ')' || c == ']' || c == '}') {
+            if (depth == 0)
+                return p;
+            depth--;
+        } else if (c == ',' && depth == 0) {
+            return p;
+        }
+        p++;
+    }
+    return NULL;
+}
 
-                // TODO use functions from <string>
-                char* desc = malloc((counter+1) * sizeof(char));
-                for (int j = 0; j < counter; j++) {
-                    desc[j] = buffer[j];
-                }
-                desc[counter] = '\0';
-
-                header_data->descr = desc;
-                header_data->descr_len = counter;
-
-                // Def of descr: endian byte, data type, word size
-                // endian:
-                //   '<' : little endian
-                //   '>' : big endian (not supported)
-                //   '=' : native (what does that mean?)
-                //   '|' : not applicable (e.g. object, bool?)
-                // data type:
-                //   'b' : bool
-                //   'i' : int
-                //   'f' : float
-                //   'c' : complex
-                //   'U' : text (I assume unicode which means 1 char is 1 byte)
-                //   'O' : object
-                // word size: size in byte
-                header_data->littleEndian = (desc[0] == '<' || desc[0] == '|' ? true : false);
-                header_data->type = desc[1];
-//                 header_data->wordsize_in_bytes = (unsigned int)atoi(desc+2);
-                header_data->wordsize_in_bytes = atoi(desc+2);
+/// Parses a tuple of integers like (), (3,) or (2, 3) into `shape` (a bare integer is taken as
+/// a 1-tuple, as in the subarray fields of structured dtypes)
+/// @Returns the position after the tuple or NULL with the error code in `*rc`
+static const char* parse_shape(const char* p, const char* end, int64_t* shape, int* shape_len,
+                               int* rc)
+{
+    *rc = -4;
+    bool tuple = *p == '(';
+    if (tuple)
+        p++;
+    int counter = 0;
+    while (true) {
+        p = skip_blanks(p, end);
+        if (p == end)
+            return NULL;
+        if (tuple && *p == ')') {
+            p++;
+            break;
+        }
+        if (*p < '0' || *p > '9' || counter == NPY_MAXDIMS)
+            return NULL;
+        int64_t dim = 0;
+        while (p < end && *p >= '0' && *p <= '9') {
+            if (dim > (INT64_MAX - 9) / 10) {
+                *rc = -5;
+                return NULL;
             }
-            // else maybe raise error because I do not understand the input
+            dim = dim*10 + (*p++ - '0');
         }
+        shape[counter++] = dim;
+        if (!tuple)
+            break;
+        p = skip_blanks(p, end);
+        if (p < end && *p == ',')
+            p++;
+    }
+    *shape_len = counter;
+    *rc = 0;
+    return p;
+}
 
-        else if (cur_char == 's') {
-            // Check for right closing quoting sign of key 'shape'
-            cur_char = (char) ptr_inputBlob[start_hdr+i+5];
-            if (   (cur_char == SIGN_SQ) || (cur_char == SIGN_DQ) ) {
-                i += 6;
-
-                // Assume the shape in a not-nested tuple. Only one '(' and ')' each
-                // Move the (tuple) content between the parenthesis to the buffer
-                counter = 0;
-                is_open = false;
-                for (int j = i; j < header_length; j++) {
-                    cur_char = (char) ptr_inputBlob[start_hdr+j];
-                    if (cur_char == '(') {
-                        is_open = true;
-                    }
-                    else if (cur_char == ')') {
-                        break;
-                    }
-                    else {
-                        if (is_open) {
-                            buffer[counter++] = cur_char;
-                        }
-                    }
-                }
-
-                // The tuple text contains a number and a comma.
-                // This means that the largest possible number of integers is counter-1
-                int shape[counter-1];
-
-                // Copy the tuple content to a new variable. The buffer may include content
-                // from previous runs
-                char tuple[counter];
-                memcpy(tuple, buffer, counter+1);
-
-                // Split at ',' and convert to integers
-                counter = 0;
-                char* elements;
-                elements = strtok(tuple, ",");
-                while (elements != NULL) {
-                    shape[counter] = atoi(elements);
-                    counter += 1;
-                    elements = strtok(NULL, ",");
-                }
-
-                // TODO Make the shape array shorter/as short as possible
-                //      Although, is it worth it? Tiny bit of memory vs (tiny) bit of reshuffling
-                //      But we could count the comma in advance
-                header_data->shape = shape;
-                header_data->shape_len = counter;
-
-                // TODO strictly speaking only if shape has entries/ shape_len > 0
-                // TODO figure out why it can have 0 elements in one dimension/element of shape
-                header_data->size = 1;
-                for (int j = 0; j < header_data->shape_len; j++) {
-                    header_data->size *= header_data->shape[j] > 0 ? header_data->shape[j] : 1;
-                }
-            }
+/// Size in bytes of one element of the simple dtype `descr`, e.g. 8 for '<f8' or '<M8[ns]' and
+/// 40 for '<U10'. @Returns -1 if it is not a dtype
+static int64_t descr_itemsize(const char* descr)
+{
+    if (strlen(descr) < 2)
+        return -1;
+    if (strcmp(descr, "bfloat16") == 0)
+        return 2;
+    int64_t size = atoll(descr+2);
+    if (size < 0 || size > UINT_MAX)
+        return -1;
+    return descr[1] == 'U' ? 4*size : size;
+}
 
+/// Walks the list of fields of a structured dtype starting at `p` (at its '['), e.g.
+///   [('x', '<f8'), ('v', '<f4', (3,)), ('pos', [('a', '<i4'), ('b', '<i4')])]
+/// and adds up the size of a record in `*itemsize`. numpy writes padding as fields of their
+/// own, so the fields follow each other without gaps. If `name` is not NULL, the field of
+/// that name (of a nested structure as 'pos.a') is stored to `field`, with its offset counted
+/// from `base`, and `*found` is set.
+/// @Returns the position after the list or NULL if it is malformed
+static const char* parse_fields(const char* p, const char* end, const char* name, int64_t base,
+                                int64_t* itemsize, Field_data* field, bool* found)
+{
+    *itemsize = 0;
+    p++;
+    while (true) {
+        p = skip_blanks(p, end);
+        if (p == end)
+            return NULL;
+        if (*p == ']')
+            return p+1;
+        if (*p != '(')
+            return NULL;
+        p = skip_blanks(p+1, end);
+
+        // The name, or a tuple (title, name)
+        char field_name[128];
+        int name_len;
+        bool titled = p < end && *p == '(';
+        if (titled) {
+            p = skip_blanks(p+1, end);
+            if (p == end || (*p != SIGN_SQ && *p != SIGN_DQ))
+                return NULL;
+            p = skip_value(p, end);
+            if (p == NULL || *p != ',')
+                return NULL;
+            p = skip_blanks(p+1, end);
+        }
+        if (p == end || (*p != SIGN_SQ && *p != SIGN_DQ))
+            return NULL;
+        p = parse_string(p, end, field_name, sizeof(field_name), &name_len);
+        if (p == NULL)
+            return NULL;
+        if (titled) {
+            p = skip_blanks(p, end);
+            if (p == end || *p != ')')
+                return NULL;
+            p++;
+        }
+        p = skip_blanks(p, end);
+        if (p == end || *p != ',')
+            return NULL;
+        p = skip_blanks(p+1, end);
+        if (p == end)
+            return NULL;
+
+        // Is it the field we look for, or does it contain it?
+        bool match = false;
+        const char* nested = NULL;
+        if (name != NULL && strncmp(name, field_name, name_len) == 0) {
+            match = name[name_len] == '\0';
+            nested = name[name_len] == '.' ? name + name_len + 1 : NULL;
         }
 
-        else if (cur_char == 'f') {
-            // Check for right closing quoting sign of key 'fortran_order'
-            cur_char = (char) ptr_inputBlob[start_hdr+i+13];
-            if ((cur_char == SIGN_SQ) || (cur_char == SIGN_DQ)) {
-                i += 14;
-
-                for (int j = i; j < header_length; j++) {
-                    cur_char = (char) ptr_inputBlob[start_hdr+j];
-
-                    if (cur_char == 'T') {
-                        header_data->fortran_order = true;
-                        i += 4;
-                        break;
-                    }
-                    else if (cur_char == 'F') {
-                        header_data->fortran_order = false;
-                        i += 5;
-                        break;
-                    }
+        // The type: a dtype string or a nested structure
+        char descr[DESCR_MAXLEN+1];
+        int64_t size;
+        if (*p == '[') {
+            p = parse_fields(p, end, nested, base + *itemsize, &size, field, found);
+            snprintf(descr, sizeof(descr), "|V%lld", (long long) size);
+        } else if (*p == SIGN_SQ || *p == SIGN_DQ) {
+            p = parse_string(p, end, descr, sizeof(descr), NULL);
+            size = descr_itemsize(descr);
+        } else {
+            return NULL;
+        }
+        if (p == NULL || size < 0)
+            return NULL;
+
+        // A subarray, e.g. ('v', '<f4', (3,))
+        int64_t shape[NPY_MAXDIMS];
+        int shape_len = 0;
+        p = skip_blanks(p, end);
+        if (p < end && *p == ',') {
+            p = skip_blanks(p+1, end);
+            if (p < end && *p != ')') {
+                int rc;
+                p = parse_shape(p, end, shape, &shape_len, &rc);
+                if (p == NULL)
+                    return NULL;
+                for (int j = 0; j < shape_len; j++) {
+                    if (shape[j] != 0 && size > INT64_MAX / shape[j])
+                        return NULL;
+                    size *= shape[j];
                 }
+                p = skip_blanks(p, end);
             }
         }
-
-        else if (cur_char == '}') {
-            break;
+        if (p == end || *p != ')')
+            return NULL;
+        p++;
+
+        if (match) {
+            memcpy(field->descr, descr, sizeof(descr));
+            field->offset = base + *itemsize;
+            field->size = size;
+            memcpy(field->shape, shape, shape_len * sizeof(int64_t));
+            field->shape_len = shape_len;
+            *found = true;
         }
+        if (size > INT64_MAX - *itemsize)
+            return NULL;
+        *itemsize += size;
+
+        p = skip_blanks(p, end);
+        if (p < end && *p == ',')
+            p++;
+    }
+}
 
-    } // for-loop over i
+/// Decodes descr into type, endianness, word size and the dtype code
+/// Def of descr: endian byte, data type, word size
+/// endian:
+///   '<' : little endian
+///   '>' : big endian
+///   '=' : native (little endian on every platform we run on)
+///   '|' : not applicable (e.g. bool or single bytes)
+/// data type:
+///   'b' : bool
+///   'i' : int
+///   'u' : unsigned int
+///   'f' : float
+///   'c' : complex
+///   'U' : text (4 bytes per character)
+///   'O' : object
+/// word size: size in byte
+/// The one exception is 'bfloat16' (no byte order character), a float with the 8 bit exponent
+/// of float32 and a 7 bit mantissa. numpy writes it as '<V2' unless ml_dtypes registered the
+/// name; np_astype writes the name so the type survives the round trip
+static void decode_descr(Header_data* header_data)
+{
+    const char* desc = header_data->descr;
+    if (header_data->descr_len < 2) {
+        header_data->type = '\0';
+        header_data->littleEndian = true;
+        header_data->wordsize_in_bytes = 0;
+        header_data->dtype = DTYPE_UNSUPPORTED;
+        return;
+    }
+    if (strcmp(desc, "bfloat16") == 0) {
+        header_data->type = 'f';
+        header_data->littleEndian = true;
+        header_data->wordsize_in_bytes = 2;
+        header_data->dtype = DTYPE_BF16;
+        return;
+    }
 
-    return header_length+start_hdr;
+    header_data->littleEndian = desc[0] != '>';
+    header_data->type = desc[1];
+    header_data->wordsize_in_bytes = atoi(desc+2);
+    if (header_data->type == 'U')
+        header_data->wordsize_in_bytes *= 4;
+
+    int w = header_data->wordsize_in_bytes;
+    Dtype_code dtype = DTYPE_UNSUPPORTED;
+    switch (header_data->type) {
+    case 'b':
+        dtype = w == 1 ? DTYPE_B1 : DTYPE_UNSUPPORTED;
+        break;
+    case 'i':
+        dtype = w == 1 ? DTYPE_I1 : w == 2 ? DTYPE_I2 : w == 4 ? DTYPE_I4 : w == 8 ? DTYPE_I8
+              : DTYPE_UNSUPPORTED;
+        break;
+    case 'u':
+        dtype = w == 1 ? DTYPE_U1 : w == 2 ? DTYPE_U2 : w == 4 ? DTYPE_U4 : w == 8 ? DTYPE_U8
+              : DTYPE_UNSUPPORTED;
+        break;
+    case 'f':
+        dtype = w == 2 ? DTYPE_F2 : w == 4 ? DTYPE_F4 : w == 8 ? DTYPE_F8 : w == 16 ? DTYPE_F16
+              : DTYPE_UNSUPPORTED;
+        break;
+    case 'c':
+        dtype = w == 8 ? DTYPE_C8 : w == 16 ? DTYPE_C16 : w == 32 ? DTYPE_C32
+              : DTYPE_UNSUPPORTED;
+        break;
+    }
+    header_data->dtype = dtype;
 }
 
-/// Reads the input BLOB (no type check!) and returns, if the BLOB is of type numpy, a string
-/// representation of the array
-char* BLOB_to_str(unsigned char* ptr_inputBlob)
+/// Sets the strides (bytes to jump in memory to get to the next element along each axis) from
+/// shape, word size and order
+void header_strides(Header_data* header_data)
 {
-    bool do_debug = false;
-    char* out = malloc(sizeof(char)*256); // TODO why restrict to some value? May cause problems!
+    long stride = header_data->wordsize_in_bytes;
+    for (int j = 0; j < header_data->shape_len; j++) {
+        int axis = header_data->fortran_order ? j : header_data->shape_len-1-j;
+        header_data->strides[axis] = stride;
+        stride *= header_data->shape[axis];
+    }
+}
 
-    Header_data* header_data;
-    header_data = malloc(sizeof(*header_data));
+/// Parses the header of a numpy BLOB with `n_bytes` bytes into `header_data` in a single pass
+/// over the dictionary. The header describes the array's format. It's a Python literal
+/// expression of a dictionary, terminated by a newline and padded with spaces, e.g.
+///   {'descr': '<f8', 'fortran_order': False, 'shape': (3, 4), }
+/// Nothing is read beyond `n_bytes` and nothing is allocated.
+///
+/// @Returns the offset of the data (magic, version, header length and header), or if negative
+///          an error code (see header_error)
+int read_header(const unsigned char* ptr_inputBlob, int64_t n_bytes, Header_data* header_data)
+{
+    short version = read_magic(ptr_inputBlob, n_bytes);
 
-    int header_length = read_header(ptr_inputBlob, header_data);
-    if (header_length < 0)
-        return "some error";
+    if (version == -1)
+        return -1;
 
-    if (do_debug) {
-        printf("\n<debug>\n");
+    // 2.0 only widened the header length to four bytes, 3.0 allows UTF-8 in the header (e.g. in
+    // field names), which we read byte by byte anyway
+    if ((version < 10) || (version >= 40))
+        return -2;
 
-        printf(" desc=%s\n", header_data->descr);
-        printf(" ├strlen=%d\n", header_data->descr_len);
-        printf(" ├type=%c\n", header_data->type);
-        printf(" └wordSize=%i\n", header_data->wordsize_in_bytes);
+    int start_hdr = header_start(version);
+    if (n_bytes < start_hdr)
+        return -3;
 
-        printf(" shape=(");
-        for (short i = 0; i < header_data->shape_len; i++) {
-            printf("%i,", header_data->shape[i]);
-        }
-        printf(")\n");
-        printf(" └size=%i\n", header_data->size);
-
-        if (header_data->fortran_order)
-            printf(" fortran_order=True\n");
-        else
-            printf(" fortran_order=False\n");
-        printf("</debug>\n");
-    } // if
-
-    data = &ptr_inputBlob[header_length];
-
-    int N = 15; // How many elements
-    N = N > header_data->size ? header_data->size : N;
-    short out_col_width = 16;
-    char buffer[out_col_width];
-    if (header_data->type == 'O') {
-
-    } else if (header_data->type == 'i') { // int
-        // For correct conversion it must be ensured that a double is really a int32
-        static_assert(sizeof(int) * CHAR_BIT == 32, "32-bit int is assumed.");
-
-        for (int j = 0; j < N; j++) {
-            int out_int;
-
-            if (header_data->wordsize_in_bytes == 8) {
-                out_int = ((long*)data)[j];
-            } else if (header_data->wordsize_in_bytes == 4) {
-                out_int = ((int*)data)[j];
-            } else if (header_data->wordsize_in_bytes == 2) {
-                out_int = ((short*)data)[j];
-            } else {
-                // TODO wordsize_in_bytes == 1 could be implemented
-                printf("data type not supported %i", header_data->wordsize_in_bytes);
-                break;
-            }
+    int64_t header_length = read_header_length(ptr_inputBlob, version);
+    if (header_length > INT_MAX - start_hdr)
+        return -5;
+    if (header_length <= 0 || start_hdr + header_length > n_bytes)
+        return -3;
 
-            //printf(" output=%i\n", ((long*)data)[j]);
-            snprintf(buffer, out_col_width, "%i\t", out_int); // TODO probably it's not checking end of out variable (aka \0)
-            strcat(out, buffer);
-        }
-    } else if (header_data->type == 'f') { // float
-        // For correct conversion it must be ensured that a double is really a float64
-        // Thanks to https://stackoverflow.com/a/72248807/4040140
-        static_assert(sizeof(double) * CHAR_BIT == 64, "64-bit double is assumed.");
-
-        for (int j = 0; j < N; j++) {
-            double out_float;
-
-            if (header_data->wordsize_in_bytes == 8) {
-                out_float = ((double*)data)[j];
-//                 printf("%f\t", out_float);
-            } else if (header_data->wordsize_in_bytes == 4) {
-                out_float = ((float*)data)[j];
-            } else if (header_data->wordsize_in_bytes == 16) {
-                out_float = ((long double*)data)[j];
+    header_data->version = version;
+
+    header_data->fortran_order = false;
+    header_data->compressed = ptr_inputBlob[MAGIC_LEN-1] == MAGIC_NUMPZ[MAGIC_LEN-1];
+    header_data->chunk = 0;
+    header_data->shape_len = -1; // marks a missing 'shape' key
+    header_data->descr_len = -1; // marks a missing 'descr' key
+    header_data->descr[0] = '\0';
+    int64_t itemsize = -1; // of a structured dtype
+
+    const char* p = (const char*) ptr_inputBlob + start_hdr;
+    const char* end = p + header_length;
+
+    p = skip_blanks(p, end);
+    if (p == end || *p != '{')
+        return -4;
+    p++;
+
+    while (true) {
+        p = skip_blanks(p, end);
+        if (p == end)
+            return -4;
+        if (*p == '}')
+            break;
+
+        // The key
+        char key[16];
+        if (*p != SIGN_SQ && *p != SIGN_DQ)
+            return -4;
+        p = parse_string(p, end, key, sizeof(key), NULL);
+        if (p == NULL)
+            return -4;
+        p = skip_blanks(p, end);
+        if (p == end || *p != ':')
+            return -4;
+        p = skip_blanks(p+1, end);
+        if (p == end)
+            return -4;
+
+        // The value
+        if (strcmp(key, "descr") == 0 && (*p == SIGN_SQ || *p == SIGN_DQ)) {
+            p = parse_string(p, end, header_data->descr, sizeof(header_data->descr),
+                             &header_data->descr_len);
+        } else if (strcmp(key, "descr") == 0 && *p == '[') {
+            // A list of fields, i.e. a structured type. Only the size of a record is kept,
+            // read_field looks up a single field
+            header_data->descr_len = 0;
+            p = parse_fields(p, end, NULL, 0, &itemsize, NULL, NULL);
+        } else if (strcmp(key, "descr") == 0) {
+            header_data->descr_len = 0;
+            p = skip_value(p, end);
+        } else if (strcmp(key, "fortran_order") == 0) {
+            if (end - p >= 4 && memcmp(p, "True", 4) == 0) {
+                header_data->fortran_order = true;
+                p += 4;
+            } else if (end - p >= 5 && memcmp(p, "False", 5) == 0) {
+                header_data->fortran_order = false;
+                p += 5;
             } else {
-                printf("data type not supported %i", header_data->wordsize_in_bytes);
-                break;
+                return -4;
             }
+        } else if (strcmp(key, "shape") == 0) {
+            // A tuple of integers like (), (3,) or (2, 3)
+            if (*p != '(')
+                return -4;
+            int rc;
+            p = parse_shape(p, end, header_data->shape, &header_data->shape_len, &rc);
+            if (p == NULL)
+                return rc;
+        } else if (strcmp(key, "chunk") == 0 && header_data->compressed) {
+            long long chunk = 0;
+            while (p < end && *p >= '0' && *p <= '9' && chunk <= INT_MAX)
+                chunk = chunk*10 + (*p++ - '0');
+            if (chunk <= 0 || chunk > INT_MAX)
+                return -4;
+            header_data->chunk = (int) chunk;
+        } else {
+            p = skip_value(p, end);
+        }
+        if (p == NULL)
+            return -4;
+
+        p = skip_blanks(p, end);
+        if (p < end && *p == ',')
+            p++;
+        else if (p == end || *p != '}')
+            return -4;
+    }
+
+    if (header_data->shape_len < 0 || header_data->descr_len < 0)
+        return -4;
+    if (header_data->compressed && header_data->chunk == 0)
+        return -4;
+
+    decode_descr(header_data);
+    if (itemsize >= 0) {
+        if (itemsize > UINT_MAX)
+            return -5;
+        header_data->type = 'V';
+        header_data->wordsize_in_bytes = (unsigned int) itemsize;
+    }
 
-            //printf(" output=%g\n", ((double*)data)[j]);
-            snprintf(buffer, out_col_width, "%6.7g\t", out_float); // TODO improve output
-            strcat(out, buffer);
+    // An empty shape `()` is a scalar with one element. A zero in any dimension
+    // means that the array has no elements at all. The bytes of all elements (and so every
+    // stride) have to fit into 64 bits, even if some other dimension is zero
+    int64_t size = 1, bytes = header_data->wordsize_in_bytes > 0 ? header_data->wordsize_in_bytes : 1;
+    bool empty = false;
+    for (int j = 0; j < header_data->shape_len; j++) {
+        int64_t dim = header_data->shape[j];
+        if (dim == 0) {
+            empty = true;
+            continue;
         }
-    } else if (header_data->type == 'c') { // complex
-        // For correct conversion it must be ensured that a double is really a float64
-        // Thanks to https://stackoverflow.com/a/72248807/4040140
-        static_assert(sizeof(double) * CHAR_BIT == 64, "64-bit double is assumed.");
-
-        for (int j = 0; j < N*2; j=j+2) {
-            double complex out_complex;
-
-            if (header_data->wordsize_in_bytes == 16) {
-                out_complex = ((double*)data)[j] + ((double*)data)[j+1]*I;
-            } else if (header_data->wordsize_in_bytes == 8) {
-                out_complex = ((float*)data)[j] + ((float*)data)[j+1]*I;
-            } else if (header_data->wordsize_in_bytes == 32) {
-                out_complex = ((long double*)data)[j] + ((long double*)data)[j+1]*I;
-            } else {
-                printf("data type not supported %i", header_data->wordsize_in_bytes);
-                break;
-            }
+        if (size > INT64_MAX / dim || bytes > INT64_MAX / dim)
+            return -5;
+        size *= dim;
+        bytes *= dim;
+    }
+    header_data->size = empty ? 0 : size;
+
+    header_strides(header_data);
+
+    header_data->offset = start_hdr + (int) header_length;
+    return header_data->offset;
+}
+
+/// Looks up the field `name` of a structured dtype (a nested one as 'outer.inner') in the
+/// header of a numpy BLOB, see parse_fields. The header is parsed again, so this is meant to
+/// be called once per column of records, not per element.
+///
+/// @Returns the offset of the data (like read_header), or if negative an error code
+///          (see header_error)
+int read_field(const unsigned char* ptr_inputBlob, int64_t n_bytes, const char* name,
+               Field_data* field)
+{
+    Header_data header_data;
+    int rc = read_header(ptr_inputBlob, n_bytes, &header_data);
+    if (rc < 0)
+        return rc;
+    if (header_data.type != 'V')
+        return -7;
+
+    // read_header checked the dictionary already, so this only walks the keys to the descr
+    const char* p = (const char*) ptr_inputBlob + header_start(header_data.version);
+    const char* end = (const char*) ptr_inputBlob + header_data.offset;
+    p = skip_blanks(p, end) + 1;
+    while (true) {
+        char key[16];
+        p = parse_string(skip_blanks(p, end), end, key, sizeof(key), NULL);
+        p = skip_blanks(skip_blanks(p, end) + 1, end);
+        if (strcmp(key, "descr") == 0)
+            break;
+        p = skip_blanks(skip_value(p, end), end) + 1;
+    }
+
+    int64_t itemsize;
+    bool found = false;
+    if (parse_fields(p, end, name, 0, &itemsize, field, &found) == NULL)
+        return -4;
+    return found ? rc : -6;
+}
+
+// The cache is direct mapped: the hash of the raw header decides the only slot an entry can
+// live in. Headers longer than CACHE_RAW_MAXLEN bytes are parsed every time
+#define CACHE_SLOTS 32
+#define CACHE_RAW_MAXLEN 256
+
+// A cache entry is reference counted: one reference is held by the slot, every user (e.g. an
+// sqlite auxdata) holds another one. So an entry stays valid even if its slot is reused
+struct Cache_entry {
+    Header_data header; // first member: a Header_data* is also a Cache_entry*
+    int refcount;
+    unsigned long long hash;
+    int64_t raw_len;
+    unsigned char raw[CACHE_RAW_MAXLEN];
+};
+typedef struct Cache_entry Cache_entry;
+
+struct Header_cache {
+    Cache_entry* slot[CACHE_SLOTS];
+    int64_t hits;    // headers found in the cache
+    int64_t parses;  // headers parsed, whether they could be cached or not
+};
+
+Header_cache* header_cache_new(void)
+{
+    return calloc(1, sizeof(Header_cache));
+}
+
+void header_cache_free(Header_cache* cache)
+{
+    if (cache == NULL)
+        return;
+    for (int i = 0; i < CACHE_SLOTS; i++) {
+        if (cache->slot[i] != NULL)
+            header_release(cache->slot[i]);
+    }
+    free(cache);
+}
+
+void header_retain(const Header_data* header_data)
+{
+    ((Cache_entry*) header_data)->refcount++;
+}
+
+/// Drops a reference to a header returned by header_cache_get. The signature fits the
+/// destructor callbacks of sqlite
+void header_release(void* header_data)
+{
+    Cache_entry* entry = header_data;
+    if (--entry->refcount == 0)
+        free(entry);
+}
+
+/// FNV-1a, but on 8 bytes per step instead of single bytes. Not cryptographic: good enough to
+/// tell headers (and with np_meta whole BLOBs) apart
+unsigned long long hash_bytes(const unsigned char* p, int64_t len)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    int64_t i = 0;
+    for (; i + 8 <= len; i += 8) {
+        unsigned long long word;
+        memcpy(&word, p+i, 8);
+        hash = (hash ^ word) * 1099511628211ULL;
+    }
+    for (; i < len; i++)
+        hash = (hash ^ p[i]) * 1099511628211ULL;
+    return hash ^ (hash >> 29);
+}
 
-//             printf(" output=(%g, %g)\n", creal(out_complex), cimag(out_complex));
-            snprintf(buffer, out_col_width, "(%4.g,%3.g)\t", creal(out_complex), cimag(out_complex));
-            strcat(out, buffer);
+/// Returns the parsed header of a numpy BLOB. Headers are only parsed if the very same header
+/// bytes are not in the cache already; most columns hold arrays of one shape and dtype, so
+/// typically a whole table is served by a single parse.
+/// The caller owns one reference to the returned header and must call header_release.
+///
+/// @Returns the header, or NULL with the error code of read_header in `*rc`
+const Header_data* header_cache_get(Header_cache* cache, const unsigned char* ptr_inputBlob,
+                                    int64_t n_bytes, int* rc)
+{
+    int64_t raw_len = header_size(ptr_inputBlob, n_bytes);
+    bool cacheable = raw_len > 0 && raw_len <= CACHE_RAW_MAXLEN && raw_len <= n_bytes;
+
+    unsigned long long hash = 0;
+    Cache_entry** slot = NULL;
+    if (cacheable) {
+        hash = hash_bytes(ptr_inputBlob, raw_len);
+        slot = &cache->slot[hash % CACHE_SLOTS];
+        Cache_entry* hit = *slot;
+        if (hit != NULL && hit->hash == hash && hit->raw_len == raw_len
+                && memcmp(hit->raw, ptr_inputBlob, raw_len) == 0) {
+            hit->refcount++;
+            cache->hits++;
+            *rc = hit->header.offset;
+            return &hit->header;
         }
-    } else if (header_data->type == 'U') { // text
-        strcat(out,  "data type U not yet supported");
-    } else {
-        strcat(out,  "data type not supported");
     }
 
+    Cache_entry* entry = malloc(sizeof(*entry));
+    if (entry == NULL) {
+        *rc = -5;
+        return NULL;
+    }
+    cache->parses++;
+    *rc = read_header(ptr_inputBlob, n_bytes, &entry->header);
+    if (*rc < 0) {
+        free(entry);
+        return NULL;
+    }
+    entry->refcount = 1;
+
+    if (cacheable) {
+        entry->hash = hash;
+        entry->raw_len = raw_len;
+        memcpy(entry->raw, ptr_inputBlob, raw_len);
+        if (*slot != NULL)
+            header_release(*slot);
+        *slot = entry;
+        entry->refcount++;
+    }
+
+    return &entry->header;
+}
+
+/// Writes how many headers were found in the cache and how many had to be parsed since it was
+/// created
+void header_cache_counts(const Header_cache* cache, int64_t* hits, int64_t* parses)
+{
+    *hits = cache->hits;
+    *parses = cache->parses;
+}
+
+/// Writes a version 1.0 header (magic, version, header length and the dictionary) to `ptr_out`
+/// in the same layout numpy uses: the dictionary is padded with spaces and terminated by '\n'
+/// such that the array data which follows starts at a multiple of 64 bytes.
+/// If `ptr_out` is NULL nothing is written, which can be used to find out the required size.
+///
+/// @Returns the number of bytes of the header, i.e. the offset of the data
+int write_header(unsigned char* ptr_out, const char* descr, bool fortran_order,
+                 const int64_t* shape, int shape_len)
+{
+    return write_header_len(ptr_out, 0, descr, fortran_order, shape, shape_len);
+}
+
+static int write_dict(unsigned char* ptr_out, int total, const char* descr, bool fortran_order,
+                      const int64_t* shape, int shape_len, int chunk);
 
-    // Clean up
-    free(header_data);
+/// Like write_header, but for a compressed BLOB (see numpy_compress.h) with `chunk` elements
+/// per chunk
+int write_header_chunked(unsigned char* ptr_out, const char* descr, bool fortran_order,
+                         const int64_t* shape, int shape_len, int chunk)
+{
+    return write_dict(ptr_out, 0, descr, fortran_order, shape, shape_len, chunk);
+}
 
-    if (N < header_data->size)
-        strcat(out, "...\0");
-    else
-        strcat(out, "\0");
-    return out;
+/// Like write_header, but the header is padded to `total` bytes if it is shorter. This allows
+/// to reserve room for the header before the final shape is known.
+/// @Returns the number of bytes of the header, which is more than `total` if it did not fit
+int write_header_len(unsigned char* ptr_out, int total, const char* descr, bool fortran_order,
+                     const int64_t* shape, int shape_len)
+{
+    return write_dict(ptr_out, total, descr, fortran_order, shape, shape_len, 0);
 }
 
+/// Writes the header of write_header_len. With `chunk` > 0 it is the header of a compressed BLOB
+static int write_dict(unsigned char* ptr_out, int total, const char* descr, bool fortran_order,
+                      const int64_t* shape, int shape_len, int chunk)
+{
+    // Even with NPY_MAXDIMS dimensions of 19 digits this is far below the 64 KiB a version 1.0
+    // header can have
+    char dict[96 + NPY_MAXDIMS*24];
+    int len = snprintf(dict, sizeof(dict), "{'descr': '%s', 'fortran_order': %s, 'shape': (",
+                       descr, fortran_order ? "True" : "False");
+    for (int i = 0; i < shape_len; i++) {
+        len += snprintf(dict+len, sizeof(dict)-len, i == 0 ? "%lld" : ", %lld",
+                        (long long) shape[i]);
+    }
+    // A 1-tuple needs a trailing comma in python
+    len += snprintf(dict+len, sizeof(dict)-len, shape_len == 1 ? ",), " : "), ");
+    if (chunk > 0)
+        len += snprintf(dict+len, sizeof(dict)-len, "'chunk': %d, ", chunk);
+    len += snprintf(dict+len, sizeof(dict)-len, "}");
+
+    int start_hdr = MAGIC_LEN+VERSION_LEN+2;
+    int needed = start_hdr + len + 1;
+    needed += (64 - needed % 64) % 64;
+    if (total < needed)
+        total = needed;
+
+    if (ptr_out != NULL) {
+        for (int i = 0; i < MAGIC_LEN; i++) {
+            ptr_out[i] = (unsigned char) (chunk > 0 ? MAGIC_NUMPZ[i] : MAGIC_NUMPY[i]);
+        }
+        ptr_out[MAGIC_LEN] = 1;
+        ptr_out[MAGIC_LEN+1] = 0;
+        ptr_out[MAGIC_LEN+VERSION_LEN]   = (total - start_hdr) & 0xff;
+        ptr_out[MAGIC_LEN+VERSION_LEN+1] = (total - start_hdr) >> 8;
+
+        memcpy(ptr_out+start_hdr, dict, len);
+        memset(ptr_out+start_hdr+len, ' ', total-start_hdr-len-1);
+        ptr_out[total-1] = '\n';
+    }
+
+    return total;
+}
@@ -6,38 +6,94 @@
 #ifndef NUMPYREADER_FILE
 #define NUMPYREADER_FILE
 #include <stdbool.h>
+#include <stdint.h>
 
-/// NOTE This is not a sqlite extention. Wrapper code is in extension.c
+/// NOTE This is not a sqlite extention. Wrapper code is in blopy.c
 
 
 extern const unsigned short MAGIC_NUMPY[];
+extern const unsigned short MAGIC_NUMPZ[];
 extern const short MAGIC_LEN;
 extern const short VERSION_LEN;
 
+// numpy itself never creates arrays with more dimensions than this (NPY_MAXDIMS)
+#define NPY_MAXDIMS 32
+// Longest descr we keep, e.g. '<U123' or '<M8[ns]'. Longer ones (structured dtypes) are cut
+#define DESCR_MAXLEN 31
+
+// The element type as a single code, decoded once from descr (type and word size)
+typedef enum Dtype_code {
+    DTYPE_UNSUPPORTED = 0,  // text, objects, structured types, ...
+    DTYPE_B1,
+    DTYPE_I1, DTYPE_I2, DTYPE_I4, DTYPE_I8,
+    DTYPE_U1, DTYPE_U2, DTYPE_U4, DTYPE_U8,
+    DTYPE_F2, DTYPE_F4, DTYPE_F8, DTYPE_F16,
+    DTYPE_C8, DTYPE_C16, DTYPE_C32,
+    DTYPE_BF16  // descr 'bfloat16', the name numpy knows once ml_dtypes is imported
+} Dtype_code;
+
 // The new "class" is of type `struct Header_data`
+// Everything is stored inline (no pointers), so a Header_data can be copied and cached as is
+// Shapes, sizes and strides are 64 bit: a compressed BLOB or a file can hold more than 2^31
+// elements, and so can a zero size array in any other dimension
 struct Header_data {
     bool fortran_order;
 
-    int* shape; int shape_len;
-    int size;
+    int64_t shape[NPY_MAXDIMS]; int shape_len;
+    int64_t size;
+    int64_t strides[NPY_MAXDIMS]; // in bytes, like numpy's ndarray.strides
 
-    char* descr; int descr_len;
-    char type;
+    char descr[DESCR_MAXLEN+1]; int descr_len; // descr_len 0 for a structured dtype
+    char type;                                  // 'V' for a structured dtype
     bool littleEndian;
     unsigned int wordsize_in_bytes; // size of each element/word length
+    Dtype_code dtype;
+
+    short version; // of the file format: 10, 20 or 30 for 1.0, 2.0 or 3.0
+    int offset; // where the data starts, i.e. the length of magic, version and header
+
+    bool compressed; // magic \x93NUMPZ, the data is compressed in chunks (see numpy_compress.h)
+    int chunk;       // elements per chunk of a compressed BLOB
 };
 // We created the type `Header_data`
 typedef struct Header_data Header_data;
 // One could combine both above into a one-liner but this looks easier to understand
 //   typedef struct Header_data { bool a;} Header_data;
 
-// Public:
-extern short read_magic(unsigned char* ptr_inputBlob);
-extern char* BLOB_to_str(unsigned char* ptr_inputBlob);
-extern int read_header(unsigned char* ptr_inputBlob, Header_data* header_data);
+// One field of a structured dtype (see read_field)
+struct Field_data {
+    char descr[DESCR_MAXLEN+1];
+    int64_t offset;                             // in bytes from the start of the record
+    int64_t size;                               // in bytes, the whole subarray if it is one
+    int64_t shape[NPY_MAXDIMS]; int shape_len;  // of a subarray field like ('v', '<f4', (3,))
+};
+typedef struct Field_data Field_data;
 
-// Private:
-static void* data;
+// A small cache of parsed headers, keyed by the raw header bytes (see header_cache_get)
+typedef struct Header_cache Header_cache;
+
+// Public:
+extern short read_magic(const unsigned char* ptr_inputBlob, int64_t n_bytes);
+extern int64_t header_size(const unsigned char* ptr_inputBlob, int64_t n_bytes);
+extern int read_header(const unsigned char* ptr_inputBlob, int64_t n_bytes,
+                       Header_data* header_data);
+extern int read_field(const unsigned char* ptr_inputBlob, int64_t n_bytes, const char* name,
+                      Field_data* field);
+extern const char* header_error(int rc);
+extern void header_strides(Header_data* header_data);
+extern int write_header(unsigned char* ptr_out, const char* descr, bool fortran_order,
+                        const int64_t* shape, int shape_len);
+extern int write_header_len(unsigned char* ptr_out, int total, const char* descr,
+                            bool fortran_order, const int64_t* shape, int shape_len);
+extern int write_header_chunked(unsigned char* ptr_out, const char* descr, bool fortran_order,
+                                const int64_t* shape, int shape_len, int chunk);
 
-static int _read_header_length(unsigned char* ptr_inputBlob);
+extern Header_cache* header_cache_new(void);
+extern void header_cache_free(Header_cache* cache);
+extern const Header_data* header_cache_get(Header_cache* cache, const unsigned char* ptr_inputBlob,
+                                           int64_t n_bytes, int* rc);
+extern void header_cache_counts(const Header_cache* cache, int64_t* hits, int64_t* parses);
+extern unsigned long long hash_bytes(const unsigned char* p, int64_t len);
+extern void header_retain(const Header_data* header_data);
+extern void header_release(void* header_data);
 #endif
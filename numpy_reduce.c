@@ -0,0 +1,471 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+**/
+
+#include "numpy_reduce.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Number of independent accumulators in the contiguous loops. A single accumulator forces the
+// compiler to keep the order of the floating point additions and therefore to stay scalar.
+// With eight of them gcc/clang turn the inner loop into packed SSE/AVX instructions (-O3).
+#define LANES 8
+
+/// The kernels below are generated once per element type T. ACC is the type used to sum up:
+/// unsigned long long for integers (wraps around like numpy instead of being undefined
+/// behaviour) and double for floats.
+/// `stride` is given in elements. The vectorized path is only taken for stride == 1
+#define DEFINE_KERNELS(SUFFIX, T, ACC)                                                  \
+static ACC sum_##SUFFIX(const T* x, long n, long stride)                                \
+{                                                                                       \
+    ACC lane[LANES] = {0};                                                              \
+    long i = 0;                                                                         \
+    if (stride == 1) {                                                                  \
+        for (; i + LANES <= n; i += LANES)                                              \
+            for (int k = 0; k < LANES; k++)                                             \
+                lane[k] += (ACC) x[i+k];                                                \
+    }                                                                                   \
+    ACC sum = 0;                                                                        \
+    for (; i < n; i++)                                                                  \
+        sum += (ACC) x[i*stride];                                                       \
+    for (int k = 0; k < LANES; k++)                                                     \
+        sum += lane[k];                                                                 \
+    return sum;                                                                         \
+}                                                                                       \
+                                                                                        \
+/* Sum of the squared deviations from `mean` (second pass of the standard deviation) */ \
+static double sqdev_##SUFFIX(const T* x, long n, long stride, double mean)              \
+{                                                                                       \
+    double lane[LANES] = {0};                                                           \
+    long i = 0;                                                                         \
+    if (stride == 1) {                                                                  \
+        for (; i + LANES <= n; i += LANES)                                              \
+            for (int k = 0; k < LANES; k++) {                                           \
+                double d = (double) x[i+k] - mean;                                      \
+                lane[k] += d*d;                                                         \
+            }                                                                           \
+    }                                                                                   \
+    double sum = 0;                                                                     \
+    for (; i < n; i++) {                                                                \
+        double d = (double) x[i*stride] - mean;                                         \
+        sum += d*d;                                                                     \
+    }                                                                                   \
+    for (int k = 0; k < LANES; k++)                                                     \
+        sum += lane[k];                                                                 \
+    return sum;                                                                         \
+}                                                                                       \
+                                                                                        \
+/* Minimum (is_max == false) or maximum of n >= 1 elements. `v != v` is only true for */ \
+/* NaN and vanishes for integer types. NaN wins like in numpy */                        \
+static T extreme_##SUFFIX(const T* x, long n, long stride, bool is_max, bool* has_nan)  \
+{                                                                                       \
+    T best = x[0];                                                                      \
+    int nan = 0;                                                                        \
+    long i = 0;                                                                         \
+    if (stride == 1 && n >= 2*LANES) {                                                  \
+        T lane[LANES];                                                                  \
+        int lane_nan[LANES];                                                            \
+        for (int k = 0; k < LANES; k++) {                                               \
+            lane[k] = x[k];                                                             \
+            lane_nan[k] = x[k] != x[k];                                                 \
+        }                                                                               \
+        for (i = LANES; i + LANES <= n; i += LANES)                                     \
+            for (int k = 0; k < LANES; k++) {                                           \
+                T v = x[i+k];                                                           \
+                if (is_max)                                                             \
+                    lane[k] = v > lane[k] ? v : lane[k];                                \
+                else                                                                    \
+                    lane[k] = v < lane[k] ? v : lane[k];                                \
+                lane_nan[k] |= v != v;                                                  \
+            }                                                                           \
+        for (int k = 0; k < LANES; k++) {                                               \
+            if (is_max)                                                                 \
+                best = lane[k] > best ? lane[k] : best;                                 \
+            else                                                                        \
+                best = lane[k] < best ? lane[k] : best;                                 \
+            nan |= lane_nan[k];                                                         \
+        }                                                                               \
+    }                                                                                   \
+    for (; i < n; i++) {                                                                \
+        T v = x[i*stride];                                                              \
+        if (is_max)                                                                     \
+            best = v > best ? v : best;                                                 \
+        else                                                                            \
+            best = v < best ? v : best;                                                 \
+        nan |= v != v;                                                                  \
+    }                                                                                   \
+    *has_nan = nan;                                                                     \
+    return best;                                                                        \
+}                                                                                       \
+                                                                                        \
+static int reduce_##SUFFIX(Reduce_op op, const T* x, long n, long stride, bool is_int,   \
+                           Reduce_value* out)                                           \
+{                                                                                       \
+    bool has_nan = false;                                                               \
+    double mean;                                                                        \
+    T best;                                                                             \
+    switch (op) {                                                                       \
+    case REDUCE_SUM:                                                                    \
+        if (is_int)                                                                     \
+            out->i = (long long) sum_##SUFFIX(x, n, stride);                            \
+        else                                                                            \
+            out->re = (double) sum_##SUFFIX(x, n, stride);                              \
+        break;                                                                          \
+    case REDUCE_MEAN:                                                                   \
+    case REDUCE_STD:                                                                    \
+        if (n <= 0) {                                                                   \
+            out->re = NAN;                                                              \
+            break;                                                                      \
+        }                                                                               \
+        mean = (is_int ? (double) (long long) sum_##SUFFIX(x, n, stride)                \
+                       : (double) sum_##SUFFIX(x, n, stride)) / n;                      \
+        out->re = op == REDUCE_MEAN ? mean                                              \
+                                    : sqrt(sqdev_##SUFFIX(x, n, stride, mean) / n);     \
+        break;                                                                          \
+    case REDUCE_MIN:                                                                    \
+    case REDUCE_MAX:                                                                    \
+        if (n <= 0)                                                                     \
+            return -2;                                                                  \
+        best = extreme_##SUFFIX(x, n, stride, op == REDUCE_MAX, &has_nan);              \
+        if (is_int)                                                                     \
+            out->i = (long long) best;                                                  \
+        else                                                                            \
+            out->re = has_nan ? NAN : (double) best;                                    \
+        break;                                                                          \
+    }                                                                                   \
+    return 0;                                                                           \
+}
+
+DEFINE_KERNELS(i2, short, unsigned long long)
+DEFINE_KERNELS(i4, int, unsigned long long)
+DEFINE_KERNELS(i8, long long, unsigned long long)
+DEFINE_KERNELS(f4, float, double)
+DEFINE_KERNELS(f8, double, double)
+
+/// Complex numbers are stored as (real, imag) pairs of T. Sum and standard deviation work on
+/// the interleaved pairs, min and max compare lexicographically (real part first) like numpy
+#define DEFINE_COMPLEX_KERNELS(SUFFIX, T)                                               \
+static void csum_##SUFFIX(const T* x, long n, long stride, double* re, double* im)     \
+{                                                                                       \
+    double lane[LANES] = {0};                                                           \
+    long i = 0;                                                                         \
+    if (stride == 1) {                                                                  \
+        /* Even lanes collect real parts, odd lanes imaginary parts */                  \
+        for (; 2*i + LANES <= 2*n; i += LANES/2)                                        \
+            for (int k = 0; k < LANES; k++)                                             \
+                lane[k] += x[2*i+k];                                                    \
+    }                                                                                   \
+    *re = 0; *im = 0;                                                                   \
+    for (; i < n; i++) {                                                                \
+        *re += x[2*i*stride];                                                           \
+        *im += x[2*i*stride+1];                                                         \
+    }                                                                                   \
+    for (int k = 0; k < LANES; k += 2) {                                                \
+        *re += lane[k];                                                                 \
+        *im += lane[k+1];                                                               \
+    }                                                                                   \
+}                                                                                       \
+                                                                                        \
+static double csqdev_##SUFFIX(const T* x, long n, long stride, double re, double im)    \
+{                                                                                       \
+    double lane[LANES] = {0};                                                           \
+    long i = 0;                                                                         \
+    if (stride == 1) {                                                                  \
+        for (; 2*i + LANES <= 2*n; i += LANES/2)                                        \
+            for (int k = 0; k < LANES; k++) {                                           \
+                double d = x[2*i+k] - (k % 2 == 0 ? re : im);                           \
+                lane[k] += d*d;                                                         \
+            }                                                                           \
+    }                                                                                   \
+    double sum = 0;                                                                     \
+    for (; i < n; i++) {                                                                \
+        double dr = x[2*i*stride] - re;                                                 \
+        double di = x[2*i*stride+1] - im;                                               \
+        sum += dr*dr + di*di;                                                           \
+    }                                                                                   \
+    for (int k = 0; k < LANES; k++)                                                     \
+        sum += lane[k];                                                                 \
+    return sum;                                                                         \
+}                                                                                       \
+                                                                                        \
+static int creduce_##SUFFIX(Reduce_op op, const T* x, long n, long stride, Reduce_value* out) \
+{                                                                                       \
+    double re, im;                                                                      \
+    switch (op) {                                                                       \
+    case REDUCE_SUM:                                                                    \
+        csum_##SUFFIX(x, n, stride, &out->re, &out->im);                                \
+        break;                                                                          \
+    case REDUCE_MEAN:                                                                   \
+        csum_##SUFFIX(x, n, stride, &re, &im);                                          \
+        out->re = n > 0 ? re / n : NAN;                                                 \
+        out->im = n > 0 ? im / n : NAN;                                                 \
+        break;                                                                          \
+    case REDUCE_STD:                                                                    \
+        csum_##SUFFIX(x, n, stride, &re, &im);                                          \
+        out->re = n > 0 ? sqrt(csqdev_##SUFFIX(x, n, stride, re / n, im / n) / n) : NAN; \
+        break;                                                                          \
+    case REDUCE_MIN:                                                                    \
+    case REDUCE_MAX:                                                                    \
+        if (n <= 0)                                                                     \
+            return -2;                                                                  \
+        re = x[0]; im = x[1];                                                           \
+        for (long i = 1; i < n; i++) {                                                  \
+            double vr = x[2*i*stride], vi = x[2*i*stride+1];                            \
+            bool less = vr < re || (vr == re && vi < im);                               \
+            bool greater = vr > re || (vr == re && vi > im);                            \
+            if ((op == REDUCE_MIN && less) || (op == REDUCE_MAX && greater)) {          \
+                re = vr; im = vi;                                                       \
+            }                                                                           \
+        }                                                                               \
+        out->re = re; out->im = im;                                                     \
+        break;                                                                          \
+    }                                                                                   \
+    return 0;                                                                           \
+}
+
+DEFINE_COMPLEX_KERNELS(c8, float)
+DEFINE_COMPLEX_KERNELS(c16, double)
+
+/// Which kind of value (see `Reduce_value`) a reduction of an array of `type` results in
+char reduce_kind(Reduce_op op, char type)
+{
+    if (type == 'c')
+        return op == REDUCE_STD ? 'f' : 'c';
+    if (type == 'i' && (op == REDUCE_SUM || op == REDUCE_MIN || op == REDUCE_MAX))
+        return 'i';
+    return 'f';
+}
+
+/// Reduces `n` elements which are `stride` elements apart, starting at `data`
+///
+/// @Returns
+///    *  0, on success
+///    * -1, if the data type is not supported
+///    * -2, if min or max of an empty array is requested
+int reduce_strided(Reduce_op op, char type, unsigned int wordsize_in_bytes,
+                   const void* data, long n, long stride, Reduce_value* out)
+{
+    out->kind = reduce_kind(op, type);
+    out->i = 0; out->re = 0; out->im = 0;
+
+    if (type == 'i') {
+        if (wordsize_in_bytes == 2)
+            return reduce_i2(op, data, n, stride, true, out);
+        if (wordsize_in_bytes == 4)
+            return reduce_i4(op, data, n, stride, true, out);
+        if (wordsize_in_bytes == 8)
+            return reduce_i8(op, data, n, stride, true, out);
+    } else if (type == 'f') {
+        if (wordsize_in_bytes == 4)
+            return reduce_f4(op, data, n, stride, false, out);
+        if (wordsize_in_bytes == 8)
+            return reduce_f8(op, data, n, stride, false, out);
+    } else if (type == 'c') {
+        if (wordsize_in_bytes == 8)
+            return creduce_c8(op, data, n, stride, out);
+        if (wordsize_in_bytes == 16)
+            return creduce_c16(op, data, n, stride, out);
+    }
+
+    return -1;
+}
+
+/// Sum of the squared deviations of `n` contiguous elements from the mean (re, im)
+/// @Returns 0 or -1 if the data type is not supported
+static int sqdev_contiguous(char type, unsigned int wordsize_in_bytes, const void* data, long n,
+                            double re, double im, double* out)
+{
+    if (type == 'i' && wordsize_in_bytes == 2)
+        *out = sqdev_i2(data, n, 1, re);
+    else if (type == 'i' && wordsize_in_bytes == 4)
+        *out = sqdev_i4(data, n, 1, re);
+    else if (type == 'i' && wordsize_in_bytes == 8)
+        *out = sqdev_i8(data, n, 1, re);
+    else if (type == 'f' && wordsize_in_bytes == 4)
+        *out = sqdev_f4(data, n, 1, re);
+    else if (type == 'f' && wordsize_in_bytes == 8)
+        *out = sqdev_f8(data, n, 1, re);
+    else if (type == 'c' && wordsize_in_bytes == 8)
+        *out = csqdev_c8(data, n, 1, re, im);
+    else if (type == 'c' && wordsize_in_bytes == 16)
+        *out = csqdev_c16(data, n, 1, re, im);
+    else
+        return -1;
+    return 0;
+}
+
+// One part of reduce_parallel per task
+struct Reduce_job {
+    Reduce_op op;          // REDUCE_SUM, REDUCE_MIN or REDUCE_MAX
+    bool sqdev;            // instead of `op`: squared deviations from (mean_re, mean_im)
+    double mean_re, mean_im;
+    char type;
+    unsigned int wordsize_in_bytes;
+    const unsigned char* data;
+    int64_t n;
+    long per_part;
+    Reduce_value* partial; // one per part
+    int* rc;               // one per part
+};
+typedef struct Reduce_job Reduce_job;
+
+static void reduce_task(void* arg, long index)
+{
+    Reduce_job* job = arg;
+    int64_t start = (int64_t) index * job->per_part;
+    long n = job->n - start < job->per_part ? (long) (job->n - start) : job->per_part;
+    const unsigned char* data = job->data + start * job->wordsize_in_bytes;
+    if (job->sqdev)
+        job->rc[index] = sqdev_contiguous(job->type, job->wordsize_in_bytes, data, n,
+                                          job->mean_re, job->mean_im, &job->partial[index].re);
+    else
+        job->rc[index] = reduce_strided(job->op, job->type, job->wordsize_in_bytes, data, n, 1,
+                                        &job->partial[index]);
+}
+
+/// Runs `job` over all parts. @Returns 0 or the first error of a part
+static int run_parts(const Parallel* parallel, Reduce_job* job, long parts)
+{
+    parallel_run(parallel, parts, reduce_task, job);
+    for (long k = 0; k < parts; k++) {
+        if (job->rc[k] < 0)
+            return job->rc[k];
+    }
+    return 0;
+}
+
+/// Like reduce_strided for `n` contiguous elements, but large arrays are cut into the parts
+/// of `parallel` (see numpy_parallel.h), which are reduced in parallel. The partial results
+/// are combined in the order of the parts: sums are added up, the mean and the standard
+/// deviation are taken from the total sum (and the squared deviations from it, in a second
+/// parallel pass), minimum and maximum compare like the kernels (NaN wins). Integer results
+/// are exactly those of reduce_strided, float ones may differ in the last bits, but do not
+/// depend on the number of threads.
+///
+/// @Returns the errors of reduce_strided, or -3 if memory ran out
+int reduce_parallel(const Parallel* parallel, Reduce_op op, char type,
+                    unsigned int wordsize_in_bytes, const void* data, int64_t n,
+                    Reduce_value* out)
+{
+    long parts = parallel_parts(parallel, n * wordsize_in_bytes);
+    if (parts <= 1)
+        return reduce_strided(op, type, wordsize_in_bytes, data, n, 1, out);
+    long per_part = (long) ((n + parts - 1) / parts);
+    parts = (long) ((n + per_part - 1) / per_part);
+
+    Reduce_value* partial = malloc(parts * (sizeof(Reduce_value) + sizeof(int)));
+    if (partial == NULL)
+        return -3;
+    Reduce_job job = {
+        .op = op == REDUCE_MEAN || op == REDUCE_STD ? REDUCE_SUM : op,
+        .type = type, .wordsize_in_bytes = wordsize_in_bytes, .data = data, .n = n,
+        .per_part = per_part, .partial = partial, .rc = (int*) (partial + parts),
+    };
+    int rc = run_parts(parallel, &job, parts);
+    if (rc < 0) {
+        free(partial);
+        return rc;
+    }
+
+    Reduce_value total = partial[0];
+    for (long k = 1; k < parts; k++) {
+        const Reduce_value* p = &partial[k];
+        if (job.op == REDUCE_SUM) {
+            // Integers wrap around like in the kernels
+            total.i = (long long) ((unsigned long long) total.i + (unsigned long long) p->i);
+            total.re += p->re;
+            total.im += p->im;
+        } else if (total.kind == 'i') {
+            bool better = op == REDUCE_MAX ? p->i > total.i : p->i < total.i;
+            if (better)
+                total.i = p->i;
+        } else if (total.kind == 'f') {
+            bool better = op == REDUCE_MAX ? p->re > total.re : p->re < total.re;
+            if (isnan(p->re) || (better && !isnan(total.re)))
+                total.re = p->re;
+        } else {
+            bool less = p->re < total.re || (p->re == total.re && p->im < total.im);
+            bool greater = p->re > total.re || (p->re == total.re && p->im > total.im);
+            if ((op == REDUCE_MIN && less) || (op == REDUCE_MAX && greater)) {
+                total.re = p->re;
+                total.im = p->im;
+            }
+        }
+    }
+
+    *out = total;
+    out->kind = reduce_kind(op, type);
+    if (op == REDUCE_MEAN || op == REDUCE_STD) {
+        double sum = total.kind == 'i' ? (double) total.i : total.re;
+        out->i = 0;
+        out->re = sum / n;
+        out->im = total.im / n;
+    }
+    if (op == REDUCE_STD) {
+        job.sqdev = true;
+        job.mean_re = out->re;
+        job.mean_im = out->im;
+        rc = run_parts(parallel, &job, parts);
+        double sum = 0;
+        for (long k = 0; k < parts; k++)
+            sum += partial[k].re;
+        out->re = sqrt(sum / n);
+        out->im = 0;
+    }
+    free(partial);
+    return rc;
+}
+
+/// Reduces a 2-d array along `axis` (0 or 1) and writes the result as a new 1-d numpy BLOB to
+/// `*ptr_out` (malloc'ed, the caller has to free it). The data type of the result is '<i8',
+/// '<f8' or '<c16' depending on `reduce_kind`.
+///
+/// @Returns the length of the BLOB in bytes, the (negative) error of `reduce_strided` or -3 if
+/// memory ran out
+int64_t reduce_axis(Reduce_op op, const Header_data* header_data, const void* data, int axis,
+                    unsigned char** ptr_out)
+{
+    // Distance (in elements) between neighbours along each of the two axes
+    long step[2] = {header_data->strides[0] / header_data->wordsize_in_bytes,
+                    header_data->strides[1] / header_data->wordsize_in_bytes};
+
+    long n = header_data->shape[axis];
+    int64_t n_out = header_data->shape[1-axis];
+    char kind = reduce_kind(op, header_data->type);
+
+    const char* descr = kind == 'i' ? "<i8" : (kind == 'c' ? "<c16" : "<f8");
+    int out_wordsize = kind == 'c' ? 16 : 8;
+
+    int header_length = write_header(NULL, descr, false, &n_out, 1);
+    unsigned char* out = malloc(header_length + (size_t) n_out * out_wordsize);
+    if (out == NULL)
+        return -3;
+    write_header(out, descr, false, &n_out, 1);
+
+    unsigned char* out_data = out + header_length;
+    for (int64_t k = 0; k < n_out; k++) {
+        const char* start = (const char*) data
+                          + (size_t) k * step[1-axis] * header_data->wordsize_in_bytes;
+        Reduce_value value;
+        int rc = reduce_strided(op, header_data->type, header_data->wordsize_in_bytes,
+                                start, n, step[axis], &value);
+        if (rc < 0) {
+            free(out);
+            return rc;
+        }
+
+        if (kind == 'i') {
+            memcpy(out_data + (size_t) k*8, &value.i, 8);
+        } else if (kind == 'f') {
+            memcpy(out_data + (size_t) k*8, &value.re, 8);
+        } else {
+            memcpy(out_data + (size_t) k*16, &value.re, 8);
+            memcpy(out_data + (size_t) k*16 + 8, &value.im, 8);
+        }
+    }
+
+    *ptr_out = out;
+    return header_length + n_out * out_wordsize;
+}
@@ -0,0 +1,42 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+#ifndef NUMPYREDUCE_FILE
+#define NUMPYREDUCE_FILE
+#include <stdbool.h>
+#include "numpy_reader.h"
+#include "numpy_parallel.h"
+
+/// NOTE This is not a sqlite extention. Wrapper code is in blopy.c
+
+typedef enum Reduce_op {
+    REDUCE_SUM,
+    REDUCE_MEAN,
+    REDUCE_MIN,
+    REDUCE_MAX,
+    REDUCE_STD  // population standard deviation (numpy's default ddof=0)
+} Reduce_op;
+
+// The result of a reduction. Which field is set depends on `kind`:
+//   'i' : integer result in `i` (sum, min and max of integer arrays)
+//   'f' : real result in `re`
+//   'c' : complex result in `re` and `im`
+struct Reduce_value {
+    char kind;
+    long long i;
+    double re, im;
+};
+typedef struct Reduce_value Reduce_value;
+
+// Public:
+extern char reduce_kind(Reduce_op op, char type);
+extern int reduce_strided(Reduce_op op, char type, unsigned int wordsize_in_bytes,
+                          const void* data, long n, long stride, Reduce_value* out);
+extern int reduce_parallel(const Parallel* parallel, Reduce_op op, char type,
+                           unsigned int wordsize_in_bytes, const void* data, int64_t n,
+                           Reduce_value* out);
+extern int64_t reduce_axis(Reduce_op op, const Header_data* header_data, const void* data,
+                           int axis, unsigned char** ptr_out);
+#endif
@@ -0,0 +1,399 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+#include "numpy_search.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "numpy_convert.h"
+
+/// Parses a comparison: '>', '>=', '<', '<=', '==' ('='), '!=' ('<>') or 'isnan'.
+/// @Returns 0 or -1 if `text` is none of them
+int parse_search_op(const char* text, Search_op* op)
+{
+    static const struct {
+        const char* text;
+        Search_op op;
+    } ops[] = {
+        {">", SEARCH_GT}, {">=", SEARCH_GE}, {"<", SEARCH_LT}, {"<=", SEARCH_LE},
+        {"==", SEARCH_EQ}, {"=", SEARCH_EQ}, {"!=", SEARCH_NE}, {"<>", SEARCH_NE},
+        {"isnan", SEARCH_ISNAN},
+    };
+    if (text == NULL)
+        return -1;
+    for (int i = 0; i < (int) (sizeof(ops)/sizeof(ops[0])); i++) {
+        if (strcmp(text, ops[i].text) == 0) {
+            *op = ops[i].op;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+/// @Returns true for the real dtypes: booleans, integers and floats
+bool search_dtype(Dtype_code dtype)
+{
+    return convertible(dtype) && dtype != DTYPE_C8 && dtype != DTYPE_C16;
+}
+
+static bool is_integer(Dtype_code dtype)
+{
+    return dtype == DTYPE_B1 || (dtype >= DTYPE_I1 && dtype <= DTYPE_U8);
+}
+
+/// The smallest value of an integer dtype and the one after its largest, both exact doubles
+static void integer_range(Dtype_code dtype, double* min, double* end)
+{
+    switch (dtype) {
+    case DTYPE_I1: *min = -0x1p7;  *end = 0x1p7;  break;
+    case DTYPE_I2: *min = -0x1p15; *end = 0x1p15; break;
+    case DTYPE_I4: *min = -0x1p31; *end = 0x1p31; break;
+    case DTYPE_I8: *min = -0x1p63; *end = 0x1p63; break;
+    case DTYPE_B1: *min = 0;       *end = 2;      break;
+    case DTYPE_U1: *min = 0;       *end = 0x1p8;  break;
+    case DTYPE_U2: *min = 0;       *end = 0x1p16; break;
+    case DTYPE_U4: *min = 0;       *end = 0x1p32; break;
+    default:       *min = 0;       *end = 0x1p64; break;
+    }
+}
+
+/// Prepares the comparison `element op value` for elements of `dtype`. For integers it becomes
+/// a range of integers of the dtype, e.g. `> 2.5` is [3, max] and `== 2.5` matches nothing.
+/// @Returns 0 or -1 if the dtype is not supported
+int search_compile(Search* search, Dtype_code dtype, Search_op op, double value)
+{
+    memset(search, 0, sizeof(*search));
+    if (!search_dtype(dtype))
+        return -1;
+    search->dtype = dtype;
+    search->op = op;
+    search->value = value;
+    if (!is_integer(dtype))
+        return 0;
+
+    // Integers are compared to whole numbers: x > 2.5 is x > 2, x < 2.5 is x < 3. The bounds
+    // stay doubles with open ends, x > v is x >= v + 1 only in the dtype (v + 1 may not be a
+    // double)
+    double lo = -INFINITY, hi = INFINITY;
+    switch (op) {
+    case SEARCH_GT: lo = floor(value); search->lo_open = true; break;
+    case SEARCH_GE: lo = ceil(value); break;
+    case SEARCH_LT: hi = ceil(value); search->hi_open = true; break;
+    case SEARCH_LE: hi = floor(value); break;
+    case SEARCH_NE: search->negate = true; // fall through
+    case SEARCH_EQ: lo = hi = floor(value) == value ? value : NAN; break;
+    case SEARCH_ISNAN: lo = hi = NAN; break;  // integers are never NaN
+    }
+    double min, end;
+    integer_range(dtype, &min, &end);
+    // NaN compares false to everything, so it ends up empty as well. end - 1 is rounded to end
+    // for 64 bit integers, no double lies between them
+    bool above = search->lo_open ? lo >= end - 1 : lo >= end;
+    bool below = search->hi_open ? hi <= min : hi < min;
+    search->empty = above || below || !(lo <= hi);
+    search->lo_min = lo < min;
+    search->hi_max = hi >= end;
+    search->lo = lo;
+    search->hi = hi;
+    return 0;
+}
+
+// Matches of n elements of integer type T in [lo, hi]. search_compile made sure the bounds fit
+// into T once they are neither below nor above its range
+#define INTEGER_KERNEL(T, SUFFIX, MIN, MAX)                                                \
+static int64_t count_##SUFFIX(const T* x, int64_t n, const Search* search)                \
+{                                                                                          \
+    T lo = search->lo_min ? (T) MIN : (T) ((T) search->lo + search->lo_open);              \
+    T hi = search->hi_max ? (T) MAX : (T) ((T) search->hi - search->hi_open);              \
+    int64_t count = 0;                                                                     \
+    for (int64_t i = 0; i < n; i++)                                                        \
+        count += (x[i] >= lo) & (x[i] <= hi);                                              \
+    return count;                                                                          \
+}
+
+INTEGER_KERNEL(int8_t, i1, INT8_MIN, INT8_MAX)
+INTEGER_KERNEL(int16_t, i2, INT16_MIN, INT16_MAX)
+INTEGER_KERNEL(int32_t, i4, INT32_MIN, INT32_MAX)
+INTEGER_KERNEL(int64_t, i8, INT64_MIN, INT64_MAX)
+INTEGER_KERNEL(uint8_t, u1, 0, UINT8_MAX)
+INTEGER_KERNEL(uint16_t, u2, 0, UINT16_MAX)
+INTEGER_KERNEL(uint32_t, u4, 0, UINT32_MAX)
+INTEGER_KERNEL(uint64_t, u8, 0, UINT64_MAX)
+
+// Matches of n floats of type T, compared as doubles (exact for float32 as well). One loop per
+// comparison, so every loop is a plain compare-and-add. The count is kept in ACC: without AVX2
+// the compiler only vectorizes the compare of doubles when the count is a double as well (exact
+// for n <= SEARCH_CHUNK)
+#define FLOAT_KERNEL(T, SUFFIX, ACC)                                                       \
+static int64_t count_##SUFFIX(const T* x, int64_t n, const Search* search)                \
+{                                                                                          \
+    double v = search->value;                                                              \
+    ACC count = 0;                                                                         \
+    switch (search->op) {                                                                  \
+    case SEARCH_GT: for (int64_t i = 0; i < n; i++) count += x[i] > v; break;              \
+    case SEARCH_GE: for (int64_t i = 0; i < n; i++) count += x[i] >= v; break;             \
+    case SEARCH_LT: for (int64_t i = 0; i < n; i++) count += x[i] < v; break;              \
+    case SEARCH_LE: for (int64_t i = 0; i < n; i++) count += x[i] <= v; break;             \
+    case SEARCH_EQ: for (int64_t i = 0; i < n; i++) count += x[i] == v; break;             \
+    case SEARCH_NE: for (int64_t i = 0; i < n; i++) count += x[i] != v; break;             \
+    case SEARCH_ISNAN: for (int64_t i = 0; i < n; i++) count += x[i] != x[i]; break;       \
+    }                                                                                      \
+    return (int64_t) count;                                                                \
+}
+
+FLOAT_KERNEL(float, f4, int64_t)
+FLOAT_KERNEL(double, f8, double)
+
+/// Matches among the elements [start, start+n) of `data` (n <= SEARCH_CHUNK)
+static int64_t count_chunk(const Search* search, const unsigned char* data, int64_t start,
+                           int64_t n)
+{
+    if (is_integer(search->dtype) && search->empty)
+        return search->negate ? n : 0;
+    int64_t count;
+    switch (search->dtype) {
+    case DTYPE_B1:
+    case DTYPE_U1: count = count_u1((const uint8_t*) data + start, n, search); break;
+    case DTYPE_I1: count = count_i1((const int8_t*) data + start, n, search); break;
+    case DTYPE_I2: count = count_i2((const int16_t*) data + start, n, search); break;
+    case DTYPE_I4: count = count_i4((const int32_t*) data + start, n, search); break;
+    case DTYPE_I8: count = count_i8((const int64_t*) data + start, n, search); break;
+    case DTYPE_U2: count = count_u2((const uint16_t*) data + start, n, search); break;
+    case DTYPE_U4: count = count_u4((const uint32_t*) data + start, n, search); break;
+    case DTYPE_U8: count = count_u8((const uint64_t*) data + start, n, search); break;
+    case DTYPE_F4: return count_f4((const float*) data + start, n, search);
+    case DTYPE_F8: return count_f8((const double*) data + start, n, search);
+    default:
+    {
+        // float16, bfloat16 and long double through a chunk of doubles
+        double block[SEARCH_CHUNK];
+        Convert_mode mode = {false, ROUND_TRUNC};
+        convert_array(search->dtype, data + start * dtype_size(search->dtype), DTYPE_F8,
+                      (unsigned char*) block, n, &mode);
+        return count_f8(block, n, search);
+    }
+    }
+    return search->negate ? n - count : count;
+}
+
+/// Counts the elements of `data` (`n` elements of the dtype of `search` in native byte order)
+/// for which the comparison holds
+int64_t search_count(const Search* search, const unsigned char* data, int64_t n)
+{
+    int64_t count = 0;
+    for (int64_t start = 0; start < n; start += SEARCH_CHUNK)
+        count += count_chunk(search, data, start,
+                             n - start < SEARCH_CHUNK ? n - start : SEARCH_CHUNK);
+    return count;
+}
+
+struct Count_job {
+    const Search* search;
+    const unsigned char* data;
+    int64_t n;
+    int64_t per_part;
+    int64_t* counts;  // one per part
+};
+typedef struct Count_job Count_job;
+
+static void count_task(void* arg, long index)
+{
+    Count_job* job = arg;
+    int64_t start = (int64_t) index * job->per_part;
+    int64_t n = job->n - start < job->per_part ? job->n - start : job->per_part;
+    const unsigned char* data = job->data + start * dtype_size(job->search->dtype);
+    job->counts[index] = search_count(job->search, data, n);
+}
+
+/// search_count over the parts of `parallel` (see numpy_parallel.h)
+int64_t search_count_parallel(const Parallel* parallel, const Search* search,
+                              const unsigned char* data, int64_t n)
+{
+    long parts = parallel_parts(parallel, n * dtype_size(search->dtype));
+    if (parts <= 1)
+        return search_count(search, data, n);
+    int64_t per_part = (n + parts - 1) / parts;
+    parts = (long) ((n + per_part - 1) / per_part);
+    int64_t* counts = malloc(parts * sizeof(int64_t));
+    if (counts == NULL)
+        return search_count(search, data, n);
+
+    Count_job job = {search, data, n, per_part, counts};
+    parallel_run(parallel, parts, count_task, &job);
+    int64_t count = 0;
+    for (long k = 0; k < parts; k++)
+        count += counts[k];
+    free(counts);
+    return count;
+}
+
+/// The index of the first element for which the comparison holds (`match`) or does not hold
+/// (!`match`). Chunks are counted with the vectorized kernels, only the first chunk that has
+/// such an element is looked at element by element.
+/// @Returns the index or -1 if there is none
+int64_t search_find(const Search* search, const unsigned char* data, int64_t n, bool match)
+{
+    for (int64_t start = 0; start < n; start += SEARCH_CHUNK) {
+        int64_t m = n - start < SEARCH_CHUNK ? n - start : SEARCH_CHUNK;
+        int64_t count = count_chunk(search, data, start, m);
+        if (match ? count == 0 : count == m)
+            continue;
+        // A binary search with the same kernel, down to the single element
+        while (m > 1) {
+            int64_t half = m / 2;
+            count = count_chunk(search, data, start, half);
+            if (match ? count > 0 : count < half) {
+                m = half;
+            } else {
+                start += half;
+                m -= half;
+            }
+        }
+        return start;
+    }
+    return -1;
+}
+
+// Lanes of the extreme kernel: independent minimums/maximums the CPU can work on at once
+#define LANES 8
+
+// The largest (or smallest) element of a chunk of n >= 1 elements, without branches, like
+// extreme_* of numpy_reduce.c. A chunk with NaN is reported with `*nan`: like numpy the first
+// NaN is the result then
+#define EXTREME_KERNEL(T, SUFFIX)                                                          \
+static T extreme_##SUFFIX(const T* x, int64_t n, bool is_max, int* nan)                    \
+{                                                                                          \
+    T best = x[0];                                                                         \
+    int has_nan = 0;                                                                       \
+    int64_t i = 0;                                                                         \
+    if (n >= 2*LANES) {                                                                    \
+        T lane[LANES];                                                                     \
+        int lane_nan[LANES];                                                               \
+        for (int k = 0; k < LANES; k++) {                                                  \
+            lane[k] = x[k];                                                                \
+            lane_nan[k] = x[k] != x[k];                                                    \
+        }                                                                                  \
+        for (i = LANES; i + LANES <= n; i += LANES)                                        \
+            for (int k = 0; k < LANES; k++) {                                              \
+                T v = x[i+k];                                                              \
+                if (is_max)                                                                \
+                    lane[k] = v > lane[k] ? v : lane[k];                                   \
+                else                                                                       \
+                    lane[k] = v < lane[k] ? v : lane[k];                                   \
+                lane_nan[k] |= v != v;                                                     \
+            }                                                                              \
+        for (int k = 0; k < LANES; k++) {                                                  \
+            if (is_max)                                                                    \
+                best = lane[k] > best ? lane[k] : best;                                    \
+            else                                                                           \
+                best = lane[k] < best ? lane[k] : best;                                    \
+            has_nan |= lane_nan[k];                                                        \
+        }                                                                                  \
+    }                                                                                      \
+    for (; i < n; i++) {                                                                   \
+        T v = x[i];                                                                        \
+        if (is_max)                                                                        \
+            best = v > best ? v : best;                                                    \
+        else                                                                               \
+            best = v < best ? v : best;                                                    \
+        has_nan |= v != v;                                                                 \
+    }                                                                                      \
+    *nan = has_nan;                                                                        \
+    return best;                                                                           \
+}                                                                                          \
+                                                                                           \
+static int64_t argext_##SUFFIX(const T* x, int64_t n, bool is_max)                         \
+{                                                                                          \
+    T best = x[0];                                                                         \
+    int64_t best_start = 0;                                                                \
+    for (int64_t start = 0; start < n; start += SEARCH_CHUNK) {                            \
+        int64_t m = n - start < SEARCH_CHUNK ? n - start : SEARCH_CHUNK;                   \
+        int nan;                                                                           \
+        T e = extreme_##SUFFIX(x + start, m, is_max, &nan);                                \
+        if (nan) {                                                                         \
+            for (int64_t i = start; ; i++) {                                               \
+                if (x[i] != x[i])                                                          \
+                    return i;                                                              \
+            }                                                                              \
+        }                                                                                  \
+        if (is_max ? e > best : e < best) {                                                \
+            best = e;                                                                      \
+            best_start = start;                                                            \
+        }                                                                                  \
+    }                                                                                      \
+    for (int64_t i = best_start; ; i++) {                                                  \
+        if (x[i] == best)                                                                  \
+            return i;                                                                      \
+    }                                                                                      \
+}
+
+EXTREME_KERNEL(int8_t, i1)
+EXTREME_KERNEL(int16_t, i2)
+EXTREME_KERNEL(int32_t, i4)
+EXTREME_KERNEL(int64_t, i8)
+EXTREME_KERNEL(uint8_t, u1)
+EXTREME_KERNEL(uint16_t, u2)
+EXTREME_KERNEL(uint32_t, u4)
+EXTREME_KERNEL(uint64_t, u8)
+EXTREME_KERNEL(float, f4)
+EXTREME_KERNEL(double, f8)
+
+/// argmax for the dtypes without a kernel of their own, through chunks of doubles
+static int64_t argext_converted(Dtype_code dtype, const unsigned char* data, int64_t n,
+                                bool is_max)
+{
+    double block[SEARCH_CHUNK];
+    Convert_mode mode = {false, ROUND_TRUNC};
+    double best = 0;
+    int64_t best_index = -1;
+    for (int64_t start = 0; start < n; start += SEARCH_CHUNK) {
+        int64_t m = n - start < SEARCH_CHUNK ? n - start : SEARCH_CHUNK;
+        convert_array(dtype, data + start * dtype_size(dtype), DTYPE_F8,
+                      (unsigned char*) block, m, &mode);
+        int64_t i = argext_f8(block, m, is_max);
+        if (isnan(block[i]))
+            return start + i;
+        if (best_index < 0 || (is_max ? block[i] > best : block[i] < best)) {
+            best = block[i];
+            best_index = start + i;
+        }
+    }
+    return best_index;
+}
+
+/// The flat index of the first largest (`is_max`) or smallest element of the `n` elements of
+/// `dtype` at `data`, like numpy.argmax and numpy.argmin: the first NaN if there is one.
+/// @Returns the index, -1 if the dtype is not supported or -2 if the array is empty
+int64_t search_argext(Dtype_code dtype, const unsigned char* data, int64_t n, bool is_max)
+{
+    if (!search_dtype(dtype))
+        return -1;
+    if (n == 0)
+        return -2;
+    switch (dtype) {
+    case DTYPE_B1:
+    case DTYPE_U1: return argext_u1((const uint8_t*) data, n, is_max);
+    case DTYPE_I1: return argext_i1((const int8_t*) data, n, is_max);
+    case DTYPE_I2: return argext_i2((const int16_t*) data, n, is_max);
+    case DTYPE_I4: return argext_i4((const int32_t*) data, n, is_max);
+    case DTYPE_I8: return argext_i8((const int64_t*) data, n, is_max);
+    case DTYPE_U2: return argext_u2((const uint16_t*) data, n, is_max);
+    case DTYPE_U4: return argext_u4((const uint32_t*) data, n, is_max);
+    case DTYPE_U8: return argext_u8((const uint64_t*) data, n, is_max);
+    case DTYPE_F4: return argext_f4((const float*) data, n, is_max);
+    case DTYPE_F8: return argext_f8((const double*) data, n, is_max);
+    default: return argext_converted(dtype, data, n, is_max);
+    }
+}
+
+const char* search_error(int rc)
+{
+    switch (rc) {
+    case -1: return "data type not supported";
+    case -2: return "attempt to get argmax or argmin of an empty array";
+    default: return "unknown error";
+    }
+}
@@ -0,0 +1,62 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+#ifndef NUMPYSEARCH_FILE
+#define NUMPYSEARCH_FILE
+#include <stdbool.h>
+#include <stdint.h>
+#include "numpy_reader.h"
+#include "numpy_parallel.h"
+
+/// NOTE This is not a sqlite extention. Wrapper code is in blopy_search.c
+
+/// Comparisons of all elements of an array with one value, and the position of its largest or
+/// smallest element. The kernels count matches in chunks of SEARCH_CHUNK elements with
+/// branch-free loops the compiler vectorizes; searches stop after the first chunk that decides
+/// the result. The value is a double. Integer elements are compared in their own dtype (the
+/// comparison becomes a range of integers), float16 and bfloat16 are converted to double chunk
+/// by chunk.
+
+// Elements per chunk (8 KiB of doubles)
+#define SEARCH_CHUNK 1024
+
+typedef enum Search_op {
+    SEARCH_GT,     // '>'
+    SEARCH_GE,     // '>='
+    SEARCH_LT,     // '<'
+    SEARCH_LE,     // '<='
+    SEARCH_EQ,     // '==' (also '=')
+    SEARCH_NE,     // '!=' (also '<>')
+    SEARCH_ISNAN   // 'isnan', without a value
+} Search_op;
+
+// A comparison prepared for one dtype (see search_compile)
+struct Search {
+    Dtype_code dtype;
+    Search_op op;
+    double value;
+    // Integers: the elements between lo and hi match (those outside if `negate`), none if
+    // `empty`. An open end excludes the bound itself, lo_min and hi_max lie beyond the dtype
+    double lo, hi;
+    bool lo_open, hi_open;
+    bool lo_min, hi_max;
+    bool empty;
+    bool negate;
+};
+typedef struct Search Search;
+
+// Public:
+extern int parse_search_op(const char* text, Search_op* op);
+extern bool search_dtype(Dtype_code dtype);
+extern int search_compile(Search* search, Dtype_code dtype, Search_op op, double value);
+extern int64_t search_count(const Search* search, const unsigned char* data, int64_t n);
+extern int64_t search_count_parallel(const Parallel* parallel, const Search* search,
+                                     const unsigned char* data, int64_t n);
+extern int64_t search_find(const Search* search, const unsigned char* data, int64_t n,
+                           bool match);
+extern int64_t search_argext(Dtype_code dtype, const unsigned char* data, int64_t n,
+                             bool is_max);
+extern const char* search_error(int rc);
+#endif
@@ -0,0 +1,334 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+#include "numpy_sketch.h"
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include "numpy_convert.h"
+
+// Elements converted to double per step (8 KiB)
+#define BLOCK 1024
+
+/// @Returns true for the real dtypes: booleans, integers and floats
+bool sketch_dtype(Dtype_code dtype)
+{
+    return convertible(dtype) && dtype != DTYPE_C8 && dtype != DTYPE_C16;
+}
+
+/// The elements [start, start+n) of `data` as doubles: a pointer into `data` for float64,
+/// else converted into `block` (at least n <= BLOCK doubles)
+static const double* as_double(Dtype_code dtype, const unsigned char* data, int64_t start,
+                               int64_t n, double* block)
+{
+    if (dtype == DTYPE_F8)
+        return (const double*) data + start;
+    Convert_mode mode = {false, ROUND_TRUNC};
+    convert_array(dtype, data + start * dtype_size(dtype), DTYPE_F8, (unsigned char*) block, n,
+                  &mode);
+    return block;
+}
+
+/// Starts a histogram with `bins` equal bins from lo to hi. Like numpy, lo == hi becomes the
+/// range lo-0.5 to hi+0.5.
+/// @Returns
+///    *  0, on success
+///    * -1, if lo or hi is not finite or lo > hi
+///    * -2, if bins is not between 1 and HISTOGRAM_MAXBINS
+///    * -3, if memory ran out
+int histogram_init(Histogram* histogram, double lo, double hi, int64_t bins)
+{
+    memset(histogram, 0, sizeof(*histogram));
+    if (!isfinite(lo) || !isfinite(hi) || lo > hi)
+        return -1;
+    if (bins < 1 || bins > HISTOGRAM_MAXBINS)
+        return -2;
+    if (lo == hi) {
+        lo -= 0.5;
+        hi += 0.5;
+    }
+    histogram->edges = malloc((bins + 1) * sizeof(double));
+    histogram->counts = calloc(bins, sizeof(int64_t));
+    if (histogram->edges == NULL || histogram->counts == NULL) {
+        histogram_free(histogram);
+        return -3;
+    }
+    histogram->lo = lo;
+    histogram->hi = hi;
+    histogram->bins = bins;
+    double step = (hi - lo) / bins;
+    for (int64_t i = 0; i < bins; i++)
+        histogram->edges[i] = i * step + lo;
+    histogram->edges[bins] = hi;
+    return 0;
+}
+
+/// Counts the `n` elements of `data` (of dtype `dtype`, native byte order). Elements outside
+/// of [lo, hi] and NaN are not counted, hi goes into the last bin.
+/// The bin of a block of elements is computed in a branch-free loop the compiler vectorizes,
+/// then corrected by one against the edges (as numpy does) while counting
+void histogram_add(Histogram* histogram, Dtype_code dtype, const unsigned char* data, int64_t n)
+{
+    double block[BLOCK];
+    int64_t index[BLOCK];
+    const double lo = histogram->lo, hi = histogram->hi;
+    const double norm = histogram->bins / (hi - lo);
+    const int64_t last = histogram->bins - 1;
+    const double* edges = histogram->edges;
+    int64_t* counts = histogram->counts;
+
+    for (int64_t start = 0; start < n; start += BLOCK) {
+        int64_t m = n - start < BLOCK ? n - start : BLOCK;
+        const double* values = as_double(dtype, data, start, m, block);
+
+        for (int64_t i = 0; i < m; i++) {
+            double value = values[i];
+            index[i] = value >= lo && value <= hi ? (int64_t) ((value - lo) * norm) : -1;
+        }
+        for (int64_t i = 0; i < m; i++) {
+            int64_t bin = index[i];
+            if (bin < 0)
+                continue;
+            if (bin > last)
+                bin = last;
+            if (values[i] < edges[bin])
+                bin--;
+            else if (bin != last && values[i] >= edges[bin + 1])
+                bin++;
+            counts[bin]++;
+        }
+    }
+}
+
+void histogram_free(Histogram* histogram)
+{
+    free(histogram->edges);
+    free(histogram->counts);
+    histogram->edges = NULL;
+    histogram->counts = NULL;
+}
+
+void kll_init(Kll* kll, int k)
+{
+    memset(kll, 0, sizeof(*kll));
+    kll->k = k;
+    kll->min = INFINITY;
+    kll->max = -INFINITY;
+    kll->random = 0x9E3779B97F4A7C15ULL;
+}
+
+/// Capacity of level h: k for the top level, shrinking by 2/3 per level below, at least 2
+static int level_capacity(const Kll* kll, int h)
+{
+    double capacity = kll->k;
+    for (int depth = kll->levels - 1 - h; depth > 0 && capacity > 2; depth--)
+        capacity *= 2.0 / 3.0;
+    return capacity > 2 ? (int) ceil(capacity) : 2;
+}
+
+/// Adds a level on top and updates max_size.
+/// @Returns 0 or -2 if there are KLL_MAXLEVELS already
+static int add_level(Kll* kll)
+{
+    if (kll->levels == KLL_MAXLEVELS)
+        return -2;
+    kll->levels++;
+    kll->max_size = 0;
+    for (int h = 0; h < kll->levels; h++)
+        kll->max_size += level_capacity(kll, h);
+    return 0;
+}
+
+/// Makes room for `extra` more items in level h.
+/// @Returns 0 or -3 if memory ran out
+static int reserve(Kll* kll, int h, int extra)
+{
+    int needed = kll->len[h] + extra;
+    if (needed <= kll->alloc[h])
+        return 0;
+    int alloc = kll->alloc[h] > 0 ? kll->alloc[h] : 16;
+    while (alloc < needed)
+        alloc *= 2;
+    double* items = realloc(kll->items[h], alloc * sizeof(double));
+    if (items == NULL)
+        return -3;
+    kll->items[h] = items;
+    kll->alloc[h] = alloc;
+    return 0;
+}
+
+static int compare_double(const void* a, const void* b)
+{
+    double x = *(const double*) a, y = *(const double*) b;
+    return (x > y) - (x < y);
+}
+
+/// Compacts the lowest full level: sorts it and moves every other item (from a random offset)
+/// up one level. With an odd number of items the smallest one stays.
+/// @Returns 0, -2 if there are too many levels or -3 if memory ran out
+static int compress(Kll* kll)
+{
+    for (int h = 0; h < kll->levels; h++) {
+        if (kll->len[h] < level_capacity(kll, h))
+            continue;
+        if (h + 1 == kll->levels) {
+            int rc = add_level(kll);
+            if (rc < 0)
+                return rc;
+        }
+        int len = kll->len[h];
+        int keep = len % 2;
+        int pairs = len / 2;
+        int rc = reserve(kll, h + 1, pairs);
+        if (rc < 0)
+            return rc;
+
+        double* items = kll->items[h];
+        qsort(items, len, sizeof(double), compare_double);
+        kll->random ^= kll->random << 13;
+        kll->random ^= kll->random >> 7;
+        kll->random ^= kll->random << 17;
+        int offset = (int) (kll->random >> 63);
+        double* up = kll->items[h + 1] + kll->len[h + 1];
+        for (int i = 0; i < pairs; i++)
+            up[i] = items[keep + 2 * i + offset];
+        kll->len[h + 1] += pairs;
+        kll->len[h] = keep;
+        kll->size -= pairs;
+        return 0;
+    }
+    return 0;
+}
+
+/// Adds the `n` elements of `data` (of dtype `dtype`, native byte order) to the sketch. NaN are
+/// not kept, but make every quantile NaN, like numpy.quantile.
+/// @Returns 0, -2 if the sketch is full (after about 2^60 elements) or -3 if memory ran out
+int kll_add(Kll* kll, Dtype_code dtype, const unsigned char* data, int64_t n)
+{
+    double block[BLOCK];
+    if (kll->levels == 0)
+        add_level(kll);
+
+    for (int64_t start = 0; start < n; start += BLOCK) {
+        int64_t m = n - start < BLOCK ? n - start : BLOCK;
+        const double* values = as_double(dtype, data, start, m, block);
+
+        int64_t i = 0;
+        while (i < m) {
+            // Level 0 takes items until the sketch is full
+            int64_t room = kll->max_size - kll->size;
+            if (room <= 0) {
+                int rc = compress(kll);
+                if (rc < 0)
+                    return rc;
+                continue;
+            }
+            int64_t take = m - i < room ? m - i : room;
+            int rc = reserve(kll, 0, (int) take);
+            if (rc < 0)
+                return rc;
+            double* level = kll->items[0];
+            int len = kll->len[0];
+            for (int64_t end = i + take; i < end; i++) {
+                if (isnan(values[i])) {
+                    kll->has_nan = true;
+                    continue;
+                }
+                level[len++] = values[i];
+                kll->min = values[i] < kll->min ? values[i] : kll->min;
+                kll->max = values[i] > kll->max ? values[i] : kll->max;
+            }
+            kll->size += len - kll->len[0];
+            kll->n += len - kll->len[0];
+            kll->len[0] = len;
+        }
+    }
+    return 0;
+}
+
+struct Weighted {
+    double value;
+    int64_t weight;
+};
+typedef struct Weighted Weighted;
+
+static int compare_weighted(const void* a, const void* b)
+{
+    return compare_double(&((const Weighted*) a)->value, &((const Weighted*) b)->value);
+}
+
+/// The value at 0-based `rank` of the sorted elements, as far as the sketch knows
+static double value_at(const Weighted* items, int64_t n_items, int64_t rank)
+{
+    int64_t cumulative = 0;
+    for (int64_t i = 0; i < n_items; i++) {
+        cumulative += items[i].weight;
+        if (cumulative > rank)
+            return items[i].value;
+    }
+    return items[n_items - 1].value;
+}
+
+/// Writes the quantiles `q` (each in [0, 1]) of the elements added to the sketch to `out`,
+/// interpolated linearly between ranks like numpy.quantile's default method. The result is
+/// exact as long as no level was compacted (fewer than about k elements), and always for q <= 0
+/// (the minimum) and q >= 1 (the maximum). NaN if there were NaN elements or none at all.
+/// @Returns 0 or -3 if memory ran out
+int kll_quantiles(const Kll* kll, const double* q, int64_t n_q, double* out)
+{
+    if (kll->has_nan || kll->n == 0) {
+        for (int64_t j = 0; j < n_q; j++)
+            out[j] = NAN;
+        return 0;
+    }
+    Weighted* items = malloc(kll->size * sizeof(Weighted));
+    if (items == NULL)
+        return -3;
+    int64_t n_items = 0;
+    for (int h = 0; h < kll->levels; h++) {
+        for (int i = 0; i < kll->len[h]; i++)
+            items[n_items++] = (Weighted) {kll->items[h][i], (int64_t) 1 << h};
+    }
+    qsort(items, n_items, sizeof(Weighted), compare_weighted);
+
+    for (int64_t j = 0; j < n_q; j++) {
+        if (q[j] <= 0 || q[j] >= 1) {
+            out[j] = q[j] <= 0 ? kll->min : kll->max;
+            continue;
+        }
+        double position = q[j] * (kll->n - 1);
+        double below = floor(position);
+        double t = position - below;
+        double a = value_at(items, n_items, (int64_t) below);
+        if (t == 0) {
+            out[j] = a;
+            continue;
+        }
+        double b = value_at(items, n_items, (int64_t) below + 1);
+        // numpy's _lerp
+        double diff = b - a;
+        out[j] = t >= 0.5 ? b - diff * (1 - t) : a + diff * t;
+    }
+    free(items);
+    return 0;
+}
+
+void kll_free(Kll* kll)
+{
+    for (int h = 0; h < kll->levels; h++)
+        free(kll->items[h]);
+    memset(kll, 0, sizeof(*kll));
+}
+
+const char* sketch_error(int rc)
+{
+    switch (rc) {
+    case -1: return "lo and hi must be finite and lo <= hi";
+    case -2: return "too many bins or elements";
+    case -3: return "out of memory";
+    default: return "unknown error";
+    }
+}
@@ -0,0 +1,63 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+#ifndef NUMPYSKETCH_FILE
+#define NUMPYSKETCH_FILE
+#include <stdbool.h>
+#include <stdint.h>
+#include "numpy_reader.h"
+
+/// NOTE This is not a sqlite extention. Wrapper code is in blopy_sketch.c
+
+/// Summaries of the distribution of the elements of many arrays, built in one pass with
+/// bounded memory: a histogram with equal bins and a KLL sketch for quantiles. Elements of any
+/// real dtype are read in blocks, converted to double (see numpy_convert.h).
+
+// Most bins of a histogram (their counts take 8 bytes each)
+#define HISTOGRAM_MAXBINS (1 << 24)
+// Levels of a KLL sketch, the items of level h stand for 2^h elements each
+#define KLL_MAXLEVELS 60
+// Default size of the sketch: ~1.3% rank error, at most ~3k items kept
+#define KLL_K 200
+
+// Counts of the elements in `bins` equal bins between lo and hi, like numpy.histogram
+struct Histogram {
+    double lo, hi;
+    int64_t bins;
+    double* edges;    // bins+1 edges, as numpy.linspace(lo, hi, bins+1)
+    int64_t* counts;
+};
+typedef struct Histogram Histogram;
+
+// A KLL sketch (Karnin, Lang, Liberty 2016): a stack of compactors. A full level is sorted and
+// every other item, starting at a random offset, moves up one level with twice the weight
+struct Kll {
+    int k;
+    int levels;
+    double* items[KLL_MAXLEVELS];
+    int len[KLL_MAXLEVELS];
+    int alloc[KLL_MAXLEVELS];
+    int64_t size;      // items kept in all levels
+    int64_t max_size;  // sum of the capacities of the levels
+    int64_t n;         // elements seen (without NaN)
+    double min, max;   // of these, exact: the quantiles 0 and 1
+    bool has_nan;
+    uint64_t random;   // fixed seed: the same rows in the same order give the same result
+};
+typedef struct Kll Kll;
+
+// Public:
+extern bool sketch_dtype(Dtype_code dtype);
+extern int histogram_init(Histogram* histogram, double lo, double hi, int64_t bins);
+extern void histogram_add(Histogram* histogram, Dtype_code dtype, const unsigned char* data,
+                          int64_t n);
+extern void histogram_free(Histogram* histogram);
+
+extern void kll_init(Kll* kll, int k);
+extern int kll_add(Kll* kll, Dtype_code dtype, const unsigned char* data, int64_t n);
+extern int kll_quantiles(const Kll* kll, const double* q, int64_t n_q, double* out);
+extern void kll_free(Kll* kll);
+extern const char* sketch_error(int rc);
+#endif
@@ -0,0 +1,278 @@
+/* This Source Code Form is subject to the terms of the Mozilla Public
+ *  License, v. 2.0. If a copy of the MPL was not distributed with this
+ * file, You can obtain one at http://mozilla.org/MPL/2.0/.
+ **/
+
+/// Regression tests of the extension: SQL queries and the text of their result. The extension
+/// is loaded with sqlite3_load_extension into an in-memory database, like a user would do it.
+/// Two helper functions build the input arrays:
+///   npy(dict, payload) : a numpy BLOB with the header dictionary `dict` (padded like numpy
+///                        pads it) followed by the BLOB `payload`
+///   arange(n)          : the int64 array 0, 1, ..., n-1
+///
+/// === Compiling
+///   gcc -O2 test_sql.c -lsqlite3 -o test_sql
+///
+/// === Running
+///   ./test_sql [extension]
+/// The extension defaults to ../blopy.so. Failed tests are printed, the exit status is the
+/// number of failures.
+
+#include <sqlite3.h>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/// The cases run in this order on one database, so a case can use the tables of earlier ones.
+/// A case may hold several statements, its result is the first column of the last row any of
+/// them returns, "NULL" for NULL and "error: <message>" if a statement fails
+static const struct {
+    const char* name;
+    const char* sql;
+    const char* expected;
+} tests[] = {
+    // np_each: LIMIT and OFFSET are only applied by np_each while the rows come in idx order
+    {"each_limit", "SELECT group_concat(idx) FROM (SELECT idx FROM np_each(arange(20)) LIMIT 2 "
+                   "OFFSET 5)", "5,6"},
+    {"each_order_idx_limit", "SELECT group_concat(idx) FROM (SELECT idx FROM "
+                             "np_each(arange(20)) ORDER BY idx LIMIT 2 OFFSET 3)", "3,4"},
+    {"each_order_idx_desc_limit", "SELECT group_concat(idx) FROM (SELECT idx FROM "
+                                  "np_each(arange(20)) ORDER BY idx DESC LIMIT 2)", "19,18"},
+    {"each_order_value_limit", "SELECT group_concat(value) FROM (SELECT value FROM "
+                               "np_each(np_sub(19, arange(20))) ORDER BY value LIMIT 2)",
+     "0,1"},
+    {"each_order_value_limit_offset", "SELECT group_concat(value) FROM (SELECT value FROM "
+                                      "np_each(np_sub(19, arange(20))) ORDER BY value "
+                                      "LIMIT 2 OFFSET 4)", "4,5"},
+
+    // np_ann: with less than 1024 vectors the search is exact, LIMIT only shrinks k while the
+    // rows come nearest first and unfiltered (older sqlite versions do not pass LIMIT along with
+    // ORDER BY)
+    {"ann_create", "CREATE TABLE v(id INTEGER PRIMARY KEY, a);"
+                   "WITH RECURSIVE r(i) AS (SELECT 1 UNION ALL SELECT i + 1 FROM r WHERE i < 60) "
+                   "INSERT INTO v SELECT i, np_scale(arange(4), i * 0.01, i % 7 * 0.3) FROM r;"
+                   "CREATE VIRTUAL TABLE v_idx USING np_ann(v, a);"
+                   "SELECT count(*) FROM v_idx_ids", "60"},
+    {"ann_exact", "SELECT group_concat(id) FROM (SELECT id FROM v ORDER BY "
+                  "np_l2(a, np_scale(arange(4), 0.5, 0.5)) LIMIT 10)",
+     "44,51,57,37,50,58,31,38,24,30"},
+    {"ann_k", "SELECT group_concat(rowid) FROM v_idx WHERE vector MATCH "
+              "np_scale(arange(4), 0.5, 0.5) AND k = 4", "44,51,57,37"},
+    {"ann_order_distance_limit", "SELECT group_concat(rowid) FROM (SELECT rowid FROM v_idx "
+                                 "WHERE vector MATCH np_scale(arange(4), 0.5, 0.5) AND k = 10 "
+                                 "ORDER BY distance LIMIT 2)", "44,51"},
+    {"ann_order_rowid_limit", "SELECT group_concat(rowid) FROM (SELECT rowid FROM v_idx "
+                              "WHERE vector MATCH np_scale(arange(4), 0.5, 0.5) AND k = 10 "
+                              "ORDER BY rowid LIMIT 3)", "24,30,31"},
+    {"ann_rowid_limit", "SELECT group_concat(rowid) FROM (SELECT rowid FROM v_idx "
+                        "WHERE vector MATCH np_scale(arange(4), 0.5, 0.5) AND rowid > 50 LIMIT 3)",
+     "51,57,58"},
+    {"ann_distance_limit", "SELECT group_concat(rowid) FROM (SELECT rowid FROM v_idx WHERE "
+                           "vector MATCH np_scale(arange(4), 0.5, 0.5) AND distance > 0.45 "
+                           "LIMIT 3)", "58,31,38"},
+    // A rollback undoes the first vector and nprobe=, the index forgets them as well
+    {"ann_rollback", "CREATE TABLE w(id INTEGER PRIMARY KEY, a);"
+                     "CREATE VIRTUAL TABLE w_idx USING np_ann(w, a);"
+                     "BEGIN;"
+                     "INSERT INTO w VALUES (1, np_scale(arange(4), 1.0, 0.5));"
+                     "INSERT INTO w_idx(command) VALUES ('nprobe=32');"
+                     "ROLLBACK;"
+                     "INSERT INTO w VALUES (2, np_scale(arange(3), 1.0, 0.5));"
+                     "SELECT rowid || ' ' || nprobe FROM w_idx "
+                     "WHERE vector MATCH np_scale(arange(3), 1.0, 0.5)", "2 8"},
+    {"ann_rollback_config", "SELECT group_concat(key || '=' || value, ' ') FROM "
+                            "(SELECT * FROM w_idx_config WHERE key IN ('descr', 'dim', 'nprobe') "
+                            "ORDER BY key)", "descr=<f8 dim=3 nprobe=8"},
+
+    // Arithmetic with numpy's type promotion, complex included
+    {"arith_complex", "SELECT np(np_mul(npy('{''descr'': ''<c16'', ''fortran_order'': False, "
+                      "''shape'': (2,), }', x'000000000000f03f0000000000000040"
+                      "0000000000000840000000000000f0bf'), np_add(arange(2), 1)))",
+     "(1.0+2.0j)\t(6.0-2.0j)"},
+    {"arith_complex_promote", "SELECT np_desc(np_add(c8, arange(1))) || ' ' || "
+                              "np_desc(np_div(c8, 2.0)) FROM (SELECT npy('{''descr'': ''<c8'', "
+                              "''fortran_order'': False, ''shape'': (1,), }', "
+                              "x'0000803f00000040') AS c8)", "<c16 <c8"},
+
+    // A damaged compressed value is an error of the value, the database file is fine
+    {"compress_damaged", "CREATE TABLE z(id INTEGER PRIMARY KEY, a);"
+                         "INSERT INTO z SELECT 1, "
+                         "CAST(substr(b, 1, 140) || x'55' || substr(b, 142) AS BLOB) "
+                         "FROM (SELECT np_compress(arange(5000)) AS b);"
+                         "SELECT np_tail(a, 3) FROM z", "error: compressed numpy BLOB is corrupt"},
+    {"compress_damaged_rowid", "SELECT np_tail('z', 'a', 1, 3)",
+     "error: compressed numpy BLOB is corrupt"},
+
+    // Arrays of records: only np_field gets at their elements, functions that write a new header
+    // reject them instead of writing one without descr
+    {"rec_create", "CREATE TABLE rec(id INTEGER PRIMARY KEY, a);"
+                   "INSERT INTO rec VALUES (1, npy('{''descr'': [(''x'', ''<i4''), "
+                   "(''y'', ''<f8'')], ''fortran_order'': False, ''shape'': (3,), }', "
+                   "x'01000000000000000000e03f02000000000000000000f83f"
+                   "030000000000000000000440'));"
+                   "INSERT INTO rec VALUES (2, npy('{''descr'': [(''x'', ''<i4'')], "
+                   "''fortran_order'': True, ''shape'': (2, 2), }', "
+                   "x'01000000030000000200000004000000'));"
+                   "SELECT sum(np_size(a)) FROM rec", "7"},
+    {"rec_field", "SELECT np(np_field(a, 'y')) FROM rec WHERE id = 1", "0.5\t1.5\t2.5"},
+    {"rec_field_fortran", "SELECT np(np_field(a, 'x')) FROM rec WHERE id = 2", "1\t2\n3\t4"},
+    {"rec_field_stack", "SELECT np(np_stack(np_field(a, 'x'))) FROM rec WHERE id = 1",
+     "1\t2\t3"},
+    {"rec_head", "SELECT np_head(a, 2) FROM rec WHERE id = 1",
+     "error: structured dtypes are not supported, use np_field"},
+    {"rec_slice", "SELECT np_slice(a, '1:') FROM rec WHERE id = 1",
+     "error: structured dtypes are not supported, use np_field"},
+    {"rec_slice_rowid", "SELECT np_slice('rec', 'a', 1, 1, 2)",
+     "error: structured dtypes are not supported, use np_field"},
+    {"rec_stack", "SELECT np_stack(a) FROM rec WHERE id = 1",
+     "error: np_stack: structured dtypes are not supported, use np_field"},
+    {"rec_ascontiguous", "SELECT np_ascontiguous(a) = a FROM rec WHERE id = 1", "1"},
+    {"rec_ascontiguous_fortran", "SELECT np_ascontiguous(a) FROM rec WHERE id = 2",
+     "error: np_ascontiguous: structured dtypes are not supported, use np_field"},
+
+    // np: the shortest text that reads back (subnormals too), whole numbers with ".0" up to 1e16
+    {"text_f8", "SELECT np(npy('{''descr'': ''<f8'', ''fortran_order'': False, "
+                "''shape'': (3,), }', x'01000000000000009a9999999999b93f0000000000406f40'))",
+     "5e-324\t0.1\t250.0"},
+    {"text_f8_large", "SELECT np(npy('{''descr'': ''<f8'', ''fortran_order'': False, "
+                      "''shape'': (3,), }', x'b6104882eb134b43ff9fd885573476c30080e03779c34143'))",
+     "1.5243453190381932e+16\t-9.999999999999998e+16\t1e+16"},
+    {"text_f4", "SELECT np(npy('{''descr'': ''<f4'', ''fortran_order'': False, "
+                "''shape'': (4,), }', x'010000000000804bcdcccc3dca1b0e5a'))",
+     "1e-45\t16777216.0\t0.1\t1e+16"},
+    {"text_bf16", "SELECT np(npy('{''descr'': ''bfloat16'', ''fortran_order'': False, "
+                  "''shape'': (3,), }', x'9a3e01008047'))", "0.3\t9e-41\t65536.0"},
+    // 2**62 + 2**54 + 1 and its negative: just above a tie, which a double in between loses
+    {"astype_i8_bf16", "SELECT np(np_astype(npy('{''descr'': ''<i8'', ''fortran_order'': False, "
+                       "''shape'': (2,), }', x'0100000000004040ffffffffffffbfbf'), 'bfloat16'))",
+     "4.65e+18\t-4.65e+18"},
+    {"ascontiguous_short", "SELECT np_ascontiguous(npy('{''descr'': ''<i8'', "
+                           "''fortran_order'': False, ''shape'': (3,), }', zeroblob(16)))",
+     "error: numpy BLOB is shorter than its shape"},
+    {"quantile_min_max", "SELECT np_quantile(a, 0) || ' ' || np_quantile(a, 1) || ' ' || "
+                         "np_quantile(b, 0) || ' ' || np_quantile(b, 1) FROM (SELECT "
+                         "arange(100000) AS a, np_sub(99999, arange(100000)) AS b)",
+     "0.0 99999.0 0.0 99999.0"},
+};
+
+/// Pads the header dictionary like numpy (version 1.0): the data starts at a multiple of 64
+static void npy_function(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    const char* dict = (const char*) sqlite3_value_text(argv[0]);
+    const void* payload = sqlite3_value_blob(argv[1]);
+    int dict_len = sqlite3_value_bytes(argv[0]);
+    int payload_len = sqlite3_value_bytes(argv[1]);
+    if (dict == NULL) {
+        sqlite3_result_null(context);
+        return;
+    }
+    int header_len = (10 + dict_len + 1 + 63) / 64 * 64;
+    unsigned char* out = malloc(header_len + payload_len);
+    if (out == NULL) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    memcpy(out, "\x93NUMPY\x01\x00", 8);
+    out[8] = (unsigned char) ((header_len - 10) & 0xff);
+    out[9] = (unsigned char) ((header_len - 10) >> 8);
+    memcpy(out + 10, dict, dict_len);
+    memset(out + 10 + dict_len, ' ', header_len - 10 - dict_len - 1);
+    out[header_len - 1] = '\n';
+    if (payload_len > 0)
+        memcpy(out + header_len, payload, payload_len);
+    sqlite3_result_blob(context, out, header_len + payload_len, free);
+}
+
+static void arange_function(sqlite3_context *context, int argc, sqlite3_value **argv)
+{
+    int64_t n = sqlite3_value_int64(argv[0]);
+    if (n < 0 || n > 1000000) {
+        sqlite3_result_error(context, "arange: n out of range", -1);
+        return;
+    }
+    char dict[96];
+    int dict_len = snprintf(dict, sizeof(dict),
+                            "{'descr': '<i8', 'fortran_order': False, 'shape': (%lld,), }",
+                            (long long) n);
+    int header_len = (10 + dict_len + 1 + 63) / 64 * 64;
+    unsigned char* out = malloc(header_len + n * 8);
+    if (out == NULL) {
+        sqlite3_result_error_nomem(context);
+        return;
+    }
+    memcpy(out, "\x93NUMPY\x01\x00", 8);
+    out[8] = (unsigned char) (header_len - 10);
+    out[9] = 0;
+    memcpy(out + 10, dict, dict_len);
+    memset(out + 10 + dict_len, ' ', header_len - 10 - dict_len - 1);
+    out[header_len - 1] = '\n';
+    for (int64_t i = 0; i < n; i++)
+        memcpy(out + header_len + 8*i, &i, 8); // little-endian hosts only
+    sqlite3_result_blob(context, out, header_len + (int) n * 8, free);
+}
+
+/// Runs the statements in `sql`
+/// @Returns the result as described at `tests`, to be freed with sqlite3_free
+static char* run(sqlite3* db, const char* sql)
+{
+    char* result = sqlite3_mprintf("no rows");
+    while (*sql != '\0') {
+        sqlite3_stmt* stmt;
+        int rc = sqlite3_prepare_v2(db, sql, -1, &stmt, &sql);
+        if (rc != SQLITE_OK) {
+            sqlite3_free(result);
+            return sqlite3_mprintf("error: %s", sqlite3_errmsg(db));
+        }
+        if (stmt == NULL) // only whitespace left
+            break;
+        while ((rc = sqlite3_step(stmt)) == SQLITE_ROW) {
+            const char* text = (const char*) sqlite3_column_text(stmt, 0);
+            sqlite3_free(result);
+            result = sqlite3_mprintf("%s", text != NULL ? text : "NULL");
+        }
+        if (rc != SQLITE_DONE) {
+            sqlite3_free(result);
+            result = sqlite3_mprintf("error: %s", sqlite3_errmsg(db));
+            sqlite3_finalize(stmt);
+            return result;
+        }
+        sqlite3_finalize(stmt);
+    }
+    return result;
+}
+
+int main(int argc, char** argv)
+{
+    const char* extension = argc > 1 ? argv[1] : "../blopy.so";
+
+    sqlite3* db;
+    char* error = NULL;
+    if (sqlite3_open(":memory:", &db) != SQLITE_OK)
+        return 1;
+    sqlite3_enable_load_extension(db, 1);
+    if (sqlite3_load_extension(db, extension, NULL, &error) != SQLITE_OK) {
+        fprintf(stderr, "loading %s: %s\n", extension, error);
+        return 1;
+    }
+    sqlite3_create_function(db, "npy", 2, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                            npy_function, NULL, NULL);
+    sqlite3_create_function(db, "arange", 1, SQLITE_UTF8 | SQLITE_DETERMINISTIC, NULL,
+                            arange_function, NULL, NULL);
+
+    int n_tests = (int) (sizeof(tests) / sizeof(tests[0]));
+    int failed = 0;
+    for (int i = 0; i < n_tests; i++) {
+        char* result = run(db, tests[i].sql);
+        if (result == NULL || strcmp(result, tests[i].expected) != 0) {
+            printf("FAIL %s\n  expected: %s\n  got:      %s\n", tests[i].name, tests[i].expected,
+                   result != NULL ? result : "(out of memory)");
+            failed++;
+        }
+        sqlite3_free(result);
+    }
+    printf("%d of %d tests passed\n", n_tests - failed, n_tests);
+    sqlite3_close(db);
+    return failed;
+}